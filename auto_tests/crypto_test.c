@@ -136,6 +136,39 @@ START_TEST(test_fast_known)
 }
 END_TEST
 
+START_TEST(test_in_place_known)
+{
+    unsigned char k[CRYPTO_SHARED_KEY_SIZE];
+    unsigned char buf[sizeof(test_c)];
+
+    encrypt_precompute(bobpk, alicesk, k);
+
+    /* Same buffer. */
+    memcpy(buf, test_m, sizeof(test_m));
+    ck_assert_msg(encrypt_data_symmetric(k, test_nonce, buf, sizeof(test_m), buf) == sizeof(test_c),
+                  "in place encryption failed");
+    ck_assert_msg(memcmp(test_c, buf, sizeof(test_c)) == 0, "in place cyphertext doesn't match test vector");
+    ck_assert_msg(decrypt_data_symmetric(k, test_nonce, buf, sizeof(test_c), buf) == sizeof(test_m),
+                  "in place decryption failed");
+    ck_assert_msg(memcmp(test_m, buf, sizeof(test_m)) == 0, "in place decrypted text doesn't match test vector");
+
+    /* Plain text right after room for the MAC. */
+    memcpy(buf + CRYPTO_MAC_SIZE, test_m, sizeof(test_m));
+    ck_assert_msg(encrypt_data_symmetric_detached(k, test_nonce, buf + CRYPTO_MAC_SIZE, sizeof(test_m), buf)
+                  == sizeof(test_m), "detached encryption failed");
+    ck_assert_msg(memcmp(test_c, buf, sizeof(test_c)) == 0, "detached cyphertext doesn't match test vector");
+    ck_assert_msg(decrypt_data_symmetric_detached(k, test_nonce, buf + CRYPTO_MAC_SIZE, sizeof(test_m), buf)
+                  == sizeof(test_m), "detached decryption failed");
+    ck_assert_msg(memcmp(test_m, buf + CRYPTO_MAC_SIZE, sizeof(test_m)) == 0,
+                  "detached decrypted text doesn't match test vector");
+
+    memcpy(buf, test_c, sizeof(test_c));
+    buf[sizeof(test_c) - 1] ^= 1;
+    ck_assert_msg(decrypt_data_symmetric_detached(k, test_nonce, buf + CRYPTO_MAC_SIZE, sizeof(test_m), buf) == -1,
+                  "detached decryption accepted a modified packet");
+}
+END_TEST
+
 START_TEST(test_endtoend)
 {
     unsigned char pk1[CRYPTO_PUBLIC_KEY_SIZE];
@@ -418,6 +451,7 @@ static Suite *crypto_suite(void)
 
     DEFTESTCASE(known);
     DEFTESTCASE(fast_known);
+    DEFTESTCASE(in_place_known);
     DEFTESTCASE_SLOW(endtoend, 15); /* waiting up to 15 seconds */
     DEFTESTCASE(large_data);
     DEFTESTCASE(large_data_symmetric);
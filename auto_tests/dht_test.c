@@ -26,39 +26,39 @@ static bool enable_broken_tests = false;
     } while(0)
 
 
-static void mark_bad(IPPTsPng *ipptp)
+static void mark_bad(const Mono_Time *mono_time, IPPTsPng *ipptp)
 {
-    ipptp->timestamp = unix_time() - 2 * BAD_NODE_TIMEOUT;
+    ipptp->timestamp = mono_time_get(mono_time) - 2 * BAD_NODE_TIMEOUT;
     ipptp->hardening.routes_requests_ok = 0;
     ipptp->hardening.send_nodes_ok = 0;
     ipptp->hardening.testing_requests = 0;
 }
 
-static void mark_possible_bad(IPPTsPng *ipptp)
+static void mark_possible_bad(const Mono_Time *mono_time, IPPTsPng *ipptp)
 {
-    ipptp->timestamp = unix_time();
+    ipptp->timestamp = mono_time_get(mono_time);
     ipptp->hardening.routes_requests_ok = 0;
     ipptp->hardening.send_nodes_ok = 0;
     ipptp->hardening.testing_requests = 0;
 }
 
-static void mark_good(IPPTsPng *ipptp)
+static void mark_good(const Mono_Time *mono_time, IPPTsPng *ipptp)
 {
-    ipptp->timestamp = unix_time();
+    ipptp->timestamp = mono_time_get(mono_time);
     ipptp->hardening.routes_requests_ok = (HARDENING_ALL_OK >> 0) & 1;
     ipptp->hardening.send_nodes_ok = (HARDENING_ALL_OK >> 1) & 1;
     ipptp->hardening.testing_requests = (HARDENING_ALL_OK >> 2) & 1;
 }
 
-static void mark_all_good(Client_data *list, uint32_t length, uint8_t ipv6)
+static void mark_all_good(const Mono_Time *mono_time, Client_data *list, uint32_t length, uint8_t ipv6)
 {
     uint32_t i;
 
     for (i = 0; i < length; ++i) {
         if (ipv6) {
-            mark_good(&list[i].assoc6);
+            mark_good(mono_time, &list[i].assoc6);
         } else {
-            mark_good(&list[i].assoc4);
+            mark_good(mono_time, &list[i].assoc4);
         }
     }
 }
@@ -177,7 +177,7 @@ static void test_addto_lists_bad(DHT            *dht,
     uint8_t ipv6 = ip_port->ip.family == AF_INET6 ? 1 : 0;
 
     random_bytes(public_key, sizeof(public_key));
-    mark_all_good(list, length, ipv6);
+    mark_all_good(dht->mono_time, list, length, ipv6);
 
     test1 = rand() % (length / 3);
     test2 = rand() % (length / 3) + length / 3;
@@ -190,13 +190,13 @@ static void test_addto_lists_bad(DHT            *dht,
 
     // mark nodes as "bad"
     if (ipv6) {
-        mark_bad(&list[test1].assoc6);
-        mark_bad(&list[test2].assoc6);
-        mark_bad(&list[test3].assoc6);
+        mark_bad(dht->mono_time, &list[test1].assoc6);
+        mark_bad(dht->mono_time, &list[test2].assoc6);
+        mark_bad(dht->mono_time, &list[test3].assoc6);
     } else {
-        mark_bad(&list[test1].assoc4);
-        mark_bad(&list[test2].assoc4);
-        mark_bad(&list[test3].assoc4);
+        mark_bad(dht->mono_time, &list[test1].assoc4);
+        mark_bad(dht->mono_time, &list[test2].assoc4);
+        mark_bad(dht->mono_time, &list[test3].assoc4);
     }
 
     ip_port->port += 1;
@@ -221,7 +221,7 @@ static void test_addto_lists_possible_bad(DHT            *dht,
     uint8_t ipv6 = ip_port->ip.family == AF_INET6 ? 1 : 0;
 
     random_bytes(public_key, sizeof(public_key));
-    mark_all_good(list, length, ipv6);
+    mark_all_good(dht->mono_time, list, length, ipv6);
 
     test1 = rand() % (length / 3);
     test2 = rand() % (length / 3) + length / 3;
@@ -234,13 +234,13 @@ static void test_addto_lists_possible_bad(DHT            *dht,
 
     // mark nodes as "possibly bad"
     if (ipv6) {
-        mark_possible_bad(&list[test1].assoc6);
-        mark_possible_bad(&list[test2].assoc6);
-        mark_possible_bad(&list[test3].assoc6);
+        mark_possible_bad(dht->mono_time, &list[test1].assoc6);
+        mark_possible_bad(dht->mono_time, &list[test2].assoc6);
+        mark_possible_bad(dht->mono_time, &list[test3].assoc6);
     } else {
-        mark_possible_bad(&list[test1].assoc4);
-        mark_possible_bad(&list[test2].assoc4);
-        mark_possible_bad(&list[test3].assoc4);
+        mark_possible_bad(dht->mono_time, &list[test1].assoc4);
+        mark_possible_bad(dht->mono_time, &list[test2].assoc4);
+        mark_possible_bad(dht->mono_time, &list[test3].assoc4);
     }
 
     ip_port->port += 1;
@@ -282,7 +282,7 @@ static void test_addto_lists_good(DHT            *dht,
     uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
     uint8_t ipv6 = ip_port->ip.family == AF_INET6 ? 1 : 0;
 
-    mark_all_good(list, length, ipv6);
+    mark_all_good(dht->mono_time, list, length, ipv6);
 
     // check "good" client id replacement
     do {
@@ -312,7 +312,8 @@ static void test_addto_lists(IP ip)
     Networking_Core *net = new_networking(NULL, ip, TOX_PORT_DEFAULT);
     ck_assert_msg(net != 0, "Failed to create Networking_Core");
 
-    DHT *dht = new_DHT(NULL, net, true);
+    Mono_Time *mono_time = mono_time_new();
+    DHT *dht = new_DHT(NULL, mono_time, net, true);
     ck_assert_msg(dht != 0, "Failed to create DHT");
 
     IP_Port ip_port = { .ip = ip, .port = TOX_PORT_DEFAULT };
@@ -373,6 +374,7 @@ static void test_addto_lists(IP ip)
 
     kill_DHT(dht);
     kill_networking(net);
+    mono_time_free(mono_time);
 }
 
 START_TEST(test_addto_lists_ipv4)
@@ -446,11 +448,13 @@ static void test_list_main(void)
 
     unsigned int i, j, k, l;
 
+    Mono_Time *mono_time = mono_time_new();
+
     for (i = 0; i < NUM_DHT; ++i) {
         IP ip;
         ip_init(&ip, 1);
 
-        dhts[i] = new_DHT(NULL, new_networking(NULL, ip, DHT_DEFAULT_PORT + i), true);
+        dhts[i] = new_DHT(NULL, mono_time, new_networking(NULL, ip, DHT_DEFAULT_PORT + i), true);
         ck_assert_msg(dhts[i] != 0, "Failed to create dht instances %u", i);
         ck_assert_msg(dhts[i]->net->port != DHT_DEFAULT_PORT + i, "Bound to wrong port");
     }
@@ -556,6 +560,8 @@ static void test_list_main(void)
         kill_DHT(dhts[i]);
         kill_networking(n);
     }
+
+    mono_time_free(mono_time);
 }
 
 
@@ -569,6 +575,445 @@ START_TEST(test_list)
 }
 END_TEST
 
+#define NUM_DISTANCE_TESTS 10000
+
+/* Byte by byte reference for pk_distance_cmp(). */
+static int distance_cmp_reference(const uint8_t *base, const uint8_t *pk1, const uint8_t *pk2)
+{
+    for (uint32_t i = 0; i < CRYPTO_PUBLIC_KEY_SIZE; ++i) {
+        const uint8_t distance1 = base[i] ^ pk1[i];
+        const uint8_t distance2 = base[i] ^ pk2[i];
+
+        if (distance1 != distance2) {
+            return distance1 < distance2 ? -1 : 1;
+        }
+    }
+
+    return 0;
+}
+
+/* Bit by bit reference for pk_common_prefix(). */
+static unsigned int common_prefix_reference(const uint8_t *pk1, const uint8_t *pk2)
+{
+    for (uint32_t i = 0; i < CRYPTO_PUBLIC_KEY_SIZE * 8; ++i) {
+        const uint8_t mask = 0x80 >> (i % 8);
+
+        if ((pk1[i / 8] & mask) != (pk2[i / 8] & mask)) {
+            return i;
+        }
+    }
+
+    return CRYPTO_PUBLIC_KEY_SIZE * 8;
+}
+
+START_TEST(test_distance_impls)
+{
+    const Distance_Impl impls[] = { DISTANCE_IMPL_GENERIC, DISTANCE_IMPL_SSE2, DISTANCE_IMPL_AVX2 };
+    distance_init();
+    const Distance_Impl default_impl = distance_impl();
+    uint8_t keys[NUM_DISTANCE_TESTS][CRYPTO_PUBLIC_KEY_SIZE];
+    uint16_t prefixes[NUM_DISTANCE_TESTS];
+    uint8_t base[CRYPTO_PUBLIC_KEY_SIZE];
+
+    random_bytes(base, sizeof(base));
+
+    for (uint32_t i = 0; i < NUM_DISTANCE_TESTS; ++i) {
+        /* Share every possible number of leading bits with base, including all of them. */
+        const uint32_t shared_bits = i % (CRYPTO_PUBLIC_KEY_SIZE * 8 + 1);
+        memcpy(keys[i], base, CRYPTO_PUBLIC_KEY_SIZE);
+
+        if (shared_bits < CRYPTO_PUBLIC_KEY_SIZE * 8) {
+            const uint32_t byte = shared_bits / 8;
+            keys[i][byte] ^= 0x80 >> (shared_bits % 8);
+            random_bytes(keys[i] + byte + 1, CRYPTO_PUBLIC_KEY_SIZE - byte - 1);
+        }
+    }
+
+    ck_assert_msg(distance_use_impl(DISTANCE_IMPL_GENERIC), "Generic implementation not available");
+
+    for (size_t j = 0; j < sizeof(impls) / sizeof(impls[0]); ++j) {
+        if (!distance_use_impl(impls[j])) {
+            continue;
+        }
+
+        const char *name = distance_impl_name(impls[j]);
+        pk_common_prefix_batch(base, keys[0], CRYPTO_PUBLIC_KEY_SIZE, NUM_DISTANCE_TESTS, prefixes);
+
+        for (uint32_t i = 0; i < NUM_DISTANCE_TESTS; ++i) {
+            const uint8_t *other = keys[(i * 7 + 1) % NUM_DISTANCE_TESTS];
+            const unsigned int prefix = common_prefix_reference(base, keys[i]);
+
+            ck_assert_msg(prefix == i % (CRYPTO_PUBLIC_KEY_SIZE * 8 + 1), "Bad test key %u", i);
+            ck_assert_msg(pk_common_prefix(base, keys[i]) == prefix, "%s: wrong common prefix", name);
+            ck_assert_msg(prefixes[i] == prefix, "%s: wrong batch common prefix", name);
+            ck_assert_msg(pk_distance_cmp(base, keys[i], other) == distance_cmp_reference(base, keys[i], other),
+                          "%s: wrong distance comparison", name);
+            ck_assert_msg(pk_distance_cmp(base, keys[i], keys[i]) == 0, "%s: key closer than itself", name);
+        }
+    }
+
+    distance_use_impl(default_impl);
+}
+END_TEST
+
+#define NUM_SHARED_KEYS 64
+
+START_TEST(test_shared_keys_cache)
+{
+    Shared_Keys shared_keys;
+    ck_assert_msg(shared_keys_init(&shared_keys, NUM_SHARED_KEYS) == 0, "Failed to init shared keys cache");
+    ck_assert_msg(shared_keys.num_slots * MAX_KEYS_PER_SLOT >= NUM_SHARED_KEYS, "Cache too small");
+
+    uint8_t self_public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t self_secret_key[CRYPTO_SECRET_KEY_SIZE];
+    crypto_new_keypair(self_public_key, self_secret_key);
+
+    uint8_t public_keys[NUM_SHARED_KEYS * 2][CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t secret_key[CRYPTO_SECRET_KEY_SIZE];
+
+    for (uint32_t i = 0; i < NUM_SHARED_KEYS * 2; ++i) {
+        crypto_new_keypair(public_keys[i], secret_key);
+    }
+
+    for (uint32_t i = 0; i < NUM_SHARED_KEYS * 2; ++i) {
+        uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
+        uint8_t expected[CRYPTO_SHARED_KEY_SIZE];
+        get_shared_key(&shared_keys, shared_key, self_secret_key, public_keys[i]);
+        encrypt_precompute(public_keys[i], self_secret_key, expected);
+        ck_assert_msg(memcmp(shared_key, expected, sizeof(expected)) == 0, "Wrong shared key computed");
+    }
+
+    ck_assert_msg(shared_keys.misses == NUM_SHARED_KEYS * 2, "Unexpected cache hits on fresh keys: %u",
+                  (unsigned)shared_keys.hits);
+    ck_assert_msg(shared_keys.evictions >= NUM_SHARED_KEYS, "Too few evictions: %u", (unsigned)shared_keys.evictions);
+
+    /* The most recently used key must still be cached and returned correctly. */
+    const uint8_t *last = public_keys[NUM_SHARED_KEYS * 2 - 1];
+    uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
+    uint8_t expected[CRYPTO_SHARED_KEY_SIZE];
+    get_shared_key(&shared_keys, shared_key, self_secret_key, last);
+    encrypt_precompute(last, self_secret_key, expected);
+    ck_assert_msg(shared_keys.hits == 1, "Recently used key was evicted");
+    ck_assert_msg(memcmp(shared_key, expected, sizeof(expected)) == 0, "Wrong shared key cached");
+
+    /* A bigger cache holds all the keys, the counters survive the resize. */
+    ck_assert_msg(shared_keys_resize(&shared_keys, NUM_SHARED_KEYS * 16) == 0, "Failed to resize shared keys cache");
+    ck_assert_msg(shared_keys.num_slots * MAX_KEYS_PER_SLOT >= NUM_SHARED_KEYS * 16, "Resized cache too small");
+    ck_assert_msg(shared_keys.hits == 1 && shared_keys.misses == NUM_SHARED_KEYS * 2, "Counters lost on resize");
+
+    /* A failed resize leaves every cache as it was. */
+    Shared_Keys other;
+    ck_assert_msg(shared_keys_init(&other, NUM_SHARED_KEYS) == 0, "Failed to create shared keys cache");
+    Shared_Keys *const caches[] = { &shared_keys, &other };
+    const Shared_Key *keys = shared_keys.keys;
+    const Shared_Key *other_keys = other.keys;
+    ck_assert_msg(shared_keys_resize_all(caches, 2, UINT32_MAX) == -1, "Impossible cache size accepted");
+    ck_assert_msg(shared_keys.keys == keys && other.keys == other_keys, "Cache changed by a failed resize");
+    shared_keys_free(&other);
+
+    for (uint32_t i = 0; i < NUM_SHARED_KEYS * 2; ++i) {
+        get_shared_key(&shared_keys, shared_key, self_secret_key, public_keys[i]);
+    }
+
+    for (uint32_t i = 0; i < NUM_SHARED_KEYS * 2; ++i) {
+        get_shared_key(&shared_keys, shared_key, self_secret_key, public_keys[i]);
+    }
+
+    ck_assert_msg(shared_keys.misses == NUM_SHARED_KEYS * 4 && shared_keys.hits == 1 + NUM_SHARED_KEYS * 2,
+                  "Keys not all cached after resize: %u hits", (unsigned)shared_keys.hits);
+
+    Shared_Keys_Stats stats = {0};
+    shared_keys_add_stats(&shared_keys, &stats);
+    shared_keys_add_stats(&shared_keys, &stats);
+    ck_assert_msg(stats.hits == shared_keys.hits * 2 && stats.misses == shared_keys.misses * 2,
+                  "Wrong summed counters");
+    shared_keys_reset_stats(&shared_keys);
+    ck_assert_msg(shared_keys.hits == 0 && shared_keys.misses == 0 && shared_keys.evictions == 0,
+                  "Counters not reset");
+
+    shared_keys_free(&shared_keys);
+    ck_assert_msg(shared_keys.keys == NULL, "Shared keys not freed");
+}
+END_TEST
+
+static uint32_t parked_packets_handled;
+
+static int handle_parked_packet(void *object, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata)
+{
+    DHT *dht = (DHT *)object;
+    uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
+    uint8_t expected[CRYPTO_SHARED_KEY_SIZE];
+
+    ck_assert_msg(DHT_get_shared_key_async(dht, &dht->shared_keys_recv, shared_key, packet, source, packet, length,
+                                           &handle_parked_packet, dht) == 0, "Key not cached when packet was returned");
+    encrypt_precompute(packet, dht->self_secret_key, expected);
+    ck_assert_msg(memcmp(shared_key, expected, sizeof(expected)) == 0, "Wrong shared key computed by workers");
+    ++parked_packets_handled;
+    return 0;
+}
+
+START_TEST(test_shared_key_workers)
+{
+    IP ip;
+    ip_init(&ip, 1);
+    Networking_Core *net = new_networking(NULL, ip, DHT_DEFAULT_PORT);
+    ck_assert_msg(net != NULL, "Failed to create networking");
+    Mono_Time *mono_time = mono_time_new();
+    DHT *dht = new_DHT(NULL, mono_time, net, true);
+    ck_assert_msg(dht != NULL, "Failed to create DHT");
+
+    ck_assert_msg(DHT_start_key_workers(dht, 0) == -1, "Started zero workers");
+    ck_assert_msg(DHT_start_key_workers(dht, 4) == 0, "Failed to start workers");
+    ck_assert_msg(DHT_start_key_workers(dht, 4) == -1, "Started workers twice");
+
+    IP_Port source;
+    ip_init(&source.ip, 1);
+    source.port = net_htons(DHT_DEFAULT_PORT);
+
+    uint8_t packets[NUM_SHARED_KEYS][CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t secret_key[CRYPTO_SECRET_KEY_SIZE];
+
+    for (uint32_t i = 0; i < NUM_SHARED_KEYS; ++i) {
+        uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
+        crypto_new_keypair(packets[i], secret_key);
+        ck_assert_msg(DHT_get_shared_key_async(dht, &dht->shared_keys_recv, shared_key, packets[i], source, packets[i],
+                                               CRYPTO_PUBLIC_KEY_SIZE, &handle_parked_packet, dht) == 1,
+                      "Packet with unknown key not parked");
+    }
+
+    /* A packet from a peer whose key is being computed waits for the same job. */
+    uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
+    ck_assert_msg(DHT_get_shared_key_async(dht, &dht->shared_keys_recv, shared_key, packets[0], source, packets[0],
+                                           CRYPTO_PUBLIC_KEY_SIZE, &handle_parked_packet, dht) == 1,
+                  "Packet with pending key not parked");
+    ck_assert_msg(dht->key_pool->num_jobs == NUM_SHARED_KEYS && dht->key_pool->num_packets == NUM_SHARED_KEYS + 1,
+                  "Key computed twice: %u jobs", dht->key_pool->num_jobs);
+
+    /* Packets of a dropped object must never be handed back. */
+    uint8_t dropped[CRYPTO_PUBLIC_KEY_SIZE];
+    crypto_new_keypair(dropped, secret_key);
+    ck_assert_msg(DHT_get_shared_key_async(dht, &dht->shared_keys_sent, shared_key, dropped, source, dropped,
+                                           sizeof(dropped), &handle_parked_packet, NULL) == 1, "Packet not parked");
+    DHT_drop_parked_packets(dht, NULL);
+
+    for (uint32_t i = 0; i < 1000 && dht->key_pool->num_jobs != 0; ++i) {
+        do_DHT(dht);
+        c_sleep(1);
+    }
+
+    ck_assert_msg(dht->key_pool->num_jobs == 0 && dht->key_pool->num_packets == 0, "Parked packets never completed");
+    ck_assert_msg(parked_packets_handled == NUM_SHARED_KEYS + 1, "Handled %u parked packets, expected %u",
+                  parked_packets_handled, NUM_SHARED_KEYS + 1);
+
+    DHT_stop_key_workers(dht);
+    ck_assert_msg(dht->key_pool == NULL, "Workers not stopped");
+    ck_assert_msg(DHT_get_shared_key_async(dht, &dht->shared_keys_sent, shared_key, dropped, source, dropped,
+                                           sizeof(dropped), &handle_parked_packet, dht) == 0,
+                  "Packet parked without workers");
+
+    kill_DHT(dht);
+    kill_networking(net);
+    mono_time_free(mono_time);
+}
+END_TEST
+
+#define NUM_INDEXED_FRIENDS 512
+
+START_TEST(test_friends_index)
+{
+    IP ip;
+    ip_init(&ip, 1);
+    Networking_Core *net = new_networking(NULL, ip, DHT_DEFAULT_PORT);
+    ck_assert_msg(net != NULL, "Failed to create networking");
+    Mono_Time *mono_time = mono_time_new();
+    DHT *dht = new_DHT(NULL, mono_time, net, true);
+    ck_assert_msg(dht != NULL, "Failed to create DHT");
+
+    uint8_t public_keys[NUM_INDEXED_FRIENDS][CRYPTO_PUBLIC_KEY_SIZE];
+    bool deleted[NUM_INDEXED_FRIENDS] = {0};
+
+    for (uint32_t i = 0; i < NUM_INDEXED_FRIENDS; ++i) {
+        random_bytes(public_keys[i], CRYPTO_PUBLIC_KEY_SIZE);
+        ck_assert_msg(DHT_addfriend(dht, public_keys[i], NULL, NULL, 0, NULL) == 0, "Failed to add friend %u", i);
+    }
+
+    ck_assert_msg(dht->friends_index_size >= dht->num_friends * 2, "Friends index too full");
+
+    for (uint32_t i = 0; i < NUM_INDEXED_FRIENDS; ++i) {
+        if (rand() % 2) {
+            ck_assert_msg(DHT_delfriend(dht, public_keys[i], 0) == 0, "Failed to delete friend %u", i);
+            deleted[i] = 1;
+        }
+    }
+
+    for (uint32_t i = 0; i < NUM_INDEXED_FRIENDS; ++i) {
+        const uint32_t index = index_of_friend_pk(dht, public_keys[i]);
+
+        if (deleted[i]) {
+            ck_assert_msg(index == UINT32_MAX, "Deleted friend %u still indexed", i);
+        } else {
+            ck_assert_msg(index < dht->num_friends, "Friend %u not indexed", i);
+            ck_assert_msg(id_equal(dht->friends_list[index].public_key, public_keys[i]), "Friend %u indexed wrong", i);
+        }
+    }
+
+    for (uint32_t i = 0; i < dht->num_friends; ++i) {
+        ck_assert_msg(index_of_friend_pk(dht, dht->friends_list[i].public_key) == i, "Friend number %u indexed wrong", i);
+    }
+
+    kill_DHT(dht);
+    kill_networking(net);
+    mono_time_free(mono_time);
+}
+END_TEST
+
+#define NUM_FRIEND_CLIENT_TESTS 256
+
+static void check_friend_client_list_order(const DHT_Friend *dht_friend)
+{
+    for (uint32_t i = 0; i + 1 < MAX_FRIEND_CLIENTS; ++i) {
+        ck_assert_msg(id_closest(dht_friend->public_key, dht_friend->client_list[i].public_key,
+                                 dht_friend->client_list[i + 1].public_key) != 1,
+                      "Friend client list not ordered at %u", i);
+    }
+}
+
+START_TEST(test_friend_client_list_order)
+{
+    IP ip;
+    ip_init(&ip, 1);
+    Networking_Core *net = new_networking(NULL, ip, DHT_DEFAULT_PORT);
+    ck_assert_msg(net != NULL, "Failed to create networking");
+    Mono_Time *mono_time = mono_time_new();
+    DHT *dht = new_DHT(NULL, mono_time, net, true);
+    ck_assert_msg(dht != NULL, "Failed to create DHT");
+
+    const DHT_Friend *dht_friend = &dht->friends_list[0];
+    uint8_t public_keys[NUM_FRIEND_CLIENT_TESTS][CRYPTO_PUBLIC_KEY_SIZE];
+    IP_Port ip_port;
+    ip_init(&ip_port.ip, 1);
+
+    for (uint32_t i = 0; i < NUM_FRIEND_CLIENT_TESTS; ++i) {
+        random_bytes(public_keys[i], CRYPTO_PUBLIC_KEY_SIZE);
+        ip_port.port = net_htons(i + 1);
+        addto_lists(dht, ip_port, public_keys[i]);
+        check_friend_client_list_order(dht_friend);
+    }
+
+    /* The list must hold the MAX_FRIEND_CLIENTS closest nodes. */
+    for (uint32_t i = 0; i < NUM_FRIEND_CLIENT_TESTS; ++i) {
+        uint32_t closer = 0;
+
+        for (uint32_t j = 0; j < NUM_FRIEND_CLIENT_TESTS; ++j) {
+            closer += id_closest(dht_friend->public_key, public_keys[j], public_keys[i]) == 1;
+        }
+
+        const bool in_list = index_of_client_pk(dht_friend->client_list, MAX_FRIEND_CLIENTS, public_keys[i]) != UINT32_MAX;
+        ck_assert_msg(in_list == (closer < MAX_FRIEND_CLIENTS), "Node %u with %u closer nodes wrongly %s", i, closer,
+                      in_list ? "kept" : "dropped");
+    }
+
+    /* A node taking over the ip_port of a listed node moves to its own position. */
+    for (uint32_t i = 0; i < MAX_FRIEND_CLIENTS; ++i) {
+        uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+        random_bytes(public_key, sizeof(public_key));
+        addto_lists(dht, dht_friend->client_list[i].assoc6.ip_port, public_key);
+        check_friend_client_list_order(dht_friend);
+    }
+
+    kill_DHT(dht);
+    kill_networking(net);
+    mono_time_free(mono_time);
+}
+END_TEST
+
+#define NUM_CLOSE_NODES_TESTS 1000
+
+START_TEST(test_close_nodes_buckets)
+{
+    IP ip;
+    ip_init(&ip, 1);
+    Networking_Core *net = new_networking(NULL, ip, DHT_DEFAULT_PORT);
+    ck_assert_msg(net != NULL, "Failed to create networking");
+    Mono_Time *mono_time = mono_time_new();
+    DHT *dht = new_DHT(NULL, mono_time, net, true);
+    ck_assert_msg(dht != NULL, "Failed to create DHT");
+
+    for (uint32_t i = 0; i < LCLIENT_LIST * 4; ++i) {
+        uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+        random_bytes(public_key, sizeof(public_key));
+
+        /* Share a random prefix with our key so that deeper buckets get filled too. */
+        const uint32_t prefix = rand() % 16;
+        memcpy(public_key, dht->self_public_key, prefix / 8);
+        public_key[prefix / 8] = dht->self_public_key[prefix / 8] ^ (0x80 >> (prefix % 8));
+
+        IP_Port ip_port;
+        ip_init(&ip_port.ip, 0);
+        ip_port.ip.ip4.uint32 = rand();
+        ip_port.port = rand() % (UINT16_MAX - 1) + 1;
+        addto_lists(dht, ip_port, public_key);
+    }
+
+    for (uint32_t i = 0; i < LCLIENT_LIST; ++i) {
+        const Client_data *client = &dht->close_clientlist[i];
+
+        if (client->assoc4.timestamp != 0) {
+            ck_assert_msg(close_bucket_index(dht->self_public_key, client->public_key) == i / LCLIENT_NODES,
+                          "Node %u stored in the wrong bucket", i);
+            ck_assert_msg(index_of_close_pk(dht, client->public_key) == i, "Node %u not found in its bucket", i);
+        }
+    }
+
+    for (uint32_t i = 0; i < NUM_CLOSE_NODES_TESTS; ++i) {
+        uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+        random_bytes(public_key, sizeof(public_key));
+        const uint32_t prefix = rand() % 16;
+        memcpy(public_key, dht->self_public_key, prefix / 8);
+
+        Node_format nodes[MAX_SENT_NODES];
+        const int num_nodes = get_close_nodes(dht, public_key, nodes, 0, 1, 0);
+
+        /* Reference result: scan the whole close list. */
+        Node_format expected[MAX_SENT_NODES];
+        memset(expected, 0, sizeof(expected));
+        uint32_t num_expected = 0;
+        get_close_nodes_inner(dht->mono_time, public_key, expected, 0, dht->close_clientlist, LCLIENT_LIST,
+                              &num_expected, 1, 0);
+
+        for (uint32_t j = 0; j < dht->num_friends; ++j) {
+            get_close_nodes_inner(dht->mono_time, public_key, expected, 0, dht->friends_list[j].client_list,
+                                  MAX_FRIEND_CLIENTS, &num_expected, 1, 0);
+        }
+
+        ck_assert_msg(num_nodes == num_expected, "Wrong number of close nodes: %d != %u", num_nodes, num_expected);
+
+        for (uint32_t j = 0; j < num_expected; ++j) {
+            ck_assert_msg(index_of_node_pk(nodes, num_nodes, expected[j].public_key) != UINT32_MAX,
+                          "Bucket search missed one of the closest nodes");
+        }
+
+        /* No node left out is closer than one that was returned. */
+        for (uint32_t j = 0; j < LCLIENT_LIST; ++j) {
+            const Client_data *client = &dht->close_clientlist[j];
+
+            if (client->assoc4.timestamp == 0 || index_of_node_pk(nodes, num_nodes, client->public_key) != UINT32_MAX) {
+                continue;
+            }
+
+            for (int k = 0; k < num_nodes; ++k) {
+                ck_assert_msg(id_closest(public_key, client->public_key, nodes[k].public_key) != 1,
+                              "Left out a node closer than one of the close nodes");
+            }
+        }
+    }
+
+    kill_DHT(dht);
+    kill_networking(net);
+    mono_time_free(mono_time);
+}
+END_TEST
+
 static void ip_callback(void *data, int32_t number, IP_Port ip_port)
 {
 }
@@ -582,11 +1027,13 @@ START_TEST(test_DHT_test)
 
     unsigned int i, j;
 
+    Mono_Time *mono_time = mono_time_new();
+
     for (i = 0; i < NUM_DHT; ++i) {
         IP ip;
         ip_init(&ip, 1);
 
-        dhts[i] = new_DHT(NULL, new_networking(NULL, ip, DHT_DEFAULT_PORT + i), true);
+        dhts[i] = new_DHT(NULL, mono_time, new_networking(NULL, ip, DHT_DEFAULT_PORT + i), true);
         ck_assert_msg(dhts[i] != 0, "Failed to create dht instances %u", i);
         ck_assert_msg(dhts[i]->net->port != DHT_DEFAULT_PORT + i, "Bound to wrong port");
     }
@@ -649,6 +1096,8 @@ loop_top:
         kill_DHT(dhts[i]);
         kill_networking(n);
     }
+
+    mono_time_free(mono_time);
 }
 END_TEST
 
@@ -768,6 +1217,12 @@ static Suite *dht_suite(void)
     Suite *s = suite_create("DHT");
     DEFTESTCASE(dht_create_packet);
     DEFTESTCASE(dht_node_packing);
+    DEFTESTCASE(distance_impls);
+    DEFTESTCASE(shared_keys_cache);
+    DEFTESTCASE(shared_key_workers);
+    DEFTESTCASE(friends_index);
+    DEFTESTCASE(friend_client_list_order);
+    DEFTESTCASE(close_nodes_buckets);
 
     DEFTESTCASE_SLOW(list, 20);
     DEFTESTCASE_SLOW(DHT_test, 50);
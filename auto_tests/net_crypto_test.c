@@ -0,0 +1,795 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "check_compat.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../toxcore/net_crypto.c"
+
+#include "helpers.h"
+
+static void init_packet_pool(Packet_Data_Pool *pool, uint32_t max_free)
+{
+    memset(pool, 0, sizeof(Packet_Data_Pool));
+    ck_assert_msg(pthread_mutex_init(&pool->mutex, NULL) == 0, "failed to init pool mutex");
+    pool->max_free = max_free;
+}
+
+static void fill_packet(Packet_Data *dt, uint32_t i)
+{
+    dt->sent_time = 0;
+    dt->length = sizeof(uint32_t);
+    memcpy(dt->data, &i, sizeof(uint32_t));
+}
+
+static void check_packets(const Packets_Array *array, uint32_t from, uint32_t to)
+{
+    uint32_t i;
+
+    for (i = from; i != to; ++i) {
+        Packet_Data *dt = NULL;
+        ck_assert_msg(get_data_pointer(array, &dt, i) == 1, "packet %u missing", i);
+
+        uint32_t stored;
+        memcpy(&stored, dt->data, sizeof(uint32_t));
+        ck_assert_msg(stored == i, "packet %u holds %u", i, stored);
+    }
+}
+
+START_TEST(test_packets_array_grow)
+{
+    Packet_Data_Pool pool;
+    init_packet_pool(&pool, CRYPTO_PACKET_DATA_DEFAULT_FREE);
+
+    /* Start right before the packet numbers wrap around. */
+    Packets_Array array;
+    memset(&array, 0, sizeof(Packets_Array));
+    array.buffer_start = UINT32_MAX - 20;
+    array.buffer_end = array.buffer_start;
+
+    Packet_Data dt;
+    uint32_t i, capacity = 0;
+
+    for (i = 0; i < 1000; ++i) {
+        fill_packet(&dt, array.buffer_start + i);
+        ck_assert_msg(add_data_end_of_buffer(&pool, &array, &dt) == (uint32_t)(array.buffer_start + i),
+                      "wrong packet number for packet %u", i);
+
+        if (array.capacity != capacity) {
+            ck_assert_msg(array.capacity >= CRYPTO_MIN_PACKET_BUFFER_SIZE, "capacity %u too small", array.capacity);
+            ck_assert_msg((array.capacity & (array.capacity - 1)) == 0, "capacity %u not a power of 2", array.capacity);
+            ck_assert_msg(array.capacity > capacity, "capacity shrank from %u to %u", capacity, array.capacity);
+            capacity = array.capacity;
+        }
+
+        ck_assert_msg(array.capacity >= num_packets_array(&array), "capacity %u below %u packets", array.capacity,
+                      num_packets_array(&array));
+    }
+
+    ck_assert_msg(capacity == 1024, "capacity for 1000 packets is %u", capacity);
+    check_packets(&array, array.buffer_start, array.buffer_end);
+
+    /* Received packets can arrive with holes. */
+    Packets_Array recv;
+    memset(&recv, 0, sizeof(Packets_Array));
+    fill_packet(&dt, 3000);
+    ck_assert_msg(add_data_to_buffer(&pool, &recv, 3000, &dt) == 0, "failed to add packet past a hole");
+    ck_assert_msg(recv.capacity == 4096, "capacity for packet 3000 is %u", recv.capacity);
+    ck_assert_msg(add_data_to_buffer(&pool, &recv, 3000, &dt) == -1, "added packet 3000 twice");
+    ck_assert_msg(add_data_to_buffer(&pool, &recv, CRYPTO_PACKET_BUFFER_SIZE + 1, &dt) == -1,
+                  "added packet beyond the maximum buffer size");
+
+    Packet_Data *hole = NULL;
+    ck_assert_msg(get_data_pointer(&recv, &hole, 1500) == 0, "hole not empty");
+
+    clear_buffer(&pool, &array);
+    clear_buffer(&pool, &recv);
+    ck_assert_msg(array.buffer == NULL && array.capacity == 0, "cleared array still has slots");
+    ck_assert_msg(pool.num_used == 0, "%u packets still in use", pool.num_used);
+
+    packet_data_pool_trim(&pool, 0);
+    pthread_mutex_destroy(&pool.mutex);
+}
+END_TEST
+
+START_TEST(test_packet_data_pool)
+{
+    Packet_Data_Pool pool;
+    init_packet_pool(&pool, 16);
+
+    Packets_Array array;
+    memset(&array, 0, sizeof(Packets_Array));
+
+    Packet_Data dt;
+    uint32_t i;
+
+    for (i = 0; i < 64; ++i) {
+        fill_packet(&dt, i);
+        ck_assert_msg(add_data_end_of_buffer(&pool, &array, &dt) == i, "failed to add packet %u", i);
+    }
+
+    ck_assert_msg(pool.num_allocated == 64 && pool.num_reused == 0, "allocated %u, reused %u",
+                  (unsigned int)pool.num_allocated, (unsigned int)pool.num_reused);
+
+    /* Acked packets go back to the pool up to max_free, the rest is freed. */
+    ck_assert_msg(clear_buffer_until(&pool, &array, 40) == 0, "failed to clear acked packets");
+    ck_assert_msg(pool.num_used == 24, "%u packets in use", pool.num_used);
+    ck_assert_msg(pool.num_free == 16, "%u packets kept for reuse", pool.num_free);
+    check_packets(&array, 40, 64);
+
+    /* New packets take the kept ones first. */
+    for (i = 64; i < 84; ++i) {
+        fill_packet(&dt, i);
+        ck_assert_msg(add_data_end_of_buffer(&pool, &array, &dt) == i, "failed to add packet %u", i);
+    }
+
+    ck_assert_msg(pool.num_reused == 16, "reused %u packets", (unsigned int)pool.num_reused);
+    ck_assert_msg(pool.num_allocated == 68, "allocated %u packets", (unsigned int)pool.num_allocated);
+    ck_assert_msg(pool.num_free == 0, "%u packets left in the pool", pool.num_free);
+    check_packets(&array, 40, 84);
+
+    Packet_Data out;
+    ck_assert_msg(read_data_beg_buffer(&pool, &array, &out) == 40, "read the wrong packet");
+    ck_assert_msg(pool.num_free == 1 && pool.num_used == 43, "read packet not given back to the pool");
+
+    /* Shrinking the pool frees the packets above the new size. */
+    clear_buffer(&pool, &array);
+    ck_assert_msg(pool.num_free == 16, "%u packets kept for reuse", pool.num_free);
+    packet_data_pool_trim(&pool, 4);
+    ck_assert_msg(pool.num_free == 4, "%u packets kept after trimming to 4", pool.num_free);
+    packet_data_pool_trim(&pool, 0);
+    ck_assert_msg(pool.num_free == 0 && pool.free_list == NULL, "pool not empty after trimming to 0");
+
+    pthread_mutex_destroy(&pool.mutex);
+}
+END_TEST
+
+/* A path that delivers 2000 packets per second with a 100 ms round trip time
+ * and queues what it can't deliver. */
+#define CONGESTION_TEST_BW 2000.0
+#define CONGESTION_TEST_RTT 100
+
+START_TEST(test_congestion_delay)
+{
+    Crypto_Connection *conn = (Crypto_Connection *)calloc(1, sizeof(Crypto_Connection));
+    ck_assert_msg(conn != NULL, "Failed to allocate connection");
+
+    conn->packet_send_rate = CRYPTO_PACKET_MIN_RATE;
+    congestion_control_delay.init(conn);
+
+    double credit = 0;
+    uint32_t queue = 0;
+    uint64_t time;
+
+    for (time = 50; time <= 20000; time += 50) {
+        credit += conn->packet_send_rate * 0.05;
+        uint32_t sent = credit;
+        credit -= sent;
+        queue += sent;
+
+        uint32_t acked = CONGESTION_TEST_BW * 0.05;
+
+        if (acked > queue) {
+            acked = queue;
+        }
+
+        queue -= acked;
+
+        Congestion_Sample sample = {0};
+        sample.time = time;
+        sample.interval = 50;
+        sample.packets_sent = sent;
+        sample.packets_acked = acked;
+        /* Packets on the wire are unacknowledged too. */
+        sample.send_queue = queue + (uint32_t)(CONGESTION_TEST_BW * CONGESTION_TEST_RTT / 1000);
+        sample.rtt = CONGESTION_TEST_RTT + (uint64_t)(queue * 1000 / CONGESTION_TEST_BW);
+        congestion_control_delay.update(conn, &sample);
+
+        if (time == 3000) {
+            ck_assert_msg(conn->packet_send_rate >= CONGESTION_TEST_BW * 0.75,
+                          "Send rate %f didn't reach the path bandwidth in 3 seconds", conn->packet_send_rate);
+        }
+    }
+
+    ck_assert_msg(conn->packet_send_rate >= CONGESTION_TEST_BW * 0.75 && conn->packet_send_rate <= CONGESTION_TEST_BW * 1.25,
+                  "Send rate %f doesn't match the path bandwidth", conn->packet_send_rate);
+    ck_assert_msg(queue < CONGESTION_TEST_BW * CONGESTION_TEST_RTT / 1000,
+                  "Queue of %u packets is longer than the path", queue);
+    free(conn);
+}
+END_TEST
+
+START_TEST(test_run_interval)
+{
+    Net_Crypto *c = (Net_Crypto *)calloc(1, sizeof(Net_Crypto));
+    Crypto_Connection *conn = (Crypto_Connection *)calloc(1, sizeof(Crypto_Connection));
+    ck_assert_msg(c != NULL && conn != NULL, "Failed to allocate");
+
+    c->last_run = 5000;
+    c->timers = new_timer_wheel(c->last_run);
+    ck_assert_msg(c->timers != NULL, "Failed to create timer wheel");
+
+    static const double rates[] = {CRYPTO_PACKET_MIN_RATE, 1000.0, 1999.0, 2001.0, 50000.0, 1e9};
+    uint32_t i;
+
+    for (i = 0; i < sizeof(rates) / sizeof(rates[0]); ++i) {
+        conn->packet_send_rate = rates[i];
+
+        /* A connection that ran out of packets in this run, and one that
+           already could have sent again. */
+        uint64_t last_set;
+
+        for (last_set = c->last_run - 10; last_set <= c->last_run; last_set += 10) {
+            conn->last_packets_left_set = last_set;
+            ck_assert_msg(paced_send_time(conn) > last_set, "no time between sends at %f packets/s", rates[i]);
+
+            c->current_sleep_time = CRYPTO_SEND_PACKET_INTERVAL;
+            crypto_run_before(c, c->last_run, paced_send_time(conn));
+            ck_assert_msg(crypto_run_interval(c) >= CRYPTO_MIN_SLEEP_TIME, "run interval %u at %f packets/s",
+                          crypto_run_interval(c), rates[i]);
+            ck_assert_msg(crypto_next_run(c) > c->last_run, "next run not after the last one at %f packets/s",
+                          rates[i]);
+        }
+    }
+
+    /* Low rates wait for their next packet. */
+    conn->packet_send_rate = 10.0;
+    conn->last_packets_left_set = c->last_run;
+    c->current_sleep_time = CRYPTO_SEND_PACKET_INTERVAL;
+    crypto_run_before(c, c->last_run, paced_send_time(conn));
+    ck_assert_msg(crypto_run_interval(c) == 100, "run interval %u at 10 packets/s", crypto_run_interval(c));
+
+    kill_timer_wheel(c->timers);
+    free(conn);
+    free(c);
+}
+END_TEST
+
+/* Fill recv with num packets from start on, leaving out the ones for which
+ * missing returns true, and send with all of them, sent long ago.
+ */
+static void fill_sack_arrays(Packet_Data_Pool *pool, Packets_Array *recv, Packets_Array *send, uint32_t start,
+                             uint32_t num, bool (*missing)(uint32_t i))
+{
+    memset(recv, 0, sizeof(Packets_Array));
+    memset(send, 0, sizeof(Packets_Array));
+    recv->buffer_start = recv->buffer_end = start;
+    send->buffer_start = send->buffer_end = start;
+
+    Packet_Data dt;
+    uint32_t i;
+
+    for (i = 0; i < num; ++i) {
+        fill_packet(&dt, start + i);
+        dt.sent_time = 1;
+        ck_assert_msg(add_data_end_of_buffer(pool, send, &dt) != -1, "failed to queue packet %u", i);
+
+        if (!missing(i)) {
+            ck_assert_msg(add_data_to_buffer(pool, recv, start + i, &dt) == 0, "failed to receive packet %u", i);
+        }
+    }
+
+    ck_assert_msg(set_buffer_end(recv, start + num) == 0, "failed to set the end of the received packets");
+}
+
+/* Check that only the packets missing from recv are left in send, marked for
+ * sending again.
+ */
+static void check_sack_arrays(const Packets_Array *send, uint32_t start, uint32_t num, bool (*missing)(uint32_t i))
+{
+    uint32_t i;
+
+    for (i = 0; i < num; ++i) {
+        Packet_Data *dt = *packets_array_slot(send, start + i);
+
+        if (missing(i)) {
+            ck_assert_msg(dt != NULL, "missing packet %u removed from the send array", i);
+            ck_assert_msg(dt->sent_time == 0, "missing packet %u not marked for sending again", i);
+        } else {
+            ck_assert_msg(dt == NULL, "received packet %u still in the send array", i);
+        }
+    }
+}
+
+static bool sack_missing_ranges(uint32_t i)
+{
+    return i == 0 || (i >= 3 && i < 7) || i == 200 || (i >= 500 && i < 530);
+}
+
+static bool sack_missing_alternate(uint32_t i)
+{
+    return i % 2 == 1 && i != 1999;
+}
+
+static uint32_t count_missing(uint32_t num, bool (*missing)(uint32_t i))
+{
+    uint32_t i, count = 0;
+
+    for (i = 0; i < num; ++i) {
+        count += missing(i);
+    }
+
+    return count;
+}
+
+START_TEST(test_sack_packet)
+{
+    Mono_Time *mono_time = mono_time_new();
+    ck_assert_msg(mono_time != NULL, "Failed to create mono_time");
+
+    Packet_Data_Pool pool;
+    init_packet_pool(&pool, 0);
+
+    Packets_Array recv, send;
+    uint8_t data[MAX_CRYPTO_DATA_SIZE];
+    uint64_t latest_send_time = 0;
+
+    /* A few runs of missing packets across the wrap of the packet numbers
+       are sent as ranges. */
+    const uint32_t start = UINT32_MAX - 100;
+    fill_sack_arrays(&pool, &recv, &send, start, 600, sack_missing_ranges);
+    int len = generate_sack_packet(data, sizeof(data), &recv);
+    ck_assert_msg(len > 0 && len < 32, "ranges packet of %d bytes", len);
+    ck_assert_msg(data[0] == PACKET_ID_SACK && data[1] == CRYPTO_SACK_RANGES, "ranges not used");
+    ck_assert_msg(handle_sack_packet(mono_time, &pool, &send, data, len, &latest_send_time, 0) ==
+                  count_missing(600, sack_missing_ranges), "wrong number of requested packets");
+    ck_assert_msg(latest_send_time == 1, "latest send time not set");
+    check_sack_arrays(&send, start, 600, sack_missing_ranges);
+    clear_buffer(&pool, &recv);
+    clear_buffer(&pool, &send);
+
+    /* Too many ranges for the packet fall back to a bitmap. */
+    fill_sack_arrays(&pool, &recv, &send, start, 2000, sack_missing_alternate);
+    len = generate_sack_packet(data, 200, &recv);
+    ck_assert_msg(len == 200, "bitmap packet of %d bytes", len);
+    ck_assert_msg(data[0] == PACKET_ID_SACK && data[1] == CRYPTO_SACK_BITMAP, "bitmap not used");
+
+    uint16_t covered;
+    memcpy(&covered, data + 2, sizeof(uint16_t));
+    covered = net_ntohs(covered);
+    ck_assert_msg(covered == (200 - CRYPTO_SACK_HEADER_SIZE) * 8, "bitmap covers %u packets", covered);
+    ck_assert_msg(handle_sack_packet(mono_time, &pool, &send, data, len, &latest_send_time, 0) ==
+                  count_missing(covered, sack_missing_alternate), "wrong number of requested packets");
+    check_sack_arrays(&send, start, covered, sack_missing_alternate);
+    clear_buffer(&pool, &recv);
+    clear_buffer(&pool, &send);
+
+    /* Malformed packets leave the send array alone. */
+    fill_sack_arrays(&pool, &recv, &send, start, 600, sack_missing_ranges);
+    len = generate_sack_packet(data, sizeof(data), &recv);
+    ck_assert_msg(handle_sack_packet(mono_time, &pool, &send, data, CRYPTO_SACK_HEADER_SIZE - 1, &latest_send_time,
+                                     0) == -1, "accepted a truncated header");
+    ck_assert_msg(handle_sack_packet(mono_time, &pool, &send, data, len - 1, &latest_send_time, 0) == -1,
+                  "accepted a truncated varint");
+
+    uint8_t bad[MAX_CRYPTO_DATA_SIZE];
+    memcpy(bad, data, len);
+    bad[1] = 2;
+    ck_assert_msg(handle_sack_packet(mono_time, &pool, &send, bad, len, &latest_send_time, 0) == -1,
+                  "accepted an unknown format");
+
+    memcpy(bad, data, len);
+    covered = net_htons(601);
+    memcpy(bad + 2, &covered, sizeof(uint16_t));
+    ck_assert_msg(handle_sack_packet(mono_time, &pool, &send, bad, len, &latest_send_time, 0) == -1,
+                  "accepted more packets than were sent");
+
+    memcpy(bad, data, len);
+    covered = net_htons(520);
+    memcpy(bad + 2, &covered, sizeof(uint16_t));
+    ck_assert_msg(handle_sack_packet(mono_time, &pool, &send, bad, len, &latest_send_time, 0) == -1,
+                  "accepted ranges beyond the packets described");
+
+    memcpy(bad, data, len);
+    bad[1] = CRYPTO_SACK_BITMAP;
+    covered = net_htons(600);
+    memcpy(bad + 2, &covered, sizeof(uint16_t));
+    ck_assert_msg(handle_sack_packet(mono_time, &pool, &send, bad, len, &latest_send_time, 0) == -1,
+                  "accepted a bitmap shorter than the packets described");
+
+    const uint16_t long_length = CRYPTO_SACK_HEADER_SIZE + CRYPTO_SACK_MAX_VARINT_SIZE + 1;
+    memcpy(bad, data, CRYPTO_SACK_HEADER_SIZE);
+    memset(bad + CRYPTO_SACK_HEADER_SIZE, 0xff, CRYPTO_SACK_MAX_VARINT_SIZE + 1);
+    ck_assert_msg(handle_sack_packet(mono_time, &pool, &send, bad, long_length, &latest_send_time, 0) == -1,
+                  "accepted a varint that is too long");
+
+    const uint32_t num_received = 600 - count_missing(600, sack_missing_ranges);
+    ck_assert_msg(num_packets_array(&send) == 600 && pool.num_used == 600 + num_received,
+                  "malformed packet changed the send array");
+
+    /* Nothing missing: everything described was received. */
+    clear_buffer(&pool, &recv);
+    memset(&recv, 0, sizeof(Packets_Array));
+    recv.buffer_start = recv.buffer_end = start + 600;
+    len = generate_sack_packet(data, sizeof(data), &recv);
+    ck_assert_msg(len == CRYPTO_SACK_HEADER_SIZE, "empty packet of %d bytes", len);
+    ck_assert_msg(handle_sack_packet(mono_time, &pool, &send, data, len, &latest_send_time, 0) == 0,
+                  "requested packets from an empty packet");
+
+    clear_buffer(&pool, &send);
+    ck_assert_msg(pool.num_used == 0, "%u packets still in use", pool.num_used);
+    pthread_mutex_destroy(&pool.mutex);
+    mono_time_free(mono_time);
+}
+END_TEST
+
+/* Give a job sealing or opening data of length with shared_key and nonce to
+ * the workers of c.
+ */
+static Crypto_Job *give_crypto_job(Net_Crypto *c, bool seal, const uint8_t *shared_key, const uint8_t *nonce,
+                                   const uint8_t *data, uint16_t length)
+{
+    Crypto_Job *job = crypto_job_new(c->crypto_pool);
+    ck_assert_msg(job != NULL, "Failed to get a crypto job");
+
+    job->seal = seal;
+    job->crypt_connection_id = 0;
+    job->length = length;
+    memcpy(job->data, data, length);
+    memcpy(job->shared_key, shared_key, CRYPTO_SHARED_KEY_SIZE);
+    memcpy(job->nonce, nonce, CRYPTO_NONCE_SIZE);
+    crypto_job_give(c->crypto_pool, job);
+    return job;
+}
+
+static void wait_crypto_job(Crypto_Pool *pool, const Crypto_Job *job)
+{
+    pthread_mutex_lock(&pool->mutex);
+
+    while (!job->done) {
+        pthread_cond_wait(&pool->done_cond, &pool->mutex);
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+#define NUM_TEST_JOBS 64
+
+START_TEST(test_crypto_workers)
+{
+    Net_Crypto *c = (Net_Crypto *)calloc(1, sizeof(Net_Crypto));
+    ck_assert_msg(c != NULL, "Failed to allocate");
+
+    c->last_run = 5000;
+    c->current_sleep_time = CRYPTO_SEND_PACKET_INTERVAL;
+    c->timers = new_timer_wheel(c->last_run);
+    ck_assert_msg(c->timers != NULL, "Failed to create timer wheel");
+
+    ck_assert_msg(crypto_start_workers(c, 0) == -1, "started 0 workers");
+    ck_assert_msg(crypto_start_workers(c, CRYPTO_MAX_WORKERS + 1) == -1, "started too many workers");
+    ck_assert_msg(crypto_start_workers(c, 2) == 0, "Failed to start workers");
+    ck_assert_msg(crypto_start_workers(c, 2) == -1, "started workers twice");
+    ck_assert_msg(crypto_next_run(c) == c->last_run + CRYPTO_SEND_PACKET_INTERVAL, "next run moved without jobs");
+
+    uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
+    uint8_t nonce[CRYPTO_NONCE_SIZE];
+    new_symmetric_key(shared_key);
+    random_nonce(nonce);
+
+    uint8_t data[NUM_TEST_JOBS][MAX_DATA_DATA_PACKET_SIZE];
+    uint16_t lengths[NUM_TEST_JOBS];
+    Crypto_Job *seals[NUM_TEST_JOBS];
+    uint32_t i;
+
+    for (i = 0; i < NUM_TEST_JOBS; ++i) {
+        lengths[i] = 1 + random_int() % MAX_DATA_DATA_PACKET_SIZE;
+        random_bytes(data[i], lengths[i]);
+        seals[i] = give_crypto_job(c, 1, shared_key, nonce, data[i], lengths[i]);
+        increment_nonce(nonce);
+
+        /* The loop must run again soon to send the packets. */
+        ck_assert_msg(crypto_next_run(c) == c->last_run, "next run not due with jobs given");
+        ck_assert_msg(crypto_run_interval(c) == CRYPTO_MIN_SLEEP_TIME, "run interval %u with jobs given",
+                      crypto_run_interval(c));
+    }
+
+    for (i = 0; i < NUM_TEST_JOBS; ++i) {
+        wait_crypto_job(c->crypto_pool, seals[i]);
+    }
+
+    ck_assert_msg(crypto_next_run(c) == c->last_run, "next run not due with finished jobs");
+
+    /* Opening the sealed packets gives the data back, with the nonces they
+       were given in order. */
+    random_nonce(nonce);
+    Crypto_Job *opens[NUM_TEST_JOBS];
+
+    for (i = 0; i < NUM_TEST_JOBS; ++i) {
+        ck_assert_msg(seals[i]->result_length == lengths[i] + DATA_PACKET_HEADER_SIZE, "packet %u sealed to %d bytes",
+                      i, seals[i]->result_length);
+        ck_assert_msg(seals[i]->result[0] == NET_PACKET_CRYPTO_DATA, "packet %u has the wrong id", i);
+
+        Crypto_Connection conn;
+        memcpy(conn.recv_nonce, seals[0]->nonce, CRYPTO_NONCE_SIZE);
+        data_packet_nonce(&conn, seals[i]->result, nonce);
+        ck_assert_msg(memcmp(nonce, seals[i]->nonce, CRYPTO_NONCE_SIZE) == 0, "packet %u has the wrong nonce", i);
+        opens[i] = give_crypto_job(c, 0, shared_key, nonce, seals[i]->result, seals[i]->result_length);
+    }
+
+    for (i = 0; i < NUM_TEST_JOBS; ++i) {
+        wait_crypto_job(c->crypto_pool, opens[i]);
+        ck_assert_msg(opens[i]->result_length == lengths[i], "packet %u opened to %d bytes", i,
+                      opens[i]->result_length);
+        ck_assert_msg(memcmp(opens[i]->result, data[i], lengths[i]) == 0, "packet %u opened to other data", i);
+    }
+
+    /* There is no connection 0 to send or handle them, so finishing them
+       only gives them back. */
+    crypto_drop_jobs(c, 0);
+    crypto_finish_jobs(c, NULL);
+    ck_assert_msg(c->crypto_pool->num_jobs == 0, "%u jobs left", c->crypto_pool->num_jobs);
+    ck_assert_msg(crypto_next_run(c) == c->last_run + CRYPTO_SEND_PACKET_INTERVAL, "next run still due");
+    ck_assert_msg(crypto_run_interval(c) == CRYPTO_SEND_PACKET_INTERVAL, "run interval %u without jobs",
+                  crypto_run_interval(c));
+
+    /* Past CRYPTO_MAX_PENDING_JOBS packets are encrypted in place. */
+    Crypto_Job **jobs = (Crypto_Job **)calloc(CRYPTO_MAX_PENDING_JOBS, sizeof(Crypto_Job *));
+    ck_assert_msg(jobs != NULL, "Failed to allocate");
+
+    for (i = 0; i < CRYPTO_MAX_PENDING_JOBS; ++i) {
+        jobs[i] = give_crypto_job(c, 1, shared_key, nonce, data[0], lengths[0]);
+    }
+
+    ck_assert_msg(crypto_job_new(c->crypto_pool) == NULL, "more than CRYPTO_MAX_PENDING_JOBS jobs pending");
+
+    crypto_drop_jobs(c, 0);
+    crypto_finish_jobs(c, NULL);
+    ck_assert_msg(c->crypto_pool->num_jobs == 0, "%u jobs left", c->crypto_pool->num_jobs);
+    free(jobs);
+
+    /* Jobs left over when the workers stop are dropped. */
+    give_crypto_job(c, 1, shared_key, nonce, data[0], lengths[0]);
+    crypto_stop_workers(c);
+    ck_assert_msg(c->crypto_pool == NULL, "workers not stopped");
+    ck_assert_msg(crypto_next_run(c) == c->last_run + CRYPTO_SEND_PACKET_INTERVAL, "next run due without workers");
+
+    kill_timer_wheel(c->timers);
+    free(c);
+}
+END_TEST
+
+static uint64_t get_test_clock(void *object)
+{
+    return *(const uint64_t *)object;
+}
+
+/* Admit a cookie request from ip:port to c.
+ *
+ * return true if it was handled or queued, false if it was dropped.
+ */
+static bool admit_cookie_request(Net_Crypto *c, IP ip, uint16_t port)
+{
+    uint8_t packet[COOKIE_REQUEST_LENGTH];
+    random_bytes(packet, sizeof(packet));
+    packet[0] = NET_PACKET_COOKIE_REQUEST;
+
+    /* Connections are found by comparing whole IP_Ports. */
+    IP_Port source;
+    memset(&source, 0, sizeof(source));
+    source.ip = ip;
+    source.port = net_htons(port);
+    /* Handling it fails, as it was not encrypted for us. */
+    const uint64_t dropped = c->handshake_stats.dropped_rate_limited + c->handshake_stats.dropped_queue_full;
+    admit_handshake(c, source, packet, sizeof(packet), NULL);
+    return c->handshake_stats.dropped_rate_limited + c->handshake_stats.dropped_queue_full == dropped;
+}
+
+static IP test_ip4(uint32_t host)
+{
+    IP ip;
+    ip_init(&ip, 0);
+    ip.ip4.uint32 = net_htonl(0x0A000000 | host);
+    return ip;
+}
+
+START_TEST(test_handshake_admission)
+{
+    uint64_t now = 1000000;
+    Mono_Time *mono_time = mono_time_new();
+    ck_assert_msg(mono_time != NULL, "Failed to create mono_time");
+    mono_time_set_clock(mono_time, &get_test_clock, &now);
+
+    IP ip;
+    ip_init(&ip, 1);
+    Networking_Core *net = new_networking(NULL, ip, 33445);
+    DHT *dht = new_DHT(NULL, mono_time, net, true);
+    TCP_Proxy_Info proxy_info = {{{0}}};
+    Net_Crypto *c = new_net_crypto(NULL, mono_time, dht, &proxy_info);
+    ck_assert_msg(c != NULL, "Failed to create Net_Crypto");
+
+    Handshake_Admission *admission = c->handshakes;
+    uint32_t i;
+
+    const IP limited = test_ip4(1);
+    const IP known_ip = test_ip4(2);
+    IP ip6;
+    ip_init(&ip6, 1);
+    ip6.ip6.uint32[0] = net_htonl(0x20010db8);
+
+    /* Sources sharing a slot share their limit, so pick a hash key that keeps
+       these apart. */
+    IP source;
+
+    while (1) {
+        const Handshake_Source *slot_limited = handshake_source_slot(c, &limited, &source);
+        const Handshake_Source *slot_known = handshake_source_slot(c, &known_ip, &source);
+        const Handshake_Source *slot_ip6 = handshake_source_slot(c, &ip6, &source);
+
+        if (slot_limited != slot_known && slot_limited != slot_ip6 && slot_known != slot_ip6) {
+            break;
+        }
+
+        random_bytes((uint8_t *)c->connections_hash_key, sizeof(c->connections_hash_key));
+    }
+
+    /* Within their burst the handshakes of a source are handled right away
+       while the budget of the run lasts. */
+    for (i = 0; i < CRYPTO_HANDSHAKE_SOURCE_BURST; ++i) {
+        ck_assert_msg(admit_cookie_request(c, limited, 1000 + i), "handshake %u of the burst dropped", i);
+    }
+
+    ck_assert_msg(c->handshake_stats.handled == CRYPTO_HANDSHAKES_PER_RUN, "%u handshakes handled",
+                  (unsigned int)c->handshake_stats.handled);
+    ck_assert_msg(admission->budget == 0, "budget of %u left", admission->budget);
+
+    /* Any port of the address, and any address of an IPv6 /64, is the same
+       source. */
+    ck_assert_msg(!admit_cookie_request(c, limited, 2000), "handshake past the burst admitted");
+
+    for (i = 0; i < CRYPTO_HANDSHAKE_SOURCE_BURST; ++i) {
+        ip6.ip6.uint32[3] = net_htonl(i);
+        ck_assert_msg(admit_cookie_request(c, ip6, 1000), "IPv6 handshake %u of the burst dropped", i);
+    }
+
+    ip6.ip6.uint32[3] = net_htonl(i);
+    ck_assert_msg(!admit_cookie_request(c, ip6, 1000), "IPv6 handshake past the burst admitted");
+    ck_assert_msg(c->handshake_stats.dropped_rate_limited == 2, "%u handshakes rate limited",
+                  (unsigned int)c->handshake_stats.dropped_rate_limited);
+    ck_assert_msg(admission->queues[HANDSHAKE_PRIORITY_NEW].count == CRYPTO_HANDSHAKE_SOURCE_BURST,
+                  "%u handshakes queued", admission->queues[HANDSHAKE_PRIORITY_NEW].count);
+
+    /* The limit lets a handshake through again after its interval. */
+    now += HANDSHAKE_SOURCE_INTERVAL;
+    ck_assert_msg(admit_cookie_request(c, limited, 2000), "handshake dropped after the interval");
+    ck_assert_msg(!admit_cookie_request(c, limited, 2000), "second handshake admitted after one interval");
+
+    /* Handshakes from the address of a connection still handshaking are
+       known ones: they have a larger burst, but are still limited. */
+    uint8_t real_pk[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t dht_pk[CRYPTO_PUBLIC_KEY_SIZE];
+    random_bytes(real_pk, sizeof(real_pk));
+    random_bytes(dht_pk, sizeof(dht_pk));
+    const int id = new_crypto_connection(c, real_pk, dht_pk);
+    ck_assert_msg(id != -1, "Failed to create a connection");
+
+    IP_Port known;
+    memset(&known, 0, sizeof(known));
+    known.ip = known_ip;
+    known.port = net_htons(5000);
+    ck_assert_msg(set_direct_ip_port(c, id, known, 0) == 0, "Failed to set the address of the connection");
+
+    uint8_t packet[COOKIE_REQUEST_LENGTH] = {NET_PACKET_COOKIE_REQUEST};
+    ck_assert_msg(handshake_priority(c, known, packet, sizeof(packet)) == HANDSHAKE_PRIORITY_KNOWN,
+                  "handshake of a connection in progress not known");
+
+    IP_Port other = known;
+    other.port = net_htons(5001);
+    ck_assert_msg(handshake_priority(c, other, packet, sizeof(packet)) == HANDSHAKE_PRIORITY_NEW,
+                  "handshake from another port known");
+
+    /* Handshakes of the connection go through the admission too. */
+    uint8_t handshake[HANDSHAKE_PACKET_LENGTH];
+    uint8_t cookie_data[COOKIE_DATA_LENGTH];
+    random_bytes(handshake, sizeof(handshake));
+    random_bytes(cookie_data, sizeof(cookie_data));
+    handshake[0] = NET_PACKET_CRYPTO_HS;
+    ck_assert_msg(create_cookie(c->mono_time, handshake + 1, cookie_data, c->secret_symmetric_key) == 0,
+                  "Failed to create a cookie");
+    ck_assert_msg(udp_handle_packet(c, known, handshake, sizeof(handshake), NULL) == 0,
+                  "handshake of a connection in progress not queued");
+    ck_assert_msg(admission->queues[HANDSHAKE_PRIORITY_KNOWN].count == 1, "handshake not queued as a known one");
+
+    for (i = 1; i < CRYPTO_HANDSHAKE_KNOWN_BURST; ++i) {
+        ck_assert_msg(admit_cookie_request(c, known.ip, 5000), "known handshake %u of the burst dropped", i);
+    }
+
+    ck_assert_msg(!admit_cookie_request(c, known.ip, 5000), "known handshake past the burst admitted");
+    ck_assert_msg(admission->queues[HANDSHAKE_PRIORITY_KNOWN].count == CRYPTO_HANDSHAKE_KNOWN_BURST,
+                  "%u known handshakes queued", admission->queues[HANDSHAKE_PRIORITY_KNOWN].count);
+
+    /* Established connections don't handshake any more. */
+    c->crypto_connections[id].status = CRYPTO_CONN_ESTABLISHED;
+    ck_assert_msg(handshake_priority(c, known, packet, sizeof(packet)) == HANDSHAKE_PRIORITY_NEW,
+                  "handshake of an established connection known");
+
+    /* A handshake packet with a cookie that isn't ours is dropped before it
+       costs anything. */
+    random_bytes(handshake + 1, sizeof(handshake) - 1);
+    ck_assert_msg(handshake_priority(c, known, handshake, sizeof(handshake)) == -1, "forged cookie accepted");
+    ck_assert_msg(handshake_priority(c, known, packet, sizeof(packet) - 1) == -1, "short cookie request accepted");
+
+    /* The next run handles the known handshakes first, then the new ones in
+       the order they came. */
+    ck_assert_msg(crypto_next_run(c) == c->last_run, "next run not due with handshakes queued");
+    const uint32_t queued_new = admission->queues[HANDSHAKE_PRIORITY_NEW].count;
+    const uint64_t handled = c->handshake_stats.handled;
+    do_handshake_queue(c, NULL);
+
+    ck_assert_msg(c->handshake_stats.handled == handled + CRYPTO_HANDSHAKES_PER_RUN, "%u handshakes handled",
+                  (unsigned int)(c->handshake_stats.handled - handled));
+    ck_assert_msg(admission->queues[HANDSHAKE_PRIORITY_KNOWN].count == CRYPTO_HANDSHAKE_KNOWN_BURST
+                  - CRYPTO_HANDSHAKES_PER_RUN, "%u known handshakes left",
+                  admission->queues[HANDSHAKE_PRIORITY_KNOWN].count);
+    ck_assert_msg(admission->queues[HANDSHAKE_PRIORITY_NEW].count == queued_new, "new handshakes handled first");
+
+    do_handshake_queue(c, NULL);
+    ck_assert_msg(admission->queues[HANDSHAKE_PRIORITY_KNOWN].count == 0, "known handshakes left");
+    ck_assert_msg(admission->queues[HANDSHAKE_PRIORITY_NEW].count == queued_new, "new handshakes handled early");
+
+    do_handshake_queue(c, NULL);
+    const Handshake_Queue *queue = &admission->queues[HANDSHAKE_PRIORITY_NEW];
+    ck_assert_msg(queue->count == queued_new - CRYPTO_HANDSHAKES_PER_RUN, "%u new handshakes left", queue->count);
+
+    /* The IPv6 ones were queued first, the one of the limited source last. */
+    const Queued_Handshake *next = &queue->packets[queue->start];
+    ck_assert_msg(next->source.ip.family == AF_INET && next->source.ip.ip4.uint32 == limited.ip4.uint32,
+                  "new handshakes handled out of order");
+
+    do_handshake_queue(c, NULL);
+    ck_assert_msg(c->handshake_stats.queued == 0, "%u handshakes still queued", c->handshake_stats.queued);
+
+    /* Past the size of its queue, handshakes are dropped. Once all sources
+       are back to their full burst, sharing a slot doesn't matter. */
+    now += 10000;
+    admission->budget = 0;
+
+    for (i = 0; i < CRYPTO_HANDSHAKE_QUEUE_SIZE; ++i) {
+        ck_assert_msg(admit_cookie_request(c, test_ip4(100 + i), 1000), "handshake %u not queued", i);
+    }
+
+    ck_assert_msg(!admit_cookie_request(c, test_ip4(100 + i), 1000), "handshake queued past the queue size");
+    ck_assert_msg(c->handshake_stats.dropped_queue_full == 1, "%u handshakes dropped for a full queue",
+                  (unsigned int)c->handshake_stats.dropped_queue_full);
+
+    kill_net_crypto(c);
+    kill_DHT(dht);
+    kill_networking(net);
+    mono_time_free(mono_time);
+}
+END_TEST
+
+static Suite *net_crypto_suite(void)
+{
+    Suite *s = suite_create("net_crypto");
+
+    DEFTESTCASE(packets_array_grow);
+    DEFTESTCASE(packet_data_pool);
+    DEFTESTCASE(congestion_delay);
+    DEFTESTCASE(run_interval);
+    DEFTESTCASE(sack_packet);
+    DEFTESTCASE(crypto_workers);
+    DEFTESTCASE(handshake_admission);
+
+    return s;
+}
+
+int main(int argc, char *argv[])
+{
+    srand((unsigned int) time(NULL));
+
+    Suite *s = net_crypto_suite();
+    SRunner *test_runner = srunner_create(s);
+
+    int number_failed = 0;
+    srunner_run_all(test_runner, CK_NORMAL);
+    number_failed = srunner_ntests_failed(test_runner);
+
+    srunner_free(test_runner);
+
+    return number_failed;
+}
@@ -5,6 +5,7 @@
 #include "check_compat.h"
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,6 +13,7 @@
 #include <time.h>
 
 #include "../toxcore/network.h"
+#include "../toxcore/packet_buf.h"
 
 #include "helpers.h"
 
@@ -136,12 +138,582 @@ START_TEST(test_ip_equal)
 }
 END_TEST
 
+/* A backend looping every datagram back to the instance that sent it. */
+typedef struct {
+    IP_Port ip_port;
+    uint8_t data[MAX_UDP_PACKET_SIZE + 16];
+    uint16_t length;
+    unsigned int killed;
+} Loopback;
+
+static int loopback_send(void *object, IP_Port ip_port, const uint8_t *data, uint16_t length)
+{
+    Loopback *loopback = (Loopback *)object;
+
+    if (loopback->length != 0 || length > sizeof(loopback->data)) {
+        return -1;
+    }
+
+    loopback->ip_port = ip_port;
+    memcpy(loopback->data, data, length);
+    loopback->length = length;
+    return length;
+}
+
+static int loopback_recv(void *object, IP_Port *ip_port, uint8_t *data, uint16_t length)
+{
+    Loopback *loopback = (Loopback *)object;
+
+    if (loopback->length == 0 || loopback->length > length) {
+        return -1;
+    }
+
+    const int received = loopback->length;
+    *ip_port = loopback->ip_port;
+    memcpy(data, loopback->data, received);
+    loopback->length = 0;
+    return received;
+}
+
+static void loopback_kill(void *object)
+{
+    Loopback *loopback = (Loopback *)object;
+    ++loopback->killed;
+}
+
+static const Network_Backend loopback_backend = {
+    loopback_send,
+    loopback_recv,
+    loopback_kill,
+    NULL,
+};
+
+static unsigned int handled_packets;
+
+static int handle_loopback_packet(void *object, IP_Port ip_port, const uint8_t *data, uint16_t len, void *userdata)
+{
+    const IP_Port *expected = (const IP_Port *)object;
+
+    ck_assert_msg(ipport_equal(&ip_port, expected), "packet came from the wrong address");
+    ck_assert_msg(len == 3 && memcmp(data, "\xfe\x01\x02", 3) == 0, "packet has the wrong content");
+    ++handled_packets;
+    return 0;
+}
+
+START_TEST(test_network_backend)
+{
+    Loopback loopback;
+    memset(&loopback, 0, sizeof(loopback));
+
+    Networking_Core *net = new_networking_backend(NULL, AF_INET, 33445, &loopback_backend, &loopback);
+    ck_assert_msg(net != NULL, "failed to create a Networking_Core with a backend");
+    ck_assert_msg(net->port == net_htons(33445), "wrong port");
+
+    IP_Port ip_port;
+    ip_init(&ip_port.ip, 0);
+    ip_port.ip.ip4.uint32 = net_htonl(0x7F000001);
+    ip_port.port = net_htons(33446);
+
+    networking_registerhandler(net, 0xfe, &handle_loopback_packet, &ip_port);
+
+    ELASTOS_VLA(uint8_t, packet, 3);
+    memcpy(packet, "\xfe\x01\x02", 3);
+    ck_assert_msg(sendpacket(net, ip_port, packet, 3) == 3, "sendpacket didn't go through the backend");
+    ck_assert_msg(loopback.length == 3 + ela_magic_size(), "backend got %u bytes", loopback.length);
+
+    IP_Port ip6_port;
+    ip_init(&ip6_port.ip, 1);
+    ip6_port.port = ip_port.port;
+    ck_assert_msg(sendpacket(net, ip6_port, packet, 3) == -1, "IPv4 instance sent to an IPv6 address");
+
+    networking_poll(net, NULL);
+    ck_assert_msg(handled_packets == 1, "the packet was handled %u times", handled_packets);
+    ck_assert_msg(loopback.length == 0, "the packet wasn't received");
+
+    kill_networking(net);
+    ck_assert_msg(loopback.killed == 1, "the backend wasn't released");
+}
+END_TEST
+
+static int reject_loopback_packet(void *object, IP_Port ip_port, const uint8_t *data, uint16_t len, void *userdata)
+{
+    return 1;
+}
+
+static void count_sent_packet(void *object, IP_Port ip_port, const uint8_t *data, uint16_t len)
+{
+    ck_assert_msg(len == 3 && ip_port.port == net_htons(33446), "wrong packet passed to the sent callback");
+    ++*(unsigned int *)object;
+}
+
+START_TEST(test_packet_stats)
+{
+    Loopback loopback;
+    memset(&loopback, 0, sizeof(loopback));
+
+    Networking_Core *net = new_networking_backend(NULL, AF_INET, 33445, &loopback_backend, &loopback);
+    ck_assert_msg(net != NULL, "failed to create a Networking_Core with a backend");
+
+    IP_Port ip_port;
+    ip_init(&ip_port.ip, 0);
+    ip_port.ip.ip4.uint32 = net_htonl(0x7F000001);
+    ip_port.port = net_htons(33446);
+
+    networking_registerhandler(net, 0xfe, &handle_loopback_packet, &ip_port);
+    networking_registerhandler(net, 0xfc, &reject_loopback_packet, NULL);
+
+    unsigned int sent = 0;
+    networking_callback_sent(net, &count_sent_packet, &sent);
+
+    ELASTOS_VLA(uint8_t, packet, 3);
+    memcpy(packet, "\xfe\x01\x02", 3);
+
+    for (uint8_t id = 0xfc; id <= 0xfe; ++id) {
+        packet[0] = id;
+        ck_assert_msg(sendpacket(net, ip_port, packet, 3) == 3, "sendpacket didn't go through the backend");
+        networking_poll(net, NULL);
+    }
+
+    ck_assert_msg(sent == 3, "sent callback called %u times for 3 packets", sent);
+
+    const Packet_Stats *handled = &net->packet_stats[0xfe];
+    ck_assert_msg(handled->packets_out == 1 && handled->bytes_out == 3, "sent packet not counted");
+    ck_assert_msg(handled->packets_in == 1 && handled->bytes_in == 3, "received packet not counted");
+    ck_assert_msg(handled->handled == 1 && handled->dropped == 0, "handled packet not counted");
+
+    const Packet_Stats *unhandled = &net->packet_stats[0xfd];
+    ck_assert_msg(unhandled->packets_in == 1 && unhandled->handled == 0 && unhandled->dropped == 1,
+                  "packet without a handler not counted as dropped");
+
+    const Packet_Stats *rejected = &net->packet_stats[0xfc];
+    ck_assert_msg(rejected->packets_in == 1 && rejected->handled == 1 && rejected->dropped == 1,
+                  "rejected packet not counted as dropped");
+
+    networking_reset_stats(net);
+    ck_assert_msg(net->packet_stats[0xfe].packets_in == 0 && net->packet_stats[0xfe].bytes_out == 0,
+                  "counters not reset");
+
+    kill_networking(net);
+}
+END_TEST
+
+static unsigned int batched_packets;
+
+static int handle_batched_packet(void *object, IP_Port ip_port, const uint8_t *data, uint16_t len, void *userdata)
+{
+    ck_assert_msg(len == 100 && data[1] == batched_packets, "packet %u arrived out of order", batched_packets);
+    ++batched_packets;
+    return 0;
+}
+
+START_TEST(test_batched_io)
+{
+    IP ip;
+    ip_init(&ip, 0);
+    ip.ip4.uint32 = net_htonl(0x7F000001);
+
+    Networking_Core *net1 = new_networking(NULL, ip, 33445);
+    Networking_Core *net2 = new_networking(NULL, ip, 33445);
+    ck_assert_msg(net1 != NULL && net2 != NULL, "failed to create the Networking_Core objects");
+    ck_assert_msg(networking_set_batch_size(net1, 0) == -1, "accepted a batch size of 0");
+    ck_assert_msg(networking_set_batch_size(net1, NET_MAX_BATCH_SIZE + 1) == -1, "accepted a too large batch size");
+    ck_assert_msg(networking_set_batch_size(net1, 8) == 0, "failed to set the batch size");
+    ck_assert_msg(networking_set_batch_size(net2, 8) == 0, "failed to set the batch size");
+
+    networking_registerhandler(net2, 0xfe, &handle_batched_packet, NULL);
+
+    IP_Port ip_port;
+    ip_port.ip = ip;
+    ip_port.port = net2->port;
+
+    ELASTOS_VLA(uint8_t, packet, 100);
+    memset(packet, 0, 100);
+    packet[0] = 0xfe;
+
+    /* More than a batch, so that a full queue is sent before the flush. */
+    for (unsigned int i = 0; i < 20; ++i) {
+        packet[1] = i;
+        ck_assert_msg(sendpacket(net1, ip_port, packet, 100) == 100, "failed to queue packet %u", i);
+    }
+
+    networking_flush(net1);
+
+    for (unsigned int i = 0; i < 50 && batched_packets < 20; ++i) {
+        c_sleep(10);
+        networking_poll(net2, NULL);
+    }
+
+    ck_assert_msg(batched_packets == 20, "received %u packets instead of 20", batched_packets);
+
+    /* Back to one datagram at a time. */
+    ck_assert_msg(networking_set_batch_size(net1, 1) == 0, "failed to disable batching");
+    packet[1] = 20;
+    ck_assert_msg(sendpacket(net1, ip_port, packet, 100) == 100, "failed to send a packet");
+
+    for (unsigned int i = 0; i < 50 && batched_packets < 21; ++i) {
+        c_sleep(10);
+        networking_poll(net2, NULL);
+    }
+
+    ck_assert_msg(batched_packets == 21, "received %u packets instead of 21", batched_packets);
+
+    kill_networking(net1);
+    kill_networking(net2);
+}
+END_TEST
+
+static unsigned int segmented_packets;
+
+static uint16_t segmented_length(unsigned int i)
+{
+    /* Runs of equal lengths, broken by shorter and longer datagrams. */
+    if (i % 30 == 29) {
+        return 300;
+    }
+
+    return i < 70 ? 1000 : 1200;
+}
+
+static int handle_segmented_packet(void *object, IP_Port ip_port, const uint8_t *data, uint16_t len,
+                                   void *userdata)
+{
+    ck_assert_msg(data[1] == segmented_packets, "packet %u arrived out of order", segmented_packets);
+    ck_assert_msg(len == segmented_length(segmented_packets), "packet %u has the wrong length %u",
+                  segmented_packets, len);
+    ++segmented_packets;
+    return 0;
+}
+
+/* Large batches to the same address, which Linux sends and receives with
+ * UDP_SEGMENT and UDP_GRO where it can. */
+START_TEST(test_segmented_io)
+{
+    IP ip;
+    ip_init(&ip, 0);
+    ip.ip4.uint32 = net_htonl(0x7F000001);
+
+    Networking_Core *net1 = new_networking(NULL, ip, 33445);
+    Networking_Core *net2 = new_networking(NULL, ip, 33445);
+    ck_assert_msg(net1 != NULL && net2 != NULL, "failed to create the Networking_Core objects");
+    ck_assert_msg(networking_set_batch_size(net1, 128) == 0, "failed to set the batch size");
+    ck_assert_msg(networking_set_batch_size(net2, 128) == 0, "failed to set the batch size");
+
+    networking_registerhandler(net2, 0xfe, &handle_segmented_packet, NULL);
+
+    IP_Port ip_port;
+    ip_port.ip = ip;
+    ip_port.port = net2->port;
+
+    ELASTOS_VLA(uint8_t, packet, 1200);
+    memset(packet, 0, 1200);
+    packet[0] = 0xfe;
+
+    for (unsigned int i = 0; i < 100; ++i) {
+        packet[1] = i;
+        ck_assert_msg(sendpacket(net1, ip_port, packet, segmented_length(i)) == segmented_length(i),
+                      "failed to queue packet %u", i);
+    }
+
+    networking_flush(net1);
+
+    for (unsigned int i = 0; i < 50 && segmented_packets < 100; ++i) {
+        c_sleep(10);
+        networking_poll(net2, NULL);
+    }
+
+    ck_assert_msg(segmented_packets == 100, "received %u packets instead of 100", segmented_packets);
+
+    /* Back to one datagram at a time, which must not get coalesced ones. */
+    ck_assert_msg(networking_set_batch_size(net2, 1) == 0, "failed to disable batching");
+
+    for (unsigned int i = 100; i < 110; ++i) {
+        packet[1] = i;
+        ck_assert_msg(sendpacket(net1, ip_port, packet, segmented_length(i)) == segmented_length(i),
+                      "failed to queue packet %u", i);
+    }
+
+    networking_flush(net1);
+
+    for (unsigned int i = 0; i < 50 && segmented_packets < 110; ++i) {
+        c_sleep(10);
+        networking_poll(net2, NULL);
+    }
+
+    ck_assert_msg(segmented_packets == 110, "received %u packets instead of 110", segmented_packets);
+
+    kill_networking(net1);
+    kill_networking(net2);
+}
+END_TEST
+
+static unsigned int fallback_packets;
+
+static int handle_fallback_packet(void *object, IP_Port ip_port, const uint8_t *data, uint16_t len, void *userdata)
+{
+    ck_assert_msg(len == 1000 && data[1] == fallback_packets % 256, "packet %u arrived out of order",
+                  fallback_packets);
+    ++fallback_packets;
+    return 0;
+}
+
+static void send_fallback_packets(Networking_Core *net1, Networking_Core *net2, IP_Port ip_port, unsigned int count)
+{
+    ELASTOS_VLA(uint8_t, packet, 1000);
+    memset(packet, 0, 1000);
+    packet[0] = 0xfe;
+
+    const unsigned int expected = fallback_packets + count;
+
+    for (unsigned int i = fallback_packets; i < expected; ++i) {
+        packet[1] = i;
+        ck_assert_msg(sendpacket(net1, ip_port, packet, 1000) == 1000, "failed to queue packet %u", i);
+    }
+
+    networking_flush(net1);
+
+    for (unsigned int i = 0; i < 50 && fallback_packets < expected; ++i) {
+        c_sleep(10);
+        networking_poll(net2, NULL);
+    }
+
+    ck_assert_msg(fallback_packets == expected, "received %u packets instead of %u", fallback_packets, expected);
+}
+
+/* Segmented sends, and the datagrams of a segmented buffer the kernel
+ * rejects going out one by one. */
+START_TEST(test_segmented_fallback)
+{
+    IP ip;
+    ip_init(&ip, 0);
+    ip.ip4.uint32 = net_htonl(0x7F000001);
+
+    Networking_Core *net1 = new_networking(NULL, ip, 33445);
+    Networking_Core *net2 = new_networking(NULL, ip, 33445);
+    ck_assert_msg(net1 != NULL && net2 != NULL, "failed to create the Networking_Core objects");
+
+    Net_Batch_Stats stats;
+    ck_assert_msg(!networking_batch_stats(net1, &stats), "stats of datagrams sent one at a time");
+    ck_assert_msg(networking_set_batch_size(net1, 128) == 0, "failed to set the batch size");
+
+    networking_registerhandler(net2, 0xfe, &handle_fallback_packet, NULL);
+
+    IP_Port ip_port;
+    ip_port.ip = ip;
+    ip_port.port = net2->port;
+
+    send_fallback_packets(net1, net2, ip_port, 100);
+
+    ck_assert_msg(networking_batch_stats(net1, &stats), "no stats of the batches");
+    ck_assert_msg(stats.datagrams == 100, "sent %u datagrams instead of 100", (unsigned int)stats.datagrams);
+    ck_assert_msg(stats.segmented == (stats.segmentation ? 100 : 0), "segmented %u datagrams",
+                  (unsigned int)stats.segmented);
+    ck_assert_msg(stats.resent == 0, "resent %u datagrams", (unsigned int)stats.resent);
+
+#ifdef SO_NO_CHECK
+    /* Linux refuses to segment for sockets that send without checksums. */
+    const int no_check = 1;
+    ck_assert_msg(setsockopt(net1->sock, SOL_SOCKET, SO_NO_CHECK, &no_check, sizeof(no_check)) == 0,
+                  "failed to turn off checksums");
+
+    send_fallback_packets(net1, net2, ip_port, 100);
+
+    ck_assert_msg(networking_batch_stats(net1, &stats), "no stats of the batches");
+    ck_assert_msg(stats.datagrams == 200, "sent %u datagrams instead of 200", (unsigned int)stats.datagrams);
+    ck_assert_msg(stats.resent == (stats.segmentation ? 100 : 0), "resent %u datagrams",
+                  (unsigned int)stats.resent);
+#endif
+
+    kill_networking(net1);
+    kill_networking(net2);
+}
+END_TEST
+
+static unsigned int threaded_packets;
+
+static int handle_threaded_packet(void *object, IP_Port ip_port, const uint8_t *data, uint16_t len, void *userdata)
+{
+    ++threaded_packets;
+    return 0;
+}
+
+typedef struct {
+    Networking_Core *net;
+    IP_Port ip_port;
+    unsigned int failed;
+} Threaded_Sender;
+
+static void *send_threaded_packets(void *arg)
+{
+    Threaded_Sender *sender = (Threaded_Sender *)arg;
+    uint8_t packet[100] = {0xfe};
+
+    for (unsigned int i = 0; i < 50; ++i) {
+        if (sendpacket(sender->net, sender->ip_port, packet, sizeof(packet)) != sizeof(packet)) {
+            ++sender->failed;
+        }
+    }
+
+    return NULL;
+}
+
+/* Datagrams of threads other than the one polling go out straight away. */
+START_TEST(test_batched_threads)
+{
+    IP ip;
+    ip_init(&ip, 0);
+    ip.ip4.uint32 = net_htonl(0x7F000001);
+
+    Networking_Core *net1 = new_networking(NULL, ip, 33445);
+    Networking_Core *net2 = new_networking(NULL, ip, 33445);
+    ck_assert_msg(net1 != NULL && net2 != NULL, "failed to create the Networking_Core objects");
+    ck_assert_msg(networking_set_batch_size(net1, 16) == 0, "failed to set the batch size");
+
+    networking_registerhandler(net2, 0xfe, &handle_threaded_packet, NULL);
+
+    Threaded_Sender sender;
+    sender.net = net1;
+    sender.ip_port.ip = ip;
+    sender.ip_port.port = net2->port;
+    sender.failed = 0;
+
+    pthread_t thread;
+    ck_assert_msg(pthread_create(&thread, NULL, &send_threaded_packets, &sender) == 0, "failed to start a thread");
+
+    uint8_t packet[100] = {0xfe};
+
+    for (unsigned int i = 0; i < 50; ++i) {
+        ck_assert_msg(sendpacket(net1, sender.ip_port, packet, sizeof(packet)) == sizeof(packet),
+                      "failed to queue packet %u", i);
+    }
+
+    pthread_join(thread, NULL);
+    ck_assert_msg(sender.failed == 0, "failed to send %u packets from a thread", sender.failed);
+
+    Net_Batch_Stats stats;
+    ck_assert_msg(networking_batch_stats(net1, &stats), "no stats of the batches");
+    ck_assert_msg(stats.direct == 50, "sent %u datagrams straight away instead of 50", (unsigned int)stats.direct);
+    ck_assert_msg(stats.datagrams == 48, "sent %u queued datagrams instead of 48", (unsigned int)stats.datagrams);
+    ck_assert_msg(networking_has_queued(net1), "nothing left queued");
+
+    Packet_Stats sent;
+    packet_stats_copy(&net1->packet_stats[0xfe], &sent);
+    ck_assert_msg(sent.packets_out == 100 && sent.bytes_out == 100 * sizeof(packet), "counted %u packets of %u bytes",
+                  (unsigned int)sent.packets_out, (unsigned int)sent.bytes_out);
+
+    networking_flush(net1);
+
+    for (unsigned int i = 0; i < 50 && threaded_packets < 100; ++i) {
+        c_sleep(10);
+        networking_poll(net2, NULL);
+    }
+
+    ck_assert_msg(threaded_packets == 100, "received %u packets instead of 100", threaded_packets);
+
+    kill_networking(net1);
+    kill_networking(net2);
+}
+END_TEST
+
+static unsigned int reuseport_packets;
+
+static int handle_reuseport_packet(void *object, IP_Port ip_port, const uint8_t *data, uint16_t len, void *userdata)
+{
+    ++reuseport_packets;
+    return 0;
+}
+
+START_TEST(test_reuseport)
+{
+    IP ip;
+    ip_init(&ip, 0);
+    ip.ip4.uint32 = net_htonl(0x7F000001);
+
+    Networking_Core *net1 = new_networking_reuseport(NULL, ip, 33460, NULL);
+    Networking_Core *net2 = new_networking_reuseport(NULL, ip, 33460, NULL);
+    ck_assert_msg(net1 != NULL && net2 != NULL, "failed to bind two SO_REUSEPORT sockets to the same port");
+    ck_assert_msg(net1->port == net2->port && net_ntohs(net1->port) == 33460, "bound to the wrong port");
+
+    networking_registerhandler(net1, 0xfe, &handle_reuseport_packet, NULL);
+    networking_registerhandler(net2, 0xfe, &handle_reuseport_packet, NULL);
+
+    Networking_Core *client = new_networking(NULL, ip, 33445);
+    ck_assert_msg(client != NULL, "failed to create the client Networking_Core");
+
+    IP_Port ip_port;
+    ip_port.ip = ip;
+    ip_port.port = net1->port;
+
+    uint8_t packet[10] = {0xfe};
+    ck_assert_msg(sendpacket(client, ip_port, packet, sizeof(packet)) == sizeof(packet), "failed to send a packet");
+
+    for (unsigned int i = 0; i < 50 && reuseport_packets == 0; ++i) {
+        c_sleep(10);
+        networking_poll(net1, NULL);
+        networking_poll(net2, NULL);
+    }
+
+    ck_assert_msg(reuseport_packets == 1, "received %u packets instead of 1", reuseport_packets);
+
+    kill_networking(client);
+    kill_networking(net1);
+    kill_networking(net2);
+}
+END_TEST
+
+START_TEST(test_packet_buf)
+{
+    Packet_Pool *pool = new_packet_pool(1);
+    ck_assert_msg(pool != NULL, "failed to create a packet pool");
+
+    const uint8_t data[4] = {1, 2, 3, 4};
+    Packet_Buf *buf = packet_buf_from_data(pool, data, sizeof(data));
+    ck_assert_msg(buf != NULL, "failed to take a buffer");
+    ck_assert_msg(packet_buf_length(buf) == sizeof(data) && packet_buf_headroom(buf) == PACKET_BUF_HEADROOM,
+                  "wrong data layout");
+    ck_assert_msg(memcmp(packet_buf_data(buf), data, sizeof(data)) == 0, "data not copied");
+
+    uint8_t *head = packet_buf_push(buf, PACKET_BUF_HEADROOM);
+    ck_assert_msg(head != NULL && packet_buf_headroom(buf) == 0, "push failed");
+    ck_assert_msg(packet_buf_push(buf, 1) == NULL, "pushed past the start of the buffer");
+    ck_assert_msg(packet_buf_pull(buf, PACKET_BUF_HEADROOM + 1) == head + PACKET_BUF_HEADROOM + 1, "pull failed");
+    ck_assert_msg(packet_buf_data(buf)[0] == 2, "pull moved the data");
+    ck_assert_msg(packet_buf_pull(buf, packet_buf_length(buf) + 1) == NULL, "pulled more than the data");
+
+    ck_assert_msg(packet_buf_put(buf, packet_buf_tailroom(buf)) != NULL && packet_buf_tailroom(buf) == 0, "put failed");
+    ck_assert_msg(packet_buf_put(buf, 1) == NULL, "put past the end of the buffer");
+    ck_assert_msg(packet_buf_trim(buf, 3) == 0 && packet_buf_length(buf) == 3, "trim failed");
+    ck_assert_msg(packet_buf_set_data(buf, head + 1, PACKET_BUF_SIZE) == NULL, "data set past the end of the buffer");
+    ck_assert_msg(packet_buf_set_data(buf, head, 2) == head && packet_buf_length(buf) == 2, "set_data failed");
+
+    // The buffer only goes back to the pool when the last reference is dropped
+    packet_buf_ref(buf);
+    packet_buf_unref(buf);
+    Packet_Buf *other = packet_buf_new(pool, 0);
+    ck_assert_msg(other != NULL && other != buf, "got a referenced buffer from the pool");
+    packet_buf_unref(buf);
+    ck_assert_msg(packet_buf_new(pool, 0) == buf, "released buffer was not reused");
+
+    // Buffers still in use outlive their pool
+    kill_packet_pool(pool);
+    packet_buf_unref(buf);
+    packet_buf_unref(other);
+}
+END_TEST
+
 static Suite *network_suite(void)
 {
     Suite *s = suite_create("Network");
 
     DEFTESTCASE(addr_resolv_localhost);
     DEFTESTCASE(ip_equal);
+    DEFTESTCASE(network_backend);
+    DEFTESTCASE(packet_stats);
+    DEFTESTCASE(batched_io);
+    DEFTESTCASE(segmented_io);
+    DEFTESTCASE(segmented_fallback);
+    DEFTESTCASE(batched_threads);
+    DEFTESTCASE(reuseport);
+    DEFTESTCASE(packet_buf);
 
     return s;
 }
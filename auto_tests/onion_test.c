@@ -144,8 +144,9 @@ START_TEST(test_basic)
     IP ip;
     ip_init(&ip, 1);
     ip.ip6.uint8[15] = 1;
-    Onion *onion1 = new_onion(new_DHT(NULL, new_networking(NULL, ip, 34567), true));
-    Onion *onion2 = new_onion(new_DHT(NULL, new_networking(NULL, ip, 34568), true));
+    Mono_Time *mono_time = mono_time_new();
+    Onion *onion1 = new_onion(mono_time, new_DHT(NULL, mono_time, new_networking(NULL, ip, 34567), true));
+    Onion *onion2 = new_onion(mono_time, new_DHT(NULL, mono_time, new_networking(NULL, ip, 34568), true));
     ck_assert_msg((onion1 != NULL) && (onion2 != NULL), "Onion failed initializing.");
     networking_registerhandler(onion2->net, 'I', &handle_test_1, onion2);
 
@@ -185,8 +186,8 @@ START_TEST(test_basic)
         do_onion(onion2);
     }
 
-    Onion_Announce *onion1_a = new_onion_announce(onion1->dht);
-    Onion_Announce *onion2_a = new_onion_announce(onion2->dht);
+    Onion_Announce *onion1_a = new_onion_announce(mono_time, onion1->dht);
+    Onion_Announce *onion2_a = new_onion_announce(mono_time, onion2->dht);
     networking_registerhandler(onion1->net, NET_PACKET_ANNOUNCE_RESPONSE, &handle_test_3, onion1);
     ck_assert_msg((onion1_a != NULL) && (onion2_a != NULL), "Onion_Announce failed initializing.");
     uint8_t zeroes[64] = {0};
@@ -209,7 +210,7 @@ START_TEST(test_basic)
     random_bytes(sb_data, sizeof(sb_data));
     memcpy(&s, sb_data, sizeof(uint64_t));
     memcpy(onion2_a->entries[1].public_key, onion2->dht->self_public_key, CRYPTO_PUBLIC_KEY_SIZE);
-    onion2_a->entries[1].time = unix_time();
+    onion2_a->entries[1].time = mono_time_get(mono_time);
     networking_registerhandler(onion1->net, NET_PACKET_ONION_DATA_RESPONSE, &handle_test_4, onion1);
     send_announce_request(onion1->net, &path, nodes[3], onion1->dht->self_public_key, onion1->dht->self_secret_key,
                           test_3_ping_id, onion1->dht->self_public_key, onion1->dht->self_public_key, s);
@@ -222,7 +223,7 @@ START_TEST(test_basic)
     }
 
     c_sleep(1000);
-    Onion *onion3 = new_onion(new_DHT(NULL, new_networking(NULL, ip, 34569), true));
+    Onion *onion3 = new_onion(mono_time, new_DHT(NULL, mono_time, new_networking(NULL, ip, 34569), true));
     ck_assert_msg((onion3 != NULL), "Onion failed initializing.");
 
     random_nonce(nonce);
@@ -270,10 +271,13 @@ START_TEST(test_basic)
         kill_DHT(dht);
         kill_networking(net);
     }
+
+    mono_time_free(mono_time);
 }
 END_TEST
 
 typedef struct {
+    Mono_Time *mono_time;
     Onion *onion;
     Onion_Announce *onion_a;
     Onion_Client *onion_c;
@@ -285,11 +289,12 @@ static Onions *new_onions(uint16_t port)
     ip_init(&ip, 1);
     ip.ip6.uint8[15] = 1;
     Onions *on = (Onions *)malloc(sizeof(Onions));
-    DHT *dht = new_DHT(NULL, new_networking(NULL, ip, port), true);
-    on->onion = new_onion(dht);
-    on->onion_a = new_onion_announce(dht);
+    on->mono_time = mono_time_new();
+    DHT *dht = new_DHT(NULL, on->mono_time, new_networking(NULL, ip, port), true);
+    on->onion = new_onion(on->mono_time, dht);
+    on->onion_a = new_onion_announce(on->mono_time, dht);
     TCP_Proxy_Info inf = {{{0}}};
-    on->onion_c = new_onion_client(new_net_crypto(NULL, dht, &inf));
+    on->onion_c = new_onion_client(on->mono_time, new_net_crypto(NULL, on->mono_time, dht, &inf));
 
     if (on->onion && on->onion_a && on->onion_c) {
         return on;
@@ -316,6 +321,7 @@ static void kill_onions(Onions *on)
     kill_net_crypto(c);
     kill_DHT(dht);
     kill_networking(net);
+    mono_time_free(on->mono_time);
     free(on);
 }
 
@@ -0,0 +1,158 @@
+/* Auto Tests: Running Tox instances from a poll() loop.
+ */
+
+#define _XOPEN_SOURCE 600
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "check_compat.h"
+
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../toxcore/tox.h"
+
+#include "helpers.h"
+
+#define NUM_POLL_TOX 2
+#define MAX_POLL_FDS 64
+
+static void accept_friend_request(Tox *m, const uint8_t *public_key, const uint8_t *data, size_t length,
+                                  void *userdata)
+{
+    if (length == 7 && memcmp("Gentoo", data, 7) == 0) {
+        tox_friend_add_norequest(m, public_key, 0);
+    }
+}
+
+/* Wait for any socket of the instances to become readable or the first of
+ * their timers to be due, and iterate them.
+ */
+static void poll_toxes(Tox **toxes, unsigned int count)
+{
+    struct pollfd fds[MAX_POLL_FDS];
+    nfds_t num_fds = 0;
+    uint32_t timeout = UINT32_MAX;
+    unsigned int i;
+
+    for (i = 0; i < count; ++i) {
+        const size_t size = tox_iteration_get_fds_size(toxes[i]);
+        ck_assert_msg(size >= 1, "instance %u has no sockets", i);
+        ck_assert_msg(num_fds + size <= MAX_POLL_FDS, "too many sockets");
+
+        int32_t tox_fds[MAX_POLL_FDS];
+        tox_iteration_get_fds(toxes[i], tox_fds);
+
+        size_t j;
+
+        for (j = 0; j < size; ++j) {
+            ck_assert_msg(tox_fds[j] >= 0, "invalid socket");
+            fds[num_fds].fd = tox_fds[j];
+            fds[num_fds].events = POLLIN;
+            fds[num_fds].revents = 0;
+            ++num_fds;
+        }
+
+        const uint32_t tox_timeout = tox_iteration_timeout(toxes[i]);
+        ck_assert_msg(tox_timeout <= 1000, "instance %u sleeps for %u ms", i, tox_timeout);
+
+        if (tox_timeout < timeout) {
+            timeout = tox_timeout;
+        }
+    }
+
+    ck_assert_msg(poll(fds, num_fds, timeout) >= 0, "poll() failed");
+
+    for (i = 0; i < count; ++i) {
+        tox_iterate(toxes[i], NULL);
+    }
+}
+
+START_TEST(test_poll_loop)
+{
+    Tox *toxes[NUM_POLL_TOX];
+    unsigned int i;
+
+    struct Tox_Options *options = tox_options_new(NULL);
+    ck_assert_msg(options != NULL, "Failed to create options");
+    tox_options_set_tcp_port(options, 33556);
+
+    toxes[0] = tox_new_log(0, 0, 0);
+    toxes[1] = tox_new_log(options, 0, 0);
+    tox_options_free(options);
+
+    for (i = 0; i < NUM_POLL_TOX; ++i) {
+        ck_assert_msg(toxes[i] != NULL, "Failed to create tox instance %u", i);
+        tox_callback_friend_request(toxes[i], &accept_friend_request);
+    }
+
+    ck_assert_msg(tox_iteration_get_fds_size(toxes[1]) > tox_iteration_get_fds_size(toxes[0]),
+                  "TCP server sockets missing");
+
+    uint8_t dht_key[TOX_PUBLIC_KEY_SIZE];
+    tox_self_get_dht_id(toxes[0], dht_key);
+    const uint16_t dht_port = tox_self_get_udp_port(toxes[0], NULL);
+    tox_bootstrap(toxes[1], "127.0.0.1", dht_port, dht_key, NULL);
+
+    uint8_t address[TOX_ADDRESS_SIZE];
+    tox_self_get_address(toxes[0], address);
+    ck_assert_msg(tox_friend_add(toxes[1], address, (const uint8_t *)"Gentoo", 7, NULL) == 0, "Failed to add friend");
+
+    const time_t start = time(NULL);
+    unsigned int iterations = 0;
+
+    while (tox_friend_get_connection_status(toxes[0], 0, NULL) == TOX_CONNECTION_NONE
+            || tox_friend_get_connection_status(toxes[1], 0, NULL) == TOX_CONNECTION_NONE) {
+        ck_assert_msg(time(NULL) - start < 120, "friends did not connect");
+        poll_toxes(toxes, NUM_POLL_TOX);
+        ++iterations;
+    }
+
+    printf("friends connected after %u iterations in %ld seconds\n", iterations, (long)(time(NULL) - start));
+
+    /* Connected and idle, the instances only wake up for timers and pings. */
+    const time_t idle_start = time(NULL);
+    iterations = 0;
+
+    while (time(NULL) - idle_start < 5) {
+        poll_toxes(toxes, NUM_POLL_TOX);
+        ++iterations;
+    }
+
+    printf("%u iterations in 5 idle seconds\n", iterations);
+    ck_assert_msg(iterations < 5 * 1000 / 50, "idle instances woke up as often as tox_iteration_interval() says");
+
+    for (i = 0; i < NUM_POLL_TOX; ++i) {
+        tox_kill(toxes[i]);
+    }
+}
+END_TEST
+
+static Suite *tox_poll_suite(void)
+{
+    Suite *s = suite_create("tox_poll");
+
+    DEFTESTCASE_SLOW(poll_loop, 120);
+
+    return s;
+}
+
+int main(int argc, char *argv[])
+{
+    srand((unsigned int) time(NULL));
+
+    Suite *s = tox_poll_suite();
+    SRunner *test_runner = srunner_create(s);
+
+    int number_failed = 0;
+    srunner_run_all(test_runner, CK_NORMAL);
+    number_failed = srunner_ntests_failed(test_runner);
+
+    srunner_free(test_runner);
+
+    return number_failed;
+}
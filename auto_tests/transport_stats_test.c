@@ -0,0 +1,276 @@
+/* Auto Tests: Per-friend transport statistics.
+ */
+
+#define _XOPEN_SOURCE 600
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "check_compat.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../toxcore/Messenger.h"
+#include "../toxcore/packet_buf.h"
+#include "../toxcore/tox.h"
+
+#include "helpers.h"
+
+#ifdef FORCE_TESTS_IPV6
+#define TOX_LOCALHOST "::1"
+#else
+#define TOX_LOCALHOST "127.0.0.1"
+#endif
+
+#define TCP_RELAY_PORT 33455
+#define NUM_STATS_PACKETS 200
+#define STATS_PACKET_ID 160
+
+static void accept_friend_request(Tox *m, const uint8_t *public_key, const uint8_t *data, size_t length,
+                                  void *userdata)
+{
+    if (length == 7 && memcmp("Gentoo", data, 7) == 0) {
+        tox_friend_add_norequest(m, public_key, 0);
+    }
+}
+
+static uint32_t stats_packets_received;
+
+static void handle_stats_packet(Tox *m, uint32_t friend_number, const uint8_t *data, size_t length, void *userdata)
+{
+    if (length == TOX_MAX_CUSTOM_PACKET_SIZE && data[0] == STATS_PACKET_ID) {
+        ++stats_packets_received;
+    }
+}
+
+/* Drops every fourth data packet a Tox instance receives over UDP, so that
+ * its friend has to resend them. */
+typedef struct {
+    Packet_Handles handler;
+    uint32_t count;
+} Lossy_Handler;
+
+static int handle_lossy_packet(void *object, IP_Port ip_port, Packet_Buf *packet, void *userdata)
+{
+    Lossy_Handler *lossy = (Lossy_Handler *)object;
+
+    if (++lossy->count % 4 == 0) {
+        return 0;
+    }
+
+    if (lossy->handler.buf_function) {
+        return lossy->handler.buf_function(lossy->handler.object, ip_port, packet, userdata);
+    }
+
+    return lossy->handler.function(lossy->handler.object, ip_port, packet_buf_data(packet),
+                                   packet_buf_length(packet), userdata);
+}
+
+static void make_lossy(Tox *tox, Lossy_Handler *lossy)
+{
+    /* A Tox instance is its Messenger. */
+    Networking_Core *net = ((Messenger *)tox)->net;
+
+    lossy->handler = net->packethandlers[NET_PACKET_CRYPTO_DATA];
+    lossy->count = 0;
+    networking_registerhandler_buf(net, NET_PACKET_CRYPTO_DATA, &handle_lossy_packet, lossy);
+}
+
+static void iterate_toxes(Tox **toxes, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; ++i) {
+        tox_iterate(toxes[i], NULL);
+    }
+
+    c_sleep(5);
+}
+
+/* Make toxes[1] and toxes[2] friends and wait until they are connected with
+ * connection. toxes[0] is their bootstrap node. */
+static void connect_friends(Tox **toxes, TOX_CONNECTION connection)
+{
+    uint8_t dht_key[TOX_PUBLIC_KEY_SIZE];
+    tox_self_get_dht_id(toxes[0], dht_key);
+    const uint16_t dht_port = tox_self_get_udp_port(toxes[0], NULL);
+
+    for (uint32_t i = 1; i < 3; ++i) {
+        ck_assert_msg(tox_bootstrap(toxes[i], TOX_LOCALHOST, dht_port, dht_key, NULL), "bootstrap failed");
+    }
+
+    tox_callback_friend_request(toxes[2], &accept_friend_request);
+
+    uint8_t address[TOX_ADDRESS_SIZE];
+    tox_self_get_address(toxes[2], address);
+    ck_assert_msg(tox_friend_add(toxes[1], address, (const uint8_t *)"Gentoo", 7, NULL) == 0,
+                  "failed to add a friend");
+
+    while (tox_friend_get_connection_status(toxes[1], 0, NULL) != connection
+            || tox_friend_get_connection_status(toxes[2], 0, NULL) != connection) {
+        iterate_toxes(toxes, 3);
+    }
+}
+
+/* Send NUM_STATS_PACKETS lossless packets from toxes[1] to toxes[2] and wait
+ * for them to arrive. */
+static void send_stats_packets(Tox **toxes)
+{
+    uint8_t data[TOX_MAX_CUSTOM_PACKET_SIZE];
+    memset(data, 0, sizeof(data));
+    data[0] = STATS_PACKET_ID;
+
+    stats_packets_received = 0;
+    tox_callback_friend_lossless_packet(toxes[2], &handle_stats_packet);
+
+    uint32_t sent = 0;
+
+    while (stats_packets_received < NUM_STATS_PACKETS) {
+        while (sent < NUM_STATS_PACKETS && tox_friend_send_lossless_packet(toxes[1], 0, data, sizeof(data), NULL)) {
+            ++sent;
+        }
+
+        iterate_toxes(toxes, 3);
+    }
+}
+
+static void check_query_errors(Tox *tox)
+{
+    TOX_ERR_FRIEND_QUERY err;
+    uint8_t relay_key[TOX_PUBLIC_KEY_SIZE];
+
+    tox_friend_transport_stat(tox, 1234, TOX_TRANSPORT_STAT_RTT, &err);
+    ck_assert_msg(err == TOX_ERR_FRIEND_QUERY_FRIEND_NOT_FOUND, "transport stats of a missing friend");
+    ck_assert_msg(!tox_friend_transport_relay(tox, 1234, relay_key, &err)
+                  && err == TOX_ERR_FRIEND_QUERY_FRIEND_NOT_FOUND, "relay of a missing friend");
+    ck_assert_msg(!tox_friend_transport_relay(tox, 0, NULL, &err) && err == TOX_ERR_FRIEND_QUERY_NULL,
+                  "relay copied to NULL");
+}
+
+START_TEST(test_transport_stats_udp)
+{
+    uint32_t index[] = { 1, 2, 3 };
+    Tox *toxes[3];
+
+    for (uint32_t i = 0; i < 3; ++i) {
+        toxes[i] = tox_new_log(NULL, NULL, &index[i]);
+        ck_assert_msg(toxes[i] != NULL, "failed to create tox instance %u", i);
+    }
+
+    connect_friends(toxes, TOX_CONNECTION_UDP);
+    check_query_errors(toxes[1]);
+
+    TOX_ERR_FRIEND_QUERY err;
+    uint8_t relay_key[TOX_PUBLIC_KEY_SIZE];
+    ck_assert_msg(!tox_friend_transport_relay(toxes[1], 0, relay_key, &err) && err == TOX_ERR_FRIEND_QUERY_OK,
+                  "relay of a direct connection");
+
+    Lossy_Handler lossy;
+    make_lossy(toxes[2], &lossy);
+    send_stats_packets(toxes);
+
+    const uint64_t sent = tox_friend_transport_stat(toxes[1], 0, TOX_TRANSPORT_STAT_PACKETS_SENT, &err);
+    ck_assert_msg(err == TOX_ERR_FRIEND_QUERY_OK, "failed to get the transport stats");
+    const uint64_t resent = tox_friend_transport_stat(toxes[1], 0, TOX_TRANSPORT_STAT_PACKETS_RESENT, NULL);
+    const uint64_t received = tox_friend_transport_stat(toxes[2], 0, TOX_TRANSPORT_STAT_PACKETS_RECEIVED, NULL);
+
+    ck_assert_msg(sent >= NUM_STATS_PACKETS + resent, "sent %u packets and resent %u", (unsigned int)sent,
+                  (unsigned int)resent);
+    ck_assert_msg(resent > 0, "no packets resent for the dropped ones");
+    ck_assert_msg(received >= NUM_STATS_PACKETS && received < sent, "received %u of %u packets",
+                  (unsigned int)received, (unsigned int)sent);
+    ck_assert_msg(tox_friend_transport_stat(toxes[1], 0, TOX_TRANSPORT_STAT_BYTES_SENT, NULL)
+                  > sent * TOX_MAX_CUSTOM_PACKET_SIZE / 2, "too few bytes sent");
+
+    /* Every round trip spans at least the sleep between two iterations. */
+    const uint64_t rtt = tox_friend_transport_stat(toxes[1], 0, TOX_TRANSPORT_STAT_RTT, NULL);
+    const uint64_t min_rtt = tox_friend_transport_stat(toxes[1], 0, TOX_TRANSPORT_STAT_MIN_RTT, NULL);
+    ck_assert_msg(rtt > 0 && min_rtt > 0 && min_rtt <= rtt, "round trip time %u ms, min %u ms", (unsigned int)rtt,
+                  (unsigned int)min_rtt);
+
+    for (uint32_t i = 0; i < 3; ++i) {
+        tox_kill(toxes[i]);
+    }
+}
+END_TEST
+
+START_TEST(test_transport_stats_tcp)
+{
+    uint32_t index[] = { 1, 2, 3 };
+    Tox *toxes[3];
+
+    for (uint32_t i = 0; i < 3; ++i) {
+        struct Tox_Options *opts = tox_options_new(NULL);
+
+        if (i == 0) {
+            tox_options_set_tcp_port(opts, TCP_RELAY_PORT);
+        } else {
+            tox_options_set_udp_enabled(opts, 0);
+        }
+
+        toxes[i] = tox_new_log(opts, NULL, &index[i]);
+        ck_assert_msg(toxes[i] != NULL, "failed to create tox instance %u", i);
+        tox_options_free(opts);
+    }
+
+    uint8_t relay_key[TOX_PUBLIC_KEY_SIZE];
+    tox_self_get_dht_id(toxes[0], relay_key);
+
+    for (uint32_t i = 1; i < 3; ++i) {
+        ck_assert_msg(tox_add_tcp_relay(toxes[i], TOX_LOCALHOST, TCP_RELAY_PORT, relay_key, NULL),
+                      "failed to add the relay");
+    }
+
+    connect_friends(toxes, TOX_CONNECTION_TCP);
+    check_query_errors(toxes[1]);
+
+    for (uint32_t i = 1; i < 3; ++i) {
+        TOX_ERR_FRIEND_QUERY err;
+        uint8_t key[TOX_PUBLIC_KEY_SIZE];
+        ck_assert_msg(tox_friend_transport_relay(toxes[i], 0, key, &err) && err == TOX_ERR_FRIEND_QUERY_OK,
+                      "no relay in use for instance %u", i);
+        ck_assert_msg(memcmp(key, relay_key, TOX_PUBLIC_KEY_SIZE) == 0, "instance %u uses the wrong relay", i);
+        ck_assert_msg(tox_friend_transport_stat(toxes[i], 0, TOX_TRANSPORT_STAT_ONLINE_TCP_RELAYS, NULL) == 1,
+                      "instance %u has no online relay", i);
+    }
+
+    send_stats_packets(toxes);
+
+    ck_assert_msg(tox_friend_transport_stat(toxes[1], 0, TOX_TRANSPORT_STAT_PACKETS_SENT, NULL) >= NUM_STATS_PACKETS,
+                  "too few packets sent");
+    ck_assert_msg(tox_friend_transport_stat(toxes[2], 0, TOX_TRANSPORT_STAT_PACKETS_RECEIVED, NULL)
+                  >= NUM_STATS_PACKETS, "too few packets received");
+
+    for (uint32_t i = 0; i < 3; ++i) {
+        tox_kill(toxes[i]);
+    }
+}
+END_TEST
+
+static Suite *transport_stats_suite(void)
+{
+    Suite *s = suite_create("Transport stats");
+
+    DEFTESTCASE_SLOW(transport_stats_udp, 120);
+    DEFTESTCASE_SLOW(transport_stats_tcp, 120);
+
+    return s;
+}
+
+int main(void)
+{
+    srand((unsigned int) time(NULL));
+
+    Suite *transport_stats = transport_stats_suite();
+    SRunner *test_runner = srunner_create(transport_stats);
+
+    int number_failed = 0;
+    srunner_run_all(test_runner, CK_NORMAL);
+    number_failed = srunner_ntests_failed(test_runner);
+
+    srunner_free(test_runner);
+
+    return number_failed;
+}
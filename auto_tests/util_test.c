@@ -0,0 +1,209 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "check_compat.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../toxcore/crypto_core.h"
+#include "../toxcore/network.h"
+#include "../toxcore/util.h"
+
+#include "helpers.h"
+
+#define NUM_TEST_TIMERS 512
+
+typedef struct {
+    Timer_Wheel *wheel;
+    uint32_t timers[NUM_TEST_TIMERS];
+    uint64_t deadlines[NUM_TEST_TIMERS];
+    uint64_t fired_at[NUM_TEST_TIMERS];
+    uint32_t num_fired;
+    uint64_t now;
+
+    /* Timer restarted by its own callback, and how often it still should be. */
+    uint32_t restart_id;
+    uint32_t restarts_left;
+} Timer_Test;
+
+static void test_timer_fired(void *object, uint32_t id, void *userdata)
+{
+    Timer_Test *test = (Timer_Test *)object;
+    ck_assert_msg(userdata == test, "wrong userdata");
+    ck_assert_msg(!timer_is_running(test->wheel, test->timers[id]), "timer still running in its callback");
+
+    test->fired_at[id] = test->now;
+    ++test->num_fired;
+
+    if (id == test->restart_id && test->restarts_left > 0) {
+        --test->restarts_left;
+        test->deadlines[id] = test->now + 100;
+        timer_start(test->wheel, test->timers[id], test->deadlines[id]);
+    }
+}
+
+START_TEST(test_timer_wheel)
+{
+    static Timer_Test test;
+    memset(&test, 0, sizeof(test));
+    test.now = 1000;
+    test.restart_id = UINT32_MAX;
+    test.wheel = new_timer_wheel(test.now);
+    ck_assert_msg(test.wheel != NULL, "failed to create a timer wheel");
+    ck_assert_msg(timer_wheel_next_deadline(test.wheel) == UINT64_MAX, "empty wheel has a deadline");
+
+    uint64_t earliest = UINT64_MAX;
+
+    for (uint32_t i = 0; i < NUM_TEST_TIMERS; ++i) {
+        test.timers[i] = timer_new(test.wheel, &test_timer_fired, &test, i);
+        ck_assert_msg(test.timers[i] != 0, "failed to create timer %u", i);
+
+        /* Deadlines on every level of the wheel, some past the end of it. */
+        test.deadlines[i] = test.now + 1 + (random_64b() % (UINT64_C(1) << (i % 30)));
+        timer_start(test.wheel, test.timers[i], test.deadlines[i]);
+
+        if (test.deadlines[i] < earliest) {
+            earliest = test.deadlines[i];
+        }
+    }
+
+    ck_assert_msg(timer_wheel_next_deadline(test.wheel) == earliest, "wrong next deadline");
+
+    timer_stop(test.wheel, test.timers[1]);
+    ck_assert_msg(!timer_is_running(test.wheel, test.timers[1]), "stopped timer still running");
+    timer_free(test.wheel, test.timers[2]);
+    test.restart_id = 3;
+    test.restarts_left = 2;
+
+    ck_assert_msg(timer_wheel_run(test.wheel, test.now, &test) == 0, "timer fired before its deadline");
+
+    uint64_t last = test.now;
+
+    uint64_t next;
+
+    while ((next = timer_wheel_next_deadline(test.wheel)) != UINT64_MAX) {
+        ck_assert_msg(next > last, "next deadline %llu not after the last run", (unsigned long long)next);
+
+        /* Step by random amounts so runs both hit and overshoot deadlines. */
+        test.now = next + random_64b() % 3;
+        timer_wheel_run(test.wheel, test.now, &test);
+        last = test.now;
+    }
+
+    for (uint32_t i = 0; i < NUM_TEST_TIMERS; ++i) {
+        if (i == 1 || i == 2) {
+            ck_assert_msg(test.fired_at[i] == 0, "stopped or freed timer %u fired", i);
+            continue;
+        }
+
+        ck_assert_msg(test.fired_at[i] >= test.deadlines[i], "timer %u fired early", i);
+        ck_assert_msg(test.fired_at[i] <= test.deadlines[i] + 2, "timer %u fired late", i);
+    }
+
+    ck_assert_msg(test.restarts_left == 0, "restarted timer did not fire again");
+    ck_assert_msg(test.num_fired == NUM_TEST_TIMERS - 2 + 2, "%u timers fired", test.num_fired);
+
+    /* A timer started at a passed deadline fires on the next run. */
+    timer_start(test.wheel, test.timers[1], 0);
+    ck_assert_msg(timer_wheel_run(test.wheel, test.now, &test) == 0, "overdue timer fired in a tick that already ran");
+    ck_assert_msg(timer_wheel_run(test.wheel, test.now + 1, &test) == 1, "overdue timer did not fire");
+
+    kill_timer_wheel(test.wheel);
+}
+END_TEST
+
+static uint64_t test_clock(void *object)
+{
+    return *(const uint64_t *)object;
+}
+
+START_TEST(test_monotonic_clock)
+{
+    uint64_t now1 = 5000;
+    uint64_t now2 = 5000;
+    Mono_Time *mono_time1 = mono_time_new();
+    Mono_Time *mono_time2 = mono_time_new();
+    ck_assert_msg(mono_time1 != NULL && mono_time2 != NULL, "could not allocate the clocks");
+    mono_time_set_clock(mono_time1, &test_clock, &now1);
+    mono_time_set_clock(mono_time2, &test_clock, &now2);
+    ck_assert_msg(mono_time_monotonic(mono_time1) == 5000, "clock not used");
+
+    const uint64_t start = mono_time_get(mono_time1);
+    ck_assert_msg(start + 5 >= (uint64_t)time(NULL), "time not aligned with the date");
+
+    /* An hour passes at once, for the first instance only. */
+    now1 += 3600 * 1000;
+    mono_time_update(mono_time1);
+    mono_time_update(mono_time2);
+    ck_assert_msg(mono_time_monotonic(mono_time1) == now1, "clock not used");
+    ck_assert_msg(mono_time_get(mono_time1) == start + 3600, "time did not follow the clock");
+    ck_assert_msg(mono_time_is_timeout(mono_time1, start, 3599), "timeout did not pass");
+    ck_assert_msg(mono_time_monotonic(mono_time2) == 5000, "clock of the other instance used");
+    ck_assert_msg(!mono_time_is_timeout(mono_time2, mono_time_get(mono_time2), 1), "time of the other instance passed");
+
+    mono_time_set_clock(mono_time1, NULL, NULL);
+    ck_assert_msg(mono_time_monotonic(mono_time1) != now1, "still using the clock");
+
+    mono_time_free(mono_time2);
+    mono_time_free(mono_time1);
+}
+END_TEST
+
+START_TEST(test_hash_public_key)
+{
+    uint64_t hash_key[4] = {0};
+    uint8_t key_bytes[16];
+    uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+
+    for (uint32_t i = 0; i < sizeof(key_bytes); ++i) {
+        key_bytes[i] = i;
+    }
+
+    for (uint32_t i = 0; i < sizeof(public_key); ++i) {
+        public_key[i] = i;
+    }
+
+    /* SipHash-2-4 reference key, little endian. */
+    for (uint32_t i = 0; i < sizeof(key_bytes); ++i) {
+        hash_key[i / 8] |= (uint64_t)key_bytes[i] << ((i % 8) * 8);
+    }
+
+    /* The two halves of the reference SipHash-2-4 of bytes 0..31 xored. */
+    ck_assert_msg(hash_public_key(hash_key, public_key) == 0x03d52de1, "not SipHash-2-4: %08x",
+                  hash_public_key(hash_key, public_key));
+
+    hash_key[1] ^= 1;
+    ck_assert_msg(hash_public_key(hash_key, public_key) != 0x03d52de1, "hash doesn't depend on the key");
+}
+END_TEST
+
+static Suite *util_suite(void)
+{
+    Suite *s = suite_create("util");
+
+    DEFTESTCASE(timer_wheel);
+    DEFTESTCASE(monotonic_clock);
+    DEFTESTCASE(hash_public_key);
+
+    return s;
+}
+
+int main(int argc, char *argv[])
+{
+    srand((unsigned int) time(NULL));
+
+    Suite *s = util_suite();
+    SRunner *test_runner = srunner_create(s);
+
+    int number_failed = 0;
+    srunner_run_all(test_runner, CK_NORMAL);
+    number_failed = srunner_ntests_failed(test_runner);
+
+    srunner_free(test_runner);
+
+    return number_failed;
+}
@@ -115,9 +115,10 @@ int main(int argc, char *argv[])
     IP ip;
     ip_init(&ip, ipv6enabled);
 
-    DHT *dht = new_DHT(NULL, new_networking(NULL, ip, PORT), true);
-    Onion *onion = new_onion(dht);
-    Onion_Announce *onion_a = new_onion_announce(dht);
+    Mono_Time *mono_time = mono_time_new();
+    DHT *dht = new_DHT(NULL, mono_time, new_networking(NULL, ip, PORT), true);
+    Onion *onion = new_onion(mono_time, dht);
+    Onion_Announce *onion_a = new_onion_announce(mono_time, dht);
 
 #ifdef DHT_NODE_EXTRA_PACKETS
     bootstrap_set_callbacks(dht->net, DHT_VERSION_NUMBER, DHT_MOTD, sizeof(DHT_MOTD));
@@ -137,7 +138,7 @@ int main(int argc, char *argv[])
 #ifdef TCP_RELAY_ENABLED
 #define NUM_PORTS 3
     uint16_t ports[NUM_PORTS] = {443, 3389, PORT};
-    TCP_Server *tcp_s = new_TCP_server(ipv6enabled, NUM_PORTS, ports, dht->self_secret_key, onion);
+    TCP_Server *tcp_s = new_TCP_server(mono_time, ipv6enabled, NUM_PORTS, ports, dht->self_secret_key, onion);
 
     if (tcp_s == NULL) {
         printf("TCP server failed to initialize.\n");
@@ -186,9 +187,10 @@ int main(int argc, char *argv[])
 
         do_DHT(dht);
 
-        if (is_timeout(last_LANdiscovery, is_waiting_for_dht_connection ? 5 : LAN_DISCOVERY_INTERVAL)) {
+        if (mono_time_is_timeout(mono_time, last_LANdiscovery,
+                                 is_waiting_for_dht_connection ? 5 : LAN_DISCOVERY_INTERVAL)) {
             send_LANdiscovery(net_htons(PORT), dht);
-            last_LANdiscovery = unix_time();
+            last_LANdiscovery = mono_time_get(mono_time);
         }
 
 #ifdef TCP_RELAY_ENABLED
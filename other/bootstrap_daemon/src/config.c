@@ -143,7 +143,8 @@ static void parse_tcp_relay_ports_config(config_t *cfg, uint16_t **tcp_relay_por
 
 int get_general_config(const char *cfg_file_path, char **pid_file_path, char **keys_file_path, int *port,
                        int *enable_ipv6, int *enable_ipv4_fallback, int *enable_lan_discovery, int *enable_tcp_relay,
-                       uint16_t **tcp_relay_ports, int *tcp_relay_port_count, int *enable_motd, char **motd)
+                       uint16_t **tcp_relay_ports, int *tcp_relay_port_count, int *enable_motd, char **motd,
+                       int *udp_batch_size, int *udp_worker_threads, int *stats_log_interval, int *shared_key_threads)
 {
     config_t cfg;
 
@@ -156,6 +157,10 @@ int get_general_config(const char *cfg_file_path, char **pid_file_path, char **k
     const char *NAME_ENABLE_TCP_RELAY     = "enable_tcp_relay";
     const char *NAME_ENABLE_MOTD          = "enable_motd";
     const char *NAME_MOTD                 = "motd";
+    const char *NAME_UDP_BATCH_SIZE       = "udp_batch_size";
+    const char *NAME_UDP_WORKER_THREADS   = "udp_worker_threads";
+    const char *NAME_STATS_LOG_INTERVAL   = "stats_log_interval";
+    const char *NAME_SHARED_KEY_THREADS   = "shared_key_threads";
 
     config_init(&cfg);
 
@@ -259,6 +264,34 @@ int get_general_config(const char *cfg_file_path, char **pid_file_path, char **k
         (*motd)[motd_length - 1] = '\0';
     }
 
+    // Get UDP batch size
+    if (config_lookup_int(&cfg, NAME_UDP_BATCH_SIZE, udp_batch_size) == CONFIG_FALSE) {
+        log_write(LOG_LEVEL_WARNING, "No '%s' setting in configuration file.\n", NAME_UDP_BATCH_SIZE);
+        log_write(LOG_LEVEL_WARNING, "Using default '%s': %d\n", NAME_UDP_BATCH_SIZE, DEFAULT_UDP_BATCH_SIZE);
+        *udp_batch_size = DEFAULT_UDP_BATCH_SIZE;
+    }
+
+    // Get UDP worker thread count
+    if (config_lookup_int(&cfg, NAME_UDP_WORKER_THREADS, udp_worker_threads) == CONFIG_FALSE) {
+        log_write(LOG_LEVEL_WARNING, "No '%s' setting in configuration file.\n", NAME_UDP_WORKER_THREADS);
+        log_write(LOG_LEVEL_WARNING, "Using default '%s': %d\n", NAME_UDP_WORKER_THREADS, DEFAULT_UDP_WORKER_THREADS);
+        *udp_worker_threads = DEFAULT_UDP_WORKER_THREADS;
+    }
+
+    // Get the interval of the traffic statistics log
+    if (config_lookup_int(&cfg, NAME_STATS_LOG_INTERVAL, stats_log_interval) == CONFIG_FALSE) {
+        log_write(LOG_LEVEL_WARNING, "No '%s' setting in configuration file.\n", NAME_STATS_LOG_INTERVAL);
+        log_write(LOG_LEVEL_WARNING, "Using default '%s': %d\n", NAME_STATS_LOG_INTERVAL, DEFAULT_STATS_LOG_INTERVAL);
+        *stats_log_interval = DEFAULT_STATS_LOG_INTERVAL;
+    }
+
+    // Get shared key thread count
+    if (config_lookup_int(&cfg, NAME_SHARED_KEY_THREADS, shared_key_threads) == CONFIG_FALSE) {
+        log_write(LOG_LEVEL_WARNING, "No '%s' setting in configuration file.\n", NAME_SHARED_KEY_THREADS);
+        log_write(LOG_LEVEL_WARNING, "Using default '%s': %d\n", NAME_SHARED_KEY_THREADS, DEFAULT_SHARED_KEY_THREADS);
+        *shared_key_threads = DEFAULT_SHARED_KEY_THREADS;
+    }
+
     config_destroy(&cfg);
 
     log_write(LOG_LEVEL_INFO, "Successfully read:\n");
@@ -291,6 +324,11 @@ int get_general_config(const char *cfg_file_path, char **pid_file_path, char **k
         log_write(LOG_LEVEL_INFO, "'%s': %s\n", NAME_MOTD, *motd);
     }
 
+    log_write(LOG_LEVEL_INFO, "'%s': %d\n", NAME_UDP_BATCH_SIZE,       *udp_batch_size);
+    log_write(LOG_LEVEL_INFO, "'%s': %d\n", NAME_UDP_WORKER_THREADS,   *udp_worker_threads);
+    log_write(LOG_LEVEL_INFO, "'%s': %d\n", NAME_STATS_LOG_INTERVAL,   *stats_log_interval);
+    log_write(LOG_LEVEL_INFO, "'%s': %d\n", NAME_SHARED_KEY_THREADS,   *shared_key_threads);
+
     return 1;
 }
 
@@ -38,5 +38,9 @@
 #define DEFAULT_TCP_RELAY_PORTS_COUNT 3
 #define DEFAULT_ENABLE_MOTD           1 // 1 - true, 0 - false
 #define DEFAULT_MOTD                  DAEMON_NAME
+#define DEFAULT_UDP_BATCH_SIZE        1 // number of datagrams per sendmmsg/recvmmsg call, 1 disables batching
+#define DEFAULT_UDP_WORKER_THREADS    1 // number of threads with their own UDP socket on the port
+#define DEFAULT_STATS_LOG_INTERVAL    0 // seconds between logging the traffic per packet id, 0 disables it
+#define DEFAULT_SHARED_KEY_THREADS    0 // threads computing shared keys of each UDP worker, 0 computes them in place
 
 #endif // CONFIG_DEFAULTS_H
@@ -31,4 +31,6 @@
 #define MIN_ALLOWED_PORT 1
 #define MAX_ALLOWED_PORT 65535
 
+#define MAX_UDP_WORKER_THREADS 64
+
 #endif // GLOBAL_H
@@ -25,6 +25,7 @@
 #define _XOPEN_SOURCE 600
 
 // system provided
+#include <pthread.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -174,6 +175,435 @@ static void daemonize(LOG_BACKEND log_backend, char *pid_file_path)
     }
 }
 
+// Binds to port, with SO_REUSEPORT if other sockets are going to share it
+
+static Networking_Core *new_daemon_networking(IP ip, int port, int reuseport)
+{
+    if (reuseport) {
+        return new_networking_reuseport(NULL, ip, port, NULL);
+    }
+
+    return new_networking(NULL, ip, port);
+}
+
+// UDP worker threads
+//
+// With udp_worker_threads > 1 every worker owns a SO_REUSEPORT socket on the
+// listening port and a DHT with the daemon's keys. The kernel sends all
+// datagrams of a peer to the same worker, which answers the requests of that
+// peer on its own. Two kinds of packets need another worker:
+//
+// - Responses to our own DHT requests land on the worker of the peer, not
+//   necessarily on the one that sent the request. Workers note which of them
+//   last sent a request to each address, and a response the worker of the
+//   peer rejects is handed to that one only. Others are dropped.
+// - Onion announce requests and data requests need the announce entries,
+//   which only the main worker (index 0) keeps. They are handed to it.
+// - Onion responses for clients of the TCP relay, which runs on the main
+//   worker, are handed to it once they are decrypted.
+//
+// Onion return paths are encrypted with a symmetric key that all workers
+// share; the main worker rotates it and the others pick it up.
+
+#define MAX_FORWARDED_PACKETS 1024
+
+// Slots of the table of the workers that sent requests, addresses are hashed into it
+#define REQUEST_ROUTES 4096
+
+typedef struct Forwarded_Packet {
+    struct Forwarded_Packet *next;
+    IP_Port source;
+    bool tcp_onion; // data goes to the TCP relay client source instead of a packet handler
+    uint16_t length;
+    uint8_t data[MAX_UDP_PACKET_SIZE];
+} Forwarded_Packet;
+
+typedef struct Worker_Pool Worker_Pool;
+
+typedef struct {
+    Worker_Pool *pool;
+    unsigned int index;
+    pthread_t thread;
+
+    DHT *dht;
+    Onion *onion;
+    uint32_t onion_key_version;
+
+    // The handlers before the forwarding ones were put in place
+    Packet_Handles handlers[256];
+
+    // Packets handed to this worker, protected by pool->mutex
+    Forwarded_Packet *inbox_head;
+    Forwarded_Packet *inbox_tail;
+    uint32_t inbox_size;
+} Worker;
+
+struct Worker_Pool {
+    pthread_mutex_t mutex;
+
+    // The onion key of the main worker, protected by mutex
+    uint8_t onion_key[CRYPTO_SYMMETRIC_KEY_SIZE];
+    uint32_t onion_key_version;
+
+    // 1 + the index of the worker that last sent a DHT request to an address
+    // hashing to the slot, 0 if none did. Protected by mutex.
+    uint8_t request_routes[REQUEST_ROUTES];
+
+    Worker workers[MAX_UDP_WORKER_THREADS];
+    unsigned int num_workers;
+};
+
+static void forward_packet(Worker *worker, IP_Port source, bool tcp_onion, const uint8_t *packet, uint16_t length)
+{
+    Forwarded_Packet *forwarded = (Forwarded_Packet *)malloc(sizeof(Forwarded_Packet));
+
+    if (forwarded == NULL) {
+        return;
+    }
+
+    forwarded->next = NULL;
+    forwarded->source = source;
+    forwarded->tcp_onion = tcp_onion;
+    forwarded->length = length;
+    memcpy(forwarded->data, packet, length);
+
+    Worker_Pool *pool = worker->pool;
+    pthread_mutex_lock(&pool->mutex);
+
+    if (worker->inbox_size >= MAX_FORWARDED_PACKETS) {
+        pthread_mutex_unlock(&pool->mutex);
+        free(forwarded);
+        return;
+    }
+
+    if (worker->inbox_tail == NULL) {
+        worker->inbox_head = forwarded;
+    } else {
+        worker->inbox_tail->next = forwarded;
+    }
+
+    worker->inbox_tail = forwarded;
+    ++worker->inbox_size;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+static int handle_for_main_worker(void *object, IP_Port source, const uint8_t *packet, uint16_t length,
+                                  void *userdata)
+{
+    Worker *worker = (Worker *)object;
+    forward_packet(&worker->pool->workers[0], source, false, packet, length);
+    return 0;
+}
+
+static int handle_tcp_onion_response(void *object, IP_Port dest, const uint8_t *data, uint16_t length)
+{
+    Worker *worker = (Worker *)object;
+    forward_packet(&worker->pool->workers[0], dest, true, data, length);
+    return 0;
+}
+
+static uint32_t request_route_slot(const IP_Port *ip_port)
+{
+    const uint8_t *bytes = ip_port->ip.ip6.uint8;
+    size_t size = sizeof(ip_port->ip.ip6.uint8);
+
+    if (ip_port->ip.family == AF_INET) {
+        bytes = ip_port->ip.ip4.uint8;
+        size = sizeof(ip_port->ip.ip4.uint8);
+    }
+
+    // FNV-1a over the address and the port
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+
+    hash = (hash ^ (ip_port->port & 0xff)) * 16777619u;
+    hash = (hash ^ (ip_port->port >> 8)) * 16777619u;
+    return hash % REQUEST_ROUTES;
+}
+
+static void note_request(void *object, IP_Port ip_port, const uint8_t *data, uint16_t length)
+{
+    if (data[0] != NET_PACKET_PING_REQUEST && data[0] != NET_PACKET_GET_NODES) {
+        return;
+    }
+
+    Worker *worker = (Worker *)object;
+    Worker_Pool *pool = worker->pool;
+    const uint32_t slot = request_route_slot(&ip_port);
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->request_routes[slot] = worker->index + 1;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+static int handle_response(void *object, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata)
+{
+    Worker *worker = (Worker *)object;
+    Worker_Pool *pool = worker->pool;
+    const Packet_Handles *handler = &worker->handlers[packet[0]];
+
+    if (handler->function && handler->function(handler->object, source, packet, length, userdata) == 0) {
+        return 0;
+    }
+
+    // Not a response to a request of this worker: hand it to the one that
+    // last sent a request to source, if any other did.
+    const uint32_t slot = request_route_slot(&source);
+
+    pthread_mutex_lock(&pool->mutex);
+    const unsigned int route = pool->request_routes[slot];
+    pthread_mutex_unlock(&pool->mutex);
+
+    if (route == 0 || route - 1 == worker->index) {
+        return 1;
+    }
+
+    forward_packet(&pool->workers[route - 1], source, false, packet, length);
+    return 0;
+}
+
+static void handle_forwarded_packets(Worker *worker)
+{
+    Worker_Pool *pool = worker->pool;
+
+    pthread_mutex_lock(&pool->mutex);
+    Forwarded_Packet *forwarded = worker->inbox_head;
+    worker->inbox_head = NULL;
+    worker->inbox_tail = NULL;
+    worker->inbox_size = 0;
+    pthread_mutex_unlock(&pool->mutex);
+
+    while (forwarded != NULL) {
+        const Packet_Handles *handler = &worker->handlers[forwarded->data[0]];
+        const Onion *onion = worker->onion;
+
+        if (forwarded->tcp_onion) {
+            if (onion->recv_1_function) {
+                onion->recv_1_function(onion->callback_object, forwarded->source, forwarded->data, forwarded->length);
+            }
+        } else if (handler->function) {
+            handler->function(handler->object, forwarded->source, forwarded->data, forwarded->length, NULL);
+        }
+
+        Forwarded_Packet *next = forwarded->next;
+        free(forwarded);
+        forwarded = next;
+    }
+}
+
+static void sync_onion_key(Worker *worker)
+{
+    Worker_Pool *pool = worker->pool;
+
+    if (worker->index == 0) {
+        // Only this thread writes pool->onion_key, so reading it unlocked is fine
+        if (memcmp(pool->onion_key, worker->onion->secret_symmetric_key, CRYPTO_SYMMETRIC_KEY_SIZE) != 0) {
+            pthread_mutex_lock(&pool->mutex);
+            memcpy(pool->onion_key, worker->onion->secret_symmetric_key, CRYPTO_SYMMETRIC_KEY_SIZE);
+            ++pool->onion_key_version;
+            pthread_mutex_unlock(&pool->mutex);
+        }
+
+        return;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+
+    if (worker->onion_key_version != pool->onion_key_version) {
+        onion_set_symmetric_key(worker->onion, pool->onion_key);
+        worker->onion_key_version = pool->onion_key_version;
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+// Put the forwarding handlers of worker in place, after all others were registered
+
+static void set_worker_handlers(Worker *worker)
+{
+    Networking_Core *net = worker->dht->net;
+    memcpy(worker->handlers, net->packethandlers, sizeof(worker->handlers));
+
+    networking_registerhandler(net, NET_PACKET_PING_RESPONSE, &handle_response, worker);
+    networking_registerhandler(net, NET_PACKET_SEND_NODES_IPV6, &handle_response, worker);
+    networking_callback_sent(net, &note_request, worker);
+
+    if (worker->index != 0) {
+        networking_registerhandler(net, NET_PACKET_ANNOUNCE_REQUEST, &handle_for_main_worker, worker);
+        networking_registerhandler(net, NET_PACKET_ONION_DATA_REQUEST, &handle_for_main_worker, worker);
+    }
+}
+
+static void *worker_thread(void *arg)
+{
+    Worker *worker = (Worker *)arg;
+
+    while (1) {
+        sync_onion_key(worker);
+        handle_forwarded_packets(worker);
+        do_DHT(worker->dht);
+        networking_poll(worker->dht->net, NULL);
+
+        SLEEP_MILLISECONDS(30);
+    }
+
+    return NULL;
+}
+
+// Sets up the workers next to the main one, which runs dht, and starts their threads.
+//
+// returns Worker_Pool on success
+//         NULL on failure, after logging the reason
+
+static Worker_Pool *start_workers(DHT *dht, Onion *onion, int num_workers, IP ip, int port, int udp_batch_size,
+                                  int shared_key_threads, const char *cfg_file_path, int enable_ipv6,
+                                  int enable_lan_discovery, char *motd)
+{
+    Worker_Pool *pool = (Worker_Pool *)calloc(1, sizeof(Worker_Pool));
+
+    if (pool == NULL || pthread_mutex_init(&pool->mutex, NULL) != 0) {
+        log_write(LOG_LEVEL_ERROR, "Couldn't allocate the UDP workers.\n");
+        free(pool);
+        return NULL;
+    }
+
+    memcpy(pool->onion_key, onion->secret_symmetric_key, CRYPTO_SYMMETRIC_KEY_SIZE);
+    pool->onion_key_version = 1;
+    pool->num_workers = num_workers;
+
+    for (int i = 0; i < num_workers; ++i) {
+        Worker *worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->index = i;
+        worker->onion_key_version = pool->onion_key_version;
+
+        if (i == 0) {
+            worker->dht = dht;
+            worker->onion = onion;
+            continue;
+        }
+
+        Networking_Core *net = new_networking_reuseport(NULL, ip, port, NULL);
+
+        if (net == NULL || networking_set_batch_size(net, udp_batch_size) != 0) {
+            log_write(LOG_LEVEL_ERROR, "Couldn't initialize networking of UDP worker %d.\n", i);
+            return NULL;
+        }
+
+        // Each worker keeps its own time, updated by its own thread
+        Mono_Time *mono_time = mono_time_new();
+
+        if (mono_time == NULL) {
+            log_write(LOG_LEVEL_ERROR, "Couldn't allocate the clock of UDP worker %d.\n", i);
+            return NULL;
+        }
+
+        worker->dht = new_DHT(NULL, mono_time, net, true);
+
+        if (worker->dht == NULL) {
+            log_write(LOG_LEVEL_ERROR, "Couldn't initialize Tox DHT instance of UDP worker %d.\n", i);
+            return NULL;
+        }
+
+        memcpy(worker->dht->self_public_key, dht->self_public_key, CRYPTO_PUBLIC_KEY_SIZE);
+        memcpy(worker->dht->self_secret_key, dht->self_secret_key, CRYPTO_SECRET_KEY_SIZE);
+
+        if (shared_key_threads > 0 && DHT_start_key_workers(worker->dht, shared_key_threads) != 0) {
+            log_write(LOG_LEVEL_ERROR, "Couldn't start the shared key threads of UDP worker %d.\n", i);
+            return NULL;
+        }
+
+        worker->onion = new_onion(mono_time, worker->dht);
+
+        if (worker->onion == NULL) {
+            log_write(LOG_LEVEL_ERROR, "Couldn't initialize Tox Onion of UDP worker %d.\n", i);
+            return NULL;
+        }
+
+        // The key comes from the main worker, never rotate it here
+        onion_set_symmetric_key(worker->onion, pool->onion_key);
+        set_callback_handle_recv_1(worker->onion, &handle_tcp_onion_response, worker);
+
+        if (motd != NULL) {
+            bootstrap_set_callbacks(net, DAEMON_VERSION_NUMBER, (uint8_t *)motd, strlen(motd) + 1);
+        }
+
+        if (enable_lan_discovery) {
+            LANdiscovery_init(worker->dht);
+        }
+
+        if (!bootstrap_from_config(cfg_file_path, worker->dht, enable_ipv6)) {
+            log_write(LOG_LEVEL_ERROR, "Couldn't read list of bootstrap nodes of UDP worker %d.\n", i);
+            return NULL;
+        }
+    }
+
+    for (int i = 0; i < num_workers; ++i) {
+        set_worker_handlers(&pool->workers[i]);
+    }
+
+    for (int i = 1; i < num_workers; ++i) {
+        if (pthread_create(&pool->workers[i].thread, NULL, &worker_thread, &pool->workers[i]) != 0) {
+            log_write(LOG_LEVEL_ERROR, "Couldn't start UDP worker thread %d.\n", i);
+            return NULL;
+        }
+    }
+
+    return pool;
+}
+
+// Logs the traffic and handler time per UDP packet id since the last call,
+// summed over the sockets of all UDP workers
+
+static void log_packet_stats(DHT *dht, Worker_Pool *pool)
+{
+    Packet_Stats total[256];
+    memset(total, 0, sizeof(total));
+
+    const unsigned int num_workers = pool != NULL ? pool->num_workers : 1;
+
+    for (unsigned int i = 0; i < num_workers; ++i) {
+        Networking_Core *net = pool != NULL ? pool->workers[i].dht->net : dht->net;
+
+        for (int id = 0; id < 256; ++id) {
+            Packet_Stats stats;
+            packet_stats_copy(&net->packet_stats[id], &stats);
+            total[id].packets_in   += stats.packets_in;
+            total[id].bytes_in     += stats.bytes_in;
+            total[id].packets_out  += stats.packets_out;
+            total[id].bytes_out    += stats.bytes_out;
+            total[id].handled      += stats.handled;
+            total[id].dropped      += stats.dropped;
+            total[id].handler_time += stats.handler_time;
+        }
+
+        // The workers keep counting, packets counted between the copy and the
+        // reset are not logged
+        networking_reset_stats(net);
+    }
+
+    log_write(LOG_LEVEL_INFO, "UDP traffic by packet id:\n");
+
+    for (int id = 0; id < 256; ++id) {
+        const Packet_Stats *stats = &total[id];
+
+        if (stats->packets_in == 0 && stats->packets_out == 0) {
+            continue;
+        }
+
+        log_write(LOG_LEVEL_INFO,
+                  "0x%02x: in %llu packets %llu bytes, out %llu packets %llu bytes, handled %llu, dropped %llu, "
+                  "handler time %llu us\n", id,
+                  (unsigned long long)stats->packets_in, (unsigned long long)stats->bytes_in,
+                  (unsigned long long)stats->packets_out, (unsigned long long)stats->bytes_out,
+                  (unsigned long long)stats->handled, (unsigned long long)stats->dropped,
+                  (unsigned long long)stats->handler_time);
+    }
+}
+
 int main(int argc, char *argv[])
 {
     umask(077);
@@ -202,9 +632,14 @@ int main(int argc, char *argv[])
     int tcp_relay_port_count;
     int enable_motd;
     char *motd;
+    int udp_batch_size;
+    int udp_worker_threads;
+    int stats_log_interval;
+    int shared_key_threads;
 
     if (get_general_config(cfg_file_path, &pid_file_path, &keys_file_path, &port, &enable_ipv6, &enable_ipv4_fallback,
-                           &enable_lan_discovery, &enable_tcp_relay, &tcp_relay_ports, &tcp_relay_port_count, &enable_motd, &motd)) {
+                           &enable_lan_discovery, &enable_tcp_relay, &tcp_relay_ports, &tcp_relay_port_count, &enable_motd, &motd,
+                           &udp_batch_size, &udp_worker_threads, &stats_log_interval, &shared_key_threads)) {
         log_write(LOG_LEVEL_INFO, "General config read successfully\n");
     } else {
         log_write(LOG_LEVEL_ERROR, "Couldn't read config file: %s. Exiting.\n", cfg_file_path);
@@ -217,6 +652,18 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    if (udp_worker_threads < 1 || udp_worker_threads > MAX_UDP_WORKER_THREADS) {
+        log_write(LOG_LEVEL_ERROR, "Invalid number of UDP worker threads: %d, should be in [1, %d]. Exiting.\n",
+                  udp_worker_threads, MAX_UDP_WORKER_THREADS);
+        return 1;
+    }
+
+    if (shared_key_threads < 0 || shared_key_threads > SHARED_KEY_MAX_WORKERS) {
+        log_write(LOG_LEVEL_ERROR, "Invalid number of shared key threads: %d, should be in [0, %d]. Exiting.\n",
+                  shared_key_threads, SHARED_KEY_MAX_WORKERS);
+        return 1;
+    }
+
     if (!run_in_foreground) {
         daemonize(log_backend, pid_file_path);
     }
@@ -226,14 +673,14 @@ int main(int argc, char *argv[])
     IP ip;
     ip_init(&ip, enable_ipv6);
 
-    Networking_Core *net = new_networking(NULL, ip, port);
+    Networking_Core *net = new_daemon_networking(ip, port, udp_worker_threads > 1);
 
     if (net == NULL) {
         if (enable_ipv6 && enable_ipv4_fallback) {
             log_write(LOG_LEVEL_WARNING, "Couldn't initialize IPv6 networking. Falling back to using IPv4.\n");
             enable_ipv6 = 0;
             ip_init(&ip, enable_ipv6);
-            net = new_networking(NULL, ip, port);
+            net = new_daemon_networking(ip, port, udp_worker_threads > 1);
 
             if (net == NULL) {
                 log_write(LOG_LEVEL_ERROR, "Couldn't fallback to IPv4. Exiting.\n");
@@ -245,15 +692,33 @@ int main(int argc, char *argv[])
         }
     }
 
-    DHT *dht = new_DHT(NULL, net, true);
+    if (udp_batch_size < 1 || udp_batch_size > NET_MAX_BATCH_SIZE || networking_set_batch_size(net, udp_batch_size) != 0) {
+        log_write(LOG_LEVEL_ERROR, "Invalid UDP batch size: %d, should be in [1, %d]. Exiting.\n", udp_batch_size,
+                  NET_MAX_BATCH_SIZE);
+        return 1;
+    }
+
+    Mono_Time *mono_time = mono_time_new();
+
+    if (mono_time == NULL) {
+        log_write(LOG_LEVEL_ERROR, "Couldn't allocate the clock. Exiting.\n");
+        return 1;
+    }
+
+    DHT *dht = new_DHT(NULL, mono_time, net, true);
 
     if (dht == NULL) {
         log_write(LOG_LEVEL_ERROR, "Couldn't initialize Tox DHT instance. Exiting.\n");
         return 1;
     }
 
-    Onion *onion = new_onion(dht);
-    Onion_Announce *onion_a = new_onion_announce(dht);
+    if (shared_key_threads > 0 && DHT_start_key_workers(dht, shared_key_threads) != 0) {
+        log_write(LOG_LEVEL_ERROR, "Couldn't start the shared key threads. Exiting.\n");
+        return 1;
+    }
+
+    Onion *onion = new_onion(mono_time, dht);
+    Onion_Announce *onion_a = new_onion_announce(mono_time, dht);
 
     if (!(onion && onion_a)) {
         log_write(LOG_LEVEL_ERROR, "Couldn't initialize Tox Onion. Exiting.\n");
@@ -267,8 +732,6 @@ int main(int argc, char *argv[])
             log_write(LOG_LEVEL_ERROR, "Couldn't set MOTD: %s. Exiting.\n", motd);
             return 1;
         }
-
-        free(motd);
     }
 
     if (manage_keys(dht, keys_file_path)) {
@@ -288,7 +751,8 @@ int main(int argc, char *argv[])
             return 1;
         }
 
-        tcp_server = new_TCP_server(enable_ipv6, tcp_relay_port_count, tcp_relay_ports, dht->self_secret_key, onion);
+        tcp_server = new_TCP_server(mono_time, enable_ipv6, tcp_relay_port_count, tcp_relay_ports, dht->self_secret_key,
+                                    onion);
 
         // tcp_relay_port_count != 0 at this point
         free(tcp_relay_ports);
@@ -311,6 +775,7 @@ int main(int argc, char *argv[])
     print_public_key(dht->self_public_key);
 
     uint64_t last_LANdiscovery = 0;
+    uint64_t last_stats_log = mono_time_get(mono_time);
     const uint16_t net_htons_port = net_htons(port);
 
     int waiting_for_dht_connection = 1;
@@ -320,12 +785,35 @@ int main(int argc, char *argv[])
         log_write(LOG_LEVEL_INFO, "Initialized LAN discovery successfully.\n");
     }
 
+    Worker_Pool *pool = NULL;
+
+    if (udp_worker_threads > 1) {
+        pool = start_workers(dht, onion, udp_worker_threads, ip, port, udp_batch_size, shared_key_threads, cfg_file_path,
+                             enable_ipv6, enable_lan_discovery, enable_motd ? motd : NULL);
+
+        if (pool == NULL) {
+            log_write(LOG_LEVEL_ERROR, "Couldn't start UDP worker threads. Exiting.\n");
+            return 1;
+        }
+
+        log_write(LOG_LEVEL_INFO, "Started %d UDP worker threads successfully.\n", udp_worker_threads);
+    }
+
+    if (enable_motd) {
+        free(motd);
+    }
+
     while (1) {
+        if (pool != NULL) {
+            sync_onion_key(&pool->workers[0]);
+            handle_forwarded_packets(&pool->workers[0]);
+        }
+
         do_DHT(dht);
 
-        if (enable_lan_discovery && is_timeout(last_LANdiscovery, LAN_DISCOVERY_INTERVAL)) {
+        if (enable_lan_discovery && mono_time_is_timeout(mono_time, last_LANdiscovery, LAN_DISCOVERY_INTERVAL)) {
             send_LANdiscovery(net_htons_port, dht);
-            last_LANdiscovery = unix_time();
+            last_LANdiscovery = mono_time_get(mono_time);
         }
 
         if (enable_tcp_relay) {
@@ -334,6 +822,11 @@ int main(int argc, char *argv[])
 
         networking_poll(dht->net, NULL);
 
+        if (stats_log_interval > 0 && mono_time_is_timeout(mono_time, last_stats_log, stats_log_interval)) {
+            log_packet_stats(dht, pool);
+            last_stats_log = mono_time_get(mono_time);
+        }
+
         if (waiting_for_dht_connection && DHT_isconnected(dht)) {
             log_write(LOG_LEVEL_INFO, "Connected to another bootstrap node successfully.\n");
             waiting_for_dht_connection = 0;
@@ -3,6 +3,7 @@
 #include "../toxcore/crypto_core.c"
 #include "../toxcore/crypto_core_mem.c"
 #include "../toxcore/DHT.c"
+#include "../toxcore/distance.c"
 #include "../toxcore/friend_connection.c"
 #include "../toxcore/friend_requests.c"
 #include "../toxcore/group.c"
@@ -15,6 +16,7 @@
 #include "../toxcore/onion_announce.c"
 #include "../toxcore/onion.c"
 #include "../toxcore/onion_client.c"
+#include "../toxcore/packet_buf.c"
 #include "../toxcore/ping_array.c"
 #include "../toxcore/ping.c"
 #include "../toxcore/TCP_client.c"
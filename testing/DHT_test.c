@@ -190,7 +190,8 @@ int main(int argc, char *argv[])
     IP ip;
     ip_init(&ip, ipv6enabled);
 
-    DHT *dht = new_DHT(NULL, new_networking(NULL, ip, PORT), true);
+    Mono_Time *mono_time = mono_time_new();
+    DHT *dht = new_DHT(NULL, mono_time, new_networking(NULL, ip, PORT), true);
     printf("OUR ID: ");
     uint32_t i;
 
@@ -0,0 +1,573 @@
+/* DHT simulation
+ * Runs many DHT nodes in one process over an in-memory network driven by a
+ * virtual clock, and reports how fast their close lists converge and what
+ * that costs in packets, bytes and CPU time.
+ *
+ * A node has converged once its close list holds the SIM_CLOSEST nodes
+ * closest to it, except for those whose k-bucket is already full of good
+ * nodes.
+ *
+ * Every node runs the real DHT, ping, onion and onion announce code. Their
+ * Networking_Core objects use a backend that queues packets in memory and
+ * delivers them after the configured latency, so an hour of protocol time
+ * takes seconds instead of an hour.
+ *
+ * Usage: ./dht_sim [nodes] [simulated seconds] [latency in ms] [loss percent] [friends per node]
+ */
+
+/*
+ * Copyright © 2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _DARWIN_C_SOURCE
+#define _XOPEN_SOURCE 600
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "../toxcore/DHT.h"
+#include "../toxcore/LAN_discovery.h"
+#include "../toxcore/distance.h"
+#include "../toxcore/network.h"
+#include "../toxcore/onion.h"
+#include "../toxcore/onion_announce.h"
+#include "../toxcore/util.h"
+
+#include <time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Interval between two iterations of every node, like tox_iteration_interval(). */
+#define SIM_TICK 50
+
+/* Virtual monotonic time the simulation starts at, in ms. */
+#define SIM_START_TIME (1000 * 1000)
+
+#define SIM_CLOSEST 8
+
+/* Interval at which nodes that aren't connected bootstrap again, in ms. */
+#define SIM_REBOOTSTRAP_INTERVAL 10000
+
+#define SIM_PORT 33445
+
+/* Nodes get consecutive addresses from 20.0.0.1 on, which are not LAN
+ * addresses so that the DHT treats them like nodes on the internet. */
+#define SIM_IP_BASE 0x14000000
+
+typedef struct Sim_Packet {
+    struct Sim_Packet *next;
+    uint64_t deliver_time;
+    uint32_t to;
+    IP_Port from;
+    uint16_t length;
+    uint8_t data[];
+} Sim_Packet;
+
+typedef struct {
+    Sim_Packet *first;
+    Sim_Packet *last;
+} Sim_Queue;
+
+typedef struct {
+    Networking_Core *net;
+    DHT *dht;
+    Onion *onion;
+    Onion_Announce *onion_a;
+    IP_Port ip_port;
+
+    /* Packets delivered to the node, not received yet. */
+    Sim_Queue inbox;
+
+    uint32_t closest[SIM_CLOSEST];
+    uint32_t num_closest;
+} Sim_Node;
+
+typedef struct {
+    uint64_t packets;
+    uint64_t bytes;
+} Sim_Counter;
+
+static struct {
+    Sim_Node *nodes;
+    uint32_t num_nodes;
+
+    /* The clock of the nodes, reading now. */
+    Mono_Time *mono_time;
+    uint64_t now;
+    uint32_t latency;
+    uint32_t loss;
+
+    /* Packets in flight, ordered by delivery time. */
+    Sim_Queue in_flight;
+
+    Sim_Counter sent[256];
+    uint64_t packets_sent;
+    uint64_t bytes_sent;
+    uint64_t packets_lost;
+    uint64_t packets_unroutable;
+    uint64_t packets_delivered;
+
+    uint64_t do_DHT_calls;
+    uint64_t do_DHT_passes;
+    uint64_t do_DHT_ns;
+    uint64_t handler_ns;
+} sim;
+
+/* The clock of the nodes. */
+static uint64_t sim_clock(void *object)
+{
+    return sim.now;
+}
+
+static uint64_t real_time_ns(clockid_t clock_id)
+{
+    struct timespec ts;
+    clock_gettime(clock_id, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void queue_push(Sim_Queue *queue, Sim_Packet *packet)
+{
+    packet->next = NULL;
+
+    if (queue->last != NULL) {
+        queue->last->next = packet;
+    } else {
+        queue->first = packet;
+    }
+
+    queue->last = packet;
+}
+
+static Sim_Packet *queue_pop(Sim_Queue *queue)
+{
+    Sim_Packet *packet = queue->first;
+
+    if (packet != NULL) {
+        queue->first = packet->next;
+
+        if (queue->first == NULL) {
+            queue->last = NULL;
+        }
+    }
+
+    return packet;
+}
+
+static void queue_free(Sim_Queue *queue)
+{
+    Sim_Packet *packet;
+
+    while ((packet = queue_pop(queue)) != NULL) {
+        free(packet);
+    }
+}
+
+static int sim_send(void *object, IP_Port ip_port, const uint8_t *data, uint16_t length)
+{
+    const Sim_Node *node = (const Sim_Node *)object;
+    const uint32_t to = net_ntohl(ip_port.ip.ip4.uint32) - SIM_IP_BASE - 1;
+
+    if (ip_port.ip.family != AF_INET || ip_port.port != net_htons(SIM_PORT) || to >= sim.num_nodes
+            || length <= ela_magic_size()) {
+        ++sim.packets_unroutable;
+        return -1;
+    }
+
+    /* Count the packets without the magic sendpacket() prepends. */
+    const uint8_t packet_id = data[ela_magic_size()];
+    ++sim.packets_sent;
+    sim.bytes_sent += length - ela_magic_size();
+    ++sim.sent[packet_id].packets;
+    sim.sent[packet_id].bytes += length - ela_magic_size();
+
+    if (sim.loss && random_int() % 100 < sim.loss) {
+        ++sim.packets_lost;
+        return length;
+    }
+
+    Sim_Packet *packet = (Sim_Packet *)malloc(sizeof(Sim_Packet) + length);
+
+    if (packet == NULL) {
+        return -1;
+    }
+
+    packet->deliver_time = sim.now + sim.latency;
+    packet->to = to;
+    packet->from = node->ip_port;
+    packet->length = length;
+    memcpy(packet->data, data, length);
+    queue_push(&sim.in_flight, packet);
+    return length;
+}
+
+static int sim_recv(void *object, IP_Port *ip_port, uint8_t *data, uint16_t length)
+{
+    Sim_Node *node = (Sim_Node *)object;
+    Sim_Packet *packet = queue_pop(&node->inbox);
+
+    if (packet == NULL) {
+        return -1;
+    }
+
+    const int received = packet->length < length ? packet->length : length;
+    memcpy(data, packet->data, received);
+    *ip_port = packet->from;
+    free(packet);
+    return received;
+}
+
+static const Network_Backend sim_backend = {
+    sim_send,
+    sim_recv,
+    NULL,
+    NULL,
+};
+
+/* Move every packet due by now to the inbox of its node. Packets sent while
+ * receiving them are due later, after the latency. */
+static void deliver_packets(void)
+{
+    while (sim.in_flight.first != NULL && sim.in_flight.first->deliver_time <= sim.now) {
+        Sim_Packet *packet = queue_pop(&sim.in_flight);
+        queue_push(&sim.nodes[packet->to].inbox, packet);
+        ++sim.packets_delivered;
+    }
+}
+
+/* Find the SIM_CLOSEST nodes closest to every node. */
+static void find_closest(void)
+{
+    for (uint32_t i = 0; i < sim.num_nodes; ++i) {
+        Sim_Node *node = &sim.nodes[i];
+        const uint8_t *base = node->dht->self_public_key;
+
+        for (uint32_t j = 0; j < sim.num_nodes; ++j) {
+            if (i == j) {
+                continue;
+            }
+
+            const uint8_t *pk = sim.nodes[j].dht->self_public_key;
+            uint32_t pos = node->num_closest;
+
+            while (pos > 0 && pk_distance_cmp(base, pk, sim.nodes[node->closest[pos - 1]].dht->self_public_key) < 0) {
+                if (pos < SIM_CLOSEST) {
+                    node->closest[pos] = node->closest[pos - 1];
+                }
+
+                --pos;
+            }
+
+            if (pos < SIM_CLOSEST) {
+                node->closest[pos] = j;
+
+                if (node->num_closest < SIM_CLOSEST) {
+                    ++node->num_closest;
+                }
+            }
+        }
+    }
+}
+
+static bool node_converged(const Sim_Node *node)
+{
+    for (uint32_t i = 0; i < node->num_closest; ++i) {
+        const uint8_t *pk = sim.nodes[node->closest[i]].dht->self_public_key;
+        const Client_data *bucket = DHT_close_bucket(node->dht, pk);
+        uint32_t good = 0;
+        bool found = 0;
+
+        for (uint32_t j = 0; j < LCLIENT_NODES; ++j) {
+            if (!mono_time_is_timeout(sim.mono_time, bucket[j].assoc4.timestamp, BAD_NODE_TIMEOUT)) {
+                ++good;
+                found |= id_equal(bucket[j].public_key, pk);
+            }
+        }
+
+        if (!found && good < LCLIENT_NODES) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static uint32_t count_converged(void)
+{
+    uint32_t converged = 0;
+
+    for (uint32_t i = 0; i < sim.num_nodes; ++i) {
+        converged += node_converged(&sim.nodes[i]);
+    }
+
+    return converged;
+}
+
+/* Bootstrap node number from one of the first num_nodes nodes. */
+static void bootstrap_node(uint32_t number, uint32_t num_nodes)
+{
+    const Sim_Node *bootstrap = &sim.nodes[random_int() % num_nodes];
+
+    if (bootstrap != &sim.nodes[number]) {
+        DHT_bootstrap(sim.nodes[number].dht, bootstrap->ip_port, bootstrap->dht->self_public_key);
+    }
+}
+
+static int create_nodes(Logger *log, uint32_t friends)
+{
+    for (uint32_t i = 0; i < sim.num_nodes; ++i) {
+        Sim_Node *node = &sim.nodes[i];
+
+        node->ip_port.ip.family = AF_INET;
+        node->ip_port.ip.ip4.uint32 = net_htonl(SIM_IP_BASE + i + 1);
+        node->ip_port.port = net_htons(SIM_PORT);
+        node->net = new_networking_backend(log, AF_INET, SIM_PORT, &sim_backend, node);
+
+        if (node->net == NULL) {
+            return -1;
+        }
+
+        node->dht = new_DHT(log, sim.mono_time, node->net, true);
+
+        if (node->dht == NULL) {
+            return -1;
+        }
+
+        node->onion = new_onion(sim.mono_time, node->dht);
+        node->onion_a = new_onion_announce(sim.mono_time, node->dht);
+
+        if (node->onion == NULL || node->onion_a == NULL) {
+            return -1;
+        }
+    }
+
+    for (uint32_t i = 0; i < sim.num_nodes; ++i) {
+        for (uint32_t j = 0; j < friends; ++j) {
+            const uint32_t friend_node = random_int() % sim.num_nodes;
+
+            if (friend_node != i) {
+                DHT_addfriend(sim.nodes[i].dht, sim.nodes[friend_node].dht->self_public_key, NULL, NULL, 0, NULL);
+            }
+        }
+    }
+
+    /* Every node joins through a node that joined before it. */
+    for (uint32_t i = 1; i < sim.num_nodes; ++i) {
+        bootstrap_node(i, i);
+    }
+
+    return 0;
+}
+
+/* Bootstrap again the nodes that lost all their packets to the network, like
+ * clients do when they aren't connected. */
+static void rebootstrap_nodes(void)
+{
+    for (uint32_t i = 0; i < sim.num_nodes; ++i) {
+        if (!DHT_isconnected(sim.nodes[i].dht)) {
+            bootstrap_node(i, sim.num_nodes);
+        }
+    }
+}
+
+static void kill_nodes(void)
+{
+    for (uint32_t i = 0; i < sim.num_nodes; ++i) {
+        Sim_Node *node = &sim.nodes[i];
+
+        if (node->onion_a != NULL) {
+            kill_onion_announce(node->onion_a);
+        }
+
+        if (node->onion != NULL) {
+            kill_onion(node->onion);
+        }
+
+        if (node->dht != NULL) {
+            kill_DHT(node->dht);
+        }
+
+        kill_networking(node->net);
+        queue_free(&node->inbox);
+    }
+
+    queue_free(&sim.in_flight);
+    free(sim.nodes);
+    mono_time_free(sim.mono_time);
+}
+
+static void do_nodes(void)
+{
+    for (uint32_t i = 0; i < sim.num_nodes; ++i) {
+        if (sim.nodes[i].inbox.first != NULL) {
+            const uint64_t start = real_time_ns(CLOCK_MONOTONIC);
+
+            networking_poll(sim.nodes[i].net, NULL);
+
+            sim.handler_ns += real_time_ns(CLOCK_MONOTONIC) - start;
+        }
+
+        DHT *dht = sim.nodes[i].dht;
+        const uint64_t last_run = dht->last_run;
+        const uint64_t start = real_time_ns(CLOCK_MONOTONIC);
+
+        do_DHT(dht);
+
+        sim.do_DHT_ns += real_time_ns(CLOCK_MONOTONIC) - start;
+        ++sim.do_DHT_calls;
+
+        if (dht->last_run != last_run) {
+            ++sim.do_DHT_passes;
+        }
+    }
+}
+
+static void print_convergence(const char *what, uint64_t time)
+{
+    if (time == 0) {
+        printf("%-24s not reached\n", what);
+    } else {
+        printf("%-24s %.1f s\n", what, (time - SIM_START_TIME) / 1000.0);
+    }
+}
+
+static void print_results(uint64_t end_time, uint64_t converged_half, uint64_t converged_most,
+                          uint64_t converged_all, uint64_t wall_ns, uint64_t cpu_ns)
+{
+    const double seconds = (end_time - SIM_START_TIME) / 1000.0;
+    const double wall_seconds = wall_ns / 1000000000.0;
+
+    print_convergence("50% converged", converged_half);
+    print_convergence("90% converged", converged_most);
+    print_convergence("100% converged", converged_all);
+    printf("%-24s %u of %u\n", "converged at end", count_converged(), sim.num_nodes);
+
+    printf("%-24s %llu (%llu lost, %llu unroutable)\n", "packets sent", (unsigned long long)sim.packets_sent,
+           (unsigned long long)sim.packets_lost, (unsigned long long)sim.packets_unroutable);
+    printf("%-24s %.1f simulated (%.2f per node), %.1f wall clock\n", "packets per second",
+           sim.packets_sent / seconds, sim.packets_sent / seconds / sim.num_nodes,
+           sim.packets_delivered / wall_seconds);
+    printf("%-24s %.1f total, %.1f per second\n", "bytes per node", (double)sim.bytes_sent / sim.num_nodes,
+           sim.bytes_sent / seconds / sim.num_nodes);
+    printf("%-24s %.2f us per call, %.2f us per pass (%llu passes)\n", "do_DHT",
+           sim.do_DHT_ns / 1000.0 / sim.do_DHT_calls,
+           sim.do_DHT_ns / 1000.0 / (sim.do_DHT_passes ? sim.do_DHT_passes : 1),
+           (unsigned long long)sim.do_DHT_passes);
+    printf("%-24s %.2f us per packet\n", "packet handlers",
+           sim.handler_ns / 1000.0 / (sim.packets_delivered ? sim.packets_delivered : 1));
+    printf("%-24s %.2f s wall clock, %.2f s CPU\n", "run time", wall_seconds, cpu_ns / 1000000000.0);
+
+    printf("\n%-6s %12s %14s %10s\n", "packet", "count", "bytes", "per node/s");
+
+    for (uint32_t i = 0; i < 256; ++i) {
+        if (sim.sent[i].packets != 0) {
+            printf("0x%02x   %12llu %14llu %10.2f\n", i, (unsigned long long)sim.sent[i].packets,
+                   (unsigned long long)sim.sent[i].bytes, sim.sent[i].packets / seconds / sim.num_nodes);
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    const uint32_t num_nodes = argc > 1 ? strtoul(argv[1], NULL, 10) : 256;
+    const uint32_t duration = argc > 2 ? strtoul(argv[2], NULL, 10) : 600;
+    const uint32_t latency = argc > 3 ? strtoul(argv[3], NULL, 10) : 50;
+    const uint32_t loss = argc > 4 ? strtoul(argv[4], NULL, 10) : 0;
+    const uint32_t friends = argc > 5 ? strtoul(argv[5], NULL, 10) : 0;
+
+    if (num_nodes < 2 || duration == 0 || latency == 0 || loss >= 100) {
+        printf("Usage: %s [nodes] [simulated seconds] [latency in ms] [loss percent] [friends per node]\n", argv[0]);
+        return 1;
+    }
+
+    if (networking_at_startup() != 0) {
+        printf("Failed to initialize networking.\n");
+        return 1;
+    }
+
+    sim.now = SIM_START_TIME;
+    sim.mono_time = mono_time_new();
+
+    if (sim.mono_time == NULL) {
+        printf("Failed to create the clock.\n");
+        return 1;
+    }
+
+    mono_time_set_clock(sim.mono_time, &sim_clock, NULL);
+    sim.latency = latency;
+    sim.loss = loss;
+    sim.num_nodes = num_nodes;
+    sim.nodes = (Sim_Node *)calloc(num_nodes, sizeof(Sim_Node));
+
+    Logger *log = logger_new();
+
+    if (sim.nodes == NULL || log == NULL || create_nodes(log, friends) == -1) {
+        printf("Failed to create %u nodes.\n", num_nodes);
+        return 1;
+    }
+
+    find_closest();
+
+    printf("%u nodes, %u s simulated, %u ms latency, %u%% loss, %u friends per node\n\n",
+           num_nodes, duration, latency, loss, friends);
+
+    const uint64_t wall_start = real_time_ns(CLOCK_MONOTONIC);
+    const uint64_t cpu_start = real_time_ns(CLOCK_PROCESS_CPUTIME_ID);
+    const uint64_t end_time = SIM_START_TIME + duration * 1000ULL;
+    uint64_t converged_half = 0;
+    uint64_t converged_most = 0;
+    uint64_t converged_all = 0;
+    uint64_t next_rebootstrap = SIM_START_TIME + SIM_REBOOTSTRAP_INTERVAL;
+
+    for (; sim.now < end_time; sim.now += SIM_TICK) {
+        deliver_packets();
+        do_nodes();
+
+        if (sim.now >= next_rebootstrap) {
+            rebootstrap_nodes();
+            next_rebootstrap = sim.now + SIM_REBOOTSTRAP_INTERVAL;
+        }
+
+        if (sim.now % 1000 != 0 || converged_all != 0) {
+            continue;
+        }
+
+        const uint32_t converged = count_converged();
+
+        if (converged_half == 0 && converged * 2 >= num_nodes) {
+            converged_half = sim.now;
+        }
+
+        if (converged_most == 0 && converged * 10 >= num_nodes * 9) {
+            converged_most = sim.now;
+        }
+
+        if (converged == num_nodes) {
+            converged_all = sim.now;
+        }
+    }
+
+    print_results(end_time, converged_half, converged_most, converged_all,
+                  real_time_ns(CLOCK_MONOTONIC) - wall_start, real_time_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu_start);
+
+    kill_nodes();
+    logger_kill(log);
+    return 0;
+}
@@ -0,0 +1,240 @@
+/* Distance benchmark
+ * Compares the speed of the XOR distance implementations supported by this
+ * CPU with the byte by byte loops they replaced, and times get_close_nodes()
+ * on a close list with each of them.
+ *
+ * Usage: ./distance_bench [iterations in millions]
+ */
+
+/*
+ * Copyright © 2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "../toxcore/DHT.h"
+#include "../toxcore/distance.h"
+#include "../toxcore/network.h"
+#include "../toxcore/util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NUM_KEYS 4096
+
+/* Keys of a DHT close list share a prefix with our own key; share up to this
+ * many leading bytes with the base key to get the same kind of inputs. */
+#define MAX_SHARED_BYTES 12
+
+/* The close list buckets filled with nodes, as in a DHT of about 2^16 nodes. */
+#define FILLED_BUCKETS 16
+
+static uint8_t keys[NUM_KEYS][CRYPTO_PUBLIC_KEY_SIZE];
+static uint8_t base[CRYPTO_PUBLIC_KEY_SIZE];
+static uint16_t prefixes[NUM_KEYS];
+
+/* The byte by byte loops DHT.c used before. */
+static int id_closest_bytes(const uint8_t *pk, const uint8_t *pk1, const uint8_t *pk2)
+{
+    for (size_t i = 0; i < CRYPTO_PUBLIC_KEY_SIZE; ++i) {
+        uint8_t distance1 = pk[i] ^ pk1[i];
+        uint8_t distance2 = pk[i] ^ pk2[i];
+
+        if (distance1 < distance2) {
+            return 1;
+        }
+
+        if (distance1 > distance2) {
+            return 2;
+        }
+    }
+
+    return 0;
+}
+
+static unsigned int bit_by_bit_cmp(const uint8_t *pk1, const uint8_t *pk2)
+{
+    unsigned int i;
+    unsigned int j = 0;
+
+    for (i = 0; i < CRYPTO_PUBLIC_KEY_SIZE; ++i) {
+        if (pk1[i] == pk2[i]) {
+            continue;
+        }
+
+        for (j = 0; j < 8; ++j) {
+            uint8_t mask = 1 << (7 - j);
+
+            if ((pk1[i] & mask) != (pk2[i] & mask)) {
+                break;
+            }
+        }
+
+        break;
+    }
+
+    return i * 8 + j;
+}
+
+static void print_result(const char *impl, const char *what, uint64_t start, uint64_t ops)
+{
+    const uint64_t ms = current_time_monotonic() - start;
+    printf("%-8s %-22s %8.2f ns/op\n", impl, what, ms * 1000000.0 / ops);
+}
+
+static void bench_impl(const char *impl, uint64_t iterations)
+{
+    volatile unsigned int sink = 0;
+    uint64_t start = current_time_monotonic();
+
+    for (uint64_t i = 0; i < iterations; ++i) {
+        sink += pk_distance_cmp(base, keys[i % NUM_KEYS], keys[(i * 7 + 1) % NUM_KEYS]);
+    }
+
+    print_result(impl, "pk_distance_cmp", start, iterations);
+
+    start = current_time_monotonic();
+
+    for (uint64_t i = 0; i < iterations; ++i) {
+        sink += pk_common_prefix(base, keys[i % NUM_KEYS]);
+    }
+
+    print_result(impl, "pk_common_prefix", start, iterations);
+
+    start = current_time_monotonic();
+
+    for (uint64_t i = 0; i < iterations; i += NUM_KEYS) {
+        pk_common_prefix_batch(base, keys[0], CRYPTO_PUBLIC_KEY_SIZE, NUM_KEYS, prefixes);
+        sink += prefixes[i % NUM_KEYS];
+    }
+
+    print_result(impl, "pk_common_prefix_batch", start, iterations);
+}
+
+/* Fill the first FILLED_BUCKETS buckets of the close list of dht. */
+static void fill_close_list(DHT *dht)
+{
+    for (uint32_t bucket = 0; bucket < FILLED_BUCKETS; ++bucket) {
+        for (uint32_t j = 0; j < LCLIENT_NODES; ++j) {
+            Client_data *client = &dht->close_clientlist[bucket * LCLIENT_NODES + j];
+            uint8_t *pk = client->public_key;
+
+            /* Share exactly bucket leading bits with our key. */
+            random_bytes(pk, CRYPTO_PUBLIC_KEY_SIZE);
+            memcpy(pk, dht->self_public_key, bucket / 8 + 1);
+            const uint8_t mask = 0x80 >> (bucket % 8);
+            pk[bucket / 8] = (pk[bucket / 8] & (mask - 1)) | ((dht->self_public_key[bucket / 8] ^ mask) & ~(mask - 1));
+
+            ip_init(&client->assoc4.ip_port.ip, 0);
+            client->assoc4.ip_port.ip.ip4.uint32 = net_htonl(0x7F000001);
+            client->assoc4.ip_port.port = net_htons(33445 + j);
+            client->assoc4.timestamp = mono_time_get(dht->mono_time);
+        }
+    }
+}
+
+static void bench_close_nodes(const char *impl, DHT *dht, uint64_t iterations)
+{
+    volatile unsigned int sink = 0;
+    Node_format nodes[MAX_SENT_NODES];
+    const uint64_t start = current_time_monotonic();
+
+    for (uint64_t i = 0; i < iterations; ++i) {
+        sink += get_close_nodes(dht, keys[i % NUM_KEYS], nodes, AF_INET, 1, 0);
+    }
+
+    print_result(impl, "get_close_nodes", start, iterations);
+}
+
+static void bench_bytes(uint64_t iterations)
+{
+    volatile unsigned int sink = 0;
+    uint64_t start = current_time_monotonic();
+
+    for (uint64_t i = 0; i < iterations; ++i) {
+        sink += id_closest_bytes(base, keys[i % NUM_KEYS], keys[(i * 7 + 1) % NUM_KEYS]);
+    }
+
+    print_result("bytes", "id_closest", start, iterations);
+
+    start = current_time_monotonic();
+
+    for (uint64_t i = 0; i < iterations; ++i) {
+        sink += bit_by_bit_cmp(base, keys[i % NUM_KEYS]);
+    }
+
+    print_result("bytes", "bit_by_bit_cmp", start, iterations);
+}
+
+int main(int argc, char *argv[])
+{
+    uint64_t iterations = 20 * 1000000;
+
+    if (argc > 1) {
+        iterations = strtoull(argv[1], NULL, 10) * 1000000;
+    }
+
+    if (iterations == 0) {
+        printf("Usage: %s [iterations in millions]\n", argv[0]);
+        return 1;
+    }
+
+    random_bytes(base, sizeof(base));
+
+    for (uint32_t i = 0; i < NUM_KEYS; ++i) {
+        random_bytes(keys[i], CRYPTO_PUBLIC_KEY_SIZE);
+        memcpy(keys[i], base, random_int() % (MAX_SHARED_BYTES + 1));
+    }
+
+    IP ip;
+    ip_init(&ip, 0);
+    ip.ip4.uint32 = net_htonl(0x7F000001);
+    Mono_Time *mono_time = mono_time_new();
+    Networking_Core *net = new_networking(NULL, ip, 33445);
+    DHT *dht = net != NULL && mono_time != NULL ? new_DHT(NULL, mono_time, net, true) : NULL;
+
+    if (dht == NULL) {
+        printf("Failed to create the DHT.\n");
+        return 1;
+    }
+
+    fill_close_list(dht);
+
+    printf("default implementation: %s\n", distance_impl_name(distance_impl()));
+
+    bench_bytes(iterations);
+
+    const Distance_Impl impls[] = { DISTANCE_IMPL_GENERIC, DISTANCE_IMPL_SSE2, DISTANCE_IMPL_AVX2 };
+
+    for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); ++i) {
+        if (!distance_use_impl(impls[i])) {
+            printf("%-8s not supported\n", distance_impl_name(impls[i]));
+            continue;
+        }
+
+        bench_impl(distance_impl_name(impls[i]), iterations);
+        bench_close_nodes(distance_impl_name(impls[i]), dht, iterations / 20);
+    }
+
+    kill_DHT(dht);
+    kill_networking(net);
+    mono_time_free(mono_time);
+    return 0;
+}
@@ -48,12 +48,14 @@
 #include "DHT.h"
 
 #include "LAN_discovery.h"
+#include "distance.h"
 #include "logger.h"
 #include "network.h"
 #include "ping.h"
 #include "util.h"
 
 #include <assert.h>
+#include <pthread.h>
 
 /* The timeout after which a node is discarded completely. */
 #define KILL_NODE_TIMEOUT (BAD_NODE_TIMEOUT + PING_INTERVAL)
@@ -76,6 +78,9 @@
 
 #define ASSOC_COUNT 2
 
+/* Initial number of slots of the friends index. */
+#define DHT_FRIENDS_INDEX_MIN_SIZE 16
+
 /* Compares pk1 and pk2 with pk.
  *
  *  return 0 if both are same distance.
@@ -84,47 +89,176 @@
  */
 int id_closest(const uint8_t *pk, const uint8_t *pk1, const uint8_t *pk2)
 {
-    for (size_t i = 0; i < CRYPTO_PUBLIC_KEY_SIZE; ++i) {
+    switch (pk_distance_cmp(pk, pk1, pk2)) {
+        case -1:
+            return 1;
 
-        uint8_t distance1 = pk[i] ^ pk1[i];
-        uint8_t distance2 = pk[i] ^ pk2[i];
+        case 1:
+            return 2;
+    }
 
-        if (distance1 < distance2) {
-            return 1;
+    return 0;
+}
+
+/* Return the index of the k-bucket public_key falls into in a close list
+ * centred on self_public_key.
+ */
+static unsigned int close_bucket_index(const uint8_t *self_public_key, const uint8_t *public_key)
+{
+    unsigned int index = pk_common_prefix(public_key, self_public_key);
+
+    if (index >= LCLIENT_LENGTH) {
+        index = LCLIENT_LENGTH - 1;
+    }
+
+    return index;
+}
+
+int shared_keys_init(Shared_Keys *shared_keys, uint32_t size)
+{
+    uint32_t num_slots = 1;
+
+    while (num_slots * MAX_KEYS_PER_SLOT < size) {
+        if (num_slots > UINT32_MAX / (MAX_KEYS_PER_SLOT * 2)) {
+            return -1;
         }
 
-        if (distance1 > distance2) {
-            return 2;
+        num_slots *= 2;
+    }
+
+    Shared_Key *keys = (Shared_Key *)calloc(num_slots * MAX_KEYS_PER_SLOT, sizeof(Shared_Key));
+
+    if (keys == NULL) {
+        return -1;
+    }
+
+    memset(shared_keys, 0, sizeof(Shared_Keys));
+    shared_keys->keys = keys;
+    shared_keys->num_slots = num_slots;
+    random_bytes((uint8_t *)shared_keys->hash_key, sizeof(shared_keys->hash_key));
+    return 0;
+}
+
+void shared_keys_free(Shared_Keys *shared_keys)
+{
+    if (shared_keys->keys != NULL) {
+        crypto_memzero(shared_keys->keys, shared_keys->num_slots * MAX_KEYS_PER_SLOT * sizeof(Shared_Key));
+        free(shared_keys->keys);
+    }
+
+    crypto_memzero(shared_keys, sizeof(Shared_Keys));
+}
+
+int shared_keys_resize(Shared_Keys *shared_keys, uint32_t size)
+{
+    return shared_keys_resize_all(&shared_keys, 1, size);
+}
+
+int shared_keys_resize_all(Shared_Keys *const *caches, uint32_t count, uint32_t size)
+{
+    VLA(Shared_Keys, resized, count);
+
+    /* Allocate all the new caches before touching any of the old ones. */
+    for (uint32_t i = 0; i < count; ++i) {
+        if (shared_keys_init(&resized[i], size) != 0) {
+            while (i > 0) {
+                --i;
+                shared_keys_free(&resized[i]);
+            }
+
+            return -1;
         }
     }
 
+    for (uint32_t i = 0; i < count; ++i) {
+        resized[i].hits = caches[i]->hits;
+        resized[i].misses = caches[i]->misses;
+        resized[i].evictions = caches[i]->evictions;
+        shared_keys_free(caches[i]);
+        *caches[i] = resized[i];
+    }
+
     return 0;
 }
 
-/* Return index of first unequal bit number.
+void shared_keys_add_stats(const Shared_Keys *shared_keys, Shared_Keys_Stats *stats)
+{
+    stats->hits += shared_keys->hits;
+    stats->misses += shared_keys->misses;
+    stats->evictions += shared_keys->evictions;
+}
+
+void shared_keys_reset_stats(Shared_Keys *shared_keys)
+{
+    shared_keys->hits = 0;
+    shared_keys->misses = 0;
+    shared_keys->evictions = 0;
+}
+
+static uint32_t shared_keys_slot(const Shared_Keys *shared_keys, const uint8_t *public_key)
+{
+    return hash_public_key(shared_keys->hash_key, public_key) & (shared_keys->num_slots - 1);
+}
+
+/* Copy the key for public_key into shared_key if it is in shared_keys.
+ *
+ * return true if it was.
  */
-static unsigned int bit_by_bit_cmp(const uint8_t *pk1, const uint8_t *pk2)
+static bool shared_keys_lookup(Shared_Keys *shared_keys, uint8_t *shared_key, const uint8_t *public_key)
 {
-    unsigned int i;
-    unsigned int j = 0;
+    Shared_Key *slot = &shared_keys->keys[shared_keys_slot(shared_keys, public_key) * MAX_KEYS_PER_SLOT];
 
-    for (i = 0; i < CRYPTO_PUBLIC_KEY_SIZE; ++i) {
-        if (pk1[i] == pk2[i]) {
-            continue;
+    for (uint32_t i = 0; i < MAX_KEYS_PER_SLOT; ++i) {
+        Shared_Key *key = &slot[i];
+
+        if (key->stored && id_equal(public_key, key->public_key)) {
+            memcpy(shared_key, key->shared_key, CRYPTO_SHARED_KEY_SIZE);
+            key->last_used = shared_keys->clock;
+            ++shared_keys->hits;
+            return true;
         }
+    }
 
-        for (j = 0; j < 8; ++j) {
-            uint8_t mask = 1 << (7 - j);
+    return false;
+}
 
-            if ((pk1[i] & mask) != (pk2[i] & mask)) {
-                break;
+/* Store shared_key for public_key in shared_keys, evicting the least recently
+ * used key of its slot if the slot is full.
+ */
+static void shared_keys_store(Shared_Keys *shared_keys, const uint8_t *public_key, const uint8_t *shared_key)
+{
+    Shared_Key *slot = &shared_keys->keys[shared_keys_slot(shared_keys, public_key) * MAX_KEYS_PER_SLOT];
+    Shared_Key *victim = NULL;
+
+    for (uint32_t i = 0; i < MAX_KEYS_PER_SLOT; ++i) {
+        Shared_Key *key = &slot[i];
+
+        if (!key->stored) {
+            if (victim == NULL || victim->stored) {
+                victim = key;
             }
+
+            continue;
+        }
+
+        if (id_equal(public_key, key->public_key)) {
+            victim = key;
+            break;
+        }
+
+        if (victim == NULL || (victim->stored && key->last_used < victim->last_used)) {
+            victim = key;
         }
+    }
 
-        break;
+    if (victim->stored && !id_equal(public_key, victim->public_key)) {
+        ++shared_keys->evictions;
     }
 
-    return i * 8 + j;
+    victim->stored = 1;
+    victim->last_used = shared_keys->clock;
+    memcpy(victim->public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    memcpy(victim->shared_key, shared_key, CRYPTO_SHARED_KEY_SIZE);
 }
 
 /* Shared key generations are costly, it is therefor smart to store commonly used
@@ -135,46 +269,21 @@ static unsigned int bit_by_bit_cmp(const uint8_t *pk1, const uint8_t *pk2)
  */
 void get_shared_key(Shared_Keys *shared_keys, uint8_t *shared_key, const uint8_t *secret_key, const uint8_t *public_key)
 {
-    uint32_t num = ~0;
-    uint32_t curr = 0;
+    if (shared_keys->keys == NULL) {
+        ++shared_keys->misses;
+        encrypt_precompute(public_key, secret_key, shared_key);
+        return;
+    }
 
-    for (uint32_t i = 0; i < MAX_KEYS_PER_SLOT; ++i) {
-        int index = public_key[30] * MAX_KEYS_PER_SLOT + i;
-        Shared_Key *key = &shared_keys->keys[index];
-
-        if (key->stored) {
-            if (id_equal(public_key, key->public_key)) {
-                memcpy(shared_key, key->shared_key, CRYPTO_SHARED_KEY_SIZE);
-                ++key->times_requested;
-                key->time_last_requested = unix_time();
-                return;
-            }
+    ++shared_keys->clock;
 
-            if (num != 0) {
-                if (is_timeout(key->time_last_requested, KEYS_TIMEOUT)) {
-                    num = 0;
-                    curr = index;
-                } else if (num > key->times_requested) {
-                    num = key->times_requested;
-                    curr = index;
-                }
-            }
-        } else if (num != 0) {
-            num = 0;
-            curr = index;
-        }
+    if (shared_keys_lookup(shared_keys, shared_key, public_key)) {
+        return;
     }
 
+    ++shared_keys->misses;
     encrypt_precompute(public_key, secret_key, shared_key);
-
-    if (num != (uint32_t)~0) {
-        Shared_Key *key = &shared_keys->keys[curr];
-        key->stored = 1;
-        key->times_requested = 1;
-        memcpy(key->public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
-        memcpy(key->shared_key, shared_key, CRYPTO_SHARED_KEY_SIZE);
-        key->time_last_requested = unix_time();
-    }
+    shared_keys_store(shared_keys, public_key, shared_key);
 }
 
 /* Copy shared_key to encrypt/decrypt DHT packet from public_key into shared_key
@@ -193,6 +302,369 @@ void DHT_get_shared_key_sent(DHT *dht, uint8_t *shared_key, const uint8_t *publi
     get_shared_key(&dht->shared_keys_sent, shared_key, dht->self_secret_key, public_key);
 }
 
+/* A received packet waiting for the shared key of its sender. */
+typedef struct Parked_Packet {
+    struct Parked_Packet *next;
+
+    /* function is set to NULL when the packet is dropped. */
+    packet_handler_callback function;
+    void *object;
+    IP_Port source;
+    uint16_t length;
+    uint8_t packet[MAX_UDP_PACKET_SIZE];
+} Parked_Packet;
+
+/* The shared key of a peer being computed, and the packets waiting for it. */
+typedef struct Shared_Key_Job {
+    struct Shared_Key_Job *next;
+    struct Shared_Key_Job *pending_next;
+
+    Shared_Keys *shared_keys;
+    uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t secret_key[CRYPTO_SECRET_KEY_SIZE];
+    uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
+
+    Parked_Packet *packets;
+    Parked_Packet *packets_tail;
+} Shared_Key_Job;
+
+typedef struct {
+    struct Shared_Key_Pool *pool;
+    pthread_t thread;
+} Shared_Key_Worker;
+
+/* Jobs go from todo to a worker to done, all protected by mutex. The workers
+ * only touch the keys of a job.
+ *
+ * pending links all the jobs not handed back yet, so that packets from a peer
+ * whose key is already being computed wait for the same job. It, the packets
+ * of the jobs and the counters are only touched by the thread running do_DHT().
+ */
+struct Shared_Key_Pool {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool stop;
+
+    Shared_Key_Worker workers[SHARED_KEY_MAX_WORKERS];
+    uint16_t num_workers;
+
+    Shared_Key_Job *todo_head;
+    Shared_Key_Job *todo_tail;
+    Shared_Key_Job *done_head;
+    Shared_Key_Job *done_tail;
+
+    Shared_Key_Job *pending;
+    uint32_t num_jobs;
+    uint32_t num_packets;
+};
+
+static void push_shared_key_job(Shared_Key_Job **head, Shared_Key_Job **tail, Shared_Key_Job *job)
+{
+    job->next = NULL;
+
+    if (*tail == NULL) {
+        *head = job;
+    } else {
+        (*tail)->next = job;
+    }
+
+    *tail = job;
+}
+
+static Shared_Key_Job *pop_shared_key_job(Shared_Key_Job **head, Shared_Key_Job **tail)
+{
+    Shared_Key_Job *job = *head;
+
+    if (job != NULL) {
+        *head = job->next;
+
+        if (*head == NULL) {
+            *tail = NULL;
+        }
+    }
+
+    return job;
+}
+
+static void free_shared_key_job(Shared_Key_Pool *pool, Shared_Key_Job *job)
+{
+    Parked_Packet *parked = job->packets;
+
+    while (parked != NULL) {
+        Parked_Packet *next = parked->next;
+        free(parked);
+        --pool->num_packets;
+        parked = next;
+    }
+
+    crypto_memzero(job->secret_key, sizeof(job->secret_key));
+    crypto_memzero(job->shared_key, sizeof(job->shared_key));
+    free(job);
+    --pool->num_jobs;
+}
+
+static void *shared_key_worker(void *arg)
+{
+    Shared_Key_Worker *worker = (Shared_Key_Worker *)arg;
+    Shared_Key_Pool *pool = worker->pool;
+
+    pthread_mutex_lock(&pool->mutex);
+
+    while (!pool->stop) {
+        Shared_Key_Job *job = pop_shared_key_job(&pool->todo_head, &pool->todo_tail);
+
+        if (job == NULL) {
+            pthread_cond_wait(&pool->cond, &pool->mutex);
+            continue;
+        }
+
+        pthread_mutex_unlock(&pool->mutex);
+
+        encrypt_precompute(job->public_key, job->secret_key, job->shared_key);
+
+        pthread_mutex_lock(&pool->mutex);
+        push_shared_key_job(&pool->done_head, &pool->done_tail, job);
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+static void stop_shared_key_workers(Shared_Key_Pool *pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (uint16_t i = 0; i < pool->num_workers; ++i) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+
+    pool->num_workers = 0;
+}
+
+int DHT_start_key_workers(DHT *dht, uint16_t num_threads)
+{
+    if (dht->key_pool != NULL || num_threads == 0 || num_threads > SHARED_KEY_MAX_WORKERS) {
+        return -1;
+    }
+
+    Shared_Key_Pool *pool = (Shared_Key_Pool *)calloc(1, sizeof(Shared_Key_Pool));
+
+    if (pool == NULL) {
+        return -1;
+    }
+
+    if (pthread_mutex_init(&pool->mutex, NULL) != 0) {
+        free(pool);
+        return -1;
+    }
+
+    if (pthread_cond_init(&pool->cond, NULL) != 0) {
+        pthread_mutex_destroy(&pool->mutex);
+        free(pool);
+        return -1;
+    }
+
+    for (uint16_t i = 0; i < num_threads; ++i) {
+        pool->workers[i].pool = pool;
+
+        if (pthread_create(&pool->workers[i].thread, NULL, shared_key_worker, &pool->workers[i]) != 0) {
+            stop_shared_key_workers(pool);
+            pthread_cond_destroy(&pool->cond);
+            pthread_mutex_destroy(&pool->mutex);
+            free(pool);
+            return -1;
+        }
+
+        ++pool->num_workers;
+    }
+
+    dht->key_pool = pool;
+    return 0;
+}
+
+void DHT_stop_key_workers(DHT *dht)
+{
+    Shared_Key_Pool *pool = dht->key_pool;
+
+    if (pool == NULL) {
+        return;
+    }
+
+    stop_shared_key_workers(pool);
+
+    /* With the workers gone every job is either still to do or done. */
+    Shared_Key_Job *job;
+
+    while ((job = pop_shared_key_job(&pool->todo_head, &pool->todo_tail)) != NULL) {
+        free_shared_key_job(pool, job);
+    }
+
+    while ((job = pop_shared_key_job(&pool->done_head, &pool->done_tail)) != NULL) {
+        free_shared_key_job(pool, job);
+    }
+
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool);
+    dht->key_pool = NULL;
+}
+
+/* Park the packet until the workers computed the key for public_key. If the
+ * key is already being computed the packet waits for that job.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+static int park_packet(DHT *dht, Shared_Keys *shared_keys, const uint8_t *public_key, IP_Port source,
+                       const uint8_t *packet, uint16_t length, packet_handler_callback cb, void *object)
+{
+    Shared_Key_Pool *pool = dht->key_pool;
+
+    if (pool->num_packets >= SHARED_KEY_MAX_PENDING || length > MAX_UDP_PACKET_SIZE) {
+        return -1;
+    }
+
+    Shared_Key_Job *job = pool->pending;
+
+    while (job != NULL && !(job->shared_keys == shared_keys && id_equal(job->public_key, public_key))) {
+        job = job->pending_next;
+    }
+
+    Parked_Packet *parked = (Parked_Packet *)malloc(sizeof(Parked_Packet));
+
+    if (parked == NULL) {
+        return -1;
+    }
+
+    parked->next = NULL;
+    parked->function = cb;
+    parked->object = object;
+    parked->source = source;
+    parked->length = length;
+    memcpy(parked->packet, packet, length);
+    ++pool->num_packets;
+
+    if (job != NULL) {
+        job->packets_tail->next = parked;
+        job->packets_tail = parked;
+        return 0;
+    }
+
+    job = (Shared_Key_Job *)malloc(sizeof(Shared_Key_Job));
+
+    if (job == NULL) {
+        free(parked);
+        --pool->num_packets;
+        return -1;
+    }
+
+    job->shared_keys = shared_keys;
+    memcpy(job->public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    memcpy(job->secret_key, dht->self_secret_key, CRYPTO_SECRET_KEY_SIZE);
+    job->packets = parked;
+    job->packets_tail = parked;
+    job->pending_next = pool->pending;
+    pool->pending = job;
+    ++pool->num_jobs;
+
+    pthread_mutex_lock(&pool->mutex);
+    push_shared_key_job(&pool->todo_head, &pool->todo_tail, job);
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+    return 0;
+}
+
+int DHT_get_shared_key_async(DHT *dht, Shared_Keys *shared_keys, uint8_t *shared_key, const uint8_t *public_key,
+                             IP_Port source, const uint8_t *packet, uint16_t length, packet_handler_callback cb, void *object)
+{
+    if (dht->key_pool == NULL || shared_keys->keys == NULL) {
+        get_shared_key(shared_keys, shared_key, dht->self_secret_key, public_key);
+        return 0;
+    }
+
+    ++shared_keys->clock;
+
+    if (shared_keys_lookup(shared_keys, shared_key, public_key)) {
+        return 0;
+    }
+
+    ++shared_keys->misses;
+
+    if (park_packet(dht, shared_keys, public_key, source, packet, length, cb, object) == 0) {
+        return 1;
+    }
+
+    encrypt_precompute(public_key, dht->self_secret_key, shared_key);
+    shared_keys_store(shared_keys, public_key, shared_key);
+    return 0;
+}
+
+void DHT_drop_parked_packets(DHT *dht, void *object)
+{
+    Shared_Key_Pool *pool = dht->key_pool;
+
+    if (pool == NULL) {
+        return;
+    }
+
+    for (Shared_Key_Job *job = pool->pending; job != NULL; job = job->pending_next) {
+        for (Parked_Packet *parked = job->packets; parked != NULL; parked = parked->next) {
+            if (parked->object == object) {
+                parked->function = NULL;
+            }
+        }
+    }
+}
+
+static void unlink_pending_job(Shared_Key_Pool *pool, const Shared_Key_Job *job)
+{
+    Shared_Key_Job **link = &pool->pending;
+
+    while (*link != job) {
+        link = &(*link)->pending_next;
+    }
+
+    *link = job->pending_next;
+}
+
+/* Store the keys computed by the workers and hand their packets back to the
+ * handlers that parked them.
+ */
+static void do_parked_packets(DHT *dht)
+{
+    Shared_Key_Pool *pool = dht->key_pool;
+
+    if (pool == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    Shared_Key_Job *job = pool->done_head;
+    pool->done_head = NULL;
+    pool->done_tail = NULL;
+    pthread_mutex_unlock(&pool->mutex);
+
+    while (job != NULL) {
+        Shared_Key_Job *next = job->next;
+        shared_keys_store(job->shared_keys, job->public_key, job->shared_key);
+
+        /* The job stays pending meanwhile so that the handlers can still drop
+         * the packets after theirs. */
+        for (Parked_Packet *parked = job->packets; parked != NULL; parked = parked->next) {
+            if (parked->function != NULL) {
+                parked->function(parked->object, parked->source, parked->packet, parked->length, NULL);
+            }
+        }
+
+        unlink_pending_job(pool, job);
+        free_shared_key_job(pool, job);
+        job = next;
+    }
+}
+
 #define CRYPTO_SIZE 1 + CRYPTO_PUBLIC_KEY_SIZE * 2 + CRYPTO_NONCE_SIZE
 
 /* Create a request to peer.
@@ -554,14 +1026,110 @@ static uint32_t index_of_client_pk(const Client_data *array, uint32_t size, cons
     INDEX_OF_PK
 }
 
-static uint32_t index_of_friend_pk(const DHT_Friend *array, uint32_t size, const uint8_t *pk)
+/* Return the slot of the friends index holding public_key, or the empty slot
+ * where it would be inserted.
+ */
+static uint32_t friends_index_slot(const DHT *dht, const uint8_t *public_key)
+{
+    const uint32_t mask = dht->friends_index_size - 1;
+    uint32_t slot = hash_public_key(dht->friends_hash_key, public_key) & mask;
+
+    while (dht->friends_index[slot] != 0
+            && !id_equal(dht->friends_list[dht->friends_index[slot] - 1].public_key, public_key)) {
+        slot = (slot + 1) & mask;
+    }
+
+    return slot;
+}
+
+/* Find the index of the friend with public_key in friends_list.
+ *
+ * return index or UINT32_MAX if not found.
+ */
+static uint32_t index_of_friend_pk(const DHT *dht, const uint8_t *public_key)
+{
+    if (dht->friends_index == NULL) {
+        return UINT32_MAX;
+    }
+
+    const uint32_t slot = friends_index_slot(dht, public_key);
+
+    if (dht->friends_index[slot] == 0) {
+        return UINT32_MAX;
+    }
+
+    return dht->friends_index[slot] - 1;
+}
+
+/* Reallocate the friends index with size slots and insert all the friends of
+ * friends_list into it.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+static int friends_index_resize(DHT *dht, uint32_t size)
+{
+    uint32_t *friends_index = (uint32_t *)calloc(size, sizeof(uint32_t));
+
+    if (friends_index == NULL) {
+        return -1;
+    }
+
+    free(dht->friends_index);
+    dht->friends_index = friends_index;
+    dht->friends_index_size = size;
+
+    for (uint32_t i = 0; i < dht->num_friends; ++i) {
+        dht->friends_index[friends_index_slot(dht, dht->friends_list[i].public_key)] = i + 1;
+    }
+
+    return 0;
+}
+
+/* Remove public_key from the friends index, shifting back the entries after
+ * it so that no probe sequence is broken.
+ */
+static void friends_index_remove(DHT *dht, const uint8_t *public_key)
+{
+    const uint32_t mask = dht->friends_index_size - 1;
+    uint32_t hole = friends_index_slot(dht, public_key);
+    uint32_t slot = hole;
+
+    dht->friends_index[hole] = 0;
+
+    while (dht->friends_index[slot = (slot + 1) & mask] != 0) {
+        const uint8_t *key = dht->friends_list[dht->friends_index[slot] - 1].public_key;
+        const uint32_t home = hash_public_key(dht->friends_hash_key, key) & mask;
+
+        /* Move the entry into the hole unless its home slot is cyclically in (hole, slot]. */
+        if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+            dht->friends_index[hole] = dht->friends_index[slot];
+            dht->friends_index[slot] = 0;
+            hole = slot;
+        }
+    }
+}
+
+static uint32_t index_of_node_pk(const Node_format *array, uint32_t size, const uint8_t *pk)
 {
     INDEX_OF_PK
 }
 
-static uint32_t index_of_node_pk(const Node_format *array, uint32_t size, const uint8_t *pk)
+/* Find index of Client_data in the close list with public_key equal to pk.
+ * Only the k-bucket pk belongs to is searched.
+ *
+ *  return index or UINT32_MAX if not found.
+ */
+static uint32_t index_of_close_pk(const DHT *dht, const uint8_t *pk)
 {
-    INDEX_OF_PK
+    const unsigned int bucket = close_bucket_index(dht->self_public_key, pk);
+    const uint32_t index = index_of_client_pk(dht->close_clientlist + bucket * LCLIENT_NODES, LCLIENT_NODES, pk);
+
+    if (index == UINT32_MAX) {
+        return UINT32_MAX;
+    }
+
+    return bucket * LCLIENT_NODES + index;
 }
 
 /* Find index of Client_data with ip_port equal to param ip_port.
@@ -582,7 +1150,7 @@ static uint32_t index_of_client_ip_port(const Client_data *array, uint32_t size,
 
 /* Update ip_port of client if it's needed.
  */
-static void update_client(Logger *log, int index, Client_data *client, IP_Port ip_port)
+static void update_client(const Mono_Time *mono_time, Logger *log, int index, Client_data *client, IP_Port ip_port)
 {
     IPPTsPng *assoc;
     int ip_version;
@@ -612,25 +1180,66 @@ static void update_client(Logger *log, int index, Client_data *client, IP_Port i
     }
 
     assoc->ip_port = ip_port;
-    assoc->timestamp = unix_time();
+    assoc->timestamp = mono_time_get(mono_time);
+}
+
+/* Friend client lists are kept ordered by distance to the public key of the
+ * friend, furthest node first and closest node last. Entries are inserted in
+ * place with a binary search instead of sorting the whole list.
+ */
+
+/* Return the position at which public_key has to be inserted in the ordered
+ * list of length entries.
+ */
+static uint32_t client_list_position(const Client_data *list, uint32_t length, const uint8_t *public_key,
+                                     const uint8_t *comp_public_key)
+{
+    uint32_t low = 0;
+    uint32_t high = length;
+
+    while (low < high) {
+        const uint32_t mid = low + (high - low) / 2;
+
+        if (id_closest(comp_public_key, list[mid].public_key, public_key) == 1) {
+            high = mid;
+        } else {
+            low = mid + 1;
+        }
+    }
+
+    return low;
+}
+
+/* Move the entry at index of the ordered list to the position its public key
+ * belongs to.
+ */
+static void client_list_reposition(Client_data *list, uint32_t length, uint32_t index, const uint8_t *comp_public_key)
+{
+    const Client_data client = list[index];
+    memmove(&list[index], &list[index + 1], (length - index - 1) * sizeof(Client_data));
+
+    const uint32_t pos = client_list_position(list, length - 1, client.public_key, comp_public_key);
+    memmove(&list[pos + 1], &list[pos], (length - 1 - pos) * sizeof(Client_data));
+    list[pos] = client;
 }
 
 /* Check if client with public_key is already in list of length length.
  * If it is then set its corresponding timestamp to current time.
  * If the id is already in the list with a different ip_port, update it.
- * TODO(irungentoo): Maybe optimize this.
+ * If comp_public_key is not NULL, list is ordered by distance to it and a client
+ * taking over the ip_port of another one is moved to its position.
  *
  *  return True(1) or False(0)
  */
-static int client_or_ip_port_in_list(Logger *log, Client_data *list, uint16_t length, const uint8_t *public_key,
-                                     IP_Port ip_port)
+static int client_or_ip_port_in_list(const Mono_Time *mono_time, Logger *log, Client_data *list, uint16_t length,
+                                     const uint8_t *public_key, IP_Port ip_port, const uint8_t *comp_public_key)
 {
-    uint64_t temp_time = unix_time();
+    uint64_t temp_time = mono_time_get(mono_time);
     uint32_t index = index_of_client_pk(list, length, public_key);
 
     /* if public_key is in list, find it and maybe overwrite ip_port */
     if (index != UINT32_MAX) {
-        update_client(log, index, &list[index], ip_port);
+        update_client(mono_time, log, index, &list[index], ip_port);
         return 1;
     }
 
@@ -664,33 +1273,93 @@ static int client_or_ip_port_in_list(Logger *log, Client_data *list, uint16_t le
 
     /* kill the other address, if it was set */
     memset(assoc, 0, sizeof(IPPTsPng));
+
+    if (comp_public_key != NULL) {
+        client_list_reposition(list, length, index, comp_public_key);
+    }
+
     return 1;
 }
 
+/* Same as client_or_ip_port_in_list() for the close list.
+ *
+ * The close list is split in k-buckets, so a public_key can only be updated in
+ * place by an entry with the same ip_port if it lives in the same bucket. An
+ * entry in another bucket is dropped instead and the node gets re-added to the
+ * right bucket by add_to_close().
+ *
+ *  return True(1) or False(0)
+ */
+static int client_or_ip_port_in_close_list(DHT *dht, const uint8_t *public_key, IP_Port ip_port)
+{
+    uint32_t index = index_of_close_pk(dht, public_key);
+
+    if (index != UINT32_MAX) {
+        update_client(dht->mono_time, dht->log, index, &dht->close_clientlist[index], ip_port);
+        return 1;
+    }
+
+    index = index_of_client_ip_port(dht->close_clientlist, LCLIENT_LIST, &ip_port);
+
+    if (index == UINT32_MAX) {
+        return 0;
+    }
+
+    const unsigned int bucket = close_bucket_index(dht->self_public_key, public_key);
+
+    if (index / LCLIENT_NODES == bucket) {
+        return client_or_ip_port_in_list(dht->mono_time, dht->log, dht->close_clientlist + bucket * LCLIENT_NODES,
+                                         LCLIENT_NODES, public_key, ip_port, NULL);
+    }
+
+    LOGGER_DEBUG(dht->log, "coipil[%u]: dropping public_key, new one belongs in bucket %u", index, bucket);
+    memset(&dht->close_clientlist[index], 0, sizeof(Client_data));
+    return 0;
+}
+
 /* Add node to the node list making sure only the nodes closest to cmp_pk are in the list.
+ *
+ * prefixes holds the number of leading bits every node in the list has in common
+ * with cmp_pk and pk_prefix the one of pk, so that most keys can be compared by
+ * their prefix alone. It is kept up to date with the list.
  */
-bool add_to_list(Node_format *nodes_list, unsigned int length, const uint8_t *pk, IP_Port ip_port,
-                 const uint8_t *cmp_pk)
+static bool add_to_list_prefixed(Node_format *nodes_list, uint16_t *prefixes, unsigned int length, const uint8_t *pk,
+                                 uint16_t pk_prefix, IP_Port ip_port, const uint8_t *cmp_pk)
 {
-    uint8_t pk_bak[CRYPTO_PUBLIC_KEY_SIZE];
-    IP_Port ip_port_bak;
+    Node_format node;
+    memcpy(node.public_key, pk, CRYPTO_PUBLIC_KEY_SIZE);
+    node.ip_port = ip_port;
+    uint16_t prefix = pk_prefix;
+    bool added = 0;
 
+    /* The node that gets replaced is further than the ones before it, so it is
+     * put back in the rest of the list. */
     for (size_t i = 0; i < length; ++i) {
-        if (id_closest(cmp_pk, nodes_list[i].public_key, pk) == 2) {
-            memcpy(pk_bak, nodes_list[i].public_key, CRYPTO_PUBLIC_KEY_SIZE);
-            ip_port_bak = nodes_list[i].ip_port;
-            memcpy(nodes_list[i].public_key, pk, CRYPTO_PUBLIC_KEY_SIZE);
-            nodes_list[i].ip_port = ip_port;
-
-            if (i != (length - 1)) {
-                add_to_list(nodes_list, length, pk_bak, ip_port_bak, cmp_pk);
-            }
-
-            return 1;
+        if (prefix < prefixes[i]
+                || (prefix == prefixes[i] && id_closest(cmp_pk, nodes_list[i].public_key, node.public_key) != 2)) {
+            continue;
         }
+
+        const Node_format replaced = nodes_list[i];
+        const uint16_t replaced_prefix = prefixes[i];
+        nodes_list[i] = node;
+        prefixes[i] = prefix;
+        node = replaced;
+        prefix = replaced_prefix;
+        added = 1;
     }
 
-    return 0;
+    return added;
+}
+
+/* Add node to the node list making sure only the nodes closest to cmp_pk are in the list.
+ */
+bool add_to_list(Node_format *nodes_list, unsigned int length, const uint8_t *pk, IP_Port ip_port,
+                 const uint8_t *cmp_pk)
+{
+    VLA(uint16_t, prefixes, length);
+    pk_common_prefix_batch(cmp_pk, nodes_list[0].public_key, sizeof(Node_format), length, prefixes);
+    return add_to_list_prefixed(nodes_list, prefixes, length, pk, pk_common_prefix(cmp_pk, pk), ip_port, cmp_pk);
 }
 
 /* TODO(irungentoo): change this to 7 when done*/
@@ -705,10 +1374,27 @@ static uint8_t hardening_correct(const Hardening *h)
 {
     return h->routes_requests_ok + (h->send_nodes_ok << 1) + (h->testing_requests << 2);
 }
+
+/* Number of clients get_close_nodes_inner() computes the common prefixes of at once. */
+#define CLOSE_NODES_BATCH 32
+
+static uint16_t min_prefix(const uint16_t *prefixes, uint32_t count)
+{
+    uint16_t min = prefixes[0];
+
+    for (uint32_t i = 1; i < count; ++i) {
+        if (prefixes[i] < min) {
+            min = prefixes[i];
+        }
+    }
+
+    return min;
+}
+
 /*
  * helper for get_close_nodes(). argument list is a monster :D
  */
-static void get_close_nodes_inner(const uint8_t *public_key, Node_format *nodes_list,
+static void get_close_nodes_inner(const Mono_Time *mono_time, const uint8_t *public_key, Node_format *nodes_list,
                                   Family sa_family, const Client_data *client_list, uint32_t client_list_length,
                                   uint32_t *num_nodes_ptr, uint8_t is_LAN, uint8_t want_good)
 {
@@ -718,9 +1404,27 @@ static void get_close_nodes_inner(const uint8_t *public_key, Node_format *nodes_
 
     uint32_t num_nodes = *num_nodes_ptr;
 
+    /* The distances are compared by common prefix with public_key, computed
+     * for the whole list and a batch of clients at a time. */
+    uint16_t node_prefixes[MAX_SENT_NODES];
+    uint16_t client_prefixes[CLOSE_NODES_BATCH];
+    pk_common_prefix_batch(public_key, nodes_list[0].public_key, sizeof(Node_format), num_nodes, node_prefixes);
+
     for (uint32_t i = 0; i < client_list_length; i++) {
         const Client_data *client = &client_list[i];
 
+        if (i % CLOSE_NODES_BATCH == 0) {
+            const uint32_t count = MIN(client_list_length - i, CLOSE_NODES_BATCH);
+            pk_common_prefix_batch(public_key, client->public_key, sizeof(Client_data), count, client_prefixes);
+        }
+
+        const uint16_t prefix = client_prefixes[i % CLOSE_NODES_BATCH];
+
+        /* further than every node in a full list? */
+        if (num_nodes == MAX_SENT_NODES && prefix < min_prefix(node_prefixes, MAX_SENT_NODES)) {
+            continue;
+        }
+
         /* node already in list? */
         if (index_of_node_pk(nodes_list, MAX_SENT_NODES, client->public_key) != UINT32_MAX) {
             continue;
@@ -739,7 +1443,7 @@ static void get_close_nodes_inner(const uint8_t *public_key, Node_format *nodes_
         }
 
         /* node not in a good condition? */
-        if (is_timeout(ipptp->timestamp, BAD_NODE_TIMEOUT)) {
+        if (mono_time_is_timeout(mono_time, ipptp->timestamp, BAD_NODE_TIMEOUT)) {
             continue;
         }
 
@@ -756,15 +1460,50 @@ static void get_close_nodes_inner(const uint8_t *public_key, Node_format *nodes_
         if (num_nodes < MAX_SENT_NODES) {
             memcpy(nodes_list[num_nodes].public_key, client->public_key, CRYPTO_PUBLIC_KEY_SIZE);
             nodes_list[num_nodes].ip_port = ipptp->ip_port;
+            node_prefixes[num_nodes] = prefix;
             num_nodes++;
         } else {
-            add_to_list(nodes_list, MAX_SENT_NODES, client->public_key, ipptp->ip_port, public_key);
+            add_to_list_prefixed(nodes_list, node_prefixes, MAX_SENT_NODES, client->public_key, prefix, ipptp->ip_port,
+                                 public_key);
         }
     }
 
     *num_nodes_ptr = num_nodes;
 }
 
+/* Put the close list nodes closest to public_key into nodes_list.
+ *
+ * Rather than scanning the whole close list, k-buckets are visited in order of
+ * increasing distance to public_key: first the bucket public_key itself falls
+ * into, then all the buckets sharing a longer prefix with us (their nodes are
+ * all at the same distance prefix from public_key), then the buckets sharing a
+ * shorter prefix with us, longest first. Every group is strictly further than
+ * the previous one, so we can stop as soon as nodes_list is full.
+ */
+static void get_close_nodes_close_list(const DHT *dht, const uint8_t *public_key, Node_format *nodes_list,
+                                       Family sa_family, uint32_t *num_nodes_ptr, uint8_t is_LAN, uint8_t want_good)
+{
+    const unsigned int target = close_bucket_index(dht->self_public_key, public_key);
+
+    get_close_nodes_inner(dht->mono_time, public_key, nodes_list, sa_family,
+                          dht->close_clientlist + target * LCLIENT_NODES,
+                          LCLIENT_NODES, num_nodes_ptr, is_LAN, want_good);
+
+    if (*num_nodes_ptr >= MAX_SENT_NODES) {
+        return;
+    }
+
+    get_close_nodes_inner(dht->mono_time, public_key, nodes_list, sa_family,
+                          dht->close_clientlist + (target + 1) * LCLIENT_NODES,
+                          (LCLIENT_LENGTH - (target + 1)) * LCLIENT_NODES, num_nodes_ptr, is_LAN, want_good);
+
+    for (unsigned int bucket = target; bucket != 0 && *num_nodes_ptr < MAX_SENT_NODES; --bucket) {
+        get_close_nodes_inner(dht->mono_time, public_key, nodes_list, sa_family,
+                              dht->close_clientlist + (bucket - 1) * LCLIENT_NODES,
+                              LCLIENT_NODES, num_nodes_ptr, is_LAN, want_good);
+    }
+}
+
 /* Find MAX_SENT_NODES nodes closest to the public_key for the send nodes request:
  * put them in the nodes_list and return how many were found.
  *
@@ -777,8 +1516,7 @@ static int get_somewhat_close_nodes(const DHT *dht, const uint8_t *public_key, N
                                     Family sa_family, uint8_t is_LAN, uint8_t want_good)
 {
     uint32_t num_nodes = 0;
-    get_close_nodes_inner(public_key, nodes_list, sa_family,
-                          dht->close_clientlist, LCLIENT_LIST, &num_nodes, is_LAN, 0);
+    get_close_nodes_close_list(dht, public_key, nodes_list, sa_family, &num_nodes, is_LAN, 0);
 
     /* TODO(irungentoo): uncomment this when hardening is added to close friend clients */
 #if 0
@@ -792,7 +1530,7 @@ static int get_somewhat_close_nodes(const DHT *dht, const uint8_t *public_key, N
 #endif
 
     for (uint32_t i = 0; i < dht->num_friends; ++i) {
-        get_close_nodes_inner(public_key, nodes_list, sa_family,
+        get_close_nodes_inner(dht->mono_time, public_key, nodes_list, sa_family,
                               dht->friends_list[i].client_list, MAX_FRIEND_CLIENTS,
                               &num_nodes, is_LAN, 0);
     }
@@ -807,94 +1545,46 @@ int get_close_nodes(const DHT *dht, const uint8_t *public_key, Node_format *node
     return get_somewhat_close_nodes(dht, public_key, nodes_list, sa_family, is_LAN, want_good);
 }
 
-typedef struct {
-    const uint8_t *base_public_key;
-    Client_data entry;
-} DHT_Cmp_data;
-
-static int cmp_dht_entry(const void *a, const void *b)
-{
-    DHT_Cmp_data cmp1, cmp2;
-    memcpy(&cmp1, a, sizeof(DHT_Cmp_data));
-    memcpy(&cmp2, b, sizeof(DHT_Cmp_data));
-    Client_data entry1 = cmp1.entry;
-    Client_data entry2 = cmp2.entry;
-    const uint8_t *cmp_public_key = cmp1.base_public_key;
-
-#define ASSOC_TIMEOUT(assoc) is_timeout((assoc).timestamp, BAD_NODE_TIMEOUT)
-
-    bool t1 = ASSOC_TIMEOUT(entry1.assoc4) && ASSOC_TIMEOUT(entry1.assoc6);
-    bool t2 = ASSOC_TIMEOUT(entry2.assoc4) && ASSOC_TIMEOUT(entry2.assoc6);
-
-    if (t1 && t2) {
-        return 0;
-    }
-
-    if (t1) {
-        return -1;
-    }
-
-    if (t2) {
-        return 1;
-    }
-
-#define INCORRECT_HARDENING(assoc) hardening_correct(&(assoc).hardening) != HARDENING_ALL_OK
-
-    t1 = INCORRECT_HARDENING(entry1.assoc4) && INCORRECT_HARDENING(entry1.assoc6);
-    t2 = INCORRECT_HARDENING(entry2.assoc4) && INCORRECT_HARDENING(entry2.assoc6);
-
-    if (t1 && !t2) {
-        return -1;
-    }
-
-    if (!t1 && t2) {
-        return 1;
-    }
-
-    int close = id_closest(cmp_public_key, entry1.public_key, entry2.public_key);
-
-    if (close == 1) {
-        return 1;
-    }
-
-    if (close == 2) {
-        return -1;
-    }
-
-    return 0;
-}
-
 /* Is it ok to store node with public_key in client.
  *
  * return 0 if node can't be stored.
  * return 1 if it can.
  */
-static unsigned int store_node_ok(const Client_data *client, const uint8_t *public_key, const uint8_t *comp_public_key)
+static unsigned int store_node_ok(const Mono_Time *mono_time, const Client_data *client, const uint8_t *public_key,
+                                  const uint8_t *comp_public_key)
 {
-    return is_timeout(client->assoc4.timestamp, BAD_NODE_TIMEOUT) &&
-           is_timeout(client->assoc6.timestamp, BAD_NODE_TIMEOUT) ||
+    return mono_time_is_timeout(mono_time, client->assoc4.timestamp, BAD_NODE_TIMEOUT) &&
+           mono_time_is_timeout(mono_time, client->assoc6.timestamp, BAD_NODE_TIMEOUT) ||
            id_closest(comp_public_key, client->public_key, public_key) == 2;
 }
 
-static void sort_client_list(Client_data *list, unsigned int length, const uint8_t *comp_public_key)
+#define ASSOC_TIMEOUT(mono_time, assoc) mono_time_is_timeout(mono_time, (assoc).timestamp, BAD_NODE_TIMEOUT)
+#define INCORRECT_HARDENING(assoc) hardening_correct(&(assoc).hardening) != HARDENING_ALL_OK
+
+/* Return the index of the entry of the ordered list to replace first: the
+ * first bad node, else the furthest node that failed hardening, else the
+ * furthest node.
+ */
+static uint32_t client_list_victim(const Mono_Time *mono_time, const Client_data *list, uint32_t length)
 {
-    // Pass comp_public_key to qsort with each Client_data entry, so the
-    // comparison function can use it as the base of comparison.
-    VLA(DHT_Cmp_data, cmp_list, length);
+    uint32_t victim = UINT32_MAX;
 
-    for (uint32_t i = 0; i < length; i++) {
-        cmp_list[i].base_public_key = comp_public_key;
-        cmp_list[i].entry = list[i];
-    }
+    for (uint32_t i = 0; i < length; ++i) {
+        const Client_data *client = &list[i];
 
-    qsort(cmp_list, length, sizeof(DHT_Cmp_data), cmp_dht_entry);
+        if (ASSOC_TIMEOUT(mono_time, client->assoc4) && ASSOC_TIMEOUT(mono_time, client->assoc6)) {
+            return i;
+        }
 
-    for (uint32_t i = 0; i < length; i++) {
-        list[i] = cmp_list[i].entry;
+        if (victim == UINT32_MAX && INCORRECT_HARDENING(client->assoc4) && INCORRECT_HARDENING(client->assoc6)) {
+            victim = i;
+        }
     }
+
+    return victim == UINT32_MAX ? 0 : victim;
 }
 
-static void update_client_with_reset(Client_data *client, const IP_Port *ip_port)
+static void update_client_with_reset(const Mono_Time *mono_time, Client_data *client, const IP_Port *ip_port)
 {
     IPPTsPng *ipptp_write = NULL;
     IPPTsPng *ipptp_clear = NULL;
@@ -908,7 +1598,7 @@ static void update_client_with_reset(Client_data *client, const IP_Port *ip_port
     }
 
     ipptp_write->ip_port = *ip_port;
-    ipptp_write->timestamp = unix_time();
+    ipptp_write->timestamp = mono_time_get(mono_time);
 
     ip_reset(&ipptp_write->ret_ip_port.ip);
     ipptp_write->ret_ip_port.port = 0;
@@ -931,7 +1621,7 @@ static void update_client_with_reset(Client_data *client, const IP_Port *ip_port
  *  than public_key.
  *
  *  returns True(1) when the item was stored, False(0) otherwise */
-static int replace_all(Client_data    *list,
+static int replace_all(const Mono_Time *mono_time, Client_data    *list,
                        uint16_t        length,
                        const uint8_t  *public_key,
                        IP_Port         ip_port,
@@ -941,17 +1631,17 @@ static int replace_all(Client_data    *list,
         return 0;
     }
 
-    if (!store_node_ok(&list[1], public_key, comp_public_key) &&
-            !store_node_ok(&list[0], public_key, comp_public_key)) {
+    const uint32_t victim = client_list_victim(mono_time, list, length);
+
+    if (!store_node_ok(mono_time, &list[victim], public_key, comp_public_key)) {
         return 0;
     }
 
-    sort_client_list(list, length, comp_public_key);
-
-    Client_data *client = &list[0];
+    Client_data *client = &list[victim];
     id_copy(client->public_key, public_key);
 
-    update_client_with_reset(client, &ip_port);
+    update_client_with_reset(mono_time, client, &ip_port);
+    client_list_reposition(list, length, victim, comp_public_key);
     return 1;
 }
 
@@ -964,19 +1654,13 @@ static int replace_all(Client_data    *list,
  */
 static int add_to_close(DHT *dht, const uint8_t *public_key, IP_Port ip_port, bool simulate)
 {
-    unsigned int index = bit_by_bit_cmp(public_key, dht->self_public_key);
-
-    if (index >= LCLIENT_LENGTH) {
-        index = LCLIENT_LENGTH - 1;
-    }
+    const unsigned int index = close_bucket_index(dht->self_public_key, public_key);
 
     for (uint32_t i = 0; i < LCLIENT_NODES; ++i) {
-        /* TODO(iphydf): write bounds checking test to catch the case that
-         * index is left as >= LCLIENT_LENGTH */
         Client_data *client = &dht->close_clientlist[(index * LCLIENT_NODES) + i];
 
-        if (!is_timeout(client->assoc4.timestamp, BAD_NODE_TIMEOUT) ||
-                !is_timeout(client->assoc6.timestamp, BAD_NODE_TIMEOUT)) {
+        if (!mono_time_is_timeout(dht->mono_time, client->assoc4.timestamp, BAD_NODE_TIMEOUT) ||
+                !mono_time_is_timeout(dht->mono_time, client->assoc6.timestamp, BAD_NODE_TIMEOUT)) {
             continue;
         }
 
@@ -985,7 +1669,7 @@ static int add_to_close(DHT *dht, const uint8_t *public_key, IP_Port ip_port, bo
         }
 
         id_copy(client->public_key, public_key);
-        update_client_with_reset(client, &ip_port);
+        update_client_with_reset(dht->mono_time, client, &ip_port);
         return 0;
     }
 
@@ -999,8 +1683,13 @@ bool node_addable_to_close_list(DHT *dht, const uint8_t *public_key, IP_Port ip_
     return add_to_close(dht, public_key, ip_port, 1) == 0;
 }
 
-static bool is_pk_in_client_list(Client_data *list, unsigned int client_list_length, const uint8_t *public_key,
-                                 IP_Port ip_port)
+const Client_data *DHT_close_bucket(const DHT *dht, const uint8_t *public_key)
+{
+    return dht->close_clientlist + close_bucket_index(dht->self_public_key, public_key) * LCLIENT_NODES;
+}
+
+static bool is_pk_in_client_list(const Mono_Time *mono_time, Client_data *list, unsigned int client_list_length,
+                                 const uint8_t *public_key, IP_Port ip_port)
 {
     uint32_t index = index_of_client_pk(list, client_list_length, public_key);
 
@@ -1012,18 +1701,15 @@ static bool is_pk_in_client_list(Client_data *list, unsigned int client_list_len
                             &list[index].assoc4 :
                             &list[index].assoc6;
 
-    return !is_timeout(assoc->timestamp, BAD_NODE_TIMEOUT);
+    return !mono_time_is_timeout(mono_time, assoc->timestamp, BAD_NODE_TIMEOUT);
 }
 
 static bool is_pk_in_close_list(DHT *dht, const uint8_t *public_key, IP_Port ip_port)
 {
-    unsigned int index = bit_by_bit_cmp(public_key, dht->self_public_key);
-
-    if (index >= LCLIENT_LENGTH) {
-        index = LCLIENT_LENGTH - 1;
-    }
+    const unsigned int index = close_bucket_index(dht->self_public_key, public_key);
 
-    return is_pk_in_client_list(dht->close_clientlist + index * LCLIENT_NODES, LCLIENT_NODES, public_key, ip_port);
+    return is_pk_in_client_list(dht->mono_time, dht->close_clientlist + index * LCLIENT_NODES, LCLIENT_NODES,
+                                public_key, ip_port);
 }
 
 /* Check if the node obtained with a get_nodes with public_key should be pinged.
@@ -1053,6 +1739,8 @@ static unsigned int ping_node_from_getnodes_ok(DHT *dht, const uint8_t *public_k
             // TODO(irungentoo): ipv6 vs v4
             add_to_list(dht->to_bootstrap, MAX_CLOSE_TO_BOOTSTRAP_NODES, public_key, ip_port, dht->self_public_key);
         }
+
+        timer_start(dht->timers, dht->close_timer, 0);
     }
 
     for (uint32_t i = 0; i < dht->num_friends; ++i) {
@@ -1060,17 +1748,16 @@ static unsigned int ping_node_from_getnodes_ok(DHT *dht, const uint8_t *public_k
 
         DHT_Friend *dht_friend = &dht->friends_list[i];
 
-        if (store_node_ok(&dht_friend->client_list[1], public_key, dht_friend->public_key)) {
-            store_ok = 1;
-        }
+        const uint32_t victim = client_list_victim(dht->mono_time, dht_friend->client_list, MAX_FRIEND_CLIENTS);
 
-        if (store_node_ok(&dht_friend->client_list[0], public_key, dht_friend->public_key)) {
+        if (store_node_ok(dht->mono_time, &dht_friend->client_list[victim], public_key, dht_friend->public_key)) {
             store_ok = 1;
         }
 
         unsigned int *friend_num = &dht_friend->num_to_bootstrap;
         const uint32_t index = index_of_node_pk(dht_friend->to_bootstrap, *friend_num, public_key);
-        const bool pk_in_list = is_pk_in_client_list(dht_friend->client_list, MAX_FRIEND_CLIENTS, public_key, ip_port);
+        const bool pk_in_list = is_pk_in_client_list(dht->mono_time, dht_friend->client_list, MAX_FRIEND_CLIENTS,
+                                                     public_key, ip_port);
 
         if (store_ok && index == UINT32_MAX && !pk_in_list) {
             if (*friend_num < MAX_SENT_NODES) {
@@ -1082,6 +1769,7 @@ static unsigned int ping_node_from_getnodes_ok(DHT *dht, const uint8_t *public_k
                 add_to_list(dht_friend->to_bootstrap, MAX_SENT_NODES, public_key, ip_port, dht_friend->public_key);
             }
 
+            timer_start(dht->timers, dht_friend->timer, 0);
             ret = 1;
         }
     }
@@ -1107,22 +1795,22 @@ uint32_t addto_lists(DHT *dht, IP_Port ip_port, const uint8_t *public_key)
     /* NOTE: Current behavior if there are two clients with the same id is
      * to replace the first ip by the second.
      */
-    const bool in_close_list = client_or_ip_port_in_list(dht->log, dht->close_clientlist,
-                               LCLIENT_LIST, public_key, ip_port);
+    const bool in_close_list = client_or_ip_port_in_close_list(dht, public_key, ip_port);
 
     /* add_to_close should be called only if !in_list (don't extract to variable) */
     if (in_close_list || add_to_close(dht, public_key, ip_port, 0)) {
+        timer_start(dht->timers, dht->close_timer, 0);
         used++;
     }
 
     DHT_Friend *friend_foundip = 0;
 
     for (uint32_t i = 0; i < dht->num_friends; ++i) {
-        const bool in_list = client_or_ip_port_in_list(dht->log, dht->friends_list[i].client_list,
-                             MAX_FRIEND_CLIENTS, public_key, ip_port);
+        const bool in_list = client_or_ip_port_in_list(dht->mono_time, dht->log, dht->friends_list[i].client_list,
+                             MAX_FRIEND_CLIENTS, public_key, ip_port, dht->friends_list[i].public_key);
 
         /* replace_all should be called only if !in_list (don't extract to variable) */
-        if (in_list || replace_all(dht->friends_list[i].client_list, MAX_FRIEND_CLIENTS, public_key,
+        if (in_list || replace_all(dht->mono_time, dht->friends_list[i].client_list, MAX_FRIEND_CLIENTS, public_key,
                                    ip_port, dht->friends_list[i].public_key)) {
             DHT_Friend *dht_friend = &dht->friends_list[i];
 
@@ -1130,6 +1818,7 @@ uint32_t addto_lists(DHT *dht, IP_Port ip_port, const uint8_t *public_key)
                 friend_foundip = dht_friend;
             }
 
+            timer_start(dht->timers, dht_friend->timer, 0);
             used++;
         }
     }
@@ -1148,9 +1837,10 @@ uint32_t addto_lists(DHT *dht, IP_Port ip_port, const uint8_t *public_key)
     return used;
 }
 
-static bool update_client_data(Client_data *array, size_t size, IP_Port ip_port, const uint8_t *pk)
+static bool update_client_data(const Mono_Time *mono_time, Client_data *array, size_t size, IP_Port ip_port,
+                               const uint8_t *pk)
 {
-    uint64_t temp_time = unix_time();
+    uint64_t temp_time = mono_time_get(mono_time);
     uint32_t index = index_of_client_pk(array, size, pk);
 
     if (index == UINT32_MAX) {
@@ -1185,18 +1875,17 @@ static void returnedip_ports(DHT *dht, IP_Port ip_port, const uint8_t *public_ke
     }
 
     if (id_equal(public_key, dht->self_public_key)) {
-        update_client_data(dht->close_clientlist, LCLIENT_LIST, ip_port, nodepublic_key);
+        const unsigned int bucket = close_bucket_index(dht->self_public_key, nodepublic_key);
+        update_client_data(dht->mono_time, dht->close_clientlist + bucket * LCLIENT_NODES, LCLIENT_NODES, ip_port,
+                           nodepublic_key);
         return;
     }
 
-    for (uint32_t i = 0; i < dht->num_friends; ++i) {
-        if (id_equal(public_key, dht->friends_list[i].public_key)) {
-            Client_data *client_list = dht->friends_list[i].client_list;
+    const uint32_t friend_num = index_of_friend_pk(dht, public_key);
 
-            if (update_client_data(client_list, MAX_FRIEND_CLIENTS, ip_port, nodepublic_key)) {
-                return;
-            }
-        }
+    if (friend_num != UINT32_MAX) {
+        update_client_data(dht->mono_time, dht->friends_list[friend_num].client_list, MAX_FRIEND_CLIENTS, ip_port,
+                           nodepublic_key);
     }
 }
 
@@ -1221,9 +1910,9 @@ static int getnodes(DHT *dht, IP_Port ip_port, const uint8_t *public_key, const
 
     if (sendback_node != NULL) {
         memcpy(plain_message + sizeof(receiver), sendback_node, sizeof(Node_format));
-        ping_id = ping_array_add(&dht->dht_harden_ping_array, plain_message, sizeof(plain_message));
+        ping_id = ping_array_add(&dht->dht_harden_ping_array, dht->mono_time, plain_message, sizeof(plain_message));
     } else {
-        ping_id = ping_array_add(&dht->dht_ping_array, plain_message, sizeof(receiver));
+        ping_id = ping_array_add(&dht->dht_ping_array, dht->mono_time, plain_message, sizeof(receiver));
     }
 
     if (ping_id == 0) {
@@ -1313,7 +2002,11 @@ static int handle_getnodes(void *object, IP_Port source, const uint8_t *packet,
     uint8_t plain[CRYPTO_NODE_SIZE];
     uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
 
-    DHT_get_shared_key_recv(dht, shared_key, packet + 1);
+    if (DHT_get_shared_key_async(dht, &dht->shared_keys_recv, shared_key, packet + 1, source, packet, length,
+                                 &handle_getnodes, dht) != 0) {
+        return 0;
+    }
+
     int len = decrypt_data_symmetric(shared_key,
                                      packet + 1 + CRYPTO_PUBLIC_KEY_SIZE,
                                      packet + 1 + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_NONCE_SIZE,
@@ -1337,9 +2030,10 @@ static uint8_t sent_getnode_to_node(DHT *dht, const uint8_t *public_key, IP_Port
 {
     uint8_t data[sizeof(Node_format) * 2];
 
-    if (ping_array_check(data, sizeof(data), &dht->dht_ping_array, ping_id) == sizeof(Node_format)) {
+    if (ping_array_check(data, sizeof(data), &dht->dht_ping_array, dht->mono_time, ping_id) == sizeof(Node_format)) {
         memset(sendback_node, 0, sizeof(Node_format));
-    } else if (ping_array_check(data, sizeof(data), &dht->dht_harden_ping_array, ping_id) == sizeof(data)) {
+    } else if (ping_array_check(data, sizeof(data), &dht->dht_harden_ping_array, dht->mono_time, ping_id)
+               == sizeof(data)) {
         memcpy(sendback_node, data + sizeof(Node_format), sizeof(Node_format));
     } else {
         return 0;
@@ -1457,10 +2151,12 @@ static int handle_sendnodes_ipv6(void *object, IP_Port source, const uint8_t *pa
 /*----------------------------------------------------------------------------------*/
 /*------------------------END of packet handling functions--------------------------*/
 
+static void do_DHT_friend(void *object, uint32_t friend_num, void *userdata);
+
 int DHT_addfriend(DHT *dht, const uint8_t *public_key, void (*ip_callback)(void *data, int32_t number, IP_Port),
                   void *data, int32_t number, uint16_t *lock_count)
 {
-    uint32_t friend_num = index_of_friend_pk(dht->friends_list, dht->num_friends, public_key);
+    uint32_t friend_num = index_of_friend_pk(dht, public_key);
 
     uint16_t lock_num;
 
@@ -1484,9 +2180,25 @@ int DHT_addfriend(DHT *dht, const uint8_t *public_key, void (*ip_callback)(void
         return 0;
     }
 
+    /* Keep the friends index at most half full. */
+    if ((dht->num_friends + 1) * 2 > dht->friends_index_size) {
+        const uint32_t size = dht->friends_index_size ? dht->friends_index_size * 2 : DHT_FRIENDS_INDEX_MIN_SIZE;
+
+        if (friends_index_resize(dht, size) == -1) {
+            return -1;
+        }
+    }
+
+    const uint32_t timer = timer_new(dht->timers, &do_DHT_friend, dht, dht->num_friends);
+
+    if (timer == 0) {
+        return -1;
+    }
+
     DHT_Friend *temp = (DHT_Friend *)realloc(dht->friends_list, sizeof(DHT_Friend) * (dht->num_friends + 1));
 
     if (temp == NULL) {
+        timer_free(dht->timers, timer);
         return -1;
     }
 
@@ -1494,8 +2206,10 @@ int DHT_addfriend(DHT *dht, const uint8_t *public_key, void (*ip_callback)(void
     DHT_Friend *dht_friend = &dht->friends_list[dht->num_friends];
     memset(dht_friend, 0, sizeof(DHT_Friend));
     memcpy(dht_friend->public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    dht_friend->timer = timer;
 
     dht_friend->nat.NATping_id = random_64b();
+    dht->friends_index[friends_index_slot(dht, public_key)] = dht->num_friends + 1;
     ++dht->num_friends;
 
     lock_num = dht_friend->lock_count;
@@ -1509,13 +2223,14 @@ int DHT_addfriend(DHT *dht, const uint8_t *public_key, void (*ip_callback)(void
     }
 
     dht_friend->num_to_bootstrap = get_close_nodes(dht, dht_friend->public_key, dht_friend->to_bootstrap, 0, 1, 0);
+    timer_start(dht->timers, dht_friend->timer, 0);
 
     return 0;
 }
 
 int DHT_delfriend(DHT *dht, const uint8_t *public_key, uint16_t lock_count)
 {
-    uint32_t friend_num = index_of_friend_pk(dht->friends_list, dht->num_friends, public_key);
+    uint32_t friend_num = index_of_friend_pk(dht, public_key);
 
     if (friend_num == UINT32_MAX) {
         return -1;
@@ -1532,12 +2247,16 @@ int DHT_delfriend(DHT *dht, const uint8_t *public_key, uint16_t lock_count)
         return 0;
     }
 
+    friends_index_remove(dht, public_key);
+    timer_free(dht->timers, dht_friend->timer);
     --dht->num_friends;
 
     if (dht->num_friends != friend_num) {
         memcpy(&dht->friends_list[friend_num],
                &dht->friends_list[dht->num_friends],
                sizeof(DHT_Friend));
+        dht->friends_index[friends_index_slot(dht, dht->friends_list[friend_num].public_key)] = friend_num + 1;
+        timer_set_id(dht->timers, dht->friends_list[friend_num].timer, friend_num);
     }
 
     if (dht->num_friends == 0) {
@@ -1556,13 +2275,12 @@ int DHT_delfriend(DHT *dht, const uint8_t *public_key, uint16_t lock_count)
     return 0;
 }
 
-/* TODO(irungentoo): Optimize this. */
 int DHT_getfriendip(const DHT *dht, const uint8_t *public_key, IP_Port *ip_port)
 {
     ip_reset(&ip_port->ip);
     ip_port->port = 0;
 
-    uint32_t friend_index = index_of_friend_pk(dht->friends_list, dht->num_friends, public_key);
+    uint32_t friend_index = index_of_friend_pk(dht, public_key);
 
     if (friend_index == UINT32_MAX) {
         return -1;
@@ -1581,7 +2299,7 @@ int DHT_getfriendip(const DHT *dht, const uint8_t *public_key, IP_Port *ip_port)
     for (size_t i = 0; i < ASSOC_COUNT; i++) {
         IPPTsPng *assoc = assocs[i];
 
-        if (!is_timeout(assoc->timestamp, BAD_NODE_TIMEOUT)) {
+        if (!mono_time_is_timeout(dht->mono_time, assoc->timestamp, BAD_NODE_TIMEOUT)) {
             *ip_port = assoc->ip_port;
             return 1;
         }
@@ -1591,17 +2309,15 @@ int DHT_getfriendip(const DHT *dht, const uint8_t *public_key, IP_Port *ip_port)
 }
 
 /* returns number of nodes not in kill-timeout */
-static uint8_t do_ping_and_sendnode_requests(DHT *dht, uint64_t *lastgetnode, const uint8_t *public_key,
-        Client_data *list, uint32_t list_count, uint32_t *bootstrap_times, bool sortable)
+static uint32_t do_ping_and_sendnode_requests(DHT *dht, uint64_t *lastgetnode, const uint8_t *public_key,
+        Client_data *list, uint32_t list_count, uint32_t *bootstrap_times)
 {
-    uint8_t not_kill = 0;
-    uint64_t temp_time = unix_time();
+    uint32_t not_kill = 0;
+    uint64_t temp_time = mono_time_get(dht->mono_time);
 
     uint32_t num_nodes = 0;
     VLA(Client_data *, client_list, list_count * 2);
     VLA(IPPTsPng *, assoc_list, list_count * 2);
-    unsigned int sort = 0;
-    bool sort_ok = 0;
 
     for (uint32_t i = 0; i < list_count; i++) {
         /* If node is not dead. */
@@ -1612,37 +2328,26 @@ static uint8_t do_ping_and_sendnode_requests(DHT *dht, uint64_t *lastgetnode, co
         for (size_t i = 0; i < ASSOC_COUNT; i++) {
             IPPTsPng *assoc = assocs[i];
 
-            if (!is_timeout(assoc->timestamp, KILL_NODE_TIMEOUT)) {
-                sort = 0;
+            if (!mono_time_is_timeout(dht->mono_time, assoc->timestamp, KILL_NODE_TIMEOUT)) {
                 not_kill++;
 
-                if (is_timeout(assoc->last_pinged, PING_INTERVAL)) {
+                if (mono_time_is_timeout(dht->mono_time, assoc->last_pinged, PING_INTERVAL)) {
                     getnodes(dht, assoc->ip_port, client->public_key, public_key, NULL);
                     assoc->last_pinged = temp_time;
                 }
 
                 /* If node is good. */
-                if (!is_timeout(assoc->timestamp, BAD_NODE_TIMEOUT)) {
+                if (!mono_time_is_timeout(dht->mono_time, assoc->timestamp, BAD_NODE_TIMEOUT)) {
                     client_list[num_nodes] = client;
                     assoc_list[num_nodes] = assoc;
                     ++num_nodes;
                 }
-            } else {
-                ++sort;
-
-                /* Timed out should be at beginning, if they are not, sort the list. */
-                if (sort > 1 && sort < (((i + 1) * 2) - 1)) {
-                    sort_ok = 1;
-                }
             }
         }
     }
 
-    if (sortable && sort_ok) {
-        sort_client_list(list, list_count, public_key);
-    }
-
-    if ((num_nodes != 0) && (is_timeout(*lastgetnode, GET_NODE_INTERVAL) || *bootstrap_times < MAX_BOOTSTRAP_TIMES)) {
+    if ((num_nodes != 0) && (mono_time_is_timeout(dht->mono_time, *lastgetnode, GET_NODE_INTERVAL)
+                             || *bootstrap_times < MAX_BOOTSTRAP_TIMES)) {
         uint32_t rand_node = rand() % (num_nodes);
 
         if ((num_nodes - 1) != rand_node) {
@@ -1658,40 +2363,100 @@ static uint8_t do_ping_and_sendnode_requests(DHT *dht, uint64_t *lastgetnode, co
     return not_kill;
 }
 
+/* Return the time at which do_ping_and_sendnode_requests() will next have to
+ * send something to list or a node in it times out, if the list doesn't change.
+ */
+static uint64_t client_list_next_run(const Mono_Time *mono_time, const Client_data *list, uint32_t list_count,
+                                     uint64_t lastgetnode, uint32_t bootstrap_times)
+{
+    uint64_t next_run = UINT64_MAX;
+    bool has_good = 0;
+
+    for (uint32_t i = 0; i < list_count; ++i) {
+        const Client_data *client = &list[i];
+        const IPPTsPng *assocs[ASSOC_COUNT] = { &client->assoc6, &client->assoc4 };
+
+        for (size_t j = 0; j < ASSOC_COUNT; ++j) {
+            const IPPTsPng *assoc = assocs[j];
+
+            if (mono_time_is_timeout(mono_time, assoc->timestamp, KILL_NODE_TIMEOUT)) {
+                continue;
+            }
+
+            if (assoc->last_pinged + PING_INTERVAL < next_run) {
+                next_run = assoc->last_pinged + PING_INTERVAL;
+            }
+
+            if (assoc->timestamp + KILL_NODE_TIMEOUT < next_run) {
+                next_run = assoc->timestamp + KILL_NODE_TIMEOUT;
+            }
+
+            if (!mono_time_is_timeout(mono_time, assoc->timestamp, BAD_NODE_TIMEOUT)) {
+                has_good = 1;
+            }
+        }
+    }
+
+    if (has_good) {
+        if (bootstrap_times < MAX_BOOTSTRAP_TIMES) {
+            return 0;
+        }
+
+        if (lastgetnode + GET_NODE_INTERVAL < next_run) {
+            next_run = lastgetnode + GET_NODE_INTERVAL;
+        }
+    }
+
+    return next_run;
+}
+
 /* Ping each client in the "friends" list every PING_INTERVAL seconds. Send a get nodes request
  * every GET_NODE_INTERVAL seconds to a random good node for each "friend" in our "friends" list.
+ *
+ * Runs from the timer of the friend, which is started again for the next time
+ * something is due and whenever the lists of the friend change.
  */
-static void do_DHT_friends(DHT *dht)
+static void do_DHT_friend(void *object, uint32_t friend_num, void *userdata)
 {
-    for (size_t i = 0; i < dht->num_friends; ++i) {
-        DHT_Friend *dht_friend = &dht->friends_list[i];
+    DHT *dht = (DHT *)object;
+    DHT_Friend *dht_friend = &dht->friends_list[friend_num];
 
-        for (size_t j = 0; j < dht_friend->num_to_bootstrap; ++j) {
-            getnodes(dht, dht_friend->to_bootstrap[j].ip_port, dht_friend->to_bootstrap[j].public_key, dht_friend->public_key,
-                     NULL);
-        }
+    for (size_t j = 0; j < dht_friend->num_to_bootstrap; ++j) {
+        getnodes(dht, dht_friend->to_bootstrap[j].ip_port, dht_friend->to_bootstrap[j].public_key, dht_friend->public_key,
+                 NULL);
+    }
+
+    dht_friend->num_to_bootstrap = 0;
 
-        dht_friend->num_to_bootstrap = 0;
+    do_ping_and_sendnode_requests(dht, &dht_friend->lastgetnode, dht_friend->public_key, dht_friend->client_list,
+                                  MAX_FRIEND_CLIENTS,
+                                  &dht_friend->bootstrap_times);
 
-        do_ping_and_sendnode_requests(dht, &dht_friend->lastgetnode, dht_friend->public_key, dht_friend->client_list,
-                                      MAX_FRIEND_CLIENTS,
-                                      &dht_friend->bootstrap_times, 1);
+    const uint64_t next_run = client_list_next_run(dht->mono_time, dht_friend->client_list, MAX_FRIEND_CLIENTS,
+                              dht_friend->lastgetnode, dht_friend->bootstrap_times);
+
+    if (next_run != UINT64_MAX) {
+        timer_start(dht->timers, dht_friend->timer, next_run);
     }
 }
 
 /* Ping each client in the close nodes list every PING_INTERVAL seconds.
  * Send a get nodes request every GET_NODE_INTERVAL seconds to a random good node in the list.
+ *
+ * Runs from the close timer like do_DHT_friend().
  */
-static void do_Close(DHT *dht)
+static void do_Close(void *object, uint32_t id, void *userdata)
 {
+    DHT *dht = (DHT *)object;
+
     for (size_t i = 0; i < dht->num_to_bootstrap; ++i) {
         getnodes(dht, dht->to_bootstrap[i].ip_port, dht->to_bootstrap[i].public_key, dht->self_public_key, NULL);
     }
 
     dht->num_to_bootstrap = 0;
 
-    uint8_t not_killed = do_ping_and_sendnode_requests(dht, &dht->close_lastgetnodes, dht->self_public_key,
-                         dht->close_clientlist, LCLIENT_LIST, &dht->close_bootstrap_times, 0);
+    uint32_t not_killed = do_ping_and_sendnode_requests(dht, &dht->close_lastgetnodes, dht->self_public_key,
+                          dht->close_clientlist, LCLIENT_LIST, &dht->close_bootstrap_times);
 
     if (!not_killed) {
         /* all existing nodes are at least KILL_NODE_TIMEOUT,
@@ -1700,7 +2465,7 @@ static void do_Close(DHT *dht)
          *
          * so: reset all nodes to be BAD_NODE_TIMEOUT, but not
          * KILL_NODE_TIMEOUT, so we at least keep trying pings */
-        uint64_t badonly = unix_time() - BAD_NODE_TIMEOUT;
+        uint64_t badonly = mono_time_get(dht->mono_time) - BAD_NODE_TIMEOUT;
 
         for (size_t i = 0; i < LCLIENT_LIST; i++) {
             Client_data *client = &dht->close_clientlist[i];
@@ -1716,6 +2481,13 @@ static void do_Close(DHT *dht)
             }
         }
     }
+
+    const uint64_t next_run = client_list_next_run(dht->mono_time, dht->close_clientlist, LCLIENT_LIST,
+                              dht->close_lastgetnodes, dht->close_bootstrap_times);
+
+    if (next_run != UINT64_MAX) {
+        timer_start(dht->timers, dht->close_timer, next_run);
+    }
 }
 
 void DHT_getnodes(DHT *dht, const IP_Port *from_ipp, const uint8_t *from_id, const uint8_t *which_id)
@@ -1763,20 +2535,20 @@ int DHT_bootstrap_from_address(DHT *dht, const char *address, uint8_t ipv6enable
  */
 int route_packet(const DHT *dht, const uint8_t *public_key, const uint8_t *packet, uint16_t length)
 {
-    for (uint32_t i = 0; i < LCLIENT_LIST; ++i) {
-        if (id_equal(public_key, dht->close_clientlist[i].public_key)) {
-            const Client_data *client = &dht->close_clientlist[i];
-            const IPPTsPng *assocs[ASSOC_COUNT] = { &client->assoc6, &client->assoc4 };
+    const uint32_t index = index_of_close_pk(dht, public_key);
 
-            for (size_t j = 0; j < ASSOC_COUNT; j++) {
-                const IPPTsPng *assoc = assocs[j];
+    if (index == UINT32_MAX) {
+        return -1;
+    }
 
-                if (ip_isset(&assoc->ip_port.ip)) {
-                    return sendpacket(dht->net, assoc->ip_port, packet, length);
-                }
-            }
+    const Client_data *client = &dht->close_clientlist[index];
+    const IPPTsPng *assocs[ASSOC_COUNT] = { &client->assoc6, &client->assoc4 };
 
-            break;
+    for (size_t j = 0; j < ASSOC_COUNT; j++) {
+        const IPPTsPng *assoc = assocs[j];
+
+        if (ip_isset(&assoc->ip_port.ip)) {
+            return sendpacket(dht->net, assoc->ip_port, packet, length);
         }
     }
 
@@ -1807,19 +2579,21 @@ static int friend_iplist(const DHT *dht, IP_Port *ip_portlist, uint16_t friend_n
         client = &(dht_friend->client_list[i]);
 
         /* If ip is not zero and node is good. */
-        if (ip_isset(&client->assoc4.ret_ip_port.ip) && !is_timeout(client->assoc4.ret_timestamp, BAD_NODE_TIMEOUT)) {
+        if (ip_isset(&client->assoc4.ret_ip_port.ip)
+                && !mono_time_is_timeout(dht->mono_time, client->assoc4.ret_timestamp, BAD_NODE_TIMEOUT)) {
             ipv4s[num_ipv4s] = client->assoc4.ret_ip_port;
             ++num_ipv4s;
         }
 
-        if (ip_isset(&client->assoc6.ret_ip_port.ip) && !is_timeout(client->assoc6.ret_timestamp, BAD_NODE_TIMEOUT)) {
+        if (ip_isset(&client->assoc6.ret_ip_port.ip)
+                && !mono_time_is_timeout(dht->mono_time, client->assoc6.ret_timestamp, BAD_NODE_TIMEOUT)) {
             ipv6s[num_ipv6s] = client->assoc6.ret_ip_port;
             ++num_ipv6s;
         }
 
         if (id_equal(client->public_key, dht_friend->public_key)) {
-            if (!is_timeout(client->assoc6.timestamp, BAD_NODE_TIMEOUT)
-                    || !is_timeout(client->assoc4.timestamp, BAD_NODE_TIMEOUT)) {
+            if (!mono_time_is_timeout(dht->mono_time, client->assoc6.timestamp, BAD_NODE_TIMEOUT)
+                    || !mono_time_is_timeout(dht->mono_time, client->assoc4.timestamp, BAD_NODE_TIMEOUT)) {
                 return 0; /* direct connectivity */
             }
         }
@@ -1865,7 +2639,7 @@ static int friend_iplist(const DHT *dht, IP_Port *ip_portlist, uint16_t friend_n
  */
 int route_tofriend(const DHT *dht, const uint8_t *friend_id, const uint8_t *packet, uint16_t length)
 {
-    uint32_t num = index_of_friend_pk(dht->friends_list, dht->num_friends, friend_id);
+    uint32_t num = index_of_friend_pk(dht, friend_id);
 
     if (num == UINT32_MAX) {
         return 0;
@@ -1900,7 +2674,8 @@ int route_tofriend(const DHT *dht, const uint8_t *friend_id, const uint8_t *pack
             const IPPTsPng *assoc = assocs[j];
 
             /* If ip is not zero and node is good. */
-            if (ip_isset(&assoc->ret_ip_port.ip) && !is_timeout(assoc->ret_timestamp, BAD_NODE_TIMEOUT)) {
+            if (ip_isset(&assoc->ret_ip_port.ip)
+                    && !mono_time_is_timeout(dht->mono_time, assoc->ret_timestamp, BAD_NODE_TIMEOUT)) {
                 int retval = sendpacket(dht->net, assoc->ip_port, packet, length);
 
                 if ((unsigned int)retval == length) {
@@ -1920,7 +2695,7 @@ int route_tofriend(const DHT *dht, const uint8_t *friend_id, const uint8_t *pack
  */
 static int routeone_tofriend(DHT *dht, const uint8_t *friend_id, const uint8_t *packet, uint16_t length)
 {
-    uint32_t num = index_of_friend_pk(dht->friends_list, dht->num_friends, friend_id);
+    uint32_t num = index_of_friend_pk(dht, friend_id);
 
     if (num == UINT32_MAX) {
         return 0;
@@ -1944,7 +2719,8 @@ static int routeone_tofriend(DHT *dht, const uint8_t *friend_id, const uint8_t *
             const IPPTsPng *assoc = assocs[j];
 
             /* If ip is not zero and node is good. */
-            if (ip_isset(&assoc->ret_ip_port.ip) && !is_timeout(assoc->ret_timestamp, BAD_NODE_TIMEOUT)) {
+            if (ip_isset(&assoc->ret_ip_port.ip)
+                    && !mono_time_is_timeout(dht->mono_time, assoc->ret_timestamp, BAD_NODE_TIMEOUT)) {
                 ip_list[n] = assoc->ip_port;
                 ++n;
             }
@@ -2009,7 +2785,7 @@ static int handle_NATping(void *object, IP_Port source, const uint8_t *source_pu
     uint64_t ping_id;
     memcpy(&ping_id, packet + 1, sizeof(uint64_t));
 
-    uint32_t friendnumber = index_of_friend_pk(dht->friends_list, dht->num_friends, source_pubkey);
+    uint32_t friendnumber = index_of_friend_pk(dht, source_pubkey);
 
     if (friendnumber == UINT32_MAX) {
         return 1;
@@ -2020,7 +2796,7 @@ static int handle_NATping(void *object, IP_Port source, const uint8_t *source_pu
     if (packet[0] == NAT_PING_REQUEST) {
         /* 1 is reply */
         send_NATping(dht, source_pubkey, ping_id, NAT_PING_RESPONSE);
-        dht_friend->nat.recvNATping_timestamp = unix_time();
+        dht_friend->nat.recvNATping_timestamp = mono_time_get(dht->mono_time);
         return 0;
     }
 
@@ -2147,7 +2923,7 @@ static void punch_holes(DHT *dht, IP ip, uint16_t *port_list, uint16_t numports,
 
 static void do_NAT(DHT *dht)
 {
-    uint64_t temp_time = unix_time();
+    uint64_t temp_time = mono_time_get(dht->mono_time);
 
     for (uint32_t i = 0; i < dht->num_friends; ++i) {
         IP_Port ip_list[MAX_FRIEND_CLIENTS];
@@ -2249,21 +3025,20 @@ static int send_hardening_getnode_res(const DHT *dht, const Node_format *sendto,
     return sendpacket(dht->net, sendto->ip_port, packet, len);
 }
 
-/* TODO(irungentoo): improve */
 static IPPTsPng *get_closelist_IPPTsPng(DHT *dht, const uint8_t *public_key, Family sa_family)
 {
-    for (uint32_t i = 0; i < LCLIENT_LIST; ++i) {
-        if (!id_equal(dht->close_clientlist[i].public_key, public_key)) {
-            continue;
-        }
+    const uint32_t index = index_of_close_pk(dht, public_key);
 
-        if (sa_family == AF_INET) {
-            return &dht->close_clientlist[i].assoc4;
-        }
+    if (index == UINT32_MAX) {
+        return NULL;
+    }
 
-        if (sa_family == AF_INET6) {
-            return &dht->close_clientlist[i].assoc6;
-        }
+    if (sa_family == AF_INET) {
+        return &dht->close_clientlist[index].assoc4;
+    }
+
+    if (sa_family == AF_INET6) {
+        return &dht->close_clientlist[index].assoc6;
     }
 
     return NULL;
@@ -2286,7 +3061,7 @@ static uint32_t have_nodes_closelist(DHT *dht, Node_format *nodes, uint16_t num)
         IPPTsPng *temp = get_closelist_IPPTsPng(dht, nodes[i].public_key, nodes[i].ip_port.ip.family);
 
         if (temp) {
-            if (!is_timeout(temp->timestamp, BAD_NODE_TIMEOUT)) {
+            if (!mono_time_is_timeout(dht->mono_time, temp->timestamp, BAD_NODE_TIMEOUT)) {
                 ++counter;
             }
         }
@@ -2357,7 +3132,7 @@ static int handle_hardening(void *object, IP_Port source, const uint8_t *source_
                 return 1;
             }
 
-            if (is_timeout(temp->hardening.send_nodes_timestamp, HARDENING_INTERVAL)) {
+            if (mono_time_is_timeout(dht->mono_time, temp->hardening.send_nodes_timestamp, HARDENING_INTERVAL)) {
                 return 1;
             }
 
@@ -2403,7 +3178,8 @@ static Node_format random_node(DHT *dht, Family sa_family)
  *
  * return the number of nodes.
  */
-static uint16_t list_nodes(Client_data *list, size_t length, Node_format *nodes, uint16_t max_num)
+static uint16_t list_nodes(const Mono_Time *mono_time, Client_data *list, size_t length, Node_format *nodes,
+                           uint16_t max_num)
 {
     if (max_num == 0) {
         return 0;
@@ -2414,11 +3190,11 @@ static uint16_t list_nodes(Client_data *list, size_t length, Node_format *nodes,
     for (size_t i = length; i != 0; --i) {
         IPPTsPng *assoc = NULL;
 
-        if (!is_timeout(list[i - 1].assoc4.timestamp, BAD_NODE_TIMEOUT)) {
+        if (!mono_time_is_timeout(mono_time, list[i - 1].assoc4.timestamp, BAD_NODE_TIMEOUT)) {
             assoc = &list[i - 1].assoc4;
         }
 
-        if (!is_timeout(list[i - 1].assoc6.timestamp, BAD_NODE_TIMEOUT)) {
+        if (!mono_time_is_timeout(mono_time, list[i - 1].assoc6.timestamp, BAD_NODE_TIMEOUT)) {
             if (assoc == NULL) {
                 assoc = &list[i - 1].assoc6;
             } else if (rand() % 2) {
@@ -2454,8 +3230,8 @@ uint16_t randfriends_nodes(DHT *dht, Node_format *nodes, uint16_t max_num)
     unsigned int r = rand();
 
     for (size_t i = 0; i < DHT_FAKE_FRIEND_NUMBER; ++i) {
-        count += list_nodes(dht->friends_list[(i + r) % DHT_FAKE_FRIEND_NUMBER].client_list, MAX_FRIEND_CLIENTS, nodes + count,
-                            max_num - count);
+        count += list_nodes(dht->mono_time, dht->friends_list[(i + r) % DHT_FAKE_FRIEND_NUMBER].client_list,
+                            MAX_FRIEND_CLIENTS, nodes + count, max_num - count);
 
         if (count >= max_num) {
             break;
@@ -2471,7 +3247,7 @@ uint16_t randfriends_nodes(DHT *dht, Node_format *nodes, uint16_t max_num)
  */
 uint16_t closelist_nodes(DHT *dht, Node_format *nodes, uint16_t max_num)
 {
-    return list_nodes(dht->close_clientlist, LCLIENT_LIST, nodes, max_num);
+    return list_nodes(dht->mono_time, dht->close_clientlist, LCLIENT_LIST, nodes, max_num);
 }
 
 #if DHT_HARDENING
@@ -2490,12 +3266,12 @@ static void do_hardening(DHT *dht)
             sa_family = AF_INET6;
         }
 
-        if (is_timeout(cur_iptspng->timestamp, BAD_NODE_TIMEOUT)) {
+        if (mono_time_is_timeout(dht->mono_time, cur_iptspng->timestamp, BAD_NODE_TIMEOUT)) {
             continue;
         }
 
         if (cur_iptspng->hardening.send_nodes_ok == 0) {
-            if (is_timeout(cur_iptspng->hardening.send_nodes_timestamp, HARDENING_INTERVAL)) {
+            if (mono_time_is_timeout(dht->mono_time, cur_iptspng->hardening.send_nodes_timestamp, HARDENING_INTERVAL)) {
                 Node_format rand_node = random_node(dht, sa_family);
 
                 if (!ipport_isset(&rand_node.ip_port)) {
@@ -2513,11 +3289,11 @@ static void do_hardening(DHT *dht)
                 // TODO(irungentoo): The search id should maybe not be ours?
                 if (send_hardening_getnode_req(dht, &rand_node, &to_test, dht->self_public_key) > 0) {
                     memcpy(cur_iptspng->hardening.send_nodes_pingedid, rand_node.public_key, CRYPTO_PUBLIC_KEY_SIZE);
-                    cur_iptspng->hardening.send_nodes_timestamp = unix_time();
+                    cur_iptspng->hardening.send_nodes_timestamp = mono_time_get(dht->mono_time);
                 }
             }
         } else {
-            if (is_timeout(cur_iptspng->hardening.send_nodes_timestamp, HARDEN_TIMEOUT)) {
+            if (mono_time_is_timeout(dht->mono_time, cur_iptspng->hardening.send_nodes_timestamp, HARDEN_TIMEOUT)) {
                 cur_iptspng->hardening.send_nodes_ok = 0;
             }
         }
@@ -2577,15 +3353,17 @@ static int cryptopacket_handle(void *object, IP_Port source, const uint8_t *pack
 
 /*----------------------------------------------------------------------------------*/
 
-DHT *new_DHT(Logger *log, Networking_Core *net, bool holepunching_enabled)
+DHT *new_DHT(Logger *log, Mono_Time *mono_time, Networking_Core *net, bool holepunching_enabled)
 {
     /* init time */
-    unix_time_update();
+    mono_time_update(mono_time);
 
     if (net == NULL) {
         return NULL;
     }
 
+    distance_init();
+
     DHT *dht = (DHT *)calloc(1, sizeof(DHT));
 
     if (dht == NULL) {
@@ -2593,17 +3371,38 @@ DHT *new_DHT(Logger *log, Networking_Core *net, bool holepunching_enabled)
     }
 
     dht->log = log;
+    dht->mono_time = mono_time;
     dht->net = net;
 
     dht->hole_punching_enabled = holepunching_enabled;
 
-    dht->ping = new_ping(dht);
+    dht->timers = new_timer_wheel(mono_time_get(dht->mono_time));
+
+    if (dht->timers == NULL) {
+        kill_DHT(dht);
+        return NULL;
+    }
+
+    dht->close_timer = timer_new(dht->timers, &do_Close, dht, 0);
+
+    if (dht->close_timer == 0) {
+        kill_DHT(dht);
+        return NULL;
+    }
+
+    dht->ping = new_ping(dht->mono_time, dht);
 
     if (dht->ping == NULL) {
         kill_DHT(dht);
         return NULL;
     }
 
+    if (shared_keys_init(&dht->shared_keys_recv, SHARED_KEYS_DEFAULT_SIZE) == -1
+            || shared_keys_init(&dht->shared_keys_sent, SHARED_KEYS_DEFAULT_SIZE) == -1) {
+        kill_DHT(dht);
+        return NULL;
+    }
+
     networking_registerhandler(dht->net, NET_PACKET_GET_NODES, &handle_getnodes, dht);
     networking_registerhandler(dht->net, NET_PACKET_SEND_NODES_IPV6, &handle_sendnodes_ipv6, dht);
     networking_registerhandler(dht->net, NET_PACKET_CRYPTO, &cryptopacket_handle, dht);
@@ -2612,6 +3411,7 @@ DHT *new_DHT(Logger *log, Networking_Core *net, bool holepunching_enabled)
 
     new_symmetric_key(dht->secret_symmetric_key);
     crypto_new_keypair(dht->self_public_key, dht->self_secret_key);
+    random_bytes((uint8_t *)dht->friends_hash_key, sizeof(dht->friends_hash_key));
 
     ping_array_init(&dht->dht_ping_array, DHT_PING_ARRAY_SIZE, PING_TIMEOUT);
     ping_array_init(&dht->dht_harden_ping_array, DHT_PING_ARRAY_SIZE, PING_TIMEOUT);
@@ -2631,9 +3431,10 @@ DHT *new_DHT(Logger *log, Networking_Core *net, bool holepunching_enabled)
 
 void do_DHT(DHT *dht)
 {
-    unix_time_update();
+    mono_time_update(dht->mono_time);
+    do_parked_packets(dht);
 
-    if (dht->last_run == unix_time()) {
+    if (dht->last_run == mono_time_get(dht->mono_time)) {
         return;
     }
 
@@ -2642,17 +3443,24 @@ void do_DHT(DHT *dht)
         DHT_connect_after_load(dht);
     }
 
-    do_Close(dht);
-    do_DHT_friends(dht);
+    timer_wheel_run(dht->timers, mono_time_get(dht->mono_time), NULL);
     do_NAT(dht);
-    do_to_ping(dht->ping);
 #if DHT_HARDENING
     do_hardening(dht);
 #endif
-    dht->last_run = unix_time();
+    dht->last_run = mono_time_get(dht->mono_time);
+    networking_flush(dht->net);
 }
+
+int DHT_set_shared_keys_size(DHT *dht, uint32_t size)
+{
+    Shared_Keys *const caches[] = { &dht->shared_keys_recv, &dht->shared_keys_sent };
+    return shared_keys_resize_all(caches, sizeof(caches) / sizeof(caches[0]), size);
+}
+
 void kill_DHT(DHT *dht)
 {
+    DHT_stop_key_workers(dht);
     networking_registerhandler(dht->net, NET_PACKET_GET_NODES, NULL, NULL);
     networking_registerhandler(dht->net, NET_PACKET_SEND_NODES_IPV6, NULL, NULL);
     cryptopacket_registerhandler(dht, CRYPTO_PACKET_NAT_PING, NULL, NULL);
@@ -2660,8 +3468,12 @@ void kill_DHT(DHT *dht)
     ping_array_free_all(&dht->dht_ping_array);
     ping_array_free_all(&dht->dht_harden_ping_array);
     kill_ping(dht->ping);
+    shared_keys_free(&dht->shared_keys_recv);
+    shared_keys_free(&dht->shared_keys_sent);
     free(dht->friends_list);
+    free(dht->friends_index);
     free(dht->loaded_nodes_list);
+    kill_timer_wheel(dht->timers);
     free(dht);
 }
 
@@ -2851,13 +3663,13 @@ int DHT_load(DHT *dht, const uint8_t *data, uint32_t length)
  */
 int DHT_isconnected(const DHT *dht)
 {
-    unix_time_update();
+    mono_time_update(dht->mono_time);
 
     for (uint32_t i = 0; i < LCLIENT_LIST; ++i) {
         const Client_data *client = &dht->close_clientlist[i];
 
-        if (!is_timeout(client->assoc4.timestamp, BAD_NODE_TIMEOUT) ||
-                !is_timeout(client->assoc6.timestamp, BAD_NODE_TIMEOUT)) {
+        if (!mono_time_is_timeout(dht->mono_time, client->assoc4.timestamp, BAD_NODE_TIMEOUT) ||
+                !mono_time_is_timeout(dht->mono_time, client->assoc6.timestamp, BAD_NODE_TIMEOUT)) {
             return 1;
         }
     }
@@ -2870,16 +3682,18 @@ int DHT_isconnected(const DHT *dht)
  */
 int DHT_non_lan_connected(const DHT *dht)
 {
-    unix_time_update();
+    mono_time_update(dht->mono_time);
 
     for (uint32_t i = 0; i < LCLIENT_LIST; ++i) {
         const Client_data *client = &dht->close_clientlist[i];
 
-        if (!is_timeout(client->assoc4.timestamp, BAD_NODE_TIMEOUT) && LAN_ip(client->assoc4.ip_port.ip) == -1) {
+        if (!mono_time_is_timeout(dht->mono_time, client->assoc4.timestamp, BAD_NODE_TIMEOUT)
+                && LAN_ip(client->assoc4.ip_port.ip) == -1) {
             return 1;
         }
 
-        if (!is_timeout(client->assoc6.timestamp, BAD_NODE_TIMEOUT) && LAN_ip(client->assoc6.ip_port.ip) == -1) {
+        if (!mono_time_is_timeout(dht->mono_time, client->assoc6.timestamp, BAD_NODE_TIMEOUT)
+                && LAN_ip(client->assoc6.ip_port.ip) == -1) {
             return 1;
         }
     }
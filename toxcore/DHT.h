@@ -28,6 +28,7 @@
 #include "logger.h"
 #include "network.h"
 #include "ping_array.h"
+#include "util.h"
 
 #include <stdbool.h>
 
@@ -37,7 +38,10 @@
 #define LCLIENT_NODES (MAX_FRIEND_CLIENTS)
 #define LCLIENT_LENGTH 128
 
-/* A list of the clients mathematically closest to ours. */
+/* A list of the clients mathematically closest to ours.
+ * It is made of LCLIENT_LENGTH k-buckets of LCLIENT_NODES nodes each, bucket i
+ * holding the nodes whose key shares exactly i leading bits with ours.
+ */
 #define LCLIENT_LIST (LCLIENT_LENGTH * LCLIENT_NODES)
 
 #define MAX_CLOSE_TO_BOOTSTRAP_NODES 8
@@ -185,6 +189,9 @@ typedef struct {
 
     Node_format to_bootstrap[MAX_SENT_NODES];
     unsigned int num_to_bootstrap;
+
+    /* Fires when do_DHT_friends() next has something to do for this friend. */
+    uint32_t    timer;
 } DHT_Friend;
 
 /* Return packet size of packed node with ip_family on success.
@@ -211,22 +218,86 @@ int unpack_nodes(Node_format *nodes, uint16_t max_num_nodes, uint16_t *processed
 
 
 /*----------------------------------------------------------------------------------*/
-/* struct to store some shared keys so we don't have to regenerate them for each request. */
-#define MAX_KEYS_PER_SLOT 4
-#define KEYS_TIMEOUT 600
+/* struct to store some shared keys so we don't have to regenerate them for each request.
+ *
+ * The cache is set associative: a keyed hash of the whole public key selects a
+ * set of MAX_KEYS_PER_SLOT entries and the least recently used entry of the set
+ * is evicted when a new key has to be stored.
+ */
+#define MAX_KEYS_PER_SLOT 8
+
+/* Default number of keys stored in each shared key cache. */
+#define SHARED_KEYS_DEFAULT_SIZE 1024
 
 typedef struct {
     uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
     uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
-    uint32_t times_requested;
     uint8_t  stored; /* 0 if not, 1 if is */
-    uint64_t time_last_requested;
+    uint64_t last_used; /* value of Shared_Keys.clock when this key was last requested */
 } Shared_Key;
 
 typedef struct {
-    Shared_Key keys[256 * MAX_KEYS_PER_SLOT];
+    Shared_Key *keys;
+    uint32_t num_slots; /* number of sets of MAX_KEYS_PER_SLOT keys, a power of 2 */
+    uint64_t hash_key[4]; /* random key for the slot hash */
+    uint64_t clock; /* incremented on every request, used for LRU eviction */
+
+    /* statistics */
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
 } Shared_Keys;
 
+/* Initialize a shared key cache able to hold at least size keys.
+ * size is rounded up to a power of 2 multiple of MAX_KEYS_PER_SLOT.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int shared_keys_init(Shared_Keys *shared_keys, uint32_t size);
+
+/* Wipe and free all the memory allocated by a shared key cache.
+ */
+void shared_keys_free(Shared_Keys *shared_keys);
+
+/* Replace the keys of a shared key cache with an empty cache able to hold at
+ * least size keys. The counters are kept.
+ *
+ * return 0 on success.
+ * return -1 on failure, the cache is left as it was.
+ */
+int shared_keys_resize(Shared_Keys *shared_keys, uint32_t size);
+
+/* Resize the count caches pointed to by caches like shared_keys_resize(), all
+ * of them or none.
+ *
+ * return 0 on success.
+ * return -1 on failure, the caches are left as they were.
+ */
+int shared_keys_resize_all(Shared_Keys *const *caches, uint32_t count, uint32_t size);
+
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+} Shared_Keys_Stats;
+
+/* Add the counters of shared_keys to stats. */
+void shared_keys_add_stats(const Shared_Keys *shared_keys, Shared_Keys_Stats *stats);
+
+/* Set the counters of shared_keys to zero. */
+void shared_keys_reset_stats(Shared_Keys *shared_keys);
+
+/* Maximum number of received packets that can wait for a shared key to be
+ * computed by the precompute workers. When full, keys are computed in place.
+ */
+#define SHARED_KEY_MAX_PENDING 256
+
+/* Maximum number of shared key precompute worker threads. */
+#define SHARED_KEY_MAX_WORKERS 16
+
+typedef struct Shared_Key_Pool Shared_Key_Pool;
+
 /*----------------------------------------------------------------------------------*/
 
 typedef int (*cryptopacket_handler_callback)(void *object, IP_Port ip_port, const uint8_t *source_pubkey,
@@ -239,6 +310,7 @@ typedef struct {
 
 typedef struct {
     Logger *log;
+    Mono_Time *mono_time;
     Networking_Core *net;
 
     bool hole_punching_enabled;
@@ -247,6 +319,11 @@ typedef struct {
     uint64_t       close_lastgetnodes;
     uint32_t       close_bootstrap_times;
 
+    /* Timers of the DHT and its friends, in seconds of mono_time_get(). The close
+     * timer fires when do_Close() next has something to do. */
+    Timer_Wheel   *timers;
+    uint32_t       close_timer;
+
     /* Note: this key should not be/is not used to transmit any sensitive materials */
     uint8_t      secret_symmetric_key[CRYPTO_SYMMETRIC_KEY_SIZE];
     /* DHT keypair */
@@ -256,12 +333,19 @@ typedef struct {
     DHT_Friend    *friends_list;
     uint16_t       num_friends;
 
+    /* Open addressing hash table of friend numbers + 1 (0 for an empty slot)
+     * keyed by public key. */
+    uint32_t      *friends_index;
+    uint32_t       friends_index_size; /* a power of 2 */
+    uint64_t       friends_hash_key[4];
+
     Node_format   *loaded_nodes_list;
     uint32_t       loaded_num_nodes;
     unsigned int   loaded_nodes_index;
 
     Shared_Keys shared_keys_recv;
     Shared_Keys shared_keys_sent;
+    Shared_Key_Pool *key_pool;
 
     struct PING   *ping;
     Ping_Array    dht_ping_array;
@@ -280,6 +364,8 @@ typedef struct {
  *
  * If shared key is already in shared_keys, copy it to shared_key.
  * else generate it into shared_key and copy it to shared_keys
+ *
+ * Callers must always pass the same secret_key for a given shared_keys.
  */
 void get_shared_key(Shared_Keys *shared_keys, uint8_t *shared_key, const uint8_t *secret_key,
                     const uint8_t *public_key);
@@ -294,6 +380,41 @@ void DHT_get_shared_key_recv(DHT *dht, uint8_t *shared_key, const uint8_t *publi
  */
 void DHT_get_shared_key_sent(DHT *dht, uint8_t *shared_key, const uint8_t *public_key);
 
+/* Start num_threads worker threads that compute the shared keys of received
+ * packets from peers we don't have a cached key for, so that the packet loop
+ * doesn't block on them.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int DHT_start_key_workers(DHT *dht, uint16_t num_threads);
+
+/* Stop the precompute workers and drop all the packets waiting for a key.
+ */
+void DHT_stop_key_workers(DHT *dht);
+
+/* Copy the shared key for public_key from shared_keys into shared_key.
+ *
+ * If the key is not cached and the precompute workers are running, a copy of
+ * the packet is parked instead and passed to cb(object, source, packet, length, NULL)
+ * from do_DHT() once the key has been computed and stored in shared_keys.
+ * cb must therefore not depend on its userdata argument. Packets from a peer
+ * whose key is already being computed wait for that same computation.
+ *
+ * shared_keys must be a cache of keys for dht->self_secret_key.
+ *
+ * return 0 if shared_key was filled.
+ * return 1 if the packet was parked.
+ */
+int DHT_get_shared_key_async(DHT *dht, Shared_Keys *shared_keys, uint8_t *shared_key, const uint8_t *public_key,
+                             IP_Port source, const uint8_t *packet, uint16_t length, packet_handler_callback cb, void *object);
+
+/* Drop all the parked packets that would be passed to object.
+ * Must be called before freeing an object that parks packets, from the thread
+ * running do_DHT().
+ */
+void DHT_drop_parked_packets(DHT *dht, void *object);
+
 void DHT_getnodes(DHT *dht, const IP_Port *from_ipp, const uint8_t *from_id, const uint8_t *which_id);
 
 /* Add a new friend to the friends list.
@@ -349,6 +470,11 @@ bool add_to_list(Node_format *nodes_list, unsigned int length, const uint8_t *pk
  */
 bool node_addable_to_close_list(DHT *dht, const uint8_t *public_key, IP_Port ip_port);
 
+/* Return the k-bucket of the close list that public_key belongs to.
+ * The returned list is LCLIENT_NODES entries long.
+ */
+const Client_data *DHT_close_bucket(const DHT *dht, const uint8_t *public_key);
+
 /* Get the (maximum MAX_SENT_NODES) closest nodes to public_key we know
  * and put them in nodes_list (must be MAX_SENT_NODES big).
  *
@@ -440,7 +566,15 @@ void DHT_save(DHT *dht, uint8_t *data);
 int DHT_load(DHT *dht, const uint8_t *data, uint32_t length);
 
 /* Initialize DHT. */
-DHT *new_DHT(Logger *log, Networking_Core *net, bool holepunching_enabled);
+DHT *new_DHT(Logger *log, Mono_Time *mono_time, Networking_Core *net, bool holepunching_enabled);
+
+/* Make the send and receive shared key caches hold at least size keys each.
+ * The keys already cached are dropped.
+ *
+ * return 0 on success.
+ * return -1 on failure, the caches are left as they were.
+ */
+int DHT_set_shared_keys_size(DHT *dht, uint32_t size);
 
 void kill_DHT(DHT *dht);
 
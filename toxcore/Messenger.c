@@ -486,6 +486,47 @@ int m_get_friend_connectionstatus(const Messenger *m, int32_t friendnumber)
     return CONNECTION_NONE;
 }
 
+int m_get_friend_transport_stats(const Messenger *m, int32_t friendnumber, Crypto_Connection_Stats *stats)
+{
+    if (friend_not_valid(m, friendnumber)) {
+        return -1;
+    }
+
+    if (m->friendlist[friendnumber].status != FRIEND_ONLINE) {
+        memset(stats, 0, sizeof(Crypto_Connection_Stats));
+        return 0;
+    }
+
+    int crypt_conn_id = friend_connection_crypt_connection_id(m->fr_c, m->friendlist[friendnumber].friendcon_id);
+
+    if (crypto_connection_stats(m->net_crypto, crypt_conn_id, stats) != 0) {
+        memset(stats, 0, sizeof(Crypto_Connection_Stats));
+    }
+
+    return 0;
+}
+
+void m_get_shared_keys_stats(const Messenger *m, Shared_Keys_Stats *stats)
+{
+    memset(stats, 0, sizeof(Shared_Keys_Stats));
+    shared_keys_add_stats(&m->dht->shared_keys_recv, stats);
+    shared_keys_add_stats(&m->dht->shared_keys_sent, stats);
+    shared_keys_add_stats(&m->onion->shared_keys_1, stats);
+    shared_keys_add_stats(&m->onion->shared_keys_2, stats);
+    shared_keys_add_stats(&m->onion->shared_keys_3, stats);
+    shared_keys_add_stats(&m->onion_a->shared_keys_recv, stats);
+}
+
+void m_reset_shared_keys_stats(Messenger *m)
+{
+    shared_keys_reset_stats(&m->dht->shared_keys_recv);
+    shared_keys_reset_stats(&m->dht->shared_keys_sent);
+    shared_keys_reset_stats(&m->onion->shared_keys_1);
+    shared_keys_reset_stats(&m->onion->shared_keys_2);
+    shared_keys_reset_stats(&m->onion->shared_keys_3);
+    shared_keys_reset_stats(&m->onion_a->shared_keys_recv);
+}
+
 int m_friend_exists(const Messenger *m, int32_t friendnumber)
 {
     if (friend_not_valid(m, friendnumber)) {
@@ -2064,6 +2105,18 @@ Messenger *new_messenger(Messenger_Options *options, unsigned int *error)
 
     m->log = log;
 
+    m->mono_time = mono_time_new();
+
+    if (m->mono_time == NULL) {
+        logger_kill(log);
+        free(m);
+        return NULL;
+    }
+
+    if (options->clock_callback) {
+        mono_time_set_clock(m->mono_time, options->clock_callback, options->clock_user_data);
+    }
+
     unsigned int net_err = 0;
 
     if (options->udp_disabled) {
@@ -2076,6 +2129,7 @@ Messenger *new_messenger(Messenger_Options *options, unsigned int *error)
     }
 
     if (m->net == NULL) {
+        mono_time_free(m->mono_time);
         free(m);
 
         if (error && net_err == 1) {
@@ -2085,27 +2139,47 @@ Messenger *new_messenger(Messenger_Options *options, unsigned int *error)
         return NULL;
     }
 
-    m->dht = new_DHT(m->log, m->net, options->hole_punching_enabled);
+    if (!options->udp_disabled && options->udp_batch_size > 1
+            && networking_set_batch_size(m->net, options->udp_batch_size) != 0) {
+        LOGGER_WARNING(m->log, "could not send datagrams in batches of %u, sending them one at a time",
+                       options->udp_batch_size);
+    }
+
+    m->dht = new_DHT(m->log, m->mono_time, m->net, options->hole_punching_enabled);
 
     if (m->dht == NULL) {
         kill_networking(m->net);
+        mono_time_free(m->mono_time);
         free(m);
         return NULL;
     }
 
-    m->net_crypto = new_net_crypto(m->log, m->dht, &options->proxy_info);
+    m->net_crypto = new_net_crypto(m->log, m->mono_time, m->dht, &options->proxy_info);
 
     if (m->net_crypto == NULL) {
         kill_networking(m->net);
         kill_DHT(m->dht);
+        mono_time_free(m->mono_time);
         free(m);
         return NULL;
     }
 
-    m->onion = new_onion(m->dht);
-    m->onion_a = new_onion_announce(m->dht);
-    m->onion_c =  new_onion_client(m->net_crypto);
-    m->fr_c = new_friend_connections(m->onion_c, options->local_discovery_enabled);
+    if (options->congestion_control) {
+        crypto_set_congestion_control(m->net_crypto, options->congestion_control);
+    }
+
+    if (options->packet_pool_size) {
+        crypto_set_packet_data_pool_size(m->net_crypto, options->packet_pool_size);
+    }
+
+    if (options->crypto_threads && crypto_start_workers(m->net_crypto, options->crypto_threads) != 0) {
+        LOGGER_WARNING(m->log, "could not start %u crypto threads, encrypting in place", options->crypto_threads);
+    }
+
+    m->onion = new_onion(m->mono_time, m->dht);
+    m->onion_a = new_onion_announce(m->mono_time, m->dht);
+    m->onion_c =  new_onion_client(m->mono_time, m->net_crypto);
+    m->fr_c = new_friend_connections(m->mono_time, m->onion_c, options->local_discovery_enabled);
 
     if (!(m->onion && m->onion_a && m->onion_c)) {
         kill_friend_connections(m->fr_c);
@@ -2115,12 +2189,26 @@ Messenger *new_messenger(Messenger_Options *options, unsigned int *error)
         kill_net_crypto(m->net_crypto);
         kill_DHT(m->dht);
         kill_networking(m->net);
+        mono_time_free(m->mono_time);
         free(m);
         return NULL;
     }
 
+    if (options->shared_keys_size
+            && (DHT_set_shared_keys_size(m->dht, options->shared_keys_size) != 0
+                || onion_set_shared_keys_size(m->onion, options->shared_keys_size) != 0
+                || onion_announce_set_shared_keys_size(m->onion_a, options->shared_keys_size) != 0)) {
+        LOGGER_WARNING(m->log, "could not resize the shared key caches to %u keys", options->shared_keys_size);
+    }
+
+    if (options->shared_key_threads && DHT_start_key_workers(m->dht, options->shared_key_threads) != 0) {
+        LOGGER_WARNING(m->log, "could not start %u shared key threads, computing keys in place",
+                       options->shared_key_threads);
+    }
+
     if (options->tcp_server_port) {
-        m->tcp_server = new_TCP_server(options->ipv6enabled, 1, &options->tcp_server_port, m->dht->self_secret_key, m->onion);
+        m->tcp_server = new_TCP_server(m->mono_time, options->ipv6enabled, 1, &options->tcp_server_port,
+                                       m->dht->self_secret_key, m->onion);
 
         if (m->tcp_server == NULL) {
             kill_friend_connections(m->fr_c);
@@ -2130,6 +2218,7 @@ Messenger *new_messenger(Messenger_Options *options, unsigned int *error)
             kill_net_crypto(m->net_crypto);
             kill_DHT(m->dht);
             kill_networking(m->net);
+            mono_time_free(m->mono_time);
             free(m);
 
             if (error) {
@@ -2179,6 +2268,7 @@ void kill_messenger(Messenger *m)
         clear_receipts(m, i);
     }
 
+    mono_time_free(m->mono_time);
     logger_kill(m->log);
     free(m->friendlist);
     free(m);
@@ -2531,7 +2621,7 @@ static int m_handle_packet(void *object, int i, const uint8_t *temp, uint16_t le
 static void do_friends(Messenger *m, void *userdata)
 {
     uint32_t i;
-    uint64_t temp_time = unix_time();
+    uint64_t temp_time = mono_time_get(m->mono_time);
 
     for (i = 0; i < m->numfriends; ++i) {
         if (m->friendlist[i].status == FRIEND_ADDED) {
@@ -2584,7 +2674,7 @@ static void do_friends(Messenger *m, void *userdata)
             do_receipts(m, i, userdata);
             do_reqchunk_filecb(m, i, userdata);
 
-            m->friendlist[i].last_seen_time = (uint64_t) time(NULL);
+            m->friendlist[i].last_seen_time = mono_time_get(m->mono_time);
         }
     }
 }
@@ -2642,6 +2732,83 @@ uint32_t messenger_run_interval(const Messenger *m)
     return crypto_interval;
 }
 
+uint32_t messenger_sockets(const Messenger *m, Socket *socks, uint32_t max)
+{
+    uint32_t count = 0;
+    const Socket sock = networking_socket(m->net);
+
+    if (sock_valid(sock)) {
+        if (max > 0) {
+            socks[0] = sock;
+        }
+
+        ++count;
+    }
+
+    uint32_t copied = count < max ? count : max;
+    count += tcp_connections_sockets(m->net_crypto->tcp_c, socks + copied, max - copied);
+
+    if (m->tcp_server) {
+        copied = count < max ? count : max;
+        count += tcp_server_sockets(m->tcp_server, socks + copied, max - copied);
+    }
+
+    return count;
+}
+
+/* Return true if a friend we are sending files to is online, so that
+ * do_messenger() asks for their next chunks.
+ */
+static bool sending_files(const Messenger *m)
+{
+    uint32_t i;
+
+    for (i = 0; i < m->numfriends; ++i) {
+        if (m->friendlist[i].status == FRIEND_ONLINE && m->friendlist[i].num_sending_files != 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+uint32_t messenger_run_timeout(const Messenger *m)
+{
+    if (networking_has_queued(m->net)) {
+        return 0;
+    }
+
+    const uint64_t now = mono_time_monotonic(m->mono_time);
+
+    /* Everything above net_crypto runs on whole seconds of mono_time_get(), which
+     * change when mono_time_monotonic() passes a multiple of 1000. */
+    uint64_t next_run = (m->net_crypto->last_run / 1000 + 1) * 1000;
+    const uint64_t crypto_next = crypto_next_run(m->net_crypto);
+
+    if (crypto_next < next_run) {
+        next_run = crypto_next;
+    }
+
+    /* Data waiting for sockets to become writable and file chunks to ask for
+     * are retried as often as messenger_run_interval() suggests. */
+    if (sending_files(m) || tcp_connections_have_pending_data(m->net_crypto->tcp_c)
+            || (m->tcp_server && tcp_server_has_pending_data(m->tcp_server))) {
+        if (m->net_crypto->last_run + MIN_RUN_INTERVAL < next_run) {
+            next_run = m->net_crypto->last_run + MIN_RUN_INTERVAL;
+        }
+    }
+
+    if (next_run <= now) {
+        return 0;
+    }
+
+    if (next_run - now > UINT32_MAX) {
+        return UINT32_MAX;
+    }
+
+    return next_run - now;
+}
+
 /* The main loop that needs to be run at least 20 times per second. */
 void do_messenger(Messenger *m, void *userdata)
 {
@@ -2666,7 +2833,7 @@ void do_messenger(Messenger *m, void *userdata)
         }
     }
 
-    unix_time_update();
+    mono_time_update(m->mono_time);
 
     if (!m->options.udp_disabled) {
         networking_poll(m->net, userdata);
@@ -2682,9 +2849,11 @@ void do_messenger(Messenger *m, void *userdata)
     do_friend_connections(m->fr_c, userdata);
     do_friends(m, userdata);
     connection_status_cb(m, userdata);
+    crypto_finish_jobs(m->net_crypto, userdata);
+    networking_flush(m->net);
 
-    if (unix_time() > m->lastdump + DUMPING_CLIENTS_FRIENDS_EVERY_N_SECONDS) {
-        m->lastdump = unix_time();
+    if (mono_time_get(m->mono_time) > m->lastdump + DUMPING_CLIENTS_FRIENDS_EVERY_N_SECONDS) {
+        m->lastdump = mono_time_get(m->mono_time);
         uint32_t client, last_pinged;
 
         for (client = 0; client < LCLIENT_LIST; client++) {
@@ -100,8 +100,30 @@ typedef struct {
     uint8_t hole_punching_enabled;
     bool local_discovery_enabled;
 
+    /* Congestion control of the crypto connections, NULL for the default. */
+    const Congestion_Control *congestion_control;
+
+    /* Number of crypto worker threads, 0 to encrypt and decrypt in place. */
+    uint16_t crypto_threads;
+
+    /* Datagrams sent and received per system call, 0 or 1 for one at a time. */
+    uint16_t udp_batch_size;
+
+    /* Keys held by each shared key cache, 0 for SHARED_KEYS_DEFAULT_SIZE. */
+    uint32_t shared_keys_size;
+
+    /* Number of threads computing shared keys for the DHT, 0 for none. */
+    uint16_t shared_key_threads;
+
     logger_cb *log_callback;
     void *log_user_data;
+
+    /* Millisecond clock used instead of the system monotonic clock, NULL for none. */
+    monotonic_clock_cb *clock_callback;
+    void *clock_user_data;
+
+    /* Unused Packet_Data kept by net_crypto, 0 for CRYPTO_PACKET_DATA_DEFAULT_FREE. */
+    uint32_t packet_pool_size;
 } Messenger_Options;
 
 
@@ -237,6 +259,7 @@ typedef struct {
 
 struct Messenger {
     Logger *log;
+    Mono_Time *mono_time;
 
     Networking_Core *net;
     Net_Crypto *net_crypto;
@@ -368,6 +391,22 @@ int m_delfriend(Messenger *m, int32_t friendnumber);
  */
 int m_get_friend_connectionstatus(const Messenger *m, int32_t friendnumber);
 
+/* Copy the transport statistics of the connection to the friend into stats.
+ * They are all zero while the friend is offline.
+ *
+ *  return 0 on success.
+ *  return -1 if friendnumber is invalid.
+ */
+int m_get_friend_transport_stats(const Messenger *m, int32_t friendnumber, Crypto_Connection_Stats *stats);
+
+/* Copy the counters of all the shared key caches of the DHT and the onion
+ * into stats, summed up.
+ */
+void m_get_shared_keys_stats(const Messenger *m, Shared_Keys_Stats *stats);
+
+/* Set the counters of all the shared key caches to zero. */
+void m_reset_shared_keys_stats(Messenger *m);
+
 /* Checks if there exists a friend with given friendnumber.
  *
  *  return 1 if friend exists.
@@ -795,6 +834,20 @@ void do_messenger(Messenger *m, void *userdata);
  */
 uint32_t messenger_run_interval(const Messenger *m);
 
+/* Copy up to max of the sockets do_messenger() reads from into socks: the UDP
+ * socket, the sockets of the TCP relay connections and those of our TCP
+ * server.
+ *
+ * return the number of sockets, which can be more than max.
+ */
+uint32_t messenger_sockets(const Messenger *m, Socket *socks, uint32_t max);
+
+/* Return the time in milliseconds until do_messenger() has timers due or
+ * data to send, if none of the sockets of messenger_sockets() become readable
+ * before.
+ */
+uint32_t messenger_run_timeout(const Messenger *m);
+
 /* SAVING AND LOADING FUNCTIONS: */
 
 /* return size of the messenger data (for saving). */
@@ -632,8 +632,8 @@ void onion_response_handler(TCP_Client_Connection *con, int (*onion_callback)(vo
 
 /* Create new TCP connection to ip_port/public_key
  */
-TCP_Client_Connection *new_TCP_connection(IP_Port ip_port, const uint8_t *public_key, const uint8_t *self_public_key,
-        const uint8_t *self_secret_key, TCP_Proxy_Info *proxy_info)
+TCP_Client_Connection *new_TCP_connection(Mono_Time *mono_time, IP_Port ip_port, const uint8_t *public_key,
+        const uint8_t *self_public_key, const uint8_t *self_secret_key, TCP_Proxy_Info *proxy_info)
 {
     if (networking_at_startup() != 0) {
         return NULL;
@@ -679,6 +679,7 @@ TCP_Client_Connection *new_TCP_connection(IP_Port ip_port, const uint8_t *public
         return NULL;
     }
 
+    temp->mono_time = mono_time;
     temp->sock = sock;
     memcpy(temp->public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
     memcpy(temp->self_public_key, self_public_key, CRYPTO_PUBLIC_KEY_SIZE);
@@ -709,7 +710,7 @@ TCP_Client_Connection *new_TCP_connection(IP_Port ip_port, const uint8_t *public
             break;
     }
 
-    temp->kill_at = unix_time() + TCP_CONNECTION_TIMEOUT;
+    temp->kill_at = mono_time_get(mono_time) + TCP_CONNECTION_TIMEOUT;
 
     return temp;
 }
@@ -879,7 +880,7 @@ static int do_confirmed_TCP(TCP_Client_Connection *conn, void *userdata)
     uint8_t packet[MAX_PACKET_SIZE];
     int len;
 
-    if (is_timeout(conn->last_pinged, TCP_PING_FREQUENCY)) {
+    if (mono_time_is_timeout(conn->mono_time, conn->last_pinged, TCP_PING_FREQUENCY)) {
         uint64_t ping_id = random_64b();
 
         if (!ping_id) {
@@ -888,10 +889,10 @@ static int do_confirmed_TCP(TCP_Client_Connection *conn, void *userdata)
 
         conn->ping_request_id = conn->ping_id = ping_id;
         tcp_send_ping_request(conn);
-        conn->last_pinged = unix_time();
+        conn->last_pinged = mono_time_get(conn->mono_time);
     }
 
-    if (conn->ping_id && is_timeout(conn->last_pinged, TCP_PING_TIMEOUT)) {
+    if (conn->ping_id && mono_time_is_timeout(conn->mono_time, conn->last_pinged, TCP_PING_TIMEOUT)) {
         conn->status = TCP_CLIENT_DISCONNECTED;
         return 0;
     }
@@ -916,7 +917,7 @@ static int do_confirmed_TCP(TCP_Client_Connection *conn, void *userdata)
  */
 void do_TCP_connection(TCP_Client_Connection *TCP_connection, void *userdata)
 {
-    unix_time_update();
+    mono_time_update(TCP_connection->mono_time);
 
     if (TCP_connection->status == TCP_CLIENT_DISCONNECTED) {
         return;
@@ -995,11 +996,29 @@ void do_TCP_connection(TCP_Client_Connection *TCP_connection, void *userdata)
         do_confirmed_TCP(TCP_connection, userdata);
     }
 
-    if (TCP_connection->kill_at <= unix_time()) {
+    if (TCP_connection->kill_at <= mono_time_get(TCP_connection->mono_time)) {
         TCP_connection->status = TCP_CLIENT_DISCONNECTED;
     }
 }
 
+bool TCP_connection_has_pending_data(const TCP_Client_Connection *TCP_connection)
+{
+    if (TCP_connection->status == TCP_CLIENT_DISCONNECTED) {
+        return 0;
+    }
+
+    return TCP_connection->last_packet_length != 0 || TCP_connection->priority_queue_start != NULL;
+}
+
+bool TCP_connection_wants_read(const TCP_Client_Connection *TCP_connection)
+{
+    if (TCP_connection->status == TCP_CLIENT_CONFIRMED) {
+        return 1;
+    }
+
+    return TCP_connection->status != TCP_CLIENT_DISCONNECTED && !TCP_connection_has_pending_data(TCP_connection);
+}
+
 /* Kill the TCP connection
  */
 void kill_TCP_connection(TCP_Client_Connection *TCP_connection)
@@ -51,6 +51,7 @@ enum {
     TCP_CLIENT_DISCONNECTED,
 };
 typedef struct  {
+    Mono_Time *mono_time;
     uint8_t status;
     Socket sock;
     uint8_t self_public_key[CRYPTO_PUBLIC_KEY_SIZE]; /* our public key */
@@ -103,8 +104,8 @@ typedef struct  {
 
 /* Create new TCP connection to ip_port/public_key
  */
-TCP_Client_Connection *new_TCP_connection(IP_Port ip_port, const uint8_t *public_key, const uint8_t *self_public_key,
-        const uint8_t *self_secret_key, TCP_Proxy_Info *proxy_info);
+TCP_Client_Connection *new_TCP_connection(Mono_Time *mono_time, IP_Port ip_port, const uint8_t *public_key,
+        const uint8_t *self_public_key, const uint8_t *self_secret_key, TCP_Proxy_Info *proxy_info);
 
 /* Run the TCP connection
  */
@@ -114,6 +115,16 @@ void do_TCP_connection(TCP_Client_Connection *TCP_connection, void *userdata);
  */
 void kill_TCP_connection(TCP_Client_Connection *TCP_connection);
 
+/* return true if data of the connection, including its handshake, waits for
+ * the socket to become writable.
+ */
+bool TCP_connection_has_pending_data(const TCP_Client_Connection *TCP_connection);
+
+/* return true if the connection waits for data on its socket. It doesn't
+ * before it has sent what it has to send while connecting.
+ */
+bool TCP_connection_wants_read(const TCP_Client_Connection *TCP_connection);
+
 /* return 1 on success.
  * return 0 if could not send packet.
  * return -1 on failure (connection must be killed).
@@ -192,6 +192,14 @@ int set_tcp_connection_to_status(TCP_Connections *tcp_c, int connections_number,
  */
 unsigned int tcp_connection_to_online_tcp_relays(TCP_Connections *tcp_c, int connections_number);
 
+/* Copy the public key of the TCP relay that packets to the connection go
+ * through to relay_pk.
+ *
+ * return 0 on success.
+ * return -1 if no relay of the connection is online.
+ */
+int tcp_connection_to_relay(TCP_Connections *tcp_c, int connections_number, uint8_t *relay_pk);
+
 /* Add a TCP relay tied to a connection.
  *
  * NOTE: This can only be used during the tcp_oob_callback.
@@ -233,11 +241,23 @@ unsigned int tcp_copy_connected_relays(TCP_Connections *tcp_c, Node_format *tcp_
  *
  * Returns NULL on failure.
  */
-TCP_Connections *new_tcp_connections(const uint8_t *secret_key, TCP_Proxy_Info *proxy_info);
+TCP_Connections *new_tcp_connections(Mono_Time *mono_time, const uint8_t *secret_key, TCP_Proxy_Info *proxy_info);
 
 void do_tcp_connections(TCP_Connections *tcp_c, void *userdata);
 void kill_tcp_connections(TCP_Connections *tcp_c);
 
+/* Copy up to max of the sockets of the TCP relay connections that wait for
+ * data into socks.
+ *
+ * return the number of sockets, which can be more than max.
+ */
+uint32_t tcp_connections_sockets(const TCP_Connections *tcp_c, Socket *socks, uint32_t max);
+
+/* return true if data of a TCP relay connection waits for its socket to
+ * become writable.
+ */
+bool tcp_connections_have_pending_data(const TCP_Connections *tcp_c);
+
 #if defined(ELASTOS_BUILD)
 int get_random_tcp_relay_addr(TCP_Connections *tcp_c, IP_Port *ip_port, uint8_t *public_key);
 #endif
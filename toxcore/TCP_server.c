@@ -60,6 +60,7 @@
 #endif
 
 struct TCP_Server {
+    Mono_Time *mono_time;
     Onion *onion;
 
 #ifdef TCP_SERVER_USE_EPOLL
@@ -83,6 +84,9 @@ struct TCP_Server {
     uint64_t counter;
 
     BS_LIST accepted_key_list;
+
+    /* Timers of the accepted connections, in seconds of mono_time_get(). */
+    Timer_Wheel *timers;
 };
 
 const uint8_t *tcp_server_public_key(const TCP_Server *tcp_server)
@@ -148,6 +152,7 @@ static int get_TCP_connection_index(const TCP_Server *TCP_server, const uint8_t
 
 
 static int kill_accepted(TCP_Server *TCP_server, int index);
+static void do_TCP_ping(void *object, uint32_t index, void *userdata);
 
 /* Add accepted TCP connection to the list.
  *
@@ -185,7 +190,14 @@ static int add_accepted(TCP_Server *TCP_server, const TCP_Secure_Connection *con
         return -1;
     }
 
+    uint32_t ping_timer = timer_new(TCP_server->timers, &do_TCP_ping, TCP_server, index);
+
+    if (ping_timer == 0) {
+        return -1;
+    }
+
     if (!bs_list_add(&TCP_server->accepted_key_list, con->public_key, index)) {
+        timer_free(TCP_server->timers, ping_timer);
         return -1;
     }
 
@@ -193,8 +205,10 @@ static int add_accepted(TCP_Server *TCP_server, const TCP_Secure_Connection *con
     TCP_server->accepted_connection_array[index].status = TCP_STATUS_CONFIRMED;
     ++TCP_server->num_accepted_connections;
     TCP_server->accepted_connection_array[index].identifier = ++TCP_server->counter;
-    TCP_server->accepted_connection_array[index].last_pinged = unix_time();
+    TCP_server->accepted_connection_array[index].last_pinged = mono_time_get(TCP_server->mono_time);
     TCP_server->accepted_connection_array[index].ping_id = 0;
+    TCP_server->accepted_connection_array[index].ping_timer = ping_timer;
+    timer_start(TCP_server->timers, ping_timer, mono_time_get(TCP_server->mono_time) + TCP_PING_FREQUENCY);
 
     return index;
 }
@@ -218,6 +232,7 @@ static int del_accepted(TCP_Server *TCP_server, int index)
         return -1;
     }
 
+    timer_free(TCP_server->timers, TCP_server->accepted_connection_array[index].ping_timer);
     crypto_memzero(&TCP_server->accepted_connection_array[index], sizeof(TCP_Secure_Connection));
     --TCP_server->num_accepted_connections;
 
@@ -1045,8 +1060,8 @@ static Socket new_listening_TCP_socket(int family, uint16_t port)
     return sock;
 }
 
-TCP_Server *new_TCP_server(uint8_t ipv6_enabled, uint16_t num_sockets, const uint16_t *ports, const uint8_t *secret_key,
-                           Onion *onion)
+TCP_Server *new_TCP_server(Mono_Time *mono_time, uint8_t ipv6_enabled, uint16_t num_sockets, const uint16_t *ports,
+                           const uint8_t *secret_key, Onion *onion)
 {
     if (num_sockets == 0 || ports == NULL) {
         return NULL;
@@ -1128,6 +1143,15 @@ TCP_Server *new_TCP_server(uint8_t ipv6_enabled, uint16_t num_sockets, const uin
 
     bs_list_init(&temp->accepted_key_list, CRYPTO_PUBLIC_KEY_SIZE, 8);
 
+    temp->mono_time = mono_time;
+    mono_time_update(mono_time);
+    temp->timers = new_timer_wheel(mono_time_get(mono_time));
+
+    if (temp->timers == NULL) {
+        kill_TCP_server(temp);
+        return NULL;
+    }
+
     return temp;
 }
 
@@ -1238,50 +1262,77 @@ static void do_TCP_unconfirmed(TCP_Server *TCP_server)
     }
 }
 
-static void do_TCP_confirmed(TCP_Server *TCP_server)
+/* Ping an accepted connection every TCP_PING_FREQUENCY seconds and kill it if
+ * it does not answer within TCP_PING_TIMEOUT seconds.
+ */
+static void do_TCP_ping(void *object, uint32_t index, void *userdata)
 {
-#ifdef TCP_SERVER_USE_EPOLL
+    TCP_Server *TCP_server = (TCP_Server *)object;
+    TCP_Secure_Connection *conn = &TCP_server->accepted_connection_array[index];
 
-    if (TCP_server->last_run_pinged == unix_time()) {
+    if (conn->status != TCP_STATUS_CONFIRMED) {
         return;
     }
 
-    TCP_server->last_run_pinged = unix_time();
-#endif
-    uint32_t i;
+    uint64_t next_run = conn->last_pinged + TCP_PING_FREQUENCY;
 
-    for (i = 0; i < TCP_server->size_accepted_connections; ++i) {
-        TCP_Secure_Connection *conn = &TCP_server->accepted_connection_array[i];
+    if (mono_time_is_timeout(TCP_server->mono_time, conn->last_pinged, TCP_PING_FREQUENCY)) {
+        uint8_t ping[1 + sizeof(uint64_t)];
+        ping[0] = TCP_PACKET_PING;
+        uint64_t ping_id = random_64b();
 
-        if (conn->status != TCP_STATUS_CONFIRMED) {
-            continue;
+        if (!ping_id) {
+            ++ping_id;
         }
 
-        if (is_timeout(conn->last_pinged, TCP_PING_FREQUENCY)) {
-            uint8_t ping[1 + sizeof(uint64_t)];
-            ping[0] = TCP_PACKET_PING;
-            uint64_t ping_id = random_64b();
+        memcpy(ping + 1, &ping_id, sizeof(uint64_t));
+        int ret = write_packet_TCP_secure_connection(conn, ping, sizeof(ping), 1);
 
-            if (!ping_id) {
-                ++ping_id;
+        if (ret == 1) {
+            conn->last_pinged = mono_time_get(TCP_server->mono_time);
+            conn->ping_id = ping_id;
+            next_run = conn->last_pinged + TCP_PING_FREQUENCY;
+        } else {
+            if (mono_time_is_timeout(TCP_server->mono_time, conn->last_pinged, TCP_PING_FREQUENCY + TCP_PING_TIMEOUT)) {
+                kill_accepted(TCP_server, index);
+                return;
             }
 
-            memcpy(ping + 1, &ping_id, sizeof(uint64_t));
-            int ret = write_packet_TCP_secure_connection(conn, ping, sizeof(ping), 1);
+            /* Try again next second. */
+            next_run = mono_time_get(TCP_server->mono_time) + 1;
+        }
+    }
 
-            if (ret == 1) {
-                conn->last_pinged = unix_time();
-                conn->ping_id = ping_id;
-            } else {
-                if (is_timeout(conn->last_pinged, TCP_PING_FREQUENCY + TCP_PING_TIMEOUT)) {
-                    kill_accepted(TCP_server, i);
-                    continue;
-                }
-            }
+    if (conn->ping_id) {
+        if (mono_time_is_timeout(TCP_server->mono_time, conn->last_pinged, TCP_PING_TIMEOUT)) {
+            kill_accepted(TCP_server, index);
+            return;
         }
 
-        if (conn->ping_id && is_timeout(conn->last_pinged, TCP_PING_TIMEOUT)) {
-            kill_accepted(TCP_server, i);
+        if (conn->last_pinged + TCP_PING_TIMEOUT < next_run) {
+            next_run = conn->last_pinged + TCP_PING_TIMEOUT;
+        }
+    }
+
+    timer_start(TCP_server->timers, conn->ping_timer, next_run);
+}
+
+static void do_TCP_confirmed(TCP_Server *TCP_server)
+{
+#ifdef TCP_SERVER_USE_EPOLL
+
+    if (TCP_server->last_run_pinged == mono_time_get(TCP_server->mono_time)) {
+        return;
+    }
+
+    TCP_server->last_run_pinged = mono_time_get(TCP_server->mono_time);
+#endif
+    uint32_t i;
+
+    for (i = 0; i < TCP_server->size_accepted_connections; ++i) {
+        TCP_Secure_Connection *conn = &TCP_server->accepted_connection_array[i];
+
+        if (conn->status != TCP_STATUS_CONFIRMED) {
             continue;
         }
 
@@ -1420,7 +1471,7 @@ static void do_TCP_epoll(TCP_Server *TCP_server)
 
 void do_TCP_server(TCP_Server *TCP_server)
 {
-    unix_time_update();
+    mono_time_update(TCP_server->mono_time);
 
 #ifdef TCP_SERVER_USE_EPOLL
     do_TCP_epoll(TCP_server);
@@ -1431,9 +1482,75 @@ void do_TCP_server(TCP_Server *TCP_server)
     do_TCP_unconfirmed(TCP_server);
 #endif
 
+    timer_wheel_run(TCP_server->timers, mono_time_get(TCP_server->mono_time), NULL);
     do_TCP_confirmed(TCP_server);
 }
 
+static uint32_t add_server_socket(Socket *socks, uint32_t max, uint32_t count, Socket sock)
+{
+    if (count < max) {
+        socks[count] = sock;
+    }
+
+    return count + 1;
+}
+
+#ifndef TCP_SERVER_USE_EPOLL
+static uint32_t add_queue_sockets(const TCP_Secure_Connection *queue, Socket *socks, uint32_t max, uint32_t count)
+{
+    uint32_t i;
+
+    for (i = 0; i < MAX_INCOMING_CONNECTIONS; ++i) {
+        if (queue[i].status != TCP_STATUS_NO_STATUS) {
+            count = add_server_socket(socks, max, count, queue[i].sock);
+        }
+    }
+
+    return count;
+}
+#endif
+
+uint32_t tcp_server_sockets(const TCP_Server *TCP_server, Socket *socks, uint32_t max)
+{
+#ifdef TCP_SERVER_USE_EPOLL
+    return add_server_socket(socks, max, 0, TCP_server->efd);
+#else
+    uint32_t count = 0;
+    uint32_t i;
+
+    for (i = 0; i < TCP_server->num_listening_socks; ++i) {
+        count = add_server_socket(socks, max, count, TCP_server->socks_listening[i]);
+    }
+
+    count = add_queue_sockets(TCP_server->incoming_connection_queue, socks, max, count);
+    count = add_queue_sockets(TCP_server->unconfirmed_connection_queue, socks, max, count);
+
+    for (i = 0; i < TCP_server->size_accepted_connections; ++i) {
+        if (TCP_server->accepted_connection_array[i].status != TCP_STATUS_NO_STATUS) {
+            count = add_server_socket(socks, max, count, TCP_server->accepted_connection_array[i].sock);
+        }
+    }
+
+    return count;
+#endif
+}
+
+bool tcp_server_has_pending_data(const TCP_Server *TCP_server)
+{
+    uint32_t i;
+
+    for (i = 0; i < TCP_server->size_accepted_connections; ++i) {
+        const TCP_Secure_Connection *conn = &TCP_server->accepted_connection_array[i];
+
+        if (conn->status == TCP_STATUS_CONFIRMED
+                && (conn->last_packet_length != 0 || conn->priority_queue_start != NULL)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
 void kill_TCP_server(TCP_Server *TCP_server)
 {
     uint32_t i;
@@ -1452,6 +1569,7 @@ void kill_TCP_server(TCP_Server *TCP_server)
     close(TCP_server->efd);
 #endif
 
+    kill_timer_wheel(TCP_server->timers);
     free(TCP_server->socks_listening);
     free(TCP_server->accepted_connection_array);
     free(TCP_server);
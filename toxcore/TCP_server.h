@@ -113,6 +113,7 @@ typedef struct TCP_Secure_Connection {
 
     uint64_t last_pinged;
     uint64_t ping_id;
+    uint32_t ping_timer; /* Fires when the connection is due for a ping or has timed out. */
 } TCP_Secure_Connection;
 
 
@@ -123,8 +124,8 @@ size_t tcp_server_listen_count(const TCP_Server *tcp_server);
 
 /* Create new TCP server instance.
  */
-TCP_Server *new_TCP_server(uint8_t ipv6_enabled, uint16_t num_sockets, const uint16_t *ports, const uint8_t *secret_key,
-                           Onion *onion);
+TCP_Server *new_TCP_server(Mono_Time *mono_time, uint8_t ipv6_enabled, uint16_t num_sockets, const uint16_t *ports,
+                           const uint8_t *secret_key, Onion *onion);
 
 /* Run the TCP_server
  */
@@ -134,6 +135,18 @@ void do_TCP_server(TCP_Server *TCP_server);
  */
 void kill_TCP_server(TCP_Server *TCP_server);
 
+/* Copy up to max of the sockets the server waits on for connections and data
+ * into socks. With epoll, this is the epoll descriptor only.
+ *
+ * return the number of sockets the server has, which can be more than max.
+ */
+uint32_t tcp_server_sockets(const TCP_Server *TCP_server, Socket *socks, uint32_t max);
+
+/* return true if data of an accepted connection waits for its socket to
+ * become writable.
+ */
+bool tcp_server_has_pending_data(const TCP_Server *TCP_server);
+
 /* return the amount of data in the tcp recv buffer.
  * return 0 on failure.
  */
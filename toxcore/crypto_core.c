@@ -126,6 +126,13 @@ int32_t encrypt_data_symmetric(const uint8_t *secret_key, const uint8_t *nonce,
         return -1;
     }
 
+#ifndef VANILLA_NACL
+
+    if (crypto_box_easy_afternm(encrypted, plain, length, nonce, secret_key) != 0) {
+        return -1;
+    }
+
+#else
     VLA(uint8_t, temp_plain, length + crypto_box_ZEROBYTES);
     VLA(uint8_t, temp_encrypted, length + crypto_box_MACBYTES + crypto_box_BOXZEROBYTES);
 
@@ -138,6 +145,7 @@ int32_t encrypt_data_symmetric(const uint8_t *secret_key, const uint8_t *nonce,
 
     /* Unpad the encrypted message. */
     memcpy(encrypted, temp_encrypted + crypto_box_BOXZEROBYTES, length + crypto_box_MACBYTES);
+#endif
     return length + crypto_box_MACBYTES;
 }
 
@@ -148,6 +156,13 @@ int32_t decrypt_data_symmetric(const uint8_t *secret_key, const uint8_t *nonce,
         return -1;
     }
 
+#ifndef VANILLA_NACL
+
+    if (crypto_box_open_easy_afternm(plain, encrypted, length, nonce, secret_key) != 0) {
+        return -1;
+    }
+
+#else
     VLA(uint8_t, temp_plain, length + crypto_box_ZEROBYTES);
     VLA(uint8_t, temp_encrypted, length + crypto_box_BOXZEROBYTES);
 
@@ -159,9 +174,62 @@ int32_t decrypt_data_symmetric(const uint8_t *secret_key, const uint8_t *nonce,
     }
 
     memcpy(plain, temp_plain + crypto_box_ZEROBYTES, length - crypto_box_MACBYTES);
+#endif
     return length - crypto_box_MACBYTES;
 }
 
+int32_t encrypt_data_symmetric_detached(const uint8_t *shared_key, const uint8_t *nonce, uint8_t *data, size_t length,
+                                        uint8_t *mac)
+{
+    if (length == 0 || !shared_key || !nonce || !data || !mac) {
+        return -1;
+    }
+
+#ifndef VANILLA_NACL
+
+    if (crypto_box_detached_afternm(data, mac, data, length, nonce, shared_key) != 0) {
+        return -1;
+    }
+
+#else
+    VLA(uint8_t, temp_encrypted, length + crypto_box_MACBYTES);
+
+    if (encrypt_data_symmetric(shared_key, nonce, data, length, temp_encrypted) == -1) {
+        return -1;
+    }
+
+    memcpy(mac, temp_encrypted, crypto_box_MACBYTES);
+    memcpy(data, temp_encrypted + crypto_box_MACBYTES, length);
+#endif
+    return length;
+}
+
+int32_t decrypt_data_symmetric_detached(const uint8_t *shared_key, const uint8_t *nonce, uint8_t *data, size_t length,
+                                        const uint8_t *mac)
+{
+    if (length == 0 || !shared_key || !nonce || !data || !mac) {
+        return -1;
+    }
+
+#ifndef VANILLA_NACL
+
+    if (crypto_box_open_detached_afternm(data, data, mac, length, nonce, shared_key) != 0) {
+        return -1;
+    }
+
+#else
+    VLA(uint8_t, temp_encrypted, length + crypto_box_MACBYTES);
+    memcpy(temp_encrypted, mac, crypto_box_MACBYTES);
+    memcpy(temp_encrypted + crypto_box_MACBYTES, data, length);
+
+    if (decrypt_data_symmetric(shared_key, nonce, temp_encrypted, length + crypto_box_MACBYTES, data) == -1) {
+        return -1;
+    }
+
+#endif
+    return length;
+}
+
 int32_t encrypt_data(const uint8_t *public_key, const uint8_t *secret_key, const uint8_t *nonce,
                      const uint8_t *plain, size_t length, uint8_t *encrypted)
 {
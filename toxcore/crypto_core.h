@@ -187,6 +187,8 @@ int32_t encrypt_precompute(const uint8_t *public_key, const uint8_t *secret_key,
  * using a shared key CRYPTO_SYMMETRIC_KEY_SIZE big and a CRYPTO_NONCE_SIZE
  * byte nonce.
  *
+ * plain and encrypted may be the same buffer.
+ *
  * @return -1 if there was a problem, length of encrypted data if everything
  * was fine.
  */
@@ -198,12 +200,38 @@ int32_t encrypt_data_symmetric(const uint8_t *shared_key, const uint8_t *nonce,
  * CRYPTO_MAC_SIZE using a shared key CRYPTO_SHARED_KEY_SIZE big and a
  * CRYPTO_NONCE_SIZE byte nonce.
  *
+ * encrypted and plain may be the same buffer.
+ *
  * @return -1 if there was a problem (decryption failed), length of plain data
  * if everything was fine.
  */
 int32_t decrypt_data_symmetric(const uint8_t *shared_key, const uint8_t *nonce, const uint8_t *encrypted, size_t length,
                                uint8_t *plain);
 
+/**
+ * Encrypts data of length length in place and puts its CRYPTO_MAC_SIZE byte
+ * MAC in mac, using a shared key CRYPTO_SHARED_KEY_SIZE big and a
+ * CRYPTO_NONCE_SIZE byte nonce.
+ *
+ * mac followed by data is what encrypt_data_symmetric() produces, so a packet
+ * can be built by writing its plain text right after room for the MAC.
+ *
+ * @return -1 if there was a problem, length if everything was fine.
+ */
+int32_t encrypt_data_symmetric_detached(const uint8_t *shared_key, const uint8_t *nonce, uint8_t *data, size_t length,
+                                        uint8_t *mac);
+
+/**
+ * Decrypts data of length length in place after checking it against its
+ * CRYPTO_MAC_SIZE byte mac, using a shared key CRYPTO_SHARED_KEY_SIZE big and
+ * a CRYPTO_NONCE_SIZE byte nonce.
+ *
+ * @return -1 if there was a problem (decryption failed), length if everything
+ * was fine.
+ */
+int32_t decrypt_data_symmetric_detached(const uint8_t *shared_key, const uint8_t *nonce, uint8_t *data, size_t length,
+                                        const uint8_t *mac);
+
 /**
  * Increment the given nonce by 1 in big endian (rightmost byte incremented
  * first).
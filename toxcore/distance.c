@@ -0,0 +1,274 @@
+/*
+ * XOR distance between public keys, vectorized where the CPU allows it.
+ *
+ * Every comparison comes down to finding the first byte at which two keys
+ * differ: the keys agree on all the bits before it, so that byte alone tells
+ * which key is closer and how long the common prefix is.
+ */
+
+/*
+ * Copyright © 2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "distance.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DISTANCE_X86 1
+#include <immintrin.h>
+#endif
+
+typedef struct {
+    /* Return the index of the first byte pk1 and pk2 differ at, or
+     * CRYPTO_PUBLIC_KEY_SIZE if they are equal. */
+    unsigned int (*first_diff)(const uint8_t *pk1, const uint8_t *pk2);
+    void (*common_prefix_batch)(const uint8_t *base, const uint8_t *keys, size_t stride, uint32_t count,
+                                uint16_t *prefixes);
+} Distance_Funcs;
+
+/* Return the common prefix of pk1 and pk2 in bits given the first byte they
+ * differ at.
+ */
+static uint16_t prefix_bits(const uint8_t *pk1, const uint8_t *pk2, unsigned int byte)
+{
+    if (byte == CRYPTO_PUBLIC_KEY_SIZE) {
+        return CRYPTO_PUBLIC_KEY_SIZE * 8;
+    }
+
+    const uint8_t diff = pk1[byte] ^ pk2[byte];
+#if defined(__GNUC__)
+    return byte * 8 + __builtin_clz(diff) - (sizeof(unsigned int) - 1) * 8;
+#else
+    uint16_t bits = byte * 8;
+
+    for (uint8_t mask = 0x80; !(diff & mask); mask >>= 1) {
+        ++bits;
+    }
+
+    return bits;
+#endif
+}
+
+static unsigned int first_diff_generic(const uint8_t *pk1, const uint8_t *pk2)
+{
+    for (unsigned int i = 0; i < CRYPTO_PUBLIC_KEY_SIZE; i += sizeof(uint64_t)) {
+        uint64_t word1;
+        uint64_t word2;
+        memcpy(&word1, pk1 + i, sizeof(uint64_t));
+        memcpy(&word2, pk2 + i, sizeof(uint64_t));
+
+        if (word1 != word2) {
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            return i + __builtin_ctzll(word1 ^ word2) / 8;
+#else
+
+            while (pk1[i] == pk2[i]) {
+                ++i;
+            }
+
+            return i;
+#endif
+        }
+    }
+
+    return CRYPTO_PUBLIC_KEY_SIZE;
+}
+
+static void common_prefix_batch_generic(const uint8_t *base, const uint8_t *keys, size_t stride, uint32_t count,
+                                        uint16_t *prefixes)
+{
+    for (uint32_t i = 0; i < count; ++i) {
+        const uint8_t *pk = keys + i * stride;
+        prefixes[i] = prefix_bits(base, pk, first_diff_generic(base, pk));
+    }
+}
+
+static const Distance_Funcs distance_generic = { first_diff_generic, common_prefix_batch_generic };
+
+#ifdef DISTANCE_X86
+
+/* Turn a mask with a bit set for every equal byte into the index of the first
+ * differing byte.
+ */
+static unsigned int first_unset_bit(uint32_t equal)
+{
+    if (equal == UINT32_MAX) {
+        return CRYPTO_PUBLIC_KEY_SIZE;
+    }
+
+    return __builtin_ctz(~equal);
+}
+
+__attribute__((target("sse2")))
+static uint32_t equal_bytes_sse2(__m128i lo, __m128i hi, const uint8_t *pk)
+{
+    const __m128i eq_lo = _mm_cmpeq_epi8(lo, _mm_loadu_si128((const __m128i *)pk));
+    const __m128i eq_hi = _mm_cmpeq_epi8(hi, _mm_loadu_si128((const __m128i *)(pk + 16)));
+    return (uint32_t)_mm_movemask_epi8(eq_lo) | ((uint32_t)_mm_movemask_epi8(eq_hi) << 16);
+}
+
+__attribute__((target("sse2")))
+static unsigned int first_diff_sse2(const uint8_t *pk1, const uint8_t *pk2)
+{
+    const __m128i lo = _mm_loadu_si128((const __m128i *)pk1);
+    const __m128i hi = _mm_loadu_si128((const __m128i *)(pk1 + 16));
+    return first_unset_bit(equal_bytes_sse2(lo, hi, pk2));
+}
+
+/* The batch kernels load base once and only load and compare the keys in the
+ * loop. */
+__attribute__((target("sse2")))
+static void common_prefix_batch_sse2(const uint8_t *base, const uint8_t *keys, size_t stride, uint32_t count,
+                                     uint16_t *prefixes)
+{
+    const __m128i lo = _mm_loadu_si128((const __m128i *)base);
+    const __m128i hi = _mm_loadu_si128((const __m128i *)(base + 16));
+
+    for (uint32_t i = 0; i < count; ++i) {
+        const uint8_t *pk = keys + i * stride;
+        prefixes[i] = prefix_bits(base, pk, first_unset_bit(equal_bytes_sse2(lo, hi, pk)));
+    }
+}
+
+__attribute__((target("avx2")))
+static unsigned int first_diff_avx2(const uint8_t *pk1, const uint8_t *pk2)
+{
+    const __m256i eq = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)pk1),
+                                         _mm256_loadu_si256((const __m256i *)pk2));
+    return first_unset_bit((uint32_t)_mm256_movemask_epi8(eq));
+}
+
+__attribute__((target("avx2")))
+static void common_prefix_batch_avx2(const uint8_t *base, const uint8_t *keys, size_t stride, uint32_t count,
+                                     uint16_t *prefixes)
+{
+    const __m256i b = _mm256_loadu_si256((const __m256i *)base);
+
+    for (uint32_t i = 0; i < count; ++i) {
+        const uint8_t *pk = keys + i * stride;
+        const __m256i eq = _mm256_cmpeq_epi8(b, _mm256_loadu_si256((const __m256i *)pk));
+        prefixes[i] = prefix_bits(base, pk, first_unset_bit((uint32_t)_mm256_movemask_epi8(eq)));
+    }
+}
+
+static const Distance_Funcs distance_sse2 = { first_diff_sse2, common_prefix_batch_sse2 };
+static const Distance_Funcs distance_avx2 = { first_diff_avx2, common_prefix_batch_avx2 };
+
+#endif /* DISTANCE_X86 */
+
+/* Selected once by distance_init(), before any DHT instance exists. */
+static const Distance_Funcs *distance_funcs = &distance_generic;
+static pthread_once_t distance_once = PTHREAD_ONCE_INIT;
+static Distance_Impl distance_current_impl = DISTANCE_IMPL_GENERIC;
+
+static const Distance_Funcs *impl_funcs(Distance_Impl impl)
+{
+    switch (impl) {
+        case DISTANCE_IMPL_GENERIC:
+            return &distance_generic;
+
+#ifdef DISTANCE_X86
+
+        case DISTANCE_IMPL_SSE2:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("sse2") ? &distance_sse2 : NULL;
+
+        case DISTANCE_IMPL_AVX2:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx2") ? &distance_avx2 : NULL;
+#endif
+
+        default:
+            return NULL;
+    }
+}
+
+bool distance_use_impl(Distance_Impl impl)
+{
+    const Distance_Funcs *funcs = impl_funcs(impl);
+
+    if (funcs == NULL) {
+        return false;
+    }
+
+    distance_current_impl = impl;
+    distance_funcs = funcs;
+    return true;
+}
+
+static void distance_select_best(void)
+{
+    if (!distance_use_impl(DISTANCE_IMPL_AVX2) && !distance_use_impl(DISTANCE_IMPL_SSE2)) {
+        distance_use_impl(DISTANCE_IMPL_GENERIC);
+    }
+}
+
+void distance_init(void)
+{
+    pthread_once(&distance_once, &distance_select_best);
+}
+
+Distance_Impl distance_impl(void)
+{
+    return distance_current_impl;
+}
+
+const char *distance_impl_name(Distance_Impl impl)
+{
+    switch (impl) {
+        case DISTANCE_IMPL_GENERIC:
+            return "generic";
+
+        case DISTANCE_IMPL_SSE2:
+            return "sse2";
+
+        case DISTANCE_IMPL_AVX2:
+            return "avx2";
+    }
+
+    return "unknown";
+}
+
+unsigned int pk_common_prefix(const uint8_t *pk1, const uint8_t *pk2)
+{
+    return prefix_bits(pk1, pk2, distance_funcs->first_diff(pk1, pk2));
+}
+
+int pk_distance_cmp(const uint8_t *base, const uint8_t *pk1, const uint8_t *pk2)
+{
+    const unsigned int i = distance_funcs->first_diff(pk1, pk2);
+
+    if (i == CRYPTO_PUBLIC_KEY_SIZE) {
+        return 0;
+    }
+
+    /* pk1 and pk2 differ first at byte i, so the key whose byte i is closer to
+     * the one of base is closer. */
+    return (base[i] ^ pk1[i]) < (base[i] ^ pk2[i]) ? -1 : 1;
+}
+
+void pk_common_prefix_batch(const uint8_t *base, const uint8_t *keys, size_t stride, uint32_t count,
+                            uint16_t *prefixes)
+{
+    distance_funcs->common_prefix_batch(base, keys, stride, count, prefixes);
+}
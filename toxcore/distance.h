@@ -0,0 +1,81 @@
+/*
+ * XOR distance between public keys, vectorized where the CPU allows it.
+ */
+
+/*
+ * Copyright © 2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef DISTANCE_H
+#define DISTANCE_H
+
+#include "crypto_core.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum {
+    DISTANCE_IMPL_GENERIC,
+    DISTANCE_IMPL_SSE2,
+    DISTANCE_IMPL_AVX2
+} Distance_Impl;
+
+/* Return the number of leading bits pk1 and pk2 have in common, which is the
+ * number of leading zero bits of their XOR distance.
+ *
+ * return CRYPTO_PUBLIC_KEY_SIZE * 8 if the keys are equal.
+ */
+unsigned int pk_common_prefix(const uint8_t *pk1, const uint8_t *pk2);
+
+/* Compare the XOR distances of pk1 and pk2 to base.
+ *
+ * return -1 if pk1 is closer.
+ * return 1 if pk2 is closer.
+ * return 0 if both are the same distance.
+ */
+int pk_distance_cmp(const uint8_t *base, const uint8_t *pk1, const uint8_t *pk2);
+
+/* For each of the count keys found every stride bytes from keys, store the
+ * number of leading bits it has in common with base into prefixes. The larger
+ * the common prefix, the closer the key is to base.
+ */
+void pk_common_prefix_batch(const uint8_t *base, const uint8_t *keys, size_t stride, uint32_t count,
+                            uint16_t *prefixes);
+
+/* Pick the best implementation supported by the CPU. Only the first call does
+ * anything. new_DHT() calls it so that the choice is made before any thread
+ * can compare keys; until then the generic implementation is used.
+ */
+void distance_init(void);
+
+/* Return the implementation in use.
+ */
+Distance_Impl distance_impl(void);
+
+/* Return the name of impl.
+ */
+const char *distance_impl_name(Distance_Impl impl);
+
+/* Force the use of impl, mainly for tests and benchmarks. Must not be called
+ * while other threads compare keys.
+ *
+ * return false if impl isn't supported by this build or CPU.
+ */
+bool distance_use_impl(Distance_Impl impl);
+
+#endif
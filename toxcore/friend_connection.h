@@ -95,6 +95,7 @@ typedef struct {
 
 
 typedef struct {
+    const Mono_Time *mono_time;
     Net_Crypto *net_crypto;
     DHT *dht;
     Onion_Client *onion_c;
@@ -198,7 +199,8 @@ void set_friend_request_callback(Friend_Connections *fr_c, int (*fr_request_call
                                  const uint8_t *, uint16_t, void *), void *object);
 
 /* Create new friend_connections instance. */
-Friend_Connections *new_friend_connections(Onion_Client *onion_c, bool local_discovery_enabled);
+Friend_Connections *new_friend_connections(const Mono_Time *mono_time, Onion_Client *onion_c,
+        bool local_discovery_enabled);
 
 /* main friend_connections loop. */
 void do_friend_connections(Friend_Connections *fr_c, void *userdata);
@@ -449,7 +449,7 @@ static int addpeer(Group_Chats *g_c, int groupnumber, const uint8_t *real_pk, co
     id_copy(g->group[g->numpeers].temp_pk, temp_pk);
     g->group[g->numpeers].peer_number = peer_number;
 
-    g->group[g->numpeers].last_recv = unix_time();
+    g->group[g->numpeers].last_recv = mono_time_get(g_c->m->mono_time);
     ++g->numpeers;
 
     add_to_closest(g_c, groupnumber, real_pk, temp_pk);
@@ -2034,7 +2034,7 @@ static void handle_message_packet_group(Group_Chats *g_c, int groupnumber, const
                 return;
             }
 
-            g->group[index].last_recv = unix_time();
+            g->group[index].last_recv = mono_time_get(g_c->m->mono_time);
         }
         break;
 
@@ -2386,9 +2386,9 @@ static int ping_groupchat(Group_Chats *g_c, int groupnumber)
         return -1;
     }
 
-    if (is_timeout(g->last_sent_ping, GROUP_PING_INTERVAL)) {
+    if (mono_time_is_timeout(g_c->m->mono_time, g->last_sent_ping, GROUP_PING_INTERVAL)) {
         if (group_ping_send(g_c, groupnumber) != -1) { /* Ping */
-            g->last_sent_ping = unix_time();
+            g->last_sent_ping = mono_time_get(g_c->m->mono_time);
         }
     }
 
@@ -2406,7 +2406,8 @@ static int groupchat_clear_timedout(Group_Chats *g_c, int groupnumber, void *use
     uint32_t i;
 
     for (i = 0; i < g->numpeers; ++i) {
-        if (g->peer_number != g->group[i].peer_number && is_timeout(g->group[i].last_recv, GROUP_PING_INTERVAL * 3)) {
+        if (g->peer_number != g->group[i].peer_number
+                && mono_time_is_timeout(g_c->m->mono_time, g->group[i].last_recv, GROUP_PING_INTERVAL * 3)) {
             delpeer(g_c, groupnumber, i, userdata);
         }
 
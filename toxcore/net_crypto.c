@@ -119,10 +119,11 @@ static int create_cookie_request(const Net_Crypto *c, uint8_t *packet, uint8_t *
  * return -1 on failure.
  * return 0 on success.
  */
-static int create_cookie(uint8_t *cookie, const uint8_t *bytes, const uint8_t *encryption_key)
+static int create_cookie(const Mono_Time *mono_time, uint8_t *cookie, const uint8_t *bytes,
+                         const uint8_t *encryption_key)
 {
     uint8_t contents[COOKIE_CONTENTS_LENGTH];
-    uint64_t temp_time = unix_time();
+    uint64_t temp_time = mono_time_get(mono_time);
     memcpy(contents, &temp_time, sizeof(temp_time));
     memcpy(contents + sizeof(temp_time), bytes, COOKIE_DATA_LENGTH);
     random_nonce(cookie);
@@ -140,7 +141,7 @@ static int create_cookie(uint8_t *cookie, const uint8_t *bytes, const uint8_t *e
  * return -1 on failure.
  * return 0 on success.
  */
-static int open_cookie(uint8_t *bytes, const uint8_t *cookie, const uint8_t *encryption_key)
+static int open_cookie(const Mono_Time *mono_time, uint8_t *bytes, const uint8_t *cookie, const uint8_t *encryption_key)
 {
     uint8_t contents[COOKIE_CONTENTS_LENGTH];
     int len = decrypt_data_symmetric(encryption_key, cookie, cookie + CRYPTO_NONCE_SIZE,
@@ -152,7 +153,7 @@ static int open_cookie(uint8_t *bytes, const uint8_t *cookie, const uint8_t *enc
 
     uint64_t cookie_time;
     memcpy(&cookie_time, contents, sizeof(cookie_time));
-    uint64_t temp_time = unix_time();
+    uint64_t temp_time = mono_time_get(mono_time);
 
     if (cookie_time + COOKIE_TIMEOUT < temp_time || temp_time < cookie_time) {
         return -1;
@@ -178,7 +179,7 @@ static int create_cookie_response(const Net_Crypto *c, uint8_t *packet, const ui
     memcpy(cookie_plain + CRYPTO_PUBLIC_KEY_SIZE, dht_public_key, CRYPTO_PUBLIC_KEY_SIZE);
     uint8_t plain[COOKIE_LENGTH + sizeof(uint64_t)];
 
-    if (create_cookie(plain, cookie_plain, c->secret_symmetric_key) != 0) {
+    if (create_cookie(c->mono_time, plain, cookie_plain, c->secret_symmetric_key) != 0) {
         return -1;
     }
 
@@ -345,8 +346,8 @@ static int create_crypto_handshake(const Net_Crypto *c, uint8_t *packet, const u
     memcpy(cookie_plain, peer_real_pk, CRYPTO_PUBLIC_KEY_SIZE);
     memcpy(cookie_plain + CRYPTO_PUBLIC_KEY_SIZE, peer_dht_pubkey, CRYPTO_PUBLIC_KEY_SIZE);
 
-    if (create_cookie(plain + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_SHA512_SIZE, cookie_plain,
-                      c->secret_symmetric_key) != 0) {
+    if (create_cookie(c->mono_time, plain + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_SHA512_SIZE,
+                      cookie_plain, c->secret_symmetric_key) != 0) {
         return -1;
     }
 
@@ -391,7 +392,7 @@ static int handle_crypto_handshake(const Net_Crypto *c, uint8_t *nonce, uint8_t
 
     uint8_t cookie_plain[COOKIE_DATA_LENGTH];
 
-    if (open_cookie(cookie_plain, packet + 1, c->secret_symmetric_key) != 0) {
+    if (open_cookie(c->mono_time, cookie_plain, packet + 1, c->secret_symmetric_key) != 0) {
         return -1;
     }
 
@@ -490,7 +491,7 @@ static IP_Port return_ip_port_connection(Net_Crypto *c, int crypt_connection_id)
         return empty;
     }
 
-    uint64_t current_time = unix_time();
+    uint64_t current_time = mono_time_get(c->mono_time);
     bool v6 = 0, v4 = 0;
 
     if ((UDP_DIRECT_TIMEOUT + conn->direct_lastrecv_timev4) > current_time) {
@@ -551,13 +552,13 @@ static int send_packet_to(Net_Crypto *c, int crypt_connection_id, const uint8_t
         }
 
         // TODO(irungentoo): a better way of sending packets directly to confirm the others ip.
-        uint64_t current_time = unix_time();
+        uint64_t current_time = mono_time_get(c->mono_time);
 
         if ((((UDP_DIRECT_TIMEOUT / 2) + conn->direct_send_attempt_time) > current_time && length < 96)
                 || data[0] == NET_PACKET_COOKIE_REQUEST || data[0] == NET_PACKET_CRYPTO_HS) {
             if ((uint32_t)sendpacket(c->dht->net, ip_port, data, length) == length) {
                 direct_send_attempt = 1;
-                conn->direct_send_attempt_time = unix_time();
+                conn->direct_send_attempt_time = mono_time_get(c->mono_time);
             }
         }
     }
@@ -570,7 +571,7 @@ static int send_packet_to(Net_Crypto *c, int crypt_connection_id, const uint8_t
     pthread_mutex_lock(&conn->mutex);
 
     if (ret == 0) {
-        conn->last_tcp_sent = current_time_monotonic();
+        conn->last_tcp_sent = mono_time_monotonic(c->mono_time);
     }
 
     pthread_mutex_unlock(&conn->mutex);
@@ -585,6 +586,131 @@ static int send_packet_to(Net_Crypto *c, int crypt_connection_id, const uint8_t
 /** START: Array Related functions **/
 
 
+/* A Packet_Data while it is on the free list of its pool. */
+union Pooled_Packet_Data {
+    Packet_Data data;
+    union Pooled_Packet_Data *next_free;
+};
+
+/* Take a Packet_Data holding a copy of data from the pool.
+ *
+ * return NULL on failure.
+ */
+static Packet_Data *packet_data_new(Packet_Data_Pool *pool, const Packet_Data *data)
+{
+    pthread_mutex_lock(&pool->mutex);
+    union Pooled_Packet_Data *pooled = pool->free_list;
+
+    if (pooled != NULL) {
+        pool->free_list = pooled->next_free;
+        --pool->num_free;
+        ++pool->num_reused;
+    } else {
+        pooled = (union Pooled_Packet_Data *)malloc(sizeof(union Pooled_Packet_Data));
+
+        if (pooled == NULL) {
+            pthread_mutex_unlock(&pool->mutex);
+            return NULL;
+        }
+
+        ++pool->num_allocated;
+    }
+
+    ++pool->num_used;
+    pthread_mutex_unlock(&pool->mutex);
+
+    memcpy(&pooled->data, data, sizeof(Packet_Data));
+    return &pooled->data;
+}
+
+/* Give a Packet_Data taken with packet_data_new back to the pool. */
+static void packet_data_free(Packet_Data_Pool *pool, Packet_Data *data)
+{
+    union Pooled_Packet_Data *pooled = (union Pooled_Packet_Data *)data;
+
+    pthread_mutex_lock(&pool->mutex);
+    --pool->num_used;
+
+    if (pool->num_free >= pool->max_free) {
+        pthread_mutex_unlock(&pool->mutex);
+        free(pooled);
+        return;
+    }
+
+    pooled->next_free = pool->free_list;
+    pool->free_list = pooled;
+    ++pool->num_free;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+/* Free the unused Packet_Data of the pool above max_free. */
+static void packet_data_pool_trim(Packet_Data_Pool *pool, uint32_t max_free)
+{
+    pthread_mutex_lock(&pool->mutex);
+
+    while (pool->num_free > max_free) {
+        union Pooled_Packet_Data *pooled = pool->free_list;
+        pool->free_list = pooled->next_free;
+        --pool->num_free;
+        free(pooled);
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+/* return the slot of packet number in array. */
+static Packet_Data **packets_array_slot(const Packets_Array *array, uint32_t number)
+{
+    return &array->buffer[number & (array->capacity - 1)];
+}
+
+/* Make room in array for num_spots packet numbers from buffer_start on.
+ *
+ * This moves the slots of array. Any thread can grow the send array of a
+ * connection, so its slots must only be touched with the connection mutex
+ * held. The recv array is only used by the thread running do_net_crypto().
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int packets_array_reserve(Packets_Array *array, uint32_t num_spots)
+{
+    if (num_spots <= array->capacity) {
+        return 0;
+    }
+
+    if (num_spots > CRYPTO_PACKET_BUFFER_SIZE) {
+        num_spots = CRYPTO_PACKET_BUFFER_SIZE;
+    }
+
+    uint32_t capacity = array->capacity != 0 ? array->capacity : CRYPTO_MIN_PACKET_BUFFER_SIZE;
+
+    while (capacity < num_spots) {
+        capacity *= 2;
+    }
+
+    if (capacity == array->capacity) {
+        return 0;
+    }
+
+    Packet_Data **buffer = (Packet_Data **)calloc(capacity, sizeof(Packet_Data *));
+
+    if (buffer == NULL) {
+        return -1;
+    }
+
+    uint32_t i;
+
+    for (i = array->buffer_start; i != array->buffer_end; ++i) {
+        buffer[i & (capacity - 1)] = *packets_array_slot(array, i);
+    }
+
+    free(array->buffer);
+    array->buffer = buffer;
+    array->capacity = capacity;
+    return 0;
+}
+
 /* Return number of packets in array
  * Note that holes are counted too.
  */
@@ -598,26 +724,29 @@ static uint32_t num_packets_array(const Packets_Array *array)
  * return -1 on failure.
  * return 0 on success.
  */
-static int add_data_to_buffer(Packets_Array *array, uint32_t number, const Packet_Data *data)
+static int add_data_to_buffer(Packet_Data_Pool *pool, Packets_Array *array, uint32_t number, const Packet_Data *data)
 {
     if (number - array->buffer_start > CRYPTO_PACKET_BUFFER_SIZE) {
         return -1;
     }
 
-    uint32_t num = number % CRYPTO_PACKET_BUFFER_SIZE;
+    if (packets_array_reserve(array, number - array->buffer_start + 1) != 0) {
+        return -1;
+    }
 
-    if (array->buffer[num]) {
+    Packet_Data **slot = packets_array_slot(array, number);
+
+    if (*slot) {
         return -1;
     }
 
-    Packet_Data *new_d = (Packet_Data *)malloc(sizeof(Packet_Data));
+    Packet_Data *new_d = packet_data_new(pool, data);
 
     if (new_d == NULL) {
         return -1;
     }
 
-    memcpy(new_d, data, sizeof(Packet_Data));
-    array->buffer[num] = new_d;
+    *slot = new_d;
 
     if ((number - array->buffer_start) >= (array->buffer_end - array->buffer_start)) {
         array->buffer_end = number + 1;
@@ -640,13 +769,13 @@ static int get_data_pointer(const Packets_Array *array, Packet_Data **data, uint
         return -1;
     }
 
-    uint32_t num = number % CRYPTO_PACKET_BUFFER_SIZE;
+    Packet_Data *dt = *packets_array_slot(array, number);
 
-    if (!array->buffer[num]) {
+    if (!dt) {
         return 0;
     }
 
-    *data = array->buffer[num];
+    *data = dt;
     return 1;
 }
 
@@ -655,21 +784,24 @@ static int get_data_pointer(const Packets_Array *array, Packet_Data **data, uint
  * return -1 on failure.
  * return packet number on success.
  */
-static int64_t add_data_end_of_buffer(Packets_Array *array, const Packet_Data *data)
+static int64_t add_data_end_of_buffer(Packet_Data_Pool *pool, Packets_Array *array, const Packet_Data *data)
 {
     if (num_packets_array(array) >= CRYPTO_PACKET_BUFFER_SIZE) {
         return -1;
     }
 
-    Packet_Data *new_d = (Packet_Data *)malloc(sizeof(Packet_Data));
+    if (packets_array_reserve(array, num_packets_array(array) + 1) != 0) {
+        return -1;
+    }
+
+    Packet_Data *new_d = packet_data_new(pool, data);
 
     if (new_d == NULL) {
         return -1;
     }
 
-    memcpy(new_d, data, sizeof(Packet_Data));
     uint32_t id = array->buffer_end;
-    array->buffer[id % CRYPTO_PACKET_BUFFER_SIZE] = new_d;
+    *packets_array_slot(array, id) = new_d;
     ++array->buffer_end;
     return id;
 }
@@ -679,23 +811,23 @@ static int64_t add_data_end_of_buffer(Packets_Array *array, const Packet_Data *d
  * return -1 on failure.
  * return packet number on success.
  */
-static int64_t read_data_beg_buffer(Packets_Array *array, Packet_Data *data)
+static int64_t read_data_beg_buffer(Packet_Data_Pool *pool, Packets_Array *array, Packet_Data *data)
 {
     if (array->buffer_end == array->buffer_start) {
         return -1;
     }
 
-    uint32_t num = array->buffer_start % CRYPTO_PACKET_BUFFER_SIZE;
+    Packet_Data **slot = packets_array_slot(array, array->buffer_start);
 
-    if (!array->buffer[num]) {
+    if (!*slot) {
         return -1;
     }
 
-    memcpy(data, array->buffer[num], sizeof(Packet_Data));
+    memcpy(data, *slot, sizeof(Packet_Data));
     uint32_t id = array->buffer_start;
     ++array->buffer_start;
-    free(array->buffer[num]);
-    array->buffer[num] = NULL;
+    packet_data_free(pool, *slot);
+    *slot = NULL;
     return id;
 }
 
@@ -704,7 +836,7 @@ static int64_t read_data_beg_buffer(Packets_Array *array, Packet_Data *data)
  * return -1 on failure.
  * return 0 on success
  */
-static int clear_buffer_until(Packets_Array *array, uint32_t number)
+static int clear_buffer_until(Packet_Data_Pool *pool, Packets_Array *array, uint32_t number)
 {
     uint32_t num_spots = array->buffer_end - array->buffer_start;
 
@@ -715,11 +847,11 @@ static int clear_buffer_until(Packets_Array *array, uint32_t number)
     uint32_t i;
 
     for (i = array->buffer_start; i != number; ++i) {
-        uint32_t num = i % CRYPTO_PACKET_BUFFER_SIZE;
+        Packet_Data **slot = packets_array_slot(array, i);
 
-        if (array->buffer[num]) {
-            free(array->buffer[num]);
-            array->buffer[num] = NULL;
+        if (*slot) {
+            packet_data_free(pool, *slot);
+            *slot = NULL;
         }
     }
 
@@ -727,20 +859,24 @@ static int clear_buffer_until(Packets_Array *array, uint32_t number)
     return 0;
 }
 
-static int clear_buffer(Packets_Array *array)
+/* Delete all packets in array and free its slots. */
+static int clear_buffer(Packet_Data_Pool *pool, Packets_Array *array)
 {
     uint32_t i;
 
     for (i = array->buffer_start; i != array->buffer_end; ++i) {
-        uint32_t num = i % CRYPTO_PACKET_BUFFER_SIZE;
+        Packet_Data **slot = packets_array_slot(array, i);
 
-        if (array->buffer[num]) {
-            free(array->buffer[num]);
-            array->buffer[num] = NULL;
+        if (*slot) {
+            packet_data_free(pool, *slot);
+            *slot = NULL;
         }
     }
 
     array->buffer_start = i;
+    free(array->buffer);
+    array->buffer = NULL;
+    array->capacity = 0;
     return 0;
 }
 
@@ -759,6 +895,10 @@ static int set_buffer_end(Packets_Array *array, uint32_t number)
         return -1;
     }
 
+    if (packets_array_reserve(array, number - array->buffer_start) != 0) {
+        return -1;
+    }
+
     array->buffer_end = number;
     return 0;
 }
@@ -790,9 +930,7 @@ static int generate_request_packet(uint8_t *data, uint16_t length, const Packets
     uint32_t i, n = 1;
 
     for (i = recv_array->buffer_start; i != recv_array->buffer_end; ++i) {
-        uint32_t num = i % CRYPTO_PACKET_BUFFER_SIZE;
-
-        if (!recv_array->buffer[num]) {
+        if (!*packets_array_slot(recv_array, i)) {
             data[cur_len] = n;
             n = 0;
             ++cur_len;
@@ -822,8 +960,8 @@ static int generate_request_packet(uint8_t *data, uint16_t length, const Packets
  * return -1 on failure.
  * return number of requested packets on success.
  */
-static int handle_request_packet(Packets_Array *send_array, const uint8_t *data, uint16_t length,
-                                 uint64_t *latest_send_time, uint64_t rtt_time)
+static int handle_request_packet(const Mono_Time *mono_time, Packet_Data_Pool *pool, Packets_Array *send_array,
+                                 const uint8_t *data, uint16_t length, uint64_t *latest_send_time, uint64_t rtt_time)
 {
     if (length < 1) {
         return -1;
@@ -843,22 +981,22 @@ static int handle_request_packet(Packets_Array *send_array, const uint8_t *data,
     uint32_t i, n = 1;
     uint32_t requested = 0;
 
-    uint64_t temp_time = current_time_monotonic();
-    uint64_t l_sent_time = ~0;
+    uint64_t temp_time = mono_time_monotonic(mono_time);
+    uint64_t l_sent_time = 0;
 
     for (i = send_array->buffer_start; i != send_array->buffer_end; ++i) {
         if (length == 0) {
             break;
         }
 
-        uint32_t num = i % CRYPTO_PACKET_BUFFER_SIZE;
+        Packet_Data **slot = packets_array_slot(send_array, i);
 
         if (n == data[0]) {
-            if (send_array->buffer[num]) {
-                uint64_t sent_time = send_array->buffer[num]->sent_time;
+            if (*slot) {
+                uint64_t sent_time = (*slot)->sent_time;
 
                 if ((sent_time + rtt_time) < temp_time) {
-                    send_array->buffer[num]->sent_time = 0;
+                    (*slot)->sent_time = 0;
                 }
             }
 
@@ -867,15 +1005,15 @@ static int handle_request_packet(Packets_Array *send_array, const uint8_t *data,
             n = 0;
             ++requested;
         } else {
-            if (send_array->buffer[num]) {
-                uint64_t sent_time = send_array->buffer[num]->sent_time;
+            if (*slot) {
+                uint64_t sent_time = (*slot)->sent_time;
 
                 if (l_sent_time < sent_time) {
                     l_sent_time = sent_time;
                 }
 
-                free(send_array->buffer[num]);
-                send_array->buffer[num] = NULL;
+                packet_data_free(pool, *slot);
+                *slot = NULL;
             }
         }
 
@@ -900,455 +1038,600 @@ static int handle_request_packet(Packets_Array *send_array, const uint8_t *data,
     return requested;
 }
 
-/** END: Array Related functions **/
-
-#define MAX_DATA_DATA_PACKET_SIZE (MAX_CRYPTO_PACKET_SIZE - (1 + sizeof(uint16_t) + CRYPTO_MAC_SIZE))
-
-/* Creates and sends a data packet to the peer using the fastest route.
+/* PACKET_ID_SACK packets are:
+ * [uint8_t PACKET_ID_SACK][uint8_t format][uint16_t number of packets described]
+ * followed, for CRYPTO_SACK_RANGES, by pairs of varints: the number of received
+ * packets before a run of missing ones and the number of missing ones minus 1,
+ * or, for CRYPTO_SACK_BITMAP, by a bit per packet set if it is missing.
  *
- * return -1 on failure.
- * return 0 on success.
+ * Packets are counted from the buffer_start in the data packet header. The
+ * packets described that are not missing were all received.
  */
-static int send_data_packet(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length)
+#define CRYPTO_SACK_RANGES 0
+#define CRYPTO_SACK_BITMAP 1
+
+#define CRYPTO_SACK_HEADER_SIZE (1 + 1 + sizeof(uint16_t))
+
+/* Longest varint of a packet count: 7 bits per byte. */
+#define CRYPTO_SACK_MAX_VARINT_SIZE 3
+
+/* Peers that understand PACKET_ID_SACK send one with each PACKET_ID_REQUEST.
+ * After this many PACKET_ID_REQUEST without any, the peer is taken not to
+ * understand them and gets none from us either. */
+#define CRYPTO_SACK_MAX_REQUESTS_WITHOUT 4
+
+static uint16_t sack_put_varint(uint8_t *data, uint32_t value)
 {
-    if (length == 0 || length + (1 + sizeof(uint16_t) + CRYPTO_MAC_SIZE) > MAX_CRYPTO_PACKET_SIZE) {
-        return -1;
+    uint16_t len = 0;
+
+    while (value >= 0x80) {
+        data[len] = (value & 0x7F) | 0x80;
+        value >>= 7;
+        ++len;
     }
 
-    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+    data[len] = value;
+    return len + 1;
+}
 
-    if (conn == 0) {
-        return -1;
-    }
+/* return number of bytes read.
+ * return 0 if the varint is truncated or too long.
+ */
+static uint16_t sack_get_varint(const uint8_t *data, uint16_t length, uint32_t *value)
+{
+    uint16_t len;
 
-    pthread_mutex_lock(&conn->mutex);
-    ELASTOS_VLA(uint8_t, packet, 1 + sizeof(uint16_t) + length + CRYPTO_MAC_SIZE);
-    packet[0] = NET_PACKET_CRYPTO_DATA;
-    memcpy(packet + 1, conn->sent_nonce + (CRYPTO_NONCE_SIZE - sizeof(uint16_t)), sizeof(uint16_t));
-    int len = encrypt_data_symmetric(conn->shared_key, conn->sent_nonce, data, length, packet + 1 + sizeof(uint16_t));
+    *value = 0;
 
-    if (len + 1 + sizeof(uint16_t) != ELASTOS_SIZEOF_VLA(packet)) {
-        pthread_mutex_unlock(&conn->mutex);
-        return -1;
-    }
+    for (len = 0; len < length && len < CRYPTO_SACK_MAX_VARINT_SIZE; ++len) {
+        *value |= (uint32_t)(data[len] & 0x7F) << (7 * len);
 
-    increment_nonce(conn->sent_nonce);
-    pthread_mutex_unlock(&conn->mutex);
+        if (!(data[len] & 0x80)) {
+            return len + 1;
+        }
+    }
 
-    return send_packet_to(c, crypt_connection_id, packet, ELASTOS_SIZEOF_VLA(packet));
+    return 0;
 }
 
-/* Creates and sends a data packet with buffer_start and num to the peer using the fastest route.
+/* Read the next range of a CRYPTO_SACK_RANGES packet from data of length.
  *
- * return -1 on failure.
- * return 0 on success.
+ * return number of bytes read.
+ * return 0 if the range is malformed.
  */
-static int send_data_packet_helper(Net_Crypto *c, int crypt_connection_id, uint32_t buffer_start, uint32_t num,
-                                   const uint8_t *data, uint16_t length)
+static uint16_t sack_get_range(const uint8_t *data, uint16_t length, uint32_t *received, uint32_t *missing)
 {
-    if (length == 0 || length > MAX_CRYPTO_DATA_SIZE) {
-        return -1;
+    const uint16_t len = sack_get_varint(data, length, received);
+
+    if (len == 0) {
+        return 0;
     }
 
-    num = net_htonl(num);
-    buffer_start = net_htonl(buffer_start);
-    uint16_t padding_length = (MAX_CRYPTO_DATA_SIZE - length) % CRYPTO_MAX_PADDING;
-    VLA(uint8_t, packet, sizeof(uint32_t) + sizeof(uint32_t) + padding_length + length);
-    memcpy(packet, &buffer_start, sizeof(uint32_t));
-    memcpy(packet + sizeof(uint32_t), &num, sizeof(uint32_t));
-    memset(packet + (sizeof(uint32_t) * 2), PACKET_ID_PADDING, padding_length);
-    memcpy(packet + (sizeof(uint32_t) * 2) + padding_length, data, length);
+    const uint16_t len2 = sack_get_varint(data + len, length - len, missing);
 
-    return send_data_packet(c, crypt_connection_id, packet, SIZEOF_VLA(packet));
+    if (len2 == 0) {
+        return 0;
+    }
+
+    ++*missing;
+    return len + len2;
 }
 
-static int reset_max_speed_reached(Net_Crypto *c, int crypt_connection_id)
+/* return true if the ranges in data of length describe at most covered
+ * packets.
+ */
+static bool sack_ranges_valid(const uint8_t *data, uint16_t length, uint32_t covered)
 {
-    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
-
-    if (conn == 0) {
-        return -1;
-    }
-
-    /* If last packet send failed, try to send packet again.
-       If sending it fails we won't be able to send the new packet. */
-    if (conn->maximum_speed_reached) {
-        Packet_Data *dt = NULL;
-        uint32_t packet_num = conn->send_array.buffer_end - 1;
-        int ret = get_data_pointer(&conn->send_array, &dt, packet_num);
+    uint32_t i = 0;
 
-        uint8_t send_failed = 0;
+    while (length != 0) {
+        uint32_t received, missing;
+        const uint16_t len = sack_get_range(data, length, &received, &missing);
 
-        if (ret == 1) {
-            if (!dt->sent_time) {
-                if (send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num, dt->data,
-                                            dt->length) != 0) {
-                    send_failed = 1;
-                } else {
-                    dt->sent_time = current_time_monotonic();
-                }
-            }
+        if (len == 0 || received + missing > covered - i) {
+            return 0;
         }
 
-        if (!send_failed) {
-            conn->maximum_speed_reached = 0;
-        } else {
-            return -1;
-        }
+        data += len;
+        length -= len;
+        i += received + missing;
     }
 
-    return 0;
+    return 1;
 }
 
-/*  return -1 if data could not be put in packet queue.
- *  return positive packet number if data was put into the queue.
+/* Create a PACKET_ID_SACK packet from recv_array into data of length.
+ *
+ * Missing packets are encoded as ranges, or as a bitmap when the ranges don't
+ * fit in the packet and the bitmap describes more packets.
+ *
+ * return -1 on failure.
+ * return length of packet on success.
  */
-static int64_t send_lossless_packet(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length,
-                                    uint8_t congestion_control)
+static int generate_sack_packet(uint8_t *data, uint16_t length, const Packets_Array *recv_array)
 {
-    if (length == 0 || length > MAX_CRYPTO_DATA_SIZE) {
+    if (length < CRYPTO_SACK_HEADER_SIZE) {
         return -1;
     }
 
-    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+    const uint32_t num = recv_array->buffer_end - recv_array->buffer_start;
+    uint32_t covered = 0;
+    uint16_t cur_len = CRYPTO_SACK_HEADER_SIZE;
+    uint32_t i = 0;
 
-    if (conn == 0) {
-        return -1;
-    }
+    while (i < num) {
+        if (*packets_array_slot(recv_array, recv_array->buffer_start + i)) {
+            ++i;
+            continue;
+        }
 
-    /* If last packet send failed, try to send packet again.
-       If sending it fails we won't be able to send the new packet. */
-    reset_max_speed_reached(c, crypt_connection_id);
+        uint32_t run = 1;
 
-    if (conn->maximum_speed_reached && congestion_control) {
-        return -1;
-    }
+        while (i + run < num && !*packets_array_slot(recv_array, recv_array->buffer_start + i + run)) {
+            ++run;
+        }
 
-    Packet_Data dt;
-    dt.sent_time = 0;
-    dt.length = length;
-    memcpy(dt.data, data, length);
-    pthread_mutex_lock(&conn->mutex);
-    int64_t packet_num = add_data_end_of_buffer(&conn->send_array, &dt);
-    pthread_mutex_unlock(&conn->mutex);
+        if (length - cur_len < CRYPTO_SACK_MAX_VARINT_SIZE * 2) {
+            break;
+        }
 
-    if (packet_num == -1) {
-        return -1;
+        cur_len += sack_put_varint(data + cur_len, i - covered);
+        cur_len += sack_put_varint(data + cur_len, run - 1);
+        i += run;
+        covered = i;
     }
 
-    if (!congestion_control && conn->maximum_speed_reached) {
-        return packet_num;
+    if (i >= num) {
+        covered = num;
+    } else {
+        /* Packets before the first range that didn't fit were received. */
+        covered = i;
     }
 
-    if (send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num, data, length) == 0) {
-        Packet_Data *dt1 = NULL;
+    data[1] = CRYPTO_SACK_RANGES;
+
+    const uint32_t bitmap_covered = MIN(num, (uint32_t)(length - CRYPTO_SACK_HEADER_SIZE) * 8);
 
-        if (get_data_pointer(&conn->send_array, &dt1, packet_num) == 1) {
-            dt1->sent_time = current_time_monotonic();
+    if (covered < bitmap_covered) {
+        covered = bitmap_covered;
+        cur_len = CRYPTO_SACK_HEADER_SIZE + (covered + 7) / 8;
+        memset(data + CRYPTO_SACK_HEADER_SIZE, 0, cur_len - CRYPTO_SACK_HEADER_SIZE);
+
+        for (i = 0; i < covered; ++i) {
+            if (!*packets_array_slot(recv_array, recv_array->buffer_start + i)) {
+                data[CRYPTO_SACK_HEADER_SIZE + i / 8] |= 1 << (i % 8);
+            }
         }
-    } else {
-        conn->maximum_speed_reached = 1;
-        LOGGER_ERROR(c->log, "send_data_packet failed\n");
-    }
 
-    return packet_num;
-}
+        data[1] = CRYPTO_SACK_BITMAP;
+    }
 
-/* Get the lowest 2 bytes from the nonce and convert
- * them to host byte format before returning them.
- */
-static uint16_t get_nonce_uint16(const uint8_t *nonce)
-{
-    uint16_t num;
-    memcpy(&num, nonce + (CRYPTO_NONCE_SIZE - sizeof(uint16_t)), sizeof(uint16_t));
-    return net_ntohs(num);
+    data[0] = PACKET_ID_SACK;
+    uint16_t covered_net = net_htons(covered);
+    memcpy(data + 2, &covered_net, sizeof(uint16_t));
+    return cur_len;
 }
 
-#define DATA_NUM_THRESHOLD 21845
-
-/* Handle a data packet.
- * Decrypt packet of length and put it into data.
- * data must be at least MAX_DATA_DATA_PACKET_SIZE big.
- *
- * return -1 on failure.
- * return length of data on success.
+/* Mark the packet in slot of send_array for sending again if the peer is
+ * missing it and it was sent more than rtt_time ago, or remove it from the
+ * array if the peer received it.
  */
-static int handle_data_packet(const Net_Crypto *c, int crypt_connection_id, uint8_t *data, const uint8_t *packet,
-                              uint16_t length)
+static void sack_packet(Packet_Data_Pool *pool, Packet_Data **slot, bool missing, uint64_t temp_time,
+                        uint64_t rtt_time, uint64_t *l_sent_time)
 {
-    if (length <= (1 + sizeof(uint16_t) + CRYPTO_MAC_SIZE) || length > MAX_CRYPTO_PACKET_SIZE) {
-        return -1;
+    if (!*slot) {
+        return;
     }
 
-    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
-
-    if (conn == 0) {
-        return -1;
-    }
+    const uint64_t sent_time = (*slot)->sent_time;
 
-    uint8_t nonce[CRYPTO_NONCE_SIZE];
-    memcpy(nonce, conn->recv_nonce, CRYPTO_NONCE_SIZE);
-    uint16_t num_cur_nonce = get_nonce_uint16(nonce);
-    uint16_t num;
-    memcpy(&num, packet + 1, sizeof(uint16_t));
-    num = net_ntohs(num);
-    uint16_t diff = num - num_cur_nonce;
-    increment_nonce_number(nonce, diff);
-    int len = decrypt_data_symmetric(conn->shared_key, nonce, packet + 1 + sizeof(uint16_t),
-                                     length - (1 + sizeof(uint16_t)), data);
+    if (missing) {
+        if ((sent_time + rtt_time) < temp_time) {
+            (*slot)->sent_time = 0;
+        }
 
-    if ((unsigned int)len != length - (1 + sizeof(uint16_t) + CRYPTO_MAC_SIZE)) {
-        return -1;
+        return;
     }
 
-    if (diff > DATA_NUM_THRESHOLD * 2) {
-        increment_nonce_number(conn->recv_nonce, DATA_NUM_THRESHOLD);
+    if (*l_sent_time < sent_time) {
+        *l_sent_time = sent_time;
     }
 
-    return len;
+    packet_data_free(pool, *slot);
+    *slot = NULL;
 }
 
-/* Send a request packet.
+/* Handle a PACKET_ID_SACK packet.
+ * Remove all the packets the other received from the array.
  *
  * return -1 on failure.
- * return 0 on success.
+ * return number of requested packets on success.
  */
-static int send_request_packet(Net_Crypto *c, int crypt_connection_id)
+static int handle_sack_packet(const Mono_Time *mono_time, Packet_Data_Pool *pool, Packets_Array *send_array,
+                              const uint8_t *data, uint16_t length, uint64_t *latest_send_time, uint64_t rtt_time)
 {
-    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
-
-    if (conn == 0) {
+    if (length < CRYPTO_SACK_HEADER_SIZE || data[0] != PACKET_ID_SACK) {
         return -1;
     }
 
-    uint8_t data[MAX_CRYPTO_DATA_SIZE];
-    int len = generate_request_packet(data, sizeof(data), &conn->recv_array);
+    uint16_t covered;
+    memcpy(&covered, data + 2, sizeof(uint16_t));
+    covered = net_ntohs(covered);
 
-    if (len == -1) {
+    if (covered > num_packets_array(send_array)) {
         return -1;
     }
 
-    return send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, conn->send_array.buffer_end, data,
-                                   len);
-}
+    const uint8_t format = data[1];
+    data += CRYPTO_SACK_HEADER_SIZE;
+    length -= CRYPTO_SACK_HEADER_SIZE;
 
-/* Send up to max num previously requested data packets.
- *
- * return -1 on failure.
- * return number of packets sent on success.
- */
-static int send_requested_packets(Net_Crypto *c, int crypt_connection_id, uint32_t max_num)
-{
-    if (max_num == 0) {
-        return -1;
-    }
+    const uint64_t temp_time = mono_time_monotonic(mono_time);
+    uint64_t l_sent_time = 0;
+    uint32_t requested = 0;
+    uint32_t i;
 
-    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+    if (format == CRYPTO_SACK_BITMAP) {
+        if (length < (covered + 7) / 8) {
+            return -1;
+        }
 
-    if (conn == 0) {
-        return -1;
-    }
+        for (i = 0; i < covered; ++i) {
+            const bool missing = (data[i / 8] >> (i % 8)) & 1;
+            sack_packet(pool, packets_array_slot(send_array, send_array->buffer_start + i), missing, temp_time, rtt_time,
+                        &l_sent_time);
+            requested += missing;
+        }
+    } else if (format == CRYPTO_SACK_RANGES) {
+        /* Don't act on a part of a malformed packet. */
+        if (!sack_ranges_valid(data, length, covered)) {
+            return -1;
+        }
 
-    uint64_t temp_time = current_time_monotonic();
-    uint32_t i, num_sent = 0, array_size = num_packets_array(&conn->send_array);
+        i = 0;
 
-    for (i = 0; i < array_size; ++i) {
-        Packet_Data *dt;
-        uint32_t packet_num = (i + conn->send_array.buffer_start);
-        int ret = get_data_pointer(&conn->send_array, &dt, packet_num);
+        while (length != 0) {
+            uint32_t received, run;
+            const uint16_t len = sack_get_range(data, length, &received, &run);
+            data += len;
+            length -= len;
 
-        if (ret == -1) {
-            return -1;
+            for (; received != 0; --received, ++i) {
+                sack_packet(pool, packets_array_slot(send_array, send_array->buffer_start + i), 0, temp_time, rtt_time,
+                            &l_sent_time);
+            }
+
+            for (; run != 0; --run, ++i) {
+                sack_packet(pool, packets_array_slot(send_array, send_array->buffer_start + i), 1, temp_time, rtt_time,
+                            &l_sent_time);
+                ++requested;
+            }
         }
 
-        if (ret == 0) {
-            continue;
+        for (; i < covered; ++i) {
+            sack_packet(pool, packets_array_slot(send_array, send_array->buffer_start + i), 0, temp_time, rtt_time,
+                        &l_sent_time);
         }
+    } else {
+        return -1;
+    }
 
-        if (dt->sent_time) {
+    if (*latest_send_time < l_sent_time) {
+        *latest_send_time = l_sent_time;
+    }
+
+    return requested;
+}
+
+/** END: Array Related functions **/
+
+/** START: Crypto workers **/
+
+/* A data packet encrypted or decrypted by the crypto workers. */
+typedef struct Crypto_Job {
+    struct Crypto_Job *next; /* Next job in the order they were given, or on the free list. */
+    struct Crypto_Job *next_todo;
+
+    bool done;
+    bool dropped; /* The connection was killed. */
+    bool seal; /* Encrypt data into a data packet, else decrypt the data packet in data. */
+
+    int crypt_connection_id;
+    IP_Port source; /* Where a received packet came from. */
+    uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
+    uint8_t nonce[CRYPTO_NONCE_SIZE];
+
+    uint16_t length;
+    uint8_t data[MAX_CRYPTO_PACKET_SIZE];
+    int result_length; /* -1 if encryption or decryption failed. */
+    uint8_t result[MAX_CRYPTO_PACKET_SIZE];
+} Crypto_Job;
+
+/* Jobs are in the given list from the time they are given to the time
+ * crypto_finish_jobs() takes them, and in todo until a thread takes them.
+ * Everything is protected by mutex.
+ */
+struct Crypto_Pool {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond; /* Signalled when a job is given. */
+    pthread_cond_t done_cond; /* Signalled when a job is done. */
+    bool stop;
+
+    pthread_t workers[CRYPTO_MAX_WORKERS];
+    uint16_t num_workers;
+
+    Crypto_Job *given_head;
+    Crypto_Job *given_tail;
+    Crypto_Job *todo_head;
+    Crypto_Job *todo_tail;
+    Crypto_Job *finishing; /* The jobs crypto_finish_jobs() has yet to send or handle. */
+
+    Crypto_Job *free_list;
+    uint32_t num_free;
+    uint32_t num_jobs; /* Jobs given and not yet finished. */
+};
+
+static void run_crypto_job(Crypto_Job *job)
+{
+    if (job->seal) {
+        job->result[0] = NET_PACKET_CRYPTO_DATA;
+        memcpy(job->result + 1, job->nonce + (CRYPTO_NONCE_SIZE - sizeof(uint16_t)), sizeof(uint16_t));
+        int len = encrypt_data_symmetric(job->shared_key, job->nonce, job->data, job->length,
+                                         job->result + 1 + sizeof(uint16_t));
+        job->result_length = len == job->length + CRYPTO_MAC_SIZE ? (int)(len + 1 + sizeof(uint16_t)) : -1;
+    } else {
+        int len = decrypt_data_symmetric(job->shared_key, job->nonce, job->data + 1 + sizeof(uint16_t),
+                                         job->length - (1 + sizeof(uint16_t)), job->result);
+        job->result_length = (unsigned int)len == job->length - (1 + sizeof(uint16_t) + CRYPTO_MAC_SIZE) ? len : -1;
+    }
+}
+
+static void *crypto_worker(void *arg)
+{
+    Crypto_Pool *pool = (Crypto_Pool *)arg;
+
+    pthread_mutex_lock(&pool->mutex);
+
+    while (!pool->stop) {
+        Crypto_Job *job = pool->todo_head;
+
+        if (job == NULL) {
+            pthread_cond_wait(&pool->cond, &pool->mutex);
             continue;
         }
 
-        if (send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num, dt->data,
-                                    dt->length) == 0) {
-            dt->sent_time = temp_time;
-            ++num_sent;
-        }
+        pool->todo_head = job->next_todo;
 
-        if (num_sent >= max_num) {
-            break;
+        if (pool->todo_head == NULL) {
+            pool->todo_tail = NULL;
         }
+
+        pthread_mutex_unlock(&pool->mutex);
+        run_crypto_job(job);
+        pthread_mutex_lock(&pool->mutex);
+
+        job->done = 1;
+        pthread_cond_broadcast(&pool->done_cond);
     }
 
-    return num_sent;
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
 }
 
-
-/* Add a new temp packet to send repeatedly.
+/* Take a job from the free list of pool, or allocate one.
  *
- * return -1 on failure.
- * return 0 on success.
+ * return NULL if CRYPTO_MAX_PENDING_JOBS jobs are pending or on failure.
  */
-static int new_temp_packet(const Net_Crypto *c, int crypt_connection_id, const uint8_t *packet, uint16_t length)
+static Crypto_Job *crypto_job_new(Crypto_Pool *pool)
 {
-    if (length == 0 || length > MAX_CRYPTO_PACKET_SIZE) {
-        return -1;
+    pthread_mutex_lock(&pool->mutex);
+
+    if (pool->num_jobs >= CRYPTO_MAX_PENDING_JOBS) {
+        pthread_mutex_unlock(&pool->mutex);
+        return NULL;
     }
 
-    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+    Crypto_Job *job = pool->free_list;
 
-    if (conn == 0) {
-        return -1;
+    if (job != NULL) {
+        pool->free_list = job->next;
+        --pool->num_free;
     }
 
-    uint8_t *temp_packet = (uint8_t *)malloc(length);
+    ++pool->num_jobs;
+    pthread_mutex_unlock(&pool->mutex);
 
-    if (temp_packet == 0) {
-        return -1;
-    }
+    if (job == NULL) {
+        job = (Crypto_Job *)malloc(sizeof(Crypto_Job));
 
-    if (conn->temp_packet) {
-        free(conn->temp_packet);
+        if (job == NULL) {
+            pthread_mutex_lock(&pool->mutex);
+            --pool->num_jobs;
+            pthread_mutex_unlock(&pool->mutex);
+            return NULL;
+        }
     }
 
-    memcpy(temp_packet, packet, length);
-    conn->temp_packet = temp_packet;
-    conn->temp_packet_length = length;
-    conn->temp_packet_sent_time = 0;
-    conn->temp_packet_num_sent = 0;
-    return 0;
+    job->done = 0;
+    job->dropped = 0;
+    return job;
 }
 
-/* Clear the temp packet.
- *
- * return -1 on failure.
- * return 0 on success.
+/* Put a finished job back on the free list of pool. Must be called with the
+ * mutex of pool locked.
  */
-static int clear_temp_packet(const Net_Crypto *c, int crypt_connection_id)
+static void crypto_job_free(Crypto_Pool *pool, Crypto_Job *job)
 {
-    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+    crypto_memzero(job->shared_key, sizeof(job->shared_key));
+    --pool->num_jobs;
 
-    if (conn == 0) {
-        return -1;
+    if (pool->num_free >= CRYPTO_MAX_PENDING_JOBS) {
+        free(job);
+        return;
     }
 
-    if (conn->temp_packet) {
-        free(conn->temp_packet);
+    job->next = pool->free_list;
+    pool->free_list = job;
+    ++pool->num_free;
+}
+
+/* Give the job to the workers. */
+static void crypto_job_give(Crypto_Pool *pool, Crypto_Job *job)
+{
+    job->next = NULL;
+    job->next_todo = NULL;
+
+    pthread_mutex_lock(&pool->mutex);
+
+    if (pool->given_tail == NULL) {
+        pool->given_head = job;
+    } else {
+        pool->given_tail->next = job;
     }
 
-    conn->temp_packet = 0;
-    conn->temp_packet_length = 0;
-    conn->temp_packet_sent_time = 0;
-    conn->temp_packet_num_sent = 0;
-    return 0;
-}
+    pool->given_tail = job;
 
+    if (pool->todo_tail == NULL) {
+        pool->todo_head = job;
+    } else {
+        pool->todo_tail->next_todo = job;
+    }
 
-/* Send the temp packet.
- *
- * return -1 on failure.
- * return 0 on success.
+    pool->todo_tail = job;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+/* Mark the jobs of the connection so that their packets are not sent or
+ * handled.
  */
-static int send_temp_packet(Net_Crypto *c, int crypt_connection_id)
+static void crypto_drop_jobs(Net_Crypto *c, int crypt_connection_id)
 {
-    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
-#if defined(ELASTOS_BUILD)
-    ELASTOS_VLA(uint8_t, packet, conn->temp_packet_length);
-    memcpy(packet, conn->temp_packet, conn->temp_packet_length);
-#else
-    uint8_t *packet = conn->temp_packet;
-#endif
+    Crypto_Pool *pool = c->crypto_pool;
 
-    if (conn == 0) {
-        return -1;
+    if (pool == NULL) {
+        return;
     }
 
-    if (!conn->temp_packet) {
-        return -1;
+    pthread_mutex_lock(&pool->mutex);
+
+    for (Crypto_Job *job = pool->finishing; job != NULL; job = job->next) {
+        if (job->crypt_connection_id == crypt_connection_id) {
+            job->dropped = 1;
+        }
     }
 
-    if (send_packet_to(c, crypt_connection_id, packet, conn->temp_packet_length) != 0) {
-        return -1;
+    for (Crypto_Job *job = pool->given_head; job != NULL; job = job->next) {
+        if (job->crypt_connection_id == crypt_connection_id) {
+            job->dropped = 1;
+        }
     }
 
-    conn->temp_packet_sent_time = current_time_monotonic();
-    ++conn->temp_packet_num_sent;
-    return 0;
+    pthread_mutex_unlock(&pool->mutex);
 }
 
-/* Create a handshake packet and set it as a temp packet.
- * cookie must be COOKIE_LENGTH.
- *
- * return -1 on failure.
- * return 0 on success.
- */
-static int create_send_handshake(Net_Crypto *c, int crypt_connection_id, const uint8_t *cookie,
-                                 const uint8_t *dht_public_key)
+static void stop_crypto_workers(Crypto_Pool *pool)
 {
-    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+    pthread_mutex_lock(&pool->mutex);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
 
-    if (conn == 0) {
-        return -1;
+    for (uint16_t i = 0; i < pool->num_workers; ++i) {
+        pthread_join(pool->workers[i], NULL);
     }
 
-    uint8_t handshake_packet[HANDSHAKE_PACKET_LENGTH];
+    pool->num_workers = 0;
+}
 
-    if (create_crypto_handshake(c, handshake_packet, cookie, conn->sent_nonce, conn->sessionpublic_key,
-                                conn->public_key, dht_public_key) != sizeof(handshake_packet)) {
+int crypto_start_workers(Net_Crypto *c, uint16_t num_threads)
+{
+    if (c->crypto_pool != NULL || num_threads == 0 || num_threads > CRYPTO_MAX_WORKERS) {
         return -1;
     }
 
-    if (new_temp_packet(c, crypt_connection_id, handshake_packet, sizeof(handshake_packet)) != 0) {
+    Crypto_Pool *pool = (Crypto_Pool *)calloc(1, sizeof(Crypto_Pool));
+
+    if (pool == NULL) {
         return -1;
     }
 
-    send_temp_packet(c, crypt_connection_id);
-    return 0;
-}
+    if (pthread_mutex_init(&pool->mutex, NULL) != 0) {
+        free(pool);
+        return -1;
+    }
 
-/* Send a kill packet.
- *
- * return -1 on failure.
- * return 0 on success.
- */
-static int send_kill_packet(Net_Crypto *c, int crypt_connection_id)
-{
-    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+    if (pthread_cond_init(&pool->cond, NULL) != 0) {
+        pthread_mutex_destroy(&pool->mutex);
+        free(pool);
+        return -1;
+    }
 
-    if (conn == 0) {
+    if (pthread_cond_init(&pool->done_cond, NULL) != 0) {
+        pthread_cond_destroy(&pool->cond);
+        pthread_mutex_destroy(&pool->mutex);
+        free(pool);
         return -1;
     }
 
-    uint8_t kill_packet = PACKET_ID_KILL;
-    return send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, conn->send_array.buffer_end,
-                                   &kill_packet, sizeof(kill_packet));
+    for (uint16_t i = 0; i < num_threads; ++i) {
+        if (pthread_create(&pool->workers[i], NULL, crypto_worker, pool) != 0) {
+            stop_crypto_workers(pool);
+            pthread_cond_destroy(&pool->done_cond);
+            pthread_cond_destroy(&pool->cond);
+            pthread_mutex_destroy(&pool->mutex);
+            free(pool);
+            return -1;
+        }
+
+        ++pool->num_workers;
+    }
+
+    c->crypto_pool = pool;
+    return 0;
 }
 
-static void connection_kill(Net_Crypto *c, int crypt_connection_id, void *userdata)
+void crypto_stop_workers(Net_Crypto *c)
 {
-    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+    Crypto_Pool *pool = c->crypto_pool;
 
-    if (conn == 0) {
+    if (pool == NULL) {
         return;
     }
 
-    if (conn->connection_status_callback) {
-        conn->connection_status_callback(conn->connection_status_callback_object, conn->connection_status_callback_id, 0,
-                                         userdata);
+    stop_crypto_workers(pool);
+
+    Crypto_Job *job;
+
+    while ((job = pool->given_head) != NULL) {
+        pool->given_head = job->next;
+        crypto_job_free(pool, job);
     }
 
-    crypto_kill(c, crypt_connection_id);
+    while ((job = pool->free_list) != NULL) {
+        pool->free_list = job->next;
+        free(job);
+    }
+
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool);
+    c->crypto_pool = NULL;
 }
 
-/* Handle a received data packet.
+/* Give the encryption of data into a data packet to the crypto workers. The
+ * packet is sent by crypto_finish_jobs().
  *
- * return -1 on failure.
+ * Only done for connections with a direct UDP path: a packet that can't be
+ * sent later is lost, which TCP relays with full buffers would make common.
+ *
+ * return -1 if the packet must be encrypted in place.
  * return 0 on success.
  */
-static int handle_data_packet_core(Net_Crypto *c, int crypt_connection_id, const uint8_t *packet, uint16_t length,
-                                   bool udp, void *userdata)
+static int seal_data_packet_async(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length)
 {
-    if (length > MAX_CRYPTO_PACKET_SIZE || length <= CRYPTO_DATA_PACKET_MIN_SIZE) {
+    if (c->crypto_pool == NULL) {
         return -1;
     }
 
@@ -1358,361 +1641,1737 @@ static int handle_data_packet_core(Net_Crypto *c, int crypt_connection_id, const
         return -1;
     }
 
-    uint8_t data[MAX_DATA_DATA_PACKET_SIZE];
-    int len = handle_data_packet(c, crypt_connection_id, data, packet, length);
+    bool direct_connected = 0;
+    crypto_connection_status(c, crypt_connection_id, &direct_connected, NULL);
 
-    if (len <= (int)(sizeof(uint32_t) * 2)) {
+    if (!direct_connected) {
         return -1;
     }
 
-    uint32_t buffer_start, num;
-    memcpy(&buffer_start, data, sizeof(uint32_t));
-    memcpy(&num, data + sizeof(uint32_t), sizeof(uint32_t));
-    buffer_start = net_ntohl(buffer_start);
-    num = net_ntohl(num);
+    Crypto_Job *job = crypto_job_new(c->crypto_pool);
 
-    uint64_t rtt_calc_time = 0;
+    if (job == NULL) {
+        return -1;
+    }
 
-    if (buffer_start != conn->send_array.buffer_start) {
-        Packet_Data *packet_time;
+    job->seal = 1;
+    job->crypt_connection_id = crypt_connection_id;
+    job->length = length;
+    memcpy(job->data, data, length);
 
-        if (get_data_pointer(&conn->send_array, &packet_time, conn->send_array.buffer_start) == 1) {
-            rtt_calc_time = packet_time->sent_time;
-        }
+    pthread_mutex_lock(&conn->mutex);
+    memcpy(job->shared_key, conn->shared_key, CRYPTO_SHARED_KEY_SIZE);
+    memcpy(job->nonce, conn->sent_nonce, CRYPTO_NONCE_SIZE);
+    increment_nonce(conn->sent_nonce);
+    pthread_mutex_unlock(&conn->mutex);
 
-        if (clear_buffer_until(&conn->send_array, buffer_start) != 0) {
-            return -1;
-        }
-    }
+    crypto_job_give(c->crypto_pool, job);
+    return 0;
+}
 
-    uint8_t *real_data = data + (sizeof(uint32_t) * 2);
-    uint16_t real_length = len - (sizeof(uint32_t) * 2);
+/** END: Crypto workers **/
 
-    while (real_data[0] == PACKET_ID_PADDING) { /* Remove Padding */
-        ++real_data;
-        --real_length;
+/* Packet id, nonce and MAC in front of the encrypted data of a data packet. */
+#define DATA_PACKET_HEADER_SIZE (1 + sizeof(uint16_t) + CRYPTO_MAC_SIZE)
 
-        if (real_length == 0) {
-            return -1;
-        }
+#define MAX_DATA_DATA_PACKET_SIZE (MAX_CRYPTO_PACKET_SIZE - DATA_PACKET_HEADER_SIZE)
+
+/* Creates and sends a data packet to the peer using the fastest route.
+ *
+ * packet must have DATA_PACKET_HEADER_SIZE bytes of room followed by the
+ * length bytes of data, which are encrypted in place.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int send_data_packet(Net_Crypto *c, int crypt_connection_id, uint8_t *packet, uint16_t length,
+                            bool may_defer)
+{
+    if (length == 0 || length > MAX_DATA_DATA_PACKET_SIZE) {
+        return -1;
     }
 
-    if (real_data[0] == PACKET_ID_KILL) {
-        connection_kill(c, crypt_connection_id, userdata);
+    if (may_defer && seal_data_packet_async(c, crypt_connection_id, packet + DATA_PACKET_HEADER_SIZE, length) == 0) {
         return 0;
     }
 
-    if (conn->status == CRYPTO_CONN_NOT_CONFIRMED) {
-        clear_temp_packet(c, crypt_connection_id);
-        conn->status = CRYPTO_CONN_ESTABLISHED;
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
 
-        if (conn->connection_status_callback) {
-            conn->connection_status_callback(conn->connection_status_callback_object, conn->connection_status_callback_id, 1,
-                                             userdata);
-        }
+    if (conn == 0) {
+        return -1;
     }
 
-    if (real_data[0] == PACKET_ID_REQUEST) {
-        uint64_t rtt_time;
+    pthread_mutex_lock(&conn->mutex);
+    packet[0] = NET_PACKET_CRYPTO_DATA;
+    memcpy(packet + 1, conn->sent_nonce + (CRYPTO_NONCE_SIZE - sizeof(uint16_t)), sizeof(uint16_t));
+    int len = encrypt_data_symmetric_detached(conn->shared_key, conn->sent_nonce, packet + DATA_PACKET_HEADER_SIZE,
+              length, packet + 1 + sizeof(uint16_t));
 
-        if (udp) {
-            rtt_time = conn->rtt_time;
-        } else {
-            rtt_time = DEFAULT_TCP_PING_CONNECTION;
-        }
-
-        int requested = handle_request_packet(&conn->send_array, real_data, real_length, &rtt_calc_time, rtt_time);
-
-        if (requested == -1) {
-            return -1;
-        }
-
-        // else { /* TODO(irungentoo): ? */ }
-
-        set_buffer_end(&conn->recv_array, num);
-    } else if (real_data[0] >= CRYPTO_RESERVED_PACKETS && real_data[0] < PACKET_ID_LOSSY_RANGE_START) {
-        Packet_Data dt;
-        dt.length = real_length;
-        memcpy(dt.data, real_data, real_length);
-
-        if (add_data_to_buffer(&conn->recv_array, num, &dt) != 0) {
-            return -1;
-        }
-
-        while (1) {
-            pthread_mutex_lock(&conn->mutex);
-            int ret = read_data_beg_buffer(&conn->recv_array, &dt);
-            pthread_mutex_unlock(&conn->mutex);
-
-            if (ret == -1) {
-                break;
-            }
-
-            if (conn->connection_data_callback) {
-                conn->connection_data_callback(conn->connection_data_callback_object, conn->connection_data_callback_id, dt.data,
-                                               dt.length, userdata);
-            }
-
-            /* conn might get killed in callback. */
-            conn = get_crypto_connection(c, crypt_connection_id);
-
-            if (conn == 0) {
-                return -1;
-            }
-        }
-
-        /* Packet counter. */
-        ++conn->packet_counter;
-    } else if (real_data[0] >= PACKET_ID_LOSSY_RANGE_START &&
-               real_data[0] < (PACKET_ID_LOSSY_RANGE_START + PACKET_ID_LOSSY_RANGE_SIZE)) {
-
-        set_buffer_end(&conn->recv_array, num);
-
-        if (conn->connection_lossy_data_callback) {
-            conn->connection_lossy_data_callback(conn->connection_lossy_data_callback_object,
-                                                 conn->connection_lossy_data_callback_id, real_data, real_length, userdata);
-        }
-    } else {
+    if (len != length) {
+        pthread_mutex_unlock(&conn->mutex);
         return -1;
     }
 
-    if (rtt_calc_time != 0) {
-        uint64_t rtt_time = current_time_monotonic() - rtt_calc_time;
+    increment_nonce(conn->sent_nonce);
+    pthread_mutex_unlock(&conn->mutex);
 
-        if (rtt_time < conn->rtt_time) {
-            conn->rtt_time = rtt_time;
-        }
+    if (send_packet_to(c, crypt_connection_id, packet, DATA_PACKET_HEADER_SIZE + length) != 0) {
+        return -1;
     }
 
+    pthread_mutex_lock(&conn->mutex);
+    ++conn->data_packets_sent;
+    conn->data_bytes_sent += DATA_PACKET_HEADER_SIZE + length;
+    pthread_mutex_unlock(&conn->mutex);
     return 0;
 }
 
-/* Handle a packet that was received for the connection.
+/* Creates and sends a data packet with buffer_start and num to the peer using the fastest route.
+ *
+ * If may_defer is set the packet can be encrypted by the crypto workers and
+ * sent later by crypto_finish_jobs().
  *
  * return -1 on failure.
  * return 0 on success.
  */
-static int handle_packet_connection(Net_Crypto *c, int crypt_connection_id, const uint8_t *packet, uint16_t length,
-                                    bool udp, void *userdata)
+static int send_data_packet_deferrable(Net_Crypto *c, int crypt_connection_id, uint32_t buffer_start, uint32_t num,
+                                       const uint8_t *data, uint16_t length, bool may_defer)
 {
-    if (length == 0 || length > MAX_CRYPTO_PACKET_SIZE) {
+    if (length == 0 || length > MAX_CRYPTO_DATA_SIZE) {
         return -1;
     }
 
-    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
-
-    if (conn == 0) {
+    num = net_htonl(num);
+    buffer_start = net_htonl(buffer_start);
+    uint16_t padding_length = (MAX_CRYPTO_DATA_SIZE - length) % CRYPTO_MAX_PADDING;
+    const uint16_t plain_length = sizeof(uint32_t) + sizeof(uint32_t) + padding_length + length;
+    VLA(uint8_t, packet, DATA_PACKET_HEADER_SIZE + plain_length);
+    uint8_t *plain = packet + DATA_PACKET_HEADER_SIZE;
+    memcpy(plain, &buffer_start, sizeof(uint32_t));
+    memcpy(plain + sizeof(uint32_t), &num, sizeof(uint32_t));
+    memset(plain + (sizeof(uint32_t) * 2), PACKET_ID_PADDING, padding_length);
+    memcpy(plain + (sizeof(uint32_t) * 2) + padding_length, data, length);
+
+    if (send_data_packet(c, crypt_connection_id, packet, plain_length, may_defer) != 0) {
         return -1;
     }
 
-    switch (packet[0]) {
-        case NET_PACKET_COOKIE_RESPONSE: {
-            if (conn->status != CRYPTO_CONN_COOKIE_REQUESTING) {
-                return -1;
-            }
-
-            uint8_t cookie[COOKIE_LENGTH];
-            uint64_t number;
+    packet_stats_sent(&c->packet_stats[data[0]], length);
+    return 0;
+}
 
-            if (handle_cookie_response(cookie, &number, packet, length, conn->shared_key) != sizeof(cookie)) {
-                return -1;
-            }
+static int send_data_packet_helper(Net_Crypto *c, int crypt_connection_id, uint32_t buffer_start, uint32_t num,
+                                   const uint8_t *data, uint16_t length)
+{
+    return send_data_packet_deferrable(c, crypt_connection_id, buffer_start, num, data, length, 0);
+}
 
-            if (number != conn->cookie_request_number) {
-                return -1;
-            }
+/* Send a lossless packet that is in the send array. These carry the bulk of
+ * transfers, and can go through the crypto workers.
+ */
+static int send_lossless_data_packet(Net_Crypto *c, int crypt_connection_id, uint32_t buffer_start, uint32_t num,
+                                     const uint8_t *data, uint16_t length)
+{
+    return send_data_packet_deferrable(c, crypt_connection_id, buffer_start, num, data, length, 1);
+}
 
-            if (create_send_handshake(c, crypt_connection_id, cookie, conn->dht_public_key) != 0) {
-                return -1;
-            }
+/* Set the sent time of packet_num in the send array of conn if it is still
+ * in there.
+ */
+static void set_packet_sent_time(Crypto_Connection *conn, uint32_t packet_num, uint64_t sent_time)
+{
+    Packet_Data *dt = NULL;
 
-            conn->status = CRYPTO_CONN_HANDSHAKE_SENT;
-            return 0;
-        }
+    pthread_mutex_lock(&conn->mutex);
 
-        case NET_PACKET_CRYPTO_HS: {
-            if (conn->status == CRYPTO_CONN_COOKIE_REQUESTING || conn->status == CRYPTO_CONN_HANDSHAKE_SENT
-                    || conn->status == CRYPTO_CONN_NOT_CONFIRMED) {
-                uint8_t peer_real_pk[CRYPTO_PUBLIC_KEY_SIZE];
-                uint8_t dht_public_key[CRYPTO_PUBLIC_KEY_SIZE];
-                uint8_t cookie[COOKIE_LENGTH];
+    if (get_data_pointer(&conn->send_array, &dt, packet_num) == 1) {
+        dt->sent_time = sent_time;
+    }
 
-                if (handle_crypto_handshake(c, conn->recv_nonce, conn->peersessionpublic_key, peer_real_pk, dht_public_key, cookie,
-                                            packet, length, conn->public_key) != 0) {
-                    return -1;
-                }
+    pthread_mutex_unlock(&conn->mutex);
+}
 
-                if (public_key_cmp(dht_public_key, conn->dht_public_key) == 0) {
-                    encrypt_precompute(conn->peersessionpublic_key, conn->sessionsecret_key, conn->shared_key);
+static int reset_max_speed_reached(Net_Crypto *c, int crypt_connection_id)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
 
-                    if (conn->status == CRYPTO_CONN_COOKIE_REQUESTING) {
-                        if (create_send_handshake(c, crypt_connection_id, cookie, dht_public_key) != 0) {
-                            return -1;
-                        }
-                    }
+    if (conn == 0) {
+        return -1;
+    }
 
-                    conn->status = CRYPTO_CONN_NOT_CONFIRMED;
-                } else {
-                    if (conn->dht_pk_callback) {
-                        conn->dht_pk_callback(conn->dht_pk_callback_object, conn->dht_pk_callback_number, dht_public_key, userdata);
-                    }
-                }
-            } else {
-                return -1;
-            }
+    /* If last packet send failed, try to send packet again.
+       If sending it fails we won't be able to send the new packet. */
+    if (conn->maximum_speed_reached) {
+        Packet_Data *dt = NULL;
+        Packet_Data last;
+        pthread_mutex_lock(&conn->mutex);
+        uint32_t packet_num = conn->send_array.buffer_end - 1;
+        int ret = get_data_pointer(&conn->send_array, &dt, packet_num);
 
-            return 0;
+        /* The packet can be acked and freed by the main thread once we let go
+         * of the mutex, so send a copy of it. */
+        if (ret == 1 && !dt->sent_time) {
+            memcpy(&last, dt, sizeof(Packet_Data));
+        } else {
+            ret = 0;
         }
 
-        case NET_PACKET_CRYPTO_DATA: {
-            if (conn->status == CRYPTO_CONN_NOT_CONFIRMED || conn->status == CRYPTO_CONN_ESTABLISHED) {
-                return handle_data_packet_core(c, crypt_connection_id, packet, length, udp, userdata);
-            }
+        pthread_mutex_unlock(&conn->mutex);
 
-            return -1;
+        uint8_t send_failed = 0;
+
+        if (ret == 1) {
+            if (send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num, last.data,
+                                        last.length) != 0) {
+                send_failed = 1;
+            } else {
+                set_packet_sent_time(conn, packet_num, mono_time_monotonic(c->mono_time));
+            }
         }
 
-        default: {
+        if (!send_failed) {
+            conn->maximum_speed_reached = 0;
+        } else {
             return -1;
         }
     }
+
+    return 0;
 }
 
-/* Set the size of the friend list to numfriends.
- *
- *  return -1 if realloc fails.
- *  return 0 if it succeeds.
+/*  return -1 if data could not be put in packet queue.
+ *  return positive packet number if data was put into the queue.
  */
-static int realloc_cryptoconnection(Net_Crypto *c, uint32_t num)
+static int64_t send_lossless_packet(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length,
+                                    uint8_t congestion_control)
 {
-    if (num == 0) {
-        free(c->crypto_connections);
-        c->crypto_connections = NULL;
-        return 0;
+    if (length == 0 || length > MAX_CRYPTO_DATA_SIZE) {
+        return -1;
     }
 
-    Crypto_Connection *newcrypto_connections = (Crypto_Connection *)realloc(c->crypto_connections,
-            num * sizeof(Crypto_Connection));
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
 
-    if (newcrypto_connections == NULL) {
+    if (conn == 0) {
         return -1;
     }
 
-    c->crypto_connections = newcrypto_connections;
-    return 0;
-}
-
-
-/* Create a new empty crypto connection.
- *
- * return -1 on failure.
- * return connection id on success.
- */
-static int create_crypto_connection(Net_Crypto *c)
-{
-    uint32_t i;
+    /* If last packet send failed, try to send packet again.
+       If sending it fails we won't be able to send the new packet. */
+    reset_max_speed_reached(c, crypt_connection_id);
 
-    for (i = 0; i < c->crypto_connections_length; ++i) {
-        if (c->crypto_connections[i].status == CRYPTO_CONN_NO_CONNECTION) {
-            return i;
-        }
+    if (conn->maximum_speed_reached && congestion_control) {
+        return -1;
     }
 
-    while (1) { /* TODO(irungentoo): is this really the best way to do this? */
-        pthread_mutex_lock(&c->connections_mutex);
-
-        if (!c->connection_use_counter) {
-            break;
-        }
+    Packet_Data dt;
+    dt.sent_time = 0;
+    dt.length = length;
+    memcpy(dt.data, data, length);
+    pthread_mutex_lock(&conn->mutex);
+    int64_t packet_num = add_data_end_of_buffer(&c->packet_pool, &conn->send_array, &dt);
+    pthread_mutex_unlock(&conn->mutex);
 
-        pthread_mutex_unlock(&c->connections_mutex);
+    if (packet_num == -1) {
+        return -1;
     }
 
-    int id = -1;
-
-    if (realloc_cryptoconnection(c, c->crypto_connections_length + 1) == 0) {
-        id = c->crypto_connections_length;
-        ++c->crypto_connections_length;
-        memset(&(c->crypto_connections[id]), 0, sizeof(Crypto_Connection));
-        // Memsetting float/double to 0 is non-portable, so we explicitly set them to 0
-        c->crypto_connections[id].packet_recv_rate = 0;
-        c->crypto_connections[id].packet_send_rate = 0;
-        c->crypto_connections[id].last_packets_left_rem = 0;
-        c->crypto_connections[id].packet_send_rate_requested = 0;
-        c->crypto_connections[id].last_packets_left_requested_rem = 0;
+    if (!congestion_control && conn->maximum_speed_reached) {
+        return packet_num;
+    }
 
-        if (pthread_mutex_init(&c->crypto_connections[id].mutex, NULL) != 0) {
-            pthread_mutex_unlock(&c->connections_mutex);
-            return -1;
-        }
+    if (send_lossless_data_packet(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num, data, length) == 0) {
+        set_packet_sent_time(conn, packet_num, mono_time_monotonic(c->mono_time));
+    } else {
+        conn->maximum_speed_reached = 1;
+        LOGGER_ERROR(c->log, "send_data_packet failed\n");
     }
 
-    pthread_mutex_unlock(&c->connections_mutex);
-    return id;
+    return packet_num;
 }
 
-/* Wipe a crypto connection.
- *
- * return -1 on failure.
- * return 0 on success.
+/* Get the lowest 2 bytes from the nonce and convert
+ * them to host byte format before returning them.
  */
-static int wipe_crypto_connection(Net_Crypto *c, int crypt_connection_id)
+static uint16_t get_nonce_uint16(const uint8_t *nonce)
 {
-    if (crypt_connection_id_not_valid(c, crypt_connection_id)) {
-        return -1;
-    }
-
-    uint32_t i;
+    uint16_t num;
+    memcpy(&num, nonce + (CRYPTO_NONCE_SIZE - sizeof(uint16_t)), sizeof(uint16_t));
+    return net_ntohs(num);
+}
+
+#define DATA_NUM_THRESHOLD 21845
+
+/* Put the nonce of the data packet received on conn in nonce.
+ *
+ * return how far it is ahead of the recv_nonce of conn.
+ */
+static uint16_t data_packet_nonce(const Crypto_Connection *conn, const uint8_t *packet, uint8_t *nonce)
+{
+    memcpy(nonce, conn->recv_nonce, CRYPTO_NONCE_SIZE);
+    uint16_t num_cur_nonce = get_nonce_uint16(nonce);
+    uint16_t num;
+    memcpy(&num, packet + 1, sizeof(uint16_t));
+    num = net_ntohs(num);
+    uint16_t diff = num - num_cur_nonce;
+    increment_nonce_number(nonce, diff);
+    return diff;
+}
+
+/* Handle a data packet.
+ * Decrypt packet of length and put it into data.
+ * data must be at least MAX_DATA_DATA_PACKET_SIZE big.
+ *
+ * return -1 on failure.
+ * return length of data on success.
+ */
+static int handle_data_packet(const Net_Crypto *c, int crypt_connection_id, uint8_t *data, const uint8_t *packet,
+                              uint16_t length)
+{
+    if (length <= (1 + sizeof(uint16_t) + CRYPTO_MAC_SIZE) || length > MAX_CRYPTO_PACKET_SIZE) {
+        return -1;
+    }
+
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0) {
+        return -1;
+    }
+
+    uint8_t nonce[CRYPTO_NONCE_SIZE];
+    uint16_t diff = data_packet_nonce(conn, packet, nonce);
+    int len = decrypt_data_symmetric(conn->shared_key, nonce, packet + 1 + sizeof(uint16_t),
+                                     length - (1 + sizeof(uint16_t)), data);
+
+    if ((unsigned int)len != length - (1 + sizeof(uint16_t) + CRYPTO_MAC_SIZE)) {
+        return -1;
+    }
+
+    if (diff > DATA_NUM_THRESHOLD * 2) {
+        increment_nonce_number(conn->recv_nonce, DATA_NUM_THRESHOLD);
+    }
+
+    return len;
+}
+
+/* Give the decryption of a data packet received over UDP to the crypto
+ * workers. The packet is handled by crypto_finish_jobs().
+ *
+ * return -1 if the packet must be handled in place.
+ * return 0 on success.
+ */
+static int open_data_packet_async(Net_Crypto *c, int crypt_connection_id, IP_Port source, const uint8_t *packet,
+                                  uint16_t length)
+{
+    if (c->crypto_pool == NULL || packet[0] != NET_PACKET_CRYPTO_DATA) {
+        return -1;
+    }
+
+    if (length > MAX_CRYPTO_PACKET_SIZE || length <= CRYPTO_DATA_PACKET_MIN_SIZE) {
+        return -1;
+    }
+
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0) {
+        return -1;
+    }
+
+    if (conn->status != CRYPTO_CONN_NOT_CONFIRMED && conn->status != CRYPTO_CONN_ESTABLISHED) {
+        return -1;
+    }
+
+    Crypto_Job *job = crypto_job_new(c->crypto_pool);
+
+    if (job == NULL) {
+        return -1;
+    }
+
+    job->seal = 0;
+    job->crypt_connection_id = crypt_connection_id;
+    job->source = source;
+    job->length = length;
+    memcpy(job->data, packet, length);
+    memcpy(job->shared_key, conn->shared_key, CRYPTO_SHARED_KEY_SIZE);
+    data_packet_nonce(conn, packet, job->nonce);
+
+    crypto_job_give(c->crypto_pool, job);
+    return 0;
+}
+
+/* Send a request packet.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int send_request_packet(Net_Crypto *c, int crypt_connection_id)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0) {
+        return -1;
+    }
+
+    uint8_t data[MAX_CRYPTO_DATA_SIZE];
+    int len;
+
+    if (conn->requests_without_sack < CRYPTO_SACK_MAX_REQUESTS_WITHOUT) {
+        len = generate_sack_packet(data, sizeof(data), &conn->recv_array);
+
+        if (len == -1) {
+            return -1;
+        }
+
+        if (send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, conn->send_array.buffer_end,
+                                    data, len) != 0) {
+            return -1;
+        }
+    }
+
+    /* Peers that never sent a PACKET_ID_SACK might not understand them. */
+    if (conn->peer_sack) {
+        return 0;
+    }
+
+    len = generate_request_packet(data, sizeof(data), &conn->recv_array);
+
+    if (len == -1) {
+        return -1;
+    }
+
+    return send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, conn->send_array.buffer_end, data,
+                                   len);
+}
+
+/* Send up to max num previously requested data packets.
+ *
+ * return -1 on failure.
+ * return number of packets sent on success.
+ */
+static int send_requested_packets(Net_Crypto *c, int crypt_connection_id, uint32_t max_num)
+{
+    if (max_num == 0) {
+        return -1;
+    }
+
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0) {
+        return -1;
+    }
+
+    uint64_t temp_time = mono_time_monotonic(c->mono_time);
+    uint32_t i, num_sent = 0, array_size = num_packets_array(&conn->send_array);
+
+    /* Only this thread frees the packets of the send array, but other threads
+     * can move its slots when they grow it. */
+    for (i = 0; i < array_size; ++i) {
+        Packet_Data *dt;
+        pthread_mutex_lock(&conn->mutex);
+        uint32_t packet_num = (i + conn->send_array.buffer_start);
+        int ret = get_data_pointer(&conn->send_array, &dt, packet_num);
+        pthread_mutex_unlock(&conn->mutex);
+
+        if (ret == -1) {
+            return -1;
+        }
+
+        if (ret == 0) {
+            continue;
+        }
+
+        if (dt->sent_time) {
+            continue;
+        }
+
+        if (send_lossless_data_packet(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num, dt->data,
+                                      dt->length) == 0) {
+            dt->sent_time = temp_time;
+            ++num_sent;
+        }
+
+        if (num_sent >= max_num) {
+            break;
+        }
+    }
+
+    return num_sent;
+}
+
+
+/* Add a new temp packet to send repeatedly.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int new_temp_packet(const Net_Crypto *c, int crypt_connection_id, const uint8_t *packet, uint16_t length)
+{
+    if (length == 0 || length > MAX_CRYPTO_PACKET_SIZE) {
+        return -1;
+    }
+
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0) {
+        return -1;
+    }
+
+    uint8_t *temp_packet = (uint8_t *)malloc(length);
+
+    if (temp_packet == 0) {
+        return -1;
+    }
+
+    if (conn->temp_packet) {
+        free(conn->temp_packet);
+    }
+
+    memcpy(temp_packet, packet, length);
+    conn->temp_packet = temp_packet;
+    conn->temp_packet_length = length;
+    conn->temp_packet_sent_time = 0;
+    conn->temp_packet_num_sent = 0;
+    timer_start(c->timers, conn->temp_packet_timer, 0);
+    return 0;
+}
+
+/* Clear the temp packet.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int clear_temp_packet(const Net_Crypto *c, int crypt_connection_id)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0) {
+        return -1;
+    }
+
+    if (conn->temp_packet) {
+        free(conn->temp_packet);
+    }
+
+    conn->temp_packet = 0;
+    conn->temp_packet_length = 0;
+    conn->temp_packet_sent_time = 0;
+    conn->temp_packet_num_sent = 0;
+    timer_stop(c->timers, conn->temp_packet_timer);
+    return 0;
+}
+
+
+/* Send the temp packet.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int send_temp_packet(Net_Crypto *c, int crypt_connection_id)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+#if defined(ELASTOS_BUILD)
+    ELASTOS_VLA(uint8_t, packet, conn->temp_packet_length);
+    memcpy(packet, conn->temp_packet, conn->temp_packet_length);
+#else
+    uint8_t *packet = conn->temp_packet;
+#endif
+
+    if (conn == 0) {
+        return -1;
+    }
+
+    if (!conn->temp_packet) {
+        return -1;
+    }
+
+    if (send_packet_to(c, crypt_connection_id, packet, conn->temp_packet_length) != 0) {
+        timer_start(c->timers, conn->temp_packet_timer,
+                    mono_time_monotonic(c->mono_time) + CRYPTO_SEND_PACKET_RETRY_INTERVAL);
+        return -1;
+    }
+
+    conn->temp_packet_sent_time = mono_time_monotonic(c->mono_time);
+    ++conn->temp_packet_num_sent;
+
+    /* After the last try, kill_timedout() has a look on the next run. */
+    if (conn->temp_packet_num_sent >= MAX_NUM_SENDPACKET_TRIES) {
+        timer_start(c->timers, conn->temp_packet_timer, 0);
+    } else {
+        timer_start(c->timers, conn->temp_packet_timer, conn->temp_packet_sent_time + CRYPTO_SEND_PACKET_INTERVAL + 1);
+    }
+
+    return 0;
+}
+
+/* Create a handshake packet and set it as a temp packet.
+ * cookie must be COOKIE_LENGTH.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int create_send_handshake(Net_Crypto *c, int crypt_connection_id, const uint8_t *cookie,
+                                 const uint8_t *dht_public_key)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0) {
+        return -1;
+    }
+
+    uint8_t handshake_packet[HANDSHAKE_PACKET_LENGTH];
+
+    if (create_crypto_handshake(c, handshake_packet, cookie, conn->sent_nonce, conn->sessionpublic_key,
+                                conn->public_key, dht_public_key) != sizeof(handshake_packet)) {
+        return -1;
+    }
+
+    if (new_temp_packet(c, crypt_connection_id, handshake_packet, sizeof(handshake_packet)) != 0) {
+        return -1;
+    }
+
+    send_temp_packet(c, crypt_connection_id);
+    return 0;
+}
+
+/* Send a kill packet.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int send_kill_packet(Net_Crypto *c, int crypt_connection_id)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0) {
+        return -1;
+    }
+
+    uint8_t kill_packet = PACKET_ID_KILL;
+    return send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, conn->send_array.buffer_end,
+                                   &kill_packet, sizeof(kill_packet));
+}
+
+static void connection_kill(Net_Crypto *c, int crypt_connection_id, void *userdata)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0) {
+        return;
+    }
+
+    if (conn->connection_status_callback) {
+        conn->connection_status_callback(conn->connection_status_callback_object, conn->connection_status_callback_id, 0,
+                                         userdata);
+    }
+
+    crypto_kill(c, crypt_connection_id);
+}
+
+/* Fold a round trip time sample of rtt_time ms into the smoothed round trip
+ * time of the connection, like TCP does (RFC 6298).
+ */
+static void update_srtt(Crypto_Connection *conn, uint64_t rtt_time)
+{
+    pthread_mutex_lock(&conn->mutex);
+
+    if (conn->srtt == 0) {
+        conn->srtt = rtt_time;
+        conn->rtt_var = rtt_time / 2;
+    } else {
+        const uint64_t diff = conn->srtt > rtt_time ? conn->srtt - rtt_time : rtt_time - conn->srtt;
+        conn->rtt_var = (3 * conn->rtt_var + diff) / 4;
+        conn->srtt = (7 * conn->srtt + rtt_time) / 8;
+    }
+
+    pthread_mutex_unlock(&conn->mutex);
+}
+
+/* Handle the decrypted contents of a received data packet.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int handle_data_packet_plain(Net_Crypto *c, int crypt_connection_id, uint8_t *data, int len, bool udp,
+                                    void *userdata)
+{
+    if (len <= (int)(sizeof(uint32_t) * 2)) {
+        return -1;
+    }
+
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0) {
+        return -1;
+    }
+
+    uint32_t buffer_start, num;
+    memcpy(&buffer_start, data, sizeof(uint32_t));
+    memcpy(&num, data + sizeof(uint32_t), sizeof(uint32_t));
+    buffer_start = net_ntohl(buffer_start);
+    num = net_ntohl(num);
+
+    uint64_t rtt_calc_time = 0;
+
+    pthread_mutex_lock(&conn->mutex);
+
+    if (buffer_start != conn->send_array.buffer_start) {
+        Packet_Data *packet_time;
+
+        if (get_data_pointer(&conn->send_array, &packet_time, conn->send_array.buffer_start) == 1) {
+            rtt_calc_time = packet_time->sent_time;
+        }
+
+        const uint32_t num_acked = buffer_start - conn->send_array.buffer_start;
+
+        if (clear_buffer_until(&c->packet_pool, &conn->send_array, buffer_start) != 0) {
+            pthread_mutex_unlock(&conn->mutex);
+            return -1;
+        }
+
+        conn->packets_acked += num_acked;
+    }
+
+    pthread_mutex_unlock(&conn->mutex);
+
+    uint8_t *real_data = data + (sizeof(uint32_t) * 2);
+    uint16_t real_length = len - (sizeof(uint32_t) * 2);
+
+    while (real_data[0] == PACKET_ID_PADDING) { /* Remove Padding */
+        ++real_data;
+        --real_length;
+
+        if (real_length == 0) {
+            return -1;
+        }
+    }
+
+    Packet_Stats *stats = &c->packet_stats[real_data[0]];
+    packet_stats_received(stats, real_length);
+
+    if (real_data[0] == PACKET_ID_KILL) {
+        packet_stats_handled(stats, current_time_monotonic_us(), true);
+        connection_kill(c, crypt_connection_id, userdata);
+        return 0;
+    }
+
+    if (conn->status == CRYPTO_CONN_NOT_CONFIRMED) {
+        clear_temp_packet(c, crypt_connection_id);
+        conn->status = CRYPTO_CONN_ESTABLISHED;
+
+        if (conn->connection_status_callback) {
+            conn->connection_status_callback(conn->connection_status_callback_object, conn->connection_status_callback_id, 1,
+                                             userdata);
+        }
+    }
+
+    if (real_data[0] == PACKET_ID_REQUEST || real_data[0] == PACKET_ID_SACK) {
+        uint64_t rtt_time;
+
+        if (udp) {
+            rtt_time = conn->rtt_time;
+        } else {
+            rtt_time = DEFAULT_TCP_PING_CONNECTION;
+        }
+
+        const uint64_t handler_start = current_time_monotonic_us();
+        int requested;
+
+        pthread_mutex_lock(&conn->mutex);
+
+        if (real_data[0] == PACKET_ID_SACK) {
+            requested = handle_sack_packet(c->mono_time, &c->packet_pool, &conn->send_array, real_data, real_length,
+                                           &rtt_calc_time, rtt_time);
+            conn->peer_sack |= requested != -1;
+        } else if (conn->peer_sack) {
+            /* Sent along with the PACKET_ID_SACK until the peer saw ours. */
+            requested = 0;
+        } else {
+            if (conn->requests_without_sack < CRYPTO_SACK_MAX_REQUESTS_WITHOUT) {
+                ++conn->requests_without_sack;
+            }
+
+            requested = handle_request_packet(c->mono_time, &c->packet_pool, &conn->send_array, real_data, real_length,
+                                              &rtt_calc_time, rtt_time);
+        }
+
+        pthread_mutex_unlock(&conn->mutex);
+        packet_stats_handled(stats, handler_start, requested != -1);
+
+        if (requested == -1) {
+            return -1;
+        }
+
+        // else { /* TODO(irungentoo): ? */ }
+
+        set_buffer_end(&conn->recv_array, num);
+    } else if (real_data[0] >= CRYPTO_RESERVED_PACKETS && real_data[0] < PACKET_ID_LOSSY_RANGE_START) {
+        Packet_Data dt;
+        dt.length = real_length;
+        memcpy(dt.data, real_data, real_length);
+
+        if (add_data_to_buffer(&c->packet_pool, &conn->recv_array, num, &dt) != 0) {
+            packet_stats_dropped(stats);
+            return -1;
+        }
+
+        while (1) {
+            pthread_mutex_lock(&conn->mutex);
+            int ret = read_data_beg_buffer(&c->packet_pool, &conn->recv_array, &dt);
+            pthread_mutex_unlock(&conn->mutex);
+
+            if (ret == -1) {
+                break;
+            }
+
+            /* Packets are handled in order, which may be later than they
+               were received. */
+            Packet_Stats *dt_stats = &c->packet_stats[dt.data[0]];
+
+            if (conn->connection_data_callback) {
+                const uint64_t handler_start = current_time_monotonic_us();
+                const int handled = conn->connection_data_callback(conn->connection_data_callback_object,
+                                    conn->connection_data_callback_id, dt.data, dt.length, userdata);
+                packet_stats_handled(dt_stats, handler_start, handled != -1);
+            } else {
+                packet_stats_dropped(dt_stats);
+            }
+
+            /* conn might get killed in callback. */
+            conn = get_crypto_connection(c, crypt_connection_id);
+
+            if (conn == 0) {
+                return -1;
+            }
+        }
+
+        /* Packet counter. */
+        ++conn->packet_counter;
+    } else if (real_data[0] >= PACKET_ID_LOSSY_RANGE_START &&
+               real_data[0] < (PACKET_ID_LOSSY_RANGE_START + PACKET_ID_LOSSY_RANGE_SIZE)) {
+
+        set_buffer_end(&conn->recv_array, num);
+
+        if (conn->connection_lossy_data_callback) {
+            const uint64_t handler_start = current_time_monotonic_us();
+            const int handled = conn->connection_lossy_data_callback(conn->connection_lossy_data_callback_object,
+                                conn->connection_lossy_data_callback_id, real_data, real_length, userdata);
+            packet_stats_handled(stats, handler_start, handled != -1);
+        } else {
+            packet_stats_dropped(stats);
+        }
+    } else {
+        packet_stats_dropped(stats);
+        return -1;
+    }
+
+    if (rtt_calc_time != 0) {
+        uint64_t rtt_time = mono_time_monotonic(c->mono_time) - rtt_calc_time;
+
+        if (rtt_time < conn->rtt_time) {
+            conn->rtt_time = rtt_time;
+        }
+
+        conn->last_rtt_sample = rtt_time;
+        update_srtt(conn, rtt_time);
+    }
+
+    return 0;
+}
+
+/* Count a data packet of length bytes received on the connection. */
+static void count_data_packet_received(Crypto_Connection *conn, uint16_t length)
+{
+    pthread_mutex_lock(&conn->mutex);
+    ++conn->data_packets_received;
+    conn->data_bytes_received += length;
+    pthread_mutex_unlock(&conn->mutex);
+}
+
+/* Handle a received data packet.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int handle_data_packet_core(Net_Crypto *c, int crypt_connection_id, const uint8_t *packet, uint16_t length,
+                                   bool udp, void *userdata)
+{
+    if (length > MAX_CRYPTO_PACKET_SIZE || length <= CRYPTO_DATA_PACKET_MIN_SIZE) {
+        return -1;
+    }
+
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0) {
+        return -1;
+    }
+
+    uint8_t data[MAX_DATA_DATA_PACKET_SIZE];
+    int len = handle_data_packet(c, crypt_connection_id, data, packet, length);
+
+    if (len == -1) {
+        return -1;
+    }
+
+    count_data_packet_received(conn, length);
+
+    return handle_data_packet_plain(c, crypt_connection_id, data, len, udp, userdata);
+}
+
+/* Handle a packet that was received for the connection.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int handle_packet_connection(Net_Crypto *c, int crypt_connection_id, const uint8_t *packet, uint16_t length,
+                                    bool udp, void *userdata)
+{
+    if (length == 0 || length > MAX_CRYPTO_PACKET_SIZE) {
+        return -1;
+    }
+
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0) {
+        return -1;
+    }
+
+    switch (packet[0]) {
+        case NET_PACKET_COOKIE_RESPONSE: {
+            if (conn->status != CRYPTO_CONN_COOKIE_REQUESTING) {
+                return -1;
+            }
+
+            uint8_t cookie[COOKIE_LENGTH];
+            uint64_t number;
+
+            if (handle_cookie_response(cookie, &number, packet, length, conn->shared_key) != sizeof(cookie)) {
+                return -1;
+            }
+
+            if (number != conn->cookie_request_number) {
+                return -1;
+            }
+
+            if (create_send_handshake(c, crypt_connection_id, cookie, conn->dht_public_key) != 0) {
+                return -1;
+            }
+
+            conn->status = CRYPTO_CONN_HANDSHAKE_SENT;
+            return 0;
+        }
+
+        case NET_PACKET_CRYPTO_HS: {
+            if (conn->status == CRYPTO_CONN_COOKIE_REQUESTING || conn->status == CRYPTO_CONN_HANDSHAKE_SENT
+                    || conn->status == CRYPTO_CONN_NOT_CONFIRMED) {
+                uint8_t peer_real_pk[CRYPTO_PUBLIC_KEY_SIZE];
+                uint8_t dht_public_key[CRYPTO_PUBLIC_KEY_SIZE];
+                uint8_t cookie[COOKIE_LENGTH];
+
+                if (handle_crypto_handshake(c, conn->recv_nonce, conn->peersessionpublic_key, peer_real_pk, dht_public_key, cookie,
+                                            packet, length, conn->public_key) != 0) {
+                    return -1;
+                }
+
+                if (public_key_cmp(dht_public_key, conn->dht_public_key) == 0) {
+                    encrypt_precompute(conn->peersessionpublic_key, conn->sessionsecret_key, conn->shared_key);
+
+                    if (conn->status == CRYPTO_CONN_COOKIE_REQUESTING) {
+                        if (create_send_handshake(c, crypt_connection_id, cookie, dht_public_key) != 0) {
+                            return -1;
+                        }
+                    }
+
+                    conn->status = CRYPTO_CONN_NOT_CONFIRMED;
+                } else {
+                    if (conn->dht_pk_callback) {
+                        conn->dht_pk_callback(conn->dht_pk_callback_object, conn->dht_pk_callback_number, dht_public_key, userdata);
+                    }
+                }
+            } else {
+                return -1;
+            }
+
+            return 0;
+        }
+
+        case NET_PACKET_CRYPTO_DATA: {
+            if (conn->status == CRYPTO_CONN_NOT_CONFIRMED || conn->status == CRYPTO_CONN_ESTABLISHED) {
+                return handle_data_packet_core(c, crypt_connection_id, packet, length, udp, userdata);
+            }
+
+            return -1;
+        }
+
+        default: {
+            return -1;
+        }
+    }
+}
+
+/* Set the size of the friend list to numfriends.
+ *
+ *  return -1 if realloc fails.
+ *  return 0 if it succeeds.
+ */
+static int realloc_cryptoconnection(Net_Crypto *c, uint32_t num)
+{
+    if (num == 0) {
+        free(c->crypto_connections);
+        c->crypto_connections = NULL;
+        return 0;
+    }
+
+    Crypto_Connection *newcrypto_connections = (Crypto_Connection *)realloc(c->crypto_connections,
+            num * sizeof(Crypto_Connection));
+
+    if (newcrypto_connections == NULL) {
+        return -1;
+    }
+
+    c->crypto_connections = newcrypto_connections;
+    return 0;
+}
+
+
+static void kill_timedout(void *object, uint32_t crypt_connection_id, void *userdata);
+
+/* Create a new empty crypto connection.
+ *
+ * return -1 on failure.
+ * return connection id on success.
+ */
+static int create_crypto_connection(Net_Crypto *c)
+{
+    uint32_t i;
+
+    for (i = 0; i < c->crypto_connections_length; ++i) {
+        Crypto_Connection *conn = &c->crypto_connections[i];
+
+        if (conn->status == CRYPTO_CONN_NO_CONNECTION) {
+            /* A connection that failed to be set up keeps its timer. */
+            if (conn->temp_packet_timer == 0) {
+                conn->temp_packet_timer = timer_new(c->timers, &kill_timedout, c, i);
+            }
+
+            return conn->temp_packet_timer != 0 ? (int)i : -1;
+        }
+    }
+
+    while (1) { /* TODO(irungentoo): is this really the best way to do this? */
+        pthread_mutex_lock(&c->connections_mutex);
+
+        if (!c->connection_use_counter) {
+            break;
+        }
+
+        pthread_mutex_unlock(&c->connections_mutex);
+    }
+
+    int id = -1;
+
+    if (realloc_cryptoconnection(c, c->crypto_connections_length + 1) == 0) {
+        id = c->crypto_connections_length;
+        ++c->crypto_connections_length;
+        memset(&(c->crypto_connections[id]), 0, sizeof(Crypto_Connection));
+        // Memsetting float/double to 0 is non-portable, so we explicitly set them to 0
+        c->crypto_connections[id].packet_recv_rate = 0;
+        c->crypto_connections[id].packet_send_rate = 0;
+        c->crypto_connections[id].last_packets_left_rem = 0;
+        c->crypto_connections[id].packet_send_rate_requested = 0;
+        c->crypto_connections[id].last_packets_left_requested_rem = 0;
+
+        if (pthread_mutex_init(&c->crypto_connections[id].mutex, NULL) != 0) {
+            pthread_mutex_unlock(&c->connections_mutex);
+            return -1;
+        }
+
+        c->crypto_connections[id].temp_packet_timer = timer_new(c->timers, &kill_timedout, c, id);
+
+        if (c->crypto_connections[id].temp_packet_timer == 0) {
+            id = -1;
+        }
+    }
+
+    pthread_mutex_unlock(&c->connections_mutex);
+    return id;
+}
+
+/* Return the slot of the connections index holding public_key, or the empty
+ * slot where it would be inserted.
+ */
+static uint32_t connections_index_slot(const Net_Crypto *c, const uint8_t *public_key)
+{
+    const uint32_t mask = c->connections_index_size - 1;
+    uint32_t slot = hash_public_key(c->connections_hash_key, public_key) & mask;
+
+    while (c->connections_index[slot] != 0
+            && !id_equal(c->crypto_connections[c->connections_index[slot] - 1].public_key, public_key)) {
+        slot = (slot + 1) & mask;
+    }
+
+    return slot;
+}
+
+/* Reallocate the connections index with size slots and insert all the
+ * connections that are set up into it.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+static int connections_index_resize(Net_Crypto *c, uint32_t size)
+{
+    uint32_t *connections_index = (uint32_t *)calloc(size, sizeof(uint32_t));
+
+    if (connections_index == NULL) {
+        return -1;
+    }
+
+    free(c->connections_index);
+    c->connections_index = connections_index;
+    c->connections_index_size = size;
+    c->connections_index_count = 0;
+
+    for (uint32_t i = 0; i < c->crypto_connections_length; ++i) {
+        if (c->crypto_connections[i].status != CRYPTO_CONN_NO_CONNECTION) {
+            c->connections_index[connections_index_slot(c, c->crypto_connections[i].public_key)] = i + 1;
+            ++c->connections_index_count;
+        }
+    }
+
+    return 0;
+}
+
+/* Add the connection to the connections index, once its public key is set and
+ * it is no longer CRYPTO_CONN_NO_CONNECTION.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+static int connections_index_add(Net_Crypto *c, int crypt_connection_id)
+{
+    if ((c->connections_index_count + 1) * 2 > c->connections_index_size) {
+        const uint32_t size = c->connections_index_size ? c->connections_index_size * 2 : CRYPTO_CONNECTIONS_INDEX_MIN_SIZE;
+
+        /* This inserts the connection too. */
+        return connections_index_resize(c, size);
+    }
+
+    const uint32_t slot = connections_index_slot(c, c->crypto_connections[crypt_connection_id].public_key);
+
+    if (c->connections_index[slot] == 0) {
+        c->connections_index[slot] = crypt_connection_id + 1;
+        ++c->connections_index_count;
+    }
+
+    return 0;
+}
+
+/* Remove the connection from the connections index, shifting back the
+ * entries after it so that no probe sequence is broken.
+ */
+static void connections_index_remove(Net_Crypto *c, int crypt_connection_id)
+{
+    if (c->connections_index == NULL) {
+        return;
+    }
+
+    const uint32_t mask = c->connections_index_size - 1;
+    uint32_t hole = connections_index_slot(c, c->crypto_connections[crypt_connection_id].public_key);
+
+    if (c->connections_index[hole] != (uint32_t)crypt_connection_id + 1) {
+        return;
+    }
+
+    uint32_t slot = hole;
+    c->connections_index[hole] = 0;
+    --c->connections_index_count;
+
+    while (c->connections_index[slot = (slot + 1) & mask] != 0) {
+        const uint8_t *key = c->crypto_connections[c->connections_index[slot] - 1].public_key;
+        const uint32_t home = hash_public_key(c->connections_hash_key, key) & mask;
+
+        /* Move the entry into the hole unless its home slot is cyclically in (hole, slot]. */
+        if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+            c->connections_index[hole] = c->connections_index[slot];
+            c->connections_index[slot] = 0;
+            hole = slot;
+        }
+    }
+}
+
+/* Wipe a crypto connection.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int wipe_crypto_connection(Net_Crypto *c, int crypt_connection_id)
+{
+    if (crypt_connection_id_not_valid(c, crypt_connection_id)) {
+        return -1;
+    }
+
+    uint32_t i;
+
+    timer_free(c->timers, c->crypto_connections[crypt_connection_id].temp_packet_timer);
+    connections_index_remove(c, crypt_connection_id);
+    crypto_drop_jobs(c, crypt_connection_id);
+
+    /* Keep mutex, only destroy it when connection is realloced out. */
+    pthread_mutex_t mutex = c->crypto_connections[crypt_connection_id].mutex;
+    crypto_memzero(&(c->crypto_connections[crypt_connection_id]), sizeof(Crypto_Connection));
+    c->crypto_connections[crypt_connection_id].mutex = mutex;
+
+    for (i = c->crypto_connections_length; i != 0; --i) {
+        if (c->crypto_connections[i - 1].status == CRYPTO_CONN_NO_CONNECTION) {
+            pthread_mutex_destroy(&c->crypto_connections[i - 1].mutex);
+            timer_free(c->timers, c->crypto_connections[i - 1].temp_packet_timer);
+        } else {
+            break;
+        }
+    }
+
+    if (c->crypto_connections_length != i) {
+        c->crypto_connections_length = i;
+        realloc_cryptoconnection(c, c->crypto_connections_length);
+    }
+
+    return 0;
+}
+
+/* Get crypto connection id from public key of peer.
+ *
+ *  return -1 if there are no connections like we are looking for.
+ *  return id if it found it.
+ */
+static int getcryptconnection_id(const Net_Crypto *c, const uint8_t *public_key)
+{
+    if (c->connections_index == NULL) {
+        return -1;
+    }
+
+    const uint32_t slot = connections_index_slot(c, public_key);
+
+    if (c->connections_index[slot] == 0) {
+        return -1;
+    }
+
+    return c->connections_index[slot] - 1;
+}
+
+/* Add a source to the crypto connection.
+ * This is to be used only when we have received a packet from that source.
+ *
+ *  return -1 on failure.
+ *  return positive number on success.
+ *  0 if source was a direct UDP connection.
+ */
+static int crypto_connection_add_source(Net_Crypto *c, int crypt_connection_id, IP_Port source)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0) {
+        return -1;
+    }
+
+    if (source.ip.family == AF_INET || source.ip.family == AF_INET6) {
+        if (add_ip_port_connection(c, crypt_connection_id, source) != 0) {
+            return -1;
+        }
+
+        if (source.ip.family == AF_INET) {
+            conn->direct_lastrecv_timev4 = mono_time_get(c->mono_time);
+        } else {
+            conn->direct_lastrecv_timev6 = mono_time_get(c->mono_time);
+        }
+
+        return 0;
+    }
+
+    if (source.ip.family == TCP_FAMILY) {
+        if (add_tcp_number_relay_connection(c->tcp_c, conn->connection_number_tcp, source.ip.ip6.uint32[0]) == 0) {
+            return 1;
+        }
+    }
+
+    return -1;
+}
+
+
+/* Set function to be called when someone requests a new connection to us.
+ *
+ * The set function should return -1 on failure and 0 on success.
+ *
+ * n_c is only valid for the duration of the function call.
+ */
+void new_connection_handler(Net_Crypto *c, int (*new_connection_callback)(void *object, New_Connection *n_c),
+                            void *object)
+{
+    c->new_connection_callback = new_connection_callback;
+    c->new_connection_callback_object = object;
+}
+
+/* Handle a handshake packet by someone who wants to initiate a new connection with us.
+ * This calls the callback set by new_connection_handler() if the handshake is ok.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int handle_new_connection_handshake(Net_Crypto *c, IP_Port source, const uint8_t *data, uint16_t length,
+        void *userdata)
+{
+    New_Connection n_c;
+    n_c.cookie = (uint8_t *)malloc(COOKIE_LENGTH);
+
+    if (n_c.cookie == NULL) {
+        return -1;
+    }
+
+    n_c.source = source;
+    n_c.cookie_length = COOKIE_LENGTH;
+
+    if (handle_crypto_handshake(c, n_c.recv_nonce, n_c.peersessionpublic_key, n_c.public_key, n_c.dht_public_key,
+                                n_c.cookie, data, length, 0) != 0) {
+        free(n_c.cookie);
+        return -1;
+    }
+
+    int crypt_connection_id = getcryptconnection_id(c, n_c.public_key);
+
+    if (crypt_connection_id != -1) {
+        Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+        if (public_key_cmp(n_c.dht_public_key, conn->dht_public_key) != 0) {
+            connection_kill(c, crypt_connection_id, userdata);
+        } else {
+            int ret = -1;
+
+            if (conn && (conn->status == CRYPTO_CONN_COOKIE_REQUESTING || conn->status == CRYPTO_CONN_HANDSHAKE_SENT)) {
+                memcpy(conn->recv_nonce, n_c.recv_nonce, CRYPTO_NONCE_SIZE);
+                memcpy(conn->peersessionpublic_key, n_c.peersessionpublic_key, CRYPTO_PUBLIC_KEY_SIZE);
+                encrypt_precompute(conn->peersessionpublic_key, conn->sessionsecret_key, conn->shared_key);
+
+                crypto_connection_add_source(c, crypt_connection_id, source);
+
+                if (create_send_handshake(c, crypt_connection_id, n_c.cookie, n_c.dht_public_key) == 0) {
+                    conn->status = CRYPTO_CONN_NOT_CONFIRMED;
+                    ret = 0;
+                }
+            }
+
+            free(n_c.cookie);
+            return ret;
+        }
+    }
+
+    int ret = c->new_connection_callback(c->new_connection_callback_object, &n_c);
+    free(n_c.cookie);
+    return ret;
+}
+
+/* Accept a crypto connection.
+ *
+ * return -1 on failure.
+ * return connection id on success.
+ */
+int accept_crypto_connection(Net_Crypto *c, New_Connection *n_c)
+{
+    if (getcryptconnection_id(c, n_c->public_key) != -1) {
+        return -1;
+    }
+
+    int crypt_connection_id = create_crypto_connection(c);
+
+    if (crypt_connection_id == -1) {
+        return -1;
+    }
+
+    Crypto_Connection *conn = &c->crypto_connections[crypt_connection_id];
+
+    if (n_c->cookie_length != COOKIE_LENGTH) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&c->tcp_mutex);
+    int connection_number_tcp = new_tcp_connection_to(c->tcp_c, n_c->dht_public_key, crypt_connection_id);
+    pthread_mutex_unlock(&c->tcp_mutex);
+
+    if (connection_number_tcp == -1) {
+        return -1;
+    }
+
+    conn->connection_number_tcp = connection_number_tcp;
+    memcpy(conn->public_key, n_c->public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    memcpy(conn->recv_nonce, n_c->recv_nonce, CRYPTO_NONCE_SIZE);
+    memcpy(conn->peersessionpublic_key, n_c->peersessionpublic_key, CRYPTO_PUBLIC_KEY_SIZE);
+    random_nonce(conn->sent_nonce);
+    crypto_new_keypair(conn->sessionpublic_key, conn->sessionsecret_key);
+    encrypt_precompute(conn->peersessionpublic_key, conn->sessionsecret_key, conn->shared_key);
+    conn->status = CRYPTO_CONN_NOT_CONFIRMED;
+
+    if (connections_index_add(c, crypt_connection_id) != 0
+            || create_send_handshake(c, crypt_connection_id, n_c->cookie, n_c->dht_public_key) != 0) {
+        pthread_mutex_lock(&c->tcp_mutex);
+        kill_tcp_connection_to(c->tcp_c, conn->connection_number_tcp);
+        pthread_mutex_unlock(&c->tcp_mutex);
+        connections_index_remove(c, crypt_connection_id);
+        conn->status = CRYPTO_CONN_NO_CONNECTION;
+        return -1;
+    }
+
+    memcpy(conn->dht_public_key, n_c->dht_public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    conn->packet_send_rate = CRYPTO_PACKET_MIN_RATE;
+    conn->packet_send_rate_requested = CRYPTO_PACKET_MIN_RATE;
+    conn->packets_left = CRYPTO_MIN_QUEUE_LENGTH;
+    conn->rtt_time = DEFAULT_PING_CONNECTION;
+    conn->congestion_control = c->congestion_control;
+
+    if (conn->congestion_control->init) {
+        conn->congestion_control->init(conn);
+    }
+
+    crypto_connection_add_source(c, crypt_connection_id, n_c->source);
+    return crypt_connection_id;
+}
+
+/* Create a crypto connection.
+ * If one to that real public key already exists, return it.
+ *
+ * return -1 on failure.
+ * return connection id on success.
+ */
+int new_crypto_connection(Net_Crypto *c, const uint8_t *real_public_key, const uint8_t *dht_public_key)
+{
+    int crypt_connection_id = getcryptconnection_id(c, real_public_key);
+
+    if (crypt_connection_id != -1) {
+        return crypt_connection_id;
+    }
+
+    crypt_connection_id = create_crypto_connection(c);
+
+    if (crypt_connection_id == -1) {
+        return -1;
+    }
+
+    Crypto_Connection *conn = &c->crypto_connections[crypt_connection_id];
+
+    if (conn == 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&c->tcp_mutex);
+    int connection_number_tcp = new_tcp_connection_to(c->tcp_c, dht_public_key, crypt_connection_id);
+    pthread_mutex_unlock(&c->tcp_mutex);
+
+    if (connection_number_tcp == -1) {
+        return -1;
+    }
+
+    conn->connection_number_tcp = connection_number_tcp;
+    memcpy(conn->public_key, real_public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    random_nonce(conn->sent_nonce);
+    crypto_new_keypair(conn->sessionpublic_key, conn->sessionsecret_key);
+    conn->status = CRYPTO_CONN_COOKIE_REQUESTING;
+    conn->packet_send_rate = CRYPTO_PACKET_MIN_RATE;
+    conn->packet_send_rate_requested = CRYPTO_PACKET_MIN_RATE;
+    conn->packets_left = CRYPTO_MIN_QUEUE_LENGTH;
+    conn->rtt_time = DEFAULT_PING_CONNECTION;
+    conn->congestion_control = c->congestion_control;
+
+    if (conn->congestion_control->init) {
+        conn->congestion_control->init(conn);
+    }
+
+    memcpy(conn->dht_public_key, dht_public_key, CRYPTO_PUBLIC_KEY_SIZE);
+
+    conn->cookie_request_number = random_64b();
+    uint8_t cookie_request[COOKIE_REQUEST_LENGTH];
+
+    if (connections_index_add(c, crypt_connection_id) != 0
+            || create_cookie_request(c, cookie_request, conn->dht_public_key, conn->cookie_request_number,
+                                     conn->shared_key) != sizeof(cookie_request)
+            || new_temp_packet(c, crypt_connection_id, cookie_request, sizeof(cookie_request)) != 0) {
+        pthread_mutex_lock(&c->tcp_mutex);
+        kill_tcp_connection_to(c->tcp_c, conn->connection_number_tcp);
+        pthread_mutex_unlock(&c->tcp_mutex);
+        connections_index_remove(c, crypt_connection_id);
+        conn->status = CRYPTO_CONN_NO_CONNECTION;
+        return -1;
+    }
+
+    return crypt_connection_id;
+}
+
+/* Set the direct ip of the crypto connection.
+ *
+ * Connected is 0 if we are not sure we are connected to that person, 1 if we are sure.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+int set_direct_ip_port(Net_Crypto *c, int crypt_connection_id, IP_Port ip_port, bool connected)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
 
-    /* Keep mutex, only destroy it when connection is realloced out. */
-    pthread_mutex_t mutex = c->crypto_connections[crypt_connection_id].mutex;
-    crypto_memzero(&(c->crypto_connections[crypt_connection_id]), sizeof(Crypto_Connection));
-    c->crypto_connections[crypt_connection_id].mutex = mutex;
+    if (conn == 0) {
+        return -1;
+    }
 
-    for (i = c->crypto_connections_length; i != 0; --i) {
-        if (c->crypto_connections[i - 1].status == CRYPTO_CONN_NO_CONNECTION) {
-            pthread_mutex_destroy(&c->crypto_connections[i - 1].mutex);
+    if (add_ip_port_connection(c, crypt_connection_id, ip_port) == 0) {
+        if (connected) {
+            if (ip_port.ip.family == AF_INET) {
+                conn->direct_lastrecv_timev4 = mono_time_get(c->mono_time);
+            } else {
+                conn->direct_lastrecv_timev6 = mono_time_get(c->mono_time);
+            }
         } else {
-            break;
+            if (ip_port.ip.family == AF_INET) {
+                conn->direct_lastrecv_timev4 = 0;
+            } else {
+                conn->direct_lastrecv_timev6 = 0;
+            }
         }
+
+        return 0;
     }
 
-    if (c->crypto_connections_length != i) {
-        c->crypto_connections_length = i;
-        realloc_cryptoconnection(c, c->crypto_connections_length);
+    return -1;
+}
+
+
+static int tcp_data_callback(void *object, int id, const uint8_t *data, uint16_t length, void *userdata)
+{
+    if (length == 0 || length > MAX_CRYPTO_PACKET_SIZE) {
+        return -1;
+    }
+
+    Net_Crypto *c = (Net_Crypto *)object;
+
+    Crypto_Connection *conn = get_crypto_connection(c, id);
+
+    if (conn == 0) {
+        return -1;
+    }
+
+    if (data[0] == NET_PACKET_COOKIE_REQUEST) {
+        return tcp_handle_cookie_request(c, conn->connection_number_tcp, data, length);
+    }
+
+    // This unlocks the mutex that at this point is locked by do_tcp before
+    // calling do_tcp_connections.
+    pthread_mutex_unlock(&c->tcp_mutex);
+    int ret = handle_packet_connection(c, id, data, length, 0, userdata);
+    pthread_mutex_lock(&c->tcp_mutex);
+
+    if (ret != 0) {
+        return -1;
     }
 
+    // TODO(irungentoo): detect and kill bad TCP connections.
     return 0;
 }
 
-/* Get crypto connection id from public key of peer.
+static int tcp_oob_callback(void *object, const uint8_t *public_key, unsigned int tcp_connections_number,
+                            const uint8_t *data, uint16_t length, void *userdata)
+{
+    if (length == 0 || length > MAX_CRYPTO_PACKET_SIZE) {
+        return -1;
+    }
+
+    Net_Crypto *c = (Net_Crypto *)object;
+
+    if (data[0] == NET_PACKET_COOKIE_REQUEST) {
+        return tcp_oob_handle_cookie_request(c, tcp_connections_number, public_key, data, length);
+    }
+
+    if (data[0] == NET_PACKET_CRYPTO_HS) {
+        IP_Port source;
+        source.port = 0;
+        source.ip.family = TCP_FAMILY;
+        source.ip.ip6.uint32[0] = tcp_connections_number;
+
+        if (handle_new_connection_handshake(c, source, data, length, userdata) != 0) {
+            return -1;
+        }
+
+        return 0;
+    }
+
+    return -1;
+}
+
+/* Add a tcp relay, associating it to a crypt_connection_id.
  *
- *  return -1 if there are no connections like we are looking for.
- *  return id if it found it.
+ * return 0 if it was added.
+ * return -1 if it wasn't.
  */
-static int getcryptconnection_id(const Net_Crypto *c, const uint8_t *public_key)
+int add_tcp_relay_peer(Net_Crypto *c, int crypt_connection_id, IP_Port ip_port, const uint8_t *public_key)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&c->tcp_mutex);
+    int ret = add_tcp_relay_connection(c->tcp_c, conn->connection_number_tcp, ip_port, public_key);
+    pthread_mutex_unlock(&c->tcp_mutex);
+    return ret;
+}
+
+/* Add a tcp relay to the array.
+ *
+ * return 0 if it was added.
+ * return -1 if it wasn't.
+ */
+int add_tcp_relay(Net_Crypto *c, IP_Port ip_port, const uint8_t *public_key)
+{
+    pthread_mutex_lock(&c->tcp_mutex);
+    int ret = add_tcp_relay_global(c->tcp_c, ip_port, public_key);
+    pthread_mutex_unlock(&c->tcp_mutex);
+    return ret;
+}
+
+/* Return a random TCP connection number for use in send_tcp_onion_request.
+ *
+ * TODO(irungentoo): This number is just the index of an array that the elements can
+ * change without warning.
+ *
+ * return TCP connection number on success.
+ * return -1 on failure.
+ */
+int get_random_tcp_con_number(Net_Crypto *c)
+{
+    pthread_mutex_lock(&c->tcp_mutex);
+    int ret = get_random_tcp_onion_conn_number(c->tcp_c);
+    pthread_mutex_unlock(&c->tcp_mutex);
+
+    return ret;
+}
+
+/* Send an onion packet via the TCP relay corresponding to tcp_connections_number.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int send_tcp_onion_request(Net_Crypto *c, unsigned int tcp_connections_number, const uint8_t *data, uint16_t length)
+{
+    pthread_mutex_lock(&c->tcp_mutex);
+    int ret = tcp_send_onion_request(c->tcp_c, tcp_connections_number, data, length);
+    pthread_mutex_unlock(&c->tcp_mutex);
+
+    return ret;
+}
+
+/* Copy a maximum of num TCP relays we are connected to to tcp_relays.
+ * NOTE that the family of the copied ip ports will be set to TCP_INET or TCP_INET6.
+ *
+ * return number of relays copied to tcp_relays on success.
+ * return 0 on failure.
+ */
+unsigned int copy_connected_tcp_relays(Net_Crypto *c, Node_format *tcp_relays, uint16_t num)
+{
+    if (num == 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&c->tcp_mutex);
+    unsigned int ret = tcp_copy_connected_relays(c->tcp_c, tcp_relays, num);
+    pthread_mutex_unlock(&c->tcp_mutex);
+
+    return ret;
+}
+
+static void do_tcp(Net_Crypto *c, void *userdata)
 {
+    pthread_mutex_lock(&c->tcp_mutex);
+    do_tcp_connections(c->tcp_c, userdata);
+    pthread_mutex_unlock(&c->tcp_mutex);
+
     uint32_t i;
 
     for (i = 0; i < c->crypto_connections_length; ++i) {
-        if (c->crypto_connections[i].status != CRYPTO_CONN_NO_CONNECTION) {
-            if (public_key_cmp(public_key, c->crypto_connections[i].public_key) == 0) {
-                return i;
+        Crypto_Connection *conn = get_crypto_connection(c, i);
+
+        if (conn == 0) {
+            return;
+        }
+
+        if (conn->status == CRYPTO_CONN_ESTABLISHED) {
+            bool direct_connected = 0;
+            crypto_connection_status(c, i, &direct_connected, NULL);
+
+            if (direct_connected) {
+                pthread_mutex_lock(&c->tcp_mutex);
+                set_tcp_connection_to_status(c->tcp_c, conn->connection_number_tcp, 0);
+                pthread_mutex_unlock(&c->tcp_mutex);
+            } else {
+                pthread_mutex_lock(&c->tcp_mutex);
+                set_tcp_connection_to_status(c->tcp_c, conn->connection_number_tcp, 1);
+                pthread_mutex_unlock(&c->tcp_mutex);
             }
         }
     }
+}
 
-    return -1;
+/* Set function to be called when connection with crypt_connection_id goes connects/disconnects.
+ *
+ * The set function should return -1 on failure and 0 on success.
+ * Note that if this function is set, the connection will clear itself on disconnect.
+ * Object and id will be passed to this function untouched.
+ * status is 1 if the connection is going online, 0 if it is going offline.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+int connection_status_handler(const Net_Crypto *c, int crypt_connection_id,
+                              int (*connection_status_callback)(void *object, int id, uint8_t status, void *userdata), void *object, int id)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0) {
+        return -1;
+    }
+
+    conn->connection_status_callback = connection_status_callback;
+    conn->connection_status_callback_object = object;
+    conn->connection_status_callback_id = id;
+    return 0;
 }
 
-/* Add a source to the crypto connection.
- * This is to be used only when we have received a packet from that source.
+/* Set function to be called when connection with crypt_connection_id receives a data packet of length.
  *
- *  return -1 on failure.
- *  return positive number on success.
- *  0 if source was a direct UDP connection.
+ * The set function should return -1 on failure and 0 on success.
+ * Object and id will be passed to this function untouched.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+int connection_data_handler(const Net_Crypto *c, int crypt_connection_id, int (*connection_data_callback)(void *object,
+                            int id, const uint8_t *data, uint16_t length, void *userdata), void *object, int id)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0) {
+        return -1;
+    }
+
+    conn->connection_data_callback = connection_data_callback;
+    conn->connection_data_callback_object = object;
+    conn->connection_data_callback_id = id;
+    return 0;
+}
+
+/* Set function to be called when connection with crypt_connection_id receives a lossy data packet of length.
+ *
+ * The set function should return -1 on failure and 0 on success.
+ * Object and id will be passed to this function untouched.
+ *
+ * return -1 on failure.
+ * return 0 on success.
  */
-static int crypto_connection_add_source(Net_Crypto *c, int crypt_connection_id, IP_Port source)
+int connection_lossy_data_handler(Net_Crypto *c, int crypt_connection_id,
+                                  int (*connection_lossy_data_callback)(void *object, int id, const uint8_t *data, uint16_t length, void *userdata),
+                                  void *object, int id)
 {
     Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
 
@@ -1720,615 +3379,732 @@ static int crypto_connection_add_source(Net_Crypto *c, int crypt_connection_id,
         return -1;
     }
 
-    if (source.ip.family == AF_INET || source.ip.family == AF_INET6) {
-        if (add_ip_port_connection(c, crypt_connection_id, source) != 0) {
-            return -1;
-        }
-
-        if (source.ip.family == AF_INET) {
-            conn->direct_lastrecv_timev4 = unix_time();
-        } else {
-            conn->direct_lastrecv_timev6 = unix_time();
-        }
-
-        return 0;
-    }
-
-    if (source.ip.family == TCP_FAMILY) {
-        if (add_tcp_number_relay_connection(c->tcp_c, conn->connection_number_tcp, source.ip.ip6.uint32[0]) == 0) {
-            return 1;
-        }
-    }
-
-    return -1;
+    conn->connection_lossy_data_callback = connection_lossy_data_callback;
+    conn->connection_lossy_data_callback_object = object;
+    conn->connection_lossy_data_callback_id = id;
+    return 0;
 }
 
 
-/* Set function to be called when someone requests a new connection to us.
+/* Set the function for this friend that will be callbacked with object and number if
+ * the friend sends us a different dht public key than we have associated to him.
  *
- * The set function should return -1 on failure and 0 on success.
+ * If this function is called, the connection should be recreated with the new public key.
  *
- * n_c is only valid for the duration of the function call.
- */
-void new_connection_handler(Net_Crypto *c, int (*new_connection_callback)(void *object, New_Connection *n_c),
-                            void *object)
-{
-    c->new_connection_callback = new_connection_callback;
-    c->new_connection_callback_object = object;
-}
-
-/* Handle a handshake packet by someone who wants to initiate a new connection with us.
- * This calls the callback set by new_connection_handler() if the handshake is ok.
+ * object and number will be passed as argument to this function.
  *
  * return -1 on failure.
  * return 0 on success.
  */
-static int handle_new_connection_handshake(Net_Crypto *c, IP_Port source, const uint8_t *data, uint16_t length,
-        void *userdata)
+int nc_dht_pk_callback(Net_Crypto *c, int crypt_connection_id, void (*function)(void *data, int32_t number,
+                       const uint8_t *dht_public_key, void *userdata), void *object, uint32_t number)
 {
-    New_Connection n_c;
-    n_c.cookie = (uint8_t *)malloc(COOKIE_LENGTH);
-
-    if (n_c.cookie == NULL) {
-        return -1;
-    }
-
-    n_c.source = source;
-    n_c.cookie_length = COOKIE_LENGTH;
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
 
-    if (handle_crypto_handshake(c, n_c.recv_nonce, n_c.peersessionpublic_key, n_c.public_key, n_c.dht_public_key,
-                                n_c.cookie, data, length, 0) != 0) {
-        free(n_c.cookie);
+    if (conn == 0) {
         return -1;
     }
 
-    int crypt_connection_id = getcryptconnection_id(c, n_c.public_key);
-
-    if (crypt_connection_id != -1) {
-        Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
-
-        if (public_key_cmp(n_c.dht_public_key, conn->dht_public_key) != 0) {
-            connection_kill(c, crypt_connection_id, userdata);
-        } else {
-            int ret = -1;
-
-            if (conn && (conn->status == CRYPTO_CONN_COOKIE_REQUESTING || conn->status == CRYPTO_CONN_HANDSHAKE_SENT)) {
-                memcpy(conn->recv_nonce, n_c.recv_nonce, CRYPTO_NONCE_SIZE);
-                memcpy(conn->peersessionpublic_key, n_c.peersessionpublic_key, CRYPTO_PUBLIC_KEY_SIZE);
-                encrypt_precompute(conn->peersessionpublic_key, conn->sessionsecret_key, conn->shared_key);
-
-                crypto_connection_add_source(c, crypt_connection_id, source);
-
-                if (create_send_handshake(c, crypt_connection_id, n_c.cookie, n_c.dht_public_key) == 0) {
-                    conn->status = CRYPTO_CONN_NOT_CONFIRMED;
-                    ret = 0;
-                }
-            }
-
-            free(n_c.cookie);
-            return ret;
-        }
-    }
-
-    int ret = c->new_connection_callback(c->new_connection_callback_object, &n_c);
-    free(n_c.cookie);
-    return ret;
+    conn->dht_pk_callback = function;
+    conn->dht_pk_callback_object = object;
+    conn->dht_pk_callback_number = number;
+    return 0;
 }
 
-/* Accept a crypto connection.
+/* Get the crypto connection id from the ip_port.
  *
  * return -1 on failure.
  * return connection id on success.
  */
-int accept_crypto_connection(Net_Crypto *c, New_Connection *n_c)
+static int crypto_id_ip_port(const Net_Crypto *c, IP_Port ip_port)
 {
-    if (getcryptconnection_id(c, n_c->public_key) != -1) {
-        return -1;
-    }
+    return bs_list_find(&c->ip_port_list, (uint8_t *)&ip_port);
+}
 
-    int crypt_connection_id = create_crypto_connection(c);
+#define CRYPTO_MIN_PACKET_SIZE (1 + sizeof(uint16_t) + CRYPTO_MAC_SIZE)
 
-    if (crypt_connection_id == -1) {
+/* Handle raw UDP packets coming directly from the socket.
+ *
+ * Handles:
+ * Cookie response packets.
+ * Crypto handshake packets.
+ * Crypto data packets.
+ *
+ */
+static int set_direct_lastrecv(Net_Crypto *c, int crypt_connection_id, IP_Port source)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0) {
         return -1;
     }
 
-    Crypto_Connection *conn = &c->crypto_connections[crypt_connection_id];
+    pthread_mutex_lock(&conn->mutex);
 
-    if (n_c->cookie_length != COOKIE_LENGTH) {
-        return -1;
+    if (source.ip.family == AF_INET) {
+        conn->direct_lastrecv_timev4 = mono_time_get(c->mono_time);
+    } else {
+        conn->direct_lastrecv_timev6 = mono_time_get(c->mono_time);
     }
 
-    pthread_mutex_lock(&c->tcp_mutex);
-    int connection_number_tcp = new_tcp_connection_to(c->tcp_c, n_c->dht_public_key, crypt_connection_id);
-    pthread_mutex_unlock(&c->tcp_mutex);
+    pthread_mutex_unlock(&conn->mutex);
+    return 0;
+}
 
-    if (connection_number_tcp == -1) {
-        return -1;
+/* Send a data packet encrypted by the crypto workers. */
+static void finish_seal_job(Net_Crypto *c, const Crypto_Job *job)
+{
+    if (send_packet_to(c, job->crypt_connection_id, job->result, job->result_length) != 0) {
+        return;
     }
 
-    conn->connection_number_tcp = connection_number_tcp;
-    memcpy(conn->public_key, n_c->public_key, CRYPTO_PUBLIC_KEY_SIZE);
-    memcpy(conn->recv_nonce, n_c->recv_nonce, CRYPTO_NONCE_SIZE);
-    memcpy(conn->peersessionpublic_key, n_c->peersessionpublic_key, CRYPTO_PUBLIC_KEY_SIZE);
-    random_nonce(conn->sent_nonce);
-    crypto_new_keypair(conn->sessionpublic_key, conn->sessionsecret_key);
-    encrypt_precompute(conn->peersessionpublic_key, conn->sessionsecret_key, conn->shared_key);
-    conn->status = CRYPTO_CONN_NOT_CONFIRMED;
+    Crypto_Connection *conn = get_crypto_connection(c, job->crypt_connection_id);
 
-    if (create_send_handshake(c, crypt_connection_id, n_c->cookie, n_c->dht_public_key) != 0) {
-        pthread_mutex_lock(&c->tcp_mutex);
-        kill_tcp_connection_to(c->tcp_c, conn->connection_number_tcp);
-        pthread_mutex_unlock(&c->tcp_mutex);
-        conn->status = CRYPTO_CONN_NO_CONNECTION;
-        return -1;
+    if (conn != 0) {
+        pthread_mutex_lock(&conn->mutex);
+        ++conn->data_packets_sent;
+        conn->data_bytes_sent += job->result_length;
+        pthread_mutex_unlock(&conn->mutex);
     }
-
-    memcpy(conn->dht_public_key, n_c->dht_public_key, CRYPTO_PUBLIC_KEY_SIZE);
-    conn->packet_send_rate = CRYPTO_PACKET_MIN_RATE;
-    conn->packet_send_rate_requested = CRYPTO_PACKET_MIN_RATE;
-    conn->packets_left = CRYPTO_MIN_QUEUE_LENGTH;
-    conn->rtt_time = DEFAULT_PING_CONNECTION;
-    crypto_connection_add_source(c, crypt_connection_id, n_c->source);
-    return crypt_connection_id;
 }
 
-/* Create a crypto connection.
- * If one to that real public key already exists, return it.
- *
- * return -1 on failure.
- * return connection id on success.
- */
-int new_crypto_connection(Net_Crypto *c, const uint8_t *real_public_key, const uint8_t *dht_public_key)
+/* Handle a data packet decrypted by the crypto workers. */
+static void finish_open_job(Net_Crypto *c, const Crypto_Job *job, void *userdata)
 {
-    int crypt_connection_id = getcryptconnection_id(c, real_public_key);
+    Crypto_Connection *conn = get_crypto_connection(c, job->crypt_connection_id);
 
-    if (crypt_connection_id != -1) {
-        return crypt_connection_id;
+    if (conn == 0) {
+        return;
     }
 
-    crypt_connection_id = create_crypto_connection(c);
-
-    if (crypt_connection_id == -1) {
-        return -1;
+    if (conn->status != CRYPTO_CONN_NOT_CONFIRMED && conn->status != CRYPTO_CONN_ESTABLISHED) {
+        return;
     }
 
-    Crypto_Connection *conn = &c->crypto_connections[crypt_connection_id];
+    uint8_t nonce[CRYPTO_NONCE_SIZE];
 
-    if (conn == 0) {
-        return -1;
+    if (data_packet_nonce(conn, job->data, nonce) > DATA_NUM_THRESHOLD * 2) {
+        increment_nonce_number(conn->recv_nonce, DATA_NUM_THRESHOLD);
     }
 
-    pthread_mutex_lock(&c->tcp_mutex);
-    int connection_number_tcp = new_tcp_connection_to(c->tcp_c, dht_public_key, crypt_connection_id);
-    pthread_mutex_unlock(&c->tcp_mutex);
+    uint8_t data[MAX_DATA_DATA_PACKET_SIZE];
+    memcpy(data, job->result, job->result_length);
 
-    if (connection_number_tcp == -1) {
-        return -1;
+    count_data_packet_received(conn, job->length);
+
+    if (handle_data_packet_plain(c, job->crypt_connection_id, data, job->result_length, 1, userdata) != 0) {
+        return;
     }
 
-    conn->connection_number_tcp = connection_number_tcp;
-    memcpy(conn->public_key, real_public_key, CRYPTO_PUBLIC_KEY_SIZE);
-    random_nonce(conn->sent_nonce);
-    crypto_new_keypair(conn->sessionpublic_key, conn->sessionsecret_key);
-    conn->status = CRYPTO_CONN_COOKIE_REQUESTING;
-    conn->packet_send_rate = CRYPTO_PACKET_MIN_RATE;
-    conn->packet_send_rate_requested = CRYPTO_PACKET_MIN_RATE;
-    conn->packets_left = CRYPTO_MIN_QUEUE_LENGTH;
-    conn->rtt_time = DEFAULT_PING_CONNECTION;
-    memcpy(conn->dht_public_key, dht_public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    set_direct_lastrecv(c, job->crypt_connection_id, job->source);
+}
 
-    conn->cookie_request_number = random_64b();
-    uint8_t cookie_request[COOKIE_REQUEST_LENGTH];
+enum {
+    HANDSHAKE_PRIORITY_KNOWN,
+    HANDSHAKE_PRIORITY_NEW,
+    HANDSHAKE_PRIORITIES
+};
+
+#define HANDSHAKE_QUEUE_PACKET_SIZE (HANDSHAKE_PACKET_LENGTH > COOKIE_REQUEST_LENGTH ? HANDSHAKE_PACKET_LENGTH : COOKIE_REQUEST_LENGTH)
+
+/* Time in ms between two handshakes of a source when it sends them at the
+ * rate it is limited to. */
+#define HANDSHAKE_SOURCE_INTERVAL (1000 / CRYPTO_HANDSHAKE_SOURCE_RATE)
+
+typedef struct {
+    IP_Port source;
+    uint16_t length;
+    uint8_t data[HANDSHAKE_QUEUE_PACKET_SIZE];
+} Queued_Handshake;
+
+typedef struct {
+    Queued_Handshake packets[CRYPTO_HANDSHAKE_QUEUE_SIZE];
+    uint32_t start;
+    uint32_t count;
+} Handshake_Queue;
+
+/* The sources sharing a slot share its limit. A source only takes over the
+ * slot of another one that has been quiet long enough to be under its limit
+ * again. */
+typedef struct {
+    IP ip;
+    uint64_t next_time; /* When the source is back to its full burst. */
+} Handshake_Source;
+
+struct Handshake_Admission {
+    Handshake_Queue queues[HANDSHAKE_PRIORITIES];
+    Handshake_Source sources[CRYPTO_HANDSHAKE_SOURCES];
+    uint32_t budget; /* Handshakes that can still be handled before the next do_net_crypto(). */
+};
+
+/* Put the part of ip its handshakes are limited by into source: the whole
+ * address for IPv4, the /64 prefix for IPv6.
+ */
+static void handshake_source_ip(IP *source, const IP *ip)
+{
+    memset(source, 0, sizeof(IP));
+    source->family = ip->family;
 
-    if (create_cookie_request(c, cookie_request, conn->dht_public_key, conn->cookie_request_number,
-                              conn->shared_key) != sizeof(cookie_request)
-            || new_temp_packet(c, crypt_connection_id, cookie_request, sizeof(cookie_request)) != 0) {
-        pthread_mutex_lock(&c->tcp_mutex);
-        kill_tcp_connection_to(c->tcp_c, conn->connection_number_tcp);
-        pthread_mutex_unlock(&c->tcp_mutex);
-        conn->status = CRYPTO_CONN_NO_CONNECTION;
-        return -1;
+    if (ip->family == AF_INET6) {
+        if (IPV6_IPV4_IN_V6(ip->ip6)) {
+            source->family = AF_INET;
+            source->ip4.uint32 = ip->ip6.uint32[3];
+        } else {
+            source->ip6.uint64[0] = ip->ip6.uint64[0];
+        }
+    } else {
+        source->ip4 = ip->ip4;
     }
+}
 
-    return crypt_connection_id;
+/* return the slot of the source of ip, the part of it put into source. */
+static Handshake_Source *handshake_source_slot(const Net_Crypto *c, const IP *ip, IP *source)
+{
+    handshake_source_ip(source, ip);
+
+    uint8_t key[CRYPTO_PUBLIC_KEY_SIZE] = {0};
+    memcpy(key, source, sizeof(IP));
+    return &c->handshakes->sources[hash_public_key(c->connections_hash_key, key) & (CRYPTO_HANDSHAKE_SOURCES - 1)];
 }
 
-/* Set the direct ip of the crypto connection.
- *
- * Connected is 0 if we are not sure we are connected to that person, 1 if we are sure.
- *
- * return -1 on failure.
- * return 0 on success.
+/* return 1 if a handshake from ip is within the limit of its source, which
+ * can send bursts of up to burst handshakes.
+ * return 0 if it is not.
  */
-int set_direct_ip_port(Net_Crypto *c, int crypt_connection_id, IP_Port ip_port, bool connected)
+static int handshake_source_allowed(Net_Crypto *c, const IP *ip, uint64_t temp_time, uint32_t burst)
 {
-    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+    IP source;
+    Handshake_Source *slot = handshake_source_slot(c, ip, &source);
 
-    if (conn == 0) {
-        return -1;
+    if (slot->next_time <= temp_time) {
+        slot->ip = source;
+        slot->next_time = temp_time;
+    } else if (slot->next_time - temp_time > (burst - 1) * HANDSHAKE_SOURCE_INTERVAL) {
+        return 0;
     }
 
-    if (add_ip_port_connection(c, crypt_connection_id, ip_port) == 0) {
-        if (connected) {
-            if (ip_port.ip.family == AF_INET) {
-                conn->direct_lastrecv_timev4 = unix_time();
-            } else {
-                conn->direct_lastrecv_timev6 = unix_time();
-            }
-        } else {
-            if (ip_port.ip.family == AF_INET) {
-                conn->direct_lastrecv_timev4 = 0;
-            } else {
-                conn->direct_lastrecv_timev6 = 0;
-            }
+    slot->next_time += HANDSHAKE_SOURCE_INTERVAL;
+    return 1;
+}
+
+/* return the HANDSHAKE_PRIORITY_* of a cookie request or handshake packet.
+ * return -1 if the packet can be dropped right away.
+ */
+static int handshake_priority(const Net_Crypto *c, IP_Port source, const uint8_t *packet, uint16_t length)
+{
+    if (packet[0] == NET_PACKET_COOKIE_REQUEST) {
+        if (length != COOKIE_REQUEST_LENGTH) {
+            return -1;
+        }
+    } else {
+        if (length != HANDSHAKE_PACKET_LENGTH) {
+            return -1;
         }
 
-        return 0;
-    }
+        /* Opening our cookie is cheap next to the rest of the handshake, and
+         * drops replays of expired cookies and forged ones. The key in it is
+         * not the sender's until the whole handshake is checked though, so it
+         * doesn't make the handshake a known one. */
+        uint8_t cookie_plain[COOKIE_DATA_LENGTH];
 
-    return -1;
-}
+        if (open_cookie(c->mono_time, cookie_plain, packet + 1, c->secret_symmetric_key) != 0) {
+            return -1;
+        }
+    }
 
+    /* Known: from the address of a connection that is still handshaking. */
+    const Crypto_Connection *conn = get_crypto_connection(c, crypto_id_ip_port(c, source));
 
-static int tcp_data_callback(void *object, int id, const uint8_t *data, uint16_t length, void *userdata)
-{
-    if (length == 0 || length > MAX_CRYPTO_PACKET_SIZE) {
-        return -1;
+    if (conn != NULL && conn->status >= CRYPTO_CONN_COOKIE_REQUESTING && conn->status <= CRYPTO_CONN_NOT_CONFIRMED) {
+        return HANDSHAKE_PRIORITY_KNOWN;
     }
 
-    Net_Crypto *c = (Net_Crypto *)object;
+    return HANDSHAKE_PRIORITY_NEW;
+}
 
-    Crypto_Connection *conn = get_crypto_connection(c, id);
+static int handle_handshake_now(Net_Crypto *c, IP_Port source, const uint8_t *packet, uint16_t length,
+                                void *userdata)
+{
+    ++c->handshake_stats.handled;
 
-    if (conn == 0) {
-        return -1;
+    if (packet[0] == NET_PACKET_COOKIE_REQUEST) {
+        return udp_handle_cookie_request(c, source, packet, length, userdata);
     }
 
-    if (data[0] == NET_PACKET_COOKIE_REQUEST) {
-        return tcp_handle_cookie_request(c, conn->connection_number_tcp, data, length);
-    }
+    /* The connection may have appeared or gone while the packet was queued. */
+    const int crypt_connection_id = crypto_id_ip_port(c, source);
 
-    // This unlocks the mutex that at this point is locked by do_tcp before
-    // calling do_tcp_connections.
-    pthread_mutex_unlock(&c->tcp_mutex);
-    int ret = handle_packet_connection(c, id, data, length, 0, userdata);
-    pthread_mutex_lock(&c->tcp_mutex);
+    if (crypt_connection_id == -1) {
+        return handle_new_connection_handshake(c, source, packet, length, userdata) != 0;
+    }
 
-    if (ret != 0) {
-        return -1;
+    if (handle_packet_connection(c, crypt_connection_id, packet, length, 1, userdata) != 0) {
+        return 1;
     }
 
-    // TODO(irungentoo): detect and kill bad TCP connections.
-    return 0;
+    return set_direct_lastrecv(c, crypt_connection_id, source);
 }
 
-static int tcp_oob_callback(void *object, const uint8_t *public_key, unsigned int tcp_connections_number,
-                            const uint8_t *data, uint16_t length, void *userdata)
+/* Handle a cookie request or a handshake received over UDP if the budget of
+ * this run allows, else queue it for the next runs.
+ *
+ * return 0 if the packet was handled or queued.
+ * return 1 if it was dropped.
+ */
+static int admit_handshake(Net_Crypto *c, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata)
 {
-    if (length == 0 || length > MAX_CRYPTO_PACKET_SIZE) {
-        return -1;
+    Handshake_Admission *admission = c->handshakes;
+    const int priority = handshake_priority(c, source, packet, length);
+
+    if (priority == -1) {
+        return 1;
     }
 
-    Net_Crypto *c = (Net_Crypto *)object;
+    const uint32_t burst = priority == HANDSHAKE_PRIORITY_KNOWN ? CRYPTO_HANDSHAKE_KNOWN_BURST
+                           : CRYPTO_HANDSHAKE_SOURCE_BURST;
 
-    if (data[0] == NET_PACKET_COOKIE_REQUEST) {
-        return tcp_oob_handle_cookie_request(c, tcp_connections_number, public_key, data, length);
+    if (!handshake_source_allowed(c, &source.ip, mono_time_monotonic(c->mono_time), burst)) {
+        ++c->handshake_stats.dropped_rate_limited;
+        return 1;
     }
 
-    if (data[0] == NET_PACKET_CRYPTO_HS) {
-        IP_Port source;
-        source.port = 0;
-        source.ip.family = TCP_FAMILY;
-        source.ip.ip6.uint32[0] = tcp_connections_number;
+    if (admission->budget > 0) {
+        --admission->budget;
+        return handle_handshake_now(c, source, packet, length, userdata);
+    }
 
-        if (handle_new_connection_handshake(c, source, data, length, userdata) != 0) {
-            return -1;
-        }
+    Handshake_Queue *queue = &admission->queues[priority];
 
-        return 0;
+    if (queue->count == CRYPTO_HANDSHAKE_QUEUE_SIZE) {
+        ++c->handshake_stats.dropped_queue_full;
+        return 1;
     }
 
-    return -1;
+    Queued_Handshake *queued = &queue->packets[(queue->start + queue->count) % CRYPTO_HANDSHAKE_QUEUE_SIZE];
+    queued->source = source;
+    queued->length = length;
+    memcpy(queued->data, packet, length);
+    ++queue->count;
+    ++c->handshake_stats.queued;
+    ++c->handshake_stats.deferred;
+    return 0;
 }
 
-/* Add a tcp relay, associating it to a crypt_connection_id.
- *
- * return 0 if it was added.
- * return -1 if it wasn't.
+/* Refill the handshake budget and handle the queued handshakes it allows,
+ * the known ones first.
  */
-int add_tcp_relay_peer(Net_Crypto *c, int crypt_connection_id, IP_Port ip_port, const uint8_t *public_key)
+static void do_handshake_queue(Net_Crypto *c, void *userdata)
 {
-    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+    Handshake_Admission *admission = c->handshakes;
+    admission->budget = CRYPTO_HANDSHAKES_PER_RUN;
 
-    if (conn == 0) {
-        return -1;
-    }
+    for (uint32_t i = 0; i < HANDSHAKE_PRIORITIES; ++i) {
+        Handshake_Queue *queue = &admission->queues[i];
 
-    pthread_mutex_lock(&c->tcp_mutex);
-    int ret = add_tcp_relay_connection(c->tcp_c, conn->connection_number_tcp, ip_port, public_key);
-    pthread_mutex_unlock(&c->tcp_mutex);
-    return ret;
+        while (queue->count > 0 && admission->budget > 0) {
+            Queued_Handshake *queued = &queue->packets[queue->start];
+            queue->start = (queue->start + 1) % CRYPTO_HANDSHAKE_QUEUE_SIZE;
+            --queue->count;
+            --c->handshake_stats.queued;
+            --admission->budget;
+
+            /* Handling it never queues packets, so its slot stays as is. */
+            handle_handshake_now(c, queued->source, queued->data, queued->length, userdata);
+        }
+    }
 }
 
-/* Add a tcp relay to the array.
- *
- * return 0 if it was added.
- * return -1 if it wasn't.
- */
-int add_tcp_relay(Net_Crypto *c, IP_Port ip_port, const uint8_t *public_key)
+static int udp_handle_handshake_request(void *object, IP_Port source, const uint8_t *packet, uint16_t length,
+                                        void *userdata)
 {
-    pthread_mutex_lock(&c->tcp_mutex);
-    int ret = add_tcp_relay_global(c->tcp_c, ip_port, public_key);
-    pthread_mutex_unlock(&c->tcp_mutex);
-    return ret;
+    return admit_handshake((Net_Crypto *)object, source, packet, length, userdata);
 }
 
-/* Return a random TCP connection number for use in send_tcp_onion_request.
- *
- * TODO(irungentoo): This number is just the index of an array that the elements can
- * change without warning.
- *
- * return TCP connection number on success.
- * return -1 on failure.
- */
-int get_random_tcp_con_number(Net_Crypto *c)
+static int udp_handle_packet(void *object, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata)
 {
-    pthread_mutex_lock(&c->tcp_mutex);
-    int ret = get_random_tcp_onion_conn_number(c->tcp_c);
-    pthread_mutex_unlock(&c->tcp_mutex);
+    if (length <= CRYPTO_MIN_PACKET_SIZE || length > MAX_CRYPTO_PACKET_SIZE) {
+        return 1;
+    }
 
-    return ret;
-}
+    Net_Crypto *c = (Net_Crypto *)object;
 
-/* Send an onion packet via the TCP relay corresponding to tcp_connections_number.
- *
- * return 0 on success.
- * return -1 on failure.
- */
-int send_tcp_onion_request(Net_Crypto *c, unsigned int tcp_connections_number, const uint8_t *data, uint16_t length)
-{
-    pthread_mutex_lock(&c->tcp_mutex);
-    int ret = tcp_send_onion_request(c->tcp_c, tcp_connections_number, data, length);
-    pthread_mutex_unlock(&c->tcp_mutex);
+    /* Handshakes of connections in progress cost as much as those of new
+     * ones, so they are admitted the same way, only with a higher priority. */
+    if (packet[0] == NET_PACKET_CRYPTO_HS) {
+        return admit_handshake(c, source, packet, length, userdata);
+    }
 
-    return ret;
-}
+    int crypt_connection_id = crypto_id_ip_port(c, source);
 
-/* Copy a maximum of num TCP relays we are connected to to tcp_relays.
- * NOTE that the family of the copied ip ports will be set to TCP_INET or TCP_INET6.
- *
- * return number of relays copied to tcp_relays on success.
- * return 0 on failure.
- */
-unsigned int copy_connected_tcp_relays(Net_Crypto *c, Node_format *tcp_relays, uint16_t num)
-{
-    if (num == 0) {
+    if (crypt_connection_id == -1) {
+        return 1;
+    }
+
+    if (open_data_packet_async(c, crypt_connection_id, source, packet, length) == 0) {
         return 0;
     }
 
-    pthread_mutex_lock(&c->tcp_mutex);
-    unsigned int ret = tcp_copy_connected_relays(c->tcp_c, tcp_relays, num);
-    pthread_mutex_unlock(&c->tcp_mutex);
+    if (handle_packet_connection(c, crypt_connection_id, packet, length, 1, userdata) != 0) {
+        return 1;
+    }
 
-    return ret;
+    return set_direct_lastrecv(c, crypt_connection_id, source);
 }
 
-static void do_tcp(Net_Crypto *c, void *userdata)
+void crypto_finish_jobs(Net_Crypto *c, void *userdata)
 {
-    pthread_mutex_lock(&c->tcp_mutex);
-    do_tcp_connections(c->tcp_c, userdata);
-    pthread_mutex_unlock(&c->tcp_mutex);
+    Crypto_Pool *pool = c->crypto_pool;
 
-    uint32_t i;
+    if (pool == NULL) {
+        return;
+    }
 
-    for (i = 0; i < c->crypto_connections_length; ++i) {
-        Crypto_Connection *conn = get_crypto_connection(c, i);
+    pthread_mutex_lock(&pool->mutex);
 
-        if (conn == 0) {
-            return;
+    if (pool->given_head == NULL) {
+        pthread_mutex_unlock(&pool->mutex);
+        return;
+    }
+
+    pool->finishing = pool->given_head;
+    pool->given_head = NULL;
+    pool->given_tail = NULL;
+
+    Crypto_Job *job;
+
+    /* Help the workers instead of just waiting for them. */
+    for (job = pool->finishing; job; job = job->next) {
+        while (!job->done) {
+            Crypto_Job *todo = pool->todo_head;
+
+            if (todo == NULL) {
+                pthread_cond_wait(&pool->done_cond, &pool->mutex);
+                continue;
+            }
+
+            pool->todo_head = todo->next_todo;
+
+            if (pool->todo_head == NULL) {
+                pool->todo_tail = NULL;
+            }
+
+            pthread_mutex_unlock(&pool->mutex);
+            run_crypto_job(todo);
+            pthread_mutex_lock(&pool->mutex);
+            todo->done = 1;
         }
+    }
 
-        if (conn->status == CRYPTO_CONN_ESTABLISHED) {
-            bool direct_connected = 0;
-            crypto_connection_status(c, i, &direct_connected, NULL);
+    pthread_mutex_unlock(&pool->mutex);
 
-            if (direct_connected) {
-                pthread_mutex_lock(&c->tcp_mutex);
-                set_tcp_connection_to_status(c->tcp_c, conn->connection_number_tcp, 0);
-                pthread_mutex_unlock(&c->tcp_mutex);
+    while (pool->finishing) {
+        job = pool->finishing;
+
+        if (!job->dropped && job->result_length > 0) {
+            if (job->seal) {
+                finish_seal_job(c, job);
             } else {
-                pthread_mutex_lock(&c->tcp_mutex);
-                set_tcp_connection_to_status(c->tcp_c, conn->connection_number_tcp, 1);
-                pthread_mutex_unlock(&c->tcp_mutex);
+                finish_open_job(c, job, userdata);
             }
         }
+
+        pthread_mutex_lock(&pool->mutex);
+        pool->finishing = job->next;
+        crypto_job_free(pool, job);
+        pthread_mutex_unlock(&pool->mutex);
     }
 }
 
-/* Set function to be called when connection with crypt_connection_id goes connects/disconnects.
- *
- * The set function should return -1 on failure and 0 on success.
- * Note that if this function is set, the connection will clear itself on disconnect.
- * Object and id will be passed to this function untouched.
- * status is 1 if the connection is going online, 0 if it is going offline.
- *
- * return -1 on failure.
- * return 0 on success.
+/* The dT for the average packet receiving rate calculations.
+   Also used as the */
+#define PACKET_COUNTER_AVERAGE_INTERVAL 50
+
+/* Ratio of recv queue size / recv packet rate (in seconds) times
+ * the number of ms between request packets to send at that ratio
  */
-int connection_status_handler(const Net_Crypto *c, int crypt_connection_id,
-                              int (*connection_status_callback)(void *object, int id, uint8_t status, void *userdata), void *object, int id)
-{
-    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+#define REQUEST_PACKETS_COMPARE_CONSTANT (0.125 * 100.0)
 
-    if (conn == 0) {
-        return -1;
-    }
+/* Timeout for increasing speed after congestion event (in ms). */
+#define CONGESTION_EVENT_TIMEOUT 1000
 
-    conn->connection_status_callback = connection_status_callback;
-    conn->connection_status_callback_object = object;
-    conn->connection_status_callback_id = id;
-    return 0;
-}
+/* If the send queue is SEND_QUEUE_RATIO times larger than the
+ * calculated link speed the packet send speed will be reduced
+ * by a value depending on this number.
+ */
+#define SEND_QUEUE_RATIO 2.0
 
-/* Set function to be called when connection with crypt_connection_id receives a data packet of length.
- *
- * The set function should return -1 on failure and 0 on success.
- * Object and id will be passed to this function untouched.
- *
- * return -1 on failure.
- * return 0 on success.
+/* Number of packets delivered during the last CONGESTION_QUEUE_ARRAY_SIZE
+ * updates is the base of the send rate, which grows while the send queue stays
+ * short and shrinks in proportion to how much the queue exceeds
+ * SEND_QUEUE_RATIO seconds of it.
  */
-int connection_data_handler(const Net_Crypto *c, int crypt_connection_id, int (*connection_data_callback)(void *object,
-                            int id, const uint8_t *data, uint16_t length, void *userdata), void *object, int id)
+static void congestion_queue_update(Crypto_Connection *conn, const Congestion_Sample *sample)
 {
-    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+    unsigned int pos = conn->last_sendqueue_counter % CONGESTION_QUEUE_ARRAY_SIZE;
+    conn->last_sendqueue_size[pos] = sample->send_queue;
+    ++conn->last_sendqueue_counter;
 
-    if (conn == 0) {
-        return -1;
+    unsigned int j;
+    long signed int sum = 0;
+    sum = (long signed int)conn->last_sendqueue_size[(pos) % CONGESTION_QUEUE_ARRAY_SIZE] -
+          (long signed int)conn->last_sendqueue_size[(pos - (CONGESTION_QUEUE_ARRAY_SIZE - 1)) % CONGESTION_QUEUE_ARRAY_SIZE];
+
+    unsigned int n_p_pos = conn->last_sendqueue_counter % CONGESTION_LAST_SENT_ARRAY_SIZE;
+    conn->last_num_packets_sent[n_p_pos] = sample->packets_sent;
+    conn->last_num_packets_resent[n_p_pos] = sample->packets_resent;
+
+    if (sample->keep_rate) {
+        return;
     }
 
-    conn->connection_data_callback = connection_data_callback;
-    conn->connection_data_callback_object = object;
-    conn->connection_data_callback_id = id;
-    return 0;
+    long signed int total_sent = 0, total_resent = 0;
+
+    // TODO(irungentoo): use real delay
+    unsigned int delay = (unsigned int)((conn->rtt_time / PACKET_COUNTER_AVERAGE_INTERVAL) + 0.5);
+    unsigned int packets_set_rem_array = (CONGESTION_LAST_SENT_ARRAY_SIZE - CONGESTION_QUEUE_ARRAY_SIZE);
+
+    if (delay > packets_set_rem_array) {
+        delay = packets_set_rem_array;
+    }
+
+    for (j = 0; j < CONGESTION_QUEUE_ARRAY_SIZE; ++j) {
+        unsigned int ind = (j + (packets_set_rem_array  - delay) + n_p_pos) % CONGESTION_LAST_SENT_ARRAY_SIZE;
+        total_sent += conn->last_num_packets_sent[ind];
+        total_resent += conn->last_num_packets_resent[ind];
+    }
+
+    if (sum > 0) {
+        total_sent -= sum;
+    } else {
+        if (total_resent > -sum) {
+            total_resent = -sum;
+        }
+    }
+
+    /* if queue is too big only allow resending packets. */
+    uint32_t npackets = sample->send_queue;
+    double min_speed = 1000.0 * (((double)(total_sent)) / ((double)(CONGESTION_QUEUE_ARRAY_SIZE) *
+                                 PACKET_COUNTER_AVERAGE_INTERVAL));
+
+    double min_speed_request = 1000.0 * (((double)(total_sent + total_resent)) / ((double)(
+            CONGESTION_QUEUE_ARRAY_SIZE) * PACKET_COUNTER_AVERAGE_INTERVAL));
+
+    if (min_speed < CRYPTO_PACKET_MIN_RATE) {
+        min_speed = CRYPTO_PACKET_MIN_RATE;
+    }
+
+    double send_array_ratio = (((double)npackets) / min_speed);
+
+    // TODO(irungentoo): Improve formula?
+    if (send_array_ratio > SEND_QUEUE_RATIO && CRYPTO_MIN_QUEUE_LENGTH < npackets) {
+        conn->packet_send_rate = min_speed * (1.0 / (send_array_ratio / SEND_QUEUE_RATIO));
+    } else if (conn->last_congestion_event + CONGESTION_EVENT_TIMEOUT < sample->time) {
+        conn->packet_send_rate = min_speed * 1.2;
+    } else {
+        conn->packet_send_rate = min_speed * 0.9;
+    }
+
+    conn->packet_send_rate_requested = min_speed_request * 1.2;
+
+    if (conn->packet_send_rate < CRYPTO_PACKET_MIN_RATE) {
+        conn->packet_send_rate = CRYPTO_PACKET_MIN_RATE;
+    }
+
+    if (conn->packet_send_rate_requested < conn->packet_send_rate) {
+        conn->packet_send_rate_requested = conn->packet_send_rate;
+    }
 }
 
-/* Set function to be called when connection with crypt_connection_id receives a lossy data packet of length.
- *
- * The set function should return -1 on failure and 0 on success.
- * Object and id will be passed to this function untouched.
- *
- * return -1 on failure.
- * return 0 on success.
- */
-int connection_lossy_data_handler(Net_Crypto *c, int crypt_connection_id,
-                                  int (*connection_lossy_data_callback)(void *object, int id, const uint8_t *data, uint16_t length, void *userdata),
-                                  void *object, int id)
-{
-    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+const Congestion_Control congestion_control_queue = {
+    NULL,
+    congestion_queue_update,
+};
+
+/* Send rate gain while looking for the bottleneck bandwidth, 2/ln(2): enough
+ * to double the delivery rate every round trip.
+ */
+#define CONGESTION_DELAY_STARTUP_GAIN 2.885
 
-    if (conn == 0) {
-        return -1;
-    }
+/* The bottleneck bandwidth is considered found after it grew by less than
+ * this ratio CONGESTION_DELAY_FULL_BW_ROUNDS round trips in a row.
+ */
+#define CONGESTION_DELAY_FULL_BW_RATIO 1.25
+#define CONGESTION_DELAY_FULL_BW_ROUNDS 3
 
-    conn->connection_lossy_data_callback = connection_lossy_data_callback;
-    conn->connection_lossy_data_callback_object = object;
-    conn->connection_lossy_data_callback_id = id;
-    return 0;
-}
+/* Time in ms a minimum round trip time measurement is kept. */
+#define CONGESTION_DELAY_MIN_RTT_WINDOW 10000
 
+/* Round trip time, as a ratio of the minimum one, above which probing for
+ * more bandwidth stops early because the queue at the bottleneck is growing.
+ */
+#define CONGESTION_DELAY_RTT_RATIO 1.25
 
-/* Set the function for this friend that will be callbacked with object and number if
- * the friend sends us a different dht public key than we have associated to him.
- *
- * If this function is called, the connection should be recreated with the new public key.
- *
- * object and number will be passed as argument to this function.
- *
- * return -1 on failure.
- * return 0 on success.
+/* Send rate gains of the round trips of a bandwidth probing cycle: probe for
+ * more, drain the queue it built, then cruise.
  */
-int nc_dht_pk_callback(Net_Crypto *c, int crypt_connection_id, void (*function)(void *data, int32_t number,
-                       const uint8_t *dht_public_key, void *userdata), void *object, uint32_t number)
+static const double congestion_delay_cycle_gain[] = {1.25, 0.75, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0};
+#define CONGESTION_DELAY_CYCLE_LENGTH (sizeof(congestion_delay_cycle_gain) / sizeof(double))
+
+static void congestion_delay_init(Crypto_Connection *conn)
 {
-    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+    memset(&conn->delay, 0, sizeof(conn->delay));
+    conn->delay.mode = CONGESTION_DELAY_STARTUP;
+}
 
-    if (conn == 0) {
-        return -1;
+static double congestion_delay_max_bw(const Crypto_Connection *conn)
+{
+    double max_bw = 0;
+
+    for (uint32_t i = 0; i < CONGESTION_DELAY_BW_FILTER_SIZE; ++i) {
+        if (conn->delay.max_bw[i] > max_bw) {
+            max_bw = conn->delay.max_bw[i];
+        }
     }
 
-    conn->dht_pk_callback = function;
-    conn->dht_pk_callback_object = object;
-    conn->dht_pk_callback_number = number;
-    return 0;
+    return max_bw;
 }
 
-/* Get the crypto connection id from the ip_port.
- *
- * return -1 on failure.
- * return connection id on success.
+/* Pace new packets at the highest delivery rate measured over the last
+ * CONGESTION_DELAY_BW_FILTER_SIZE round trips, times a gain that depends on
+ * whether the bottleneck bandwidth is still being searched for, probed or
+ * drained. Losses don't lower the rate, a growing round trip time does.
  */
-static int crypto_id_ip_port(const Net_Crypto *c, IP_Port ip_port)
+static void congestion_delay_update(Crypto_Connection *conn, const Congestion_Sample *sample)
 {
-    return bs_list_find(&c->ip_port_list, (uint8_t *)&ip_port);
-}
+    if (sample->keep_rate) {
+        return;
+    }
 
-#define CRYPTO_MIN_PACKET_SIZE (1 + sizeof(uint16_t) + CRYPTO_MAC_SIZE)
+    if (sample->rtt != 0 && (conn->delay.min_rtt == 0 || sample->rtt <= conn->delay.min_rtt
+                             || conn->delay.min_rtt_set + CONGESTION_DELAY_MIN_RTT_WINDOW < sample->time)) {
+        conn->delay.min_rtt = sample->rtt;
+        conn->delay.min_rtt_set = sample->time;
+    }
 
-/* Handle raw UDP packets coming directly from the socket.
- *
- * Handles:
- * Cookie response packets.
- * Crypto handshake packets.
- * Crypto data packets.
- *
- */
-static int udp_handle_packet(void *object, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata)
-{
-    if (length <= CRYPTO_MIN_PACKET_SIZE || length > MAX_CRYPTO_PACKET_SIZE) {
-        return 1;
+    uint64_t round_time = conn->delay.min_rtt;
+
+    if (round_time < PACKET_COUNTER_AVERAGE_INTERVAL) {
+        round_time = PACKET_COUNTER_AVERAGE_INTERVAL;
     }
 
-    Net_Crypto *c = (Net_Crypto *)object;
-    int crypt_connection_id = crypto_id_ip_port(c, source);
+    /* Measure the delivery rate over whole round trips, updates are too short
+     * to hold more than a few packets at low rates. */
+    conn->delay.round_acked += sample->packets_acked;
 
-    if (crypt_connection_id == -1) {
-        if (packet[0] != NET_PACKET_CRYPTO_HS) {
-            return 1;
-        }
+    bool new_round = conn->delay.round_set + round_time <= sample->time;
 
-        if (handle_new_connection_handshake(c, source, packet, length, userdata) != 0) {
-            return 1;
+    if (new_round) {
+        if (conn->delay.round_set != 0) {
+            conn->delay.max_bw_pos = (conn->delay.max_bw_pos + 1) % CONGESTION_DELAY_BW_FILTER_SIZE;
+            conn->delay.max_bw[conn->delay.max_bw_pos] = 1000.0 * conn->delay.round_acked / (sample->time - conn->delay.round_set);
         }
 
-        return 0;
+        conn->delay.round_set = sample->time;
+        conn->delay.round_acked = 0;
     }
 
-    if (handle_packet_connection(c, crypt_connection_id, packet, length, 1, userdata) != 0) {
-        return 1;
+    double bw = congestion_delay_max_bw(conn);
+
+    if (bw < CRYPTO_PACKET_MIN_RATE) {
+        bw = CRYPTO_PACKET_MIN_RATE;
     }
 
-    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+    double bdp = bw * (double)round_time / 1000.0;
+    double gain = 1.0;
 
-    if (conn == 0) {
-        return -1;
+    switch (conn->delay.mode) {
+        case CONGESTION_DELAY_STARTUP: {
+            if (new_round && !sample->app_limited) {
+                if (bw >= conn->delay.full_bw * CONGESTION_DELAY_FULL_BW_RATIO) {
+                    conn->delay.full_bw = bw;
+                    conn->delay.full_bw_count = 0;
+                } else if (++conn->delay.full_bw_count >= CONGESTION_DELAY_FULL_BW_ROUNDS) {
+                    conn->delay.mode = CONGESTION_DELAY_DRAIN;
+                }
+            }
+
+            gain = CONGESTION_DELAY_STARTUP_GAIN;
+            break;
+        }
+
+        case CONGESTION_DELAY_DRAIN: {
+            if (sample->send_queue <= bdp + CRYPTO_MIN_QUEUE_LENGTH) {
+                conn->delay.mode = CONGESTION_DELAY_PROBE_BW;
+                conn->delay.cycle_pos = 2;
+                conn->delay.cycle_set = sample->time;
+            }
+
+            gain = 1.0 / CONGESTION_DELAY_STARTUP_GAIN;
+            break;
+        }
+
+        case CONGESTION_DELAY_PROBE_BW: {
+            gain = congestion_delay_cycle_gain[conn->delay.cycle_pos];
+
+            bool next = conn->delay.cycle_set + round_time <= sample->time;
+
+            if (gain > 1.0 && sample->rtt > conn->delay.min_rtt * CONGESTION_DELAY_RTT_RATIO) {
+                next = 1;
+            }
+
+            if (gain < 1.0 && sample->send_queue <= bdp) {
+                next = 1;
+            }
+
+            if (next) {
+                conn->delay.cycle_pos = (conn->delay.cycle_pos + 1) % CONGESTION_DELAY_CYCLE_LENGTH;
+                conn->delay.cycle_set = sample->time;
+                gain = congestion_delay_cycle_gain[conn->delay.cycle_pos];
+            }
+
+            /* More than two round trips worth of packets in flight. */
+            if (gain > 1.0 && sample->send_queue > 2 * bdp + CRYPTO_MIN_QUEUE_LENGTH) {
+                gain = 1.0;
+            }
+
+            break;
+        }
     }
 
-    pthread_mutex_lock(&conn->mutex);
+    conn->packet_send_rate = bw * gain;
 
-    if (source.ip.family == AF_INET) {
-        conn->direct_lastrecv_timev4 = unix_time();
-    } else {
-        conn->direct_lastrecv_timev6 = unix_time();
+    if (conn->packet_send_rate < CRYPTO_PACKET_MIN_RATE) {
+        conn->packet_send_rate = CRYPTO_PACKET_MIN_RATE;
     }
 
-    pthread_mutex_unlock(&conn->mutex);
-    return 0;
+    conn->packet_send_rate_requested = conn->packet_send_rate;
 }
 
-/* The dT for the average packet receiving rate calculations.
-   Also used as the */
-#define PACKET_COUNTER_AVERAGE_INTERVAL 50
+const Congestion_Control congestion_control_delay = {
+    congestion_delay_init,
+    congestion_delay_update,
+};
 
-/* Ratio of recv queue size / recv packet rate (in seconds) times
- * the number of ms between request packets to send at that ratio
+/* return the time at which the send rate of conn lets it send packets again.
  */
-#define REQUEST_PACKETS_COMPARE_CONSTANT (0.125 * 100.0)
-
-/* Timeout for increasing speed after congestion event (in ms). */
-#define CONGESTION_EVENT_TIMEOUT 1000
+static uint64_t paced_send_time(const Crypto_Connection *conn)
+{
+    const uint64_t interval = (1000.0 / conn->packet_send_rate) + 0.5;
+    return conn->last_packets_left_set + (interval > CRYPTO_MIN_SLEEP_TIME ? interval : CRYPTO_MIN_SLEEP_TIME);
+}
 
-/* If the send queue is SEND_QUEUE_RATIO times larger than the
- * calculated link speed the packet send speed will be reduced
- * by a value depending on this number.
+/* Make do_net_crypto() run again at time, or CRYPTO_MIN_SLEEP_TIME after now
+ * if that is earlier, unless it runs before anyway.
  */
-#define SEND_QUEUE_RATIO 2.0
+static void crypto_run_before(Net_Crypto *c, uint64_t now, uint64_t time)
+{
+    const uint64_t sleep_time = time > now + CRYPTO_MIN_SLEEP_TIME ? time - now : CRYPTO_MIN_SLEEP_TIME;
+
+    if (c->current_sleep_time > sleep_time) {
+        c->current_sleep_time = sleep_time;
+    }
+}
 
 static void send_crypto_packets(Net_Crypto *c)
 {
     uint32_t i;
-    uint64_t temp_time = current_time_monotonic();
-    double total_send_rate = 0;
+    uint64_t temp_time = mono_time_monotonic(c->mono_time);
+    uint64_t next_paced_send = UINT64_MAX;
     uint32_t peak_request_packet_interval = ~0;
 
     for (i = 0; i < c->crypto_connections_length; ++i) {
@@ -2338,10 +4114,6 @@ static void send_crypto_packets(Net_Crypto *c)
             return;
         }
 
-        if (CRYPTO_SEND_PACKET_INTERVAL + conn->temp_packet_sent_time < temp_time) {
-            send_temp_packet(c, i);
-        }
-
         if ((conn->status == CRYPTO_CONN_NOT_CONFIRMED || conn->status == CRYPTO_CONN_ESTABLISHED)
                 && ((CRYPTO_SEND_PACKET_INTERVAL) + conn->last_request_packet_sent) < temp_time) {
             if (send_request_packet(c, i) == 0) {
@@ -2388,92 +4160,27 @@ static void send_crypto_packets(Net_Crypto *c)
                 conn->packet_counter = 0;
                 conn->packet_counter_set = temp_time;
 
-                uint32_t packets_sent = conn->packets_sent;
-                conn->packets_sent = 0;
-
-                uint32_t packets_resent = conn->packets_resent;
-                conn->packets_resent = 0;
-
-                /* conjestion control
-                    calculate a new value of conn->packet_send_rate based on some data
-                 */
-
-                unsigned int pos = conn->last_sendqueue_counter % CONGESTION_QUEUE_ARRAY_SIZE;
-                conn->last_sendqueue_size[pos] = num_packets_array(&conn->send_array);
-                ++conn->last_sendqueue_counter;
-
-                unsigned int j;
-                long signed int sum = 0;
-                sum = (long signed int)conn->last_sendqueue_size[(pos) % CONGESTION_QUEUE_ARRAY_SIZE] -
-                      (long signed int)conn->last_sendqueue_size[(pos - (CONGESTION_QUEUE_ARRAY_SIZE - 1)) % CONGESTION_QUEUE_ARRAY_SIZE];
-
-                unsigned int n_p_pos = conn->last_sendqueue_counter % CONGESTION_LAST_SENT_ARRAY_SIZE;
-                conn->last_num_packets_sent[n_p_pos] = packets_sent;
-                conn->last_num_packets_resent[n_p_pos] = packets_resent;
-
                 bool direct_connected = 0;
                 crypto_connection_status(c, i, &direct_connected, NULL);
 
-                if (direct_connected && conn->last_tcp_sent + CONGESTION_EVENT_TIMEOUT > temp_time) {
-                    /* When switching from TCP to UDP, don't change the packet send rate for CONGESTION_EVENT_TIMEOUT ms. */
-                } else {
-                    long signed int total_sent = 0, total_resent = 0;
-
-                    // TODO(irungentoo): use real delay
-                    unsigned int delay = (unsigned int)((conn->rtt_time / PACKET_COUNTER_AVERAGE_INTERVAL) + 0.5);
-                    unsigned int packets_set_rem_array = (CONGESTION_LAST_SENT_ARRAY_SIZE - CONGESTION_QUEUE_ARRAY_SIZE);
-
-                    if (delay > packets_set_rem_array) {
-                        delay = packets_set_rem_array;
-                    }
-
-                    for (j = 0; j < CONGESTION_QUEUE_ARRAY_SIZE; ++j) {
-                        unsigned int ind = (j + (packets_set_rem_array  - delay) + n_p_pos) % CONGESTION_LAST_SENT_ARRAY_SIZE;
-                        total_sent += conn->last_num_packets_sent[ind];
-                        total_resent += conn->last_num_packets_resent[ind];
-                    }
-
-                    if (sum > 0) {
-                        total_sent -= sum;
-                    } else {
-                        if (total_resent > -sum) {
-                            total_resent = -sum;
-                        }
-                    }
-
-                    /* if queue is too big only allow resending packets. */
-                    uint32_t npackets = num_packets_array(&conn->send_array);
-                    double min_speed = 1000.0 * (((double)(total_sent)) / ((double)(CONGESTION_QUEUE_ARRAY_SIZE) *
-                                                 PACKET_COUNTER_AVERAGE_INTERVAL));
-
-                    double min_speed_request = 1000.0 * (((double)(total_sent + total_resent)) / ((double)(
-                            CONGESTION_QUEUE_ARRAY_SIZE) * PACKET_COUNTER_AVERAGE_INTERVAL));
-
-                    if (min_speed < CRYPTO_PACKET_MIN_RATE) {
-                        min_speed = CRYPTO_PACKET_MIN_RATE;
-                    }
-
-                    double send_array_ratio = (((double)npackets) / min_speed);
-
-                    // TODO(irungentoo): Improve formula?
-                    if (send_array_ratio > SEND_QUEUE_RATIO && CRYPTO_MIN_QUEUE_LENGTH < npackets) {
-                        conn->packet_send_rate = min_speed * (1.0 / (send_array_ratio / SEND_QUEUE_RATIO));
-                    } else if (conn->last_congestion_event + CONGESTION_EVENT_TIMEOUT < temp_time) {
-                        conn->packet_send_rate = min_speed * 1.2;
-                    } else {
-                        conn->packet_send_rate = min_speed * 0.9;
-                    }
-
-                    conn->packet_send_rate_requested = min_speed_request * 1.2;
+                Congestion_Sample sample;
+                sample.time = temp_time;
+                sample.interval = dt;
+                sample.packets_sent = conn->packets_sent;
+                sample.packets_resent = conn->packets_resent;
+                sample.packets_acked = conn->packets_acked;
+                sample.send_queue = num_packets_array(&conn->send_array);
+                sample.rtt = conn->last_rtt_sample;
+                /* When switching from TCP to UDP, don't change the packet send rate for CONGESTION_EVENT_TIMEOUT ms. */
+                sample.keep_rate = direct_connected && conn->last_tcp_sent + CONGESTION_EVENT_TIMEOUT > temp_time;
+                sample.app_limited = conn->packets_left != 0;
 
-                    if (conn->packet_send_rate < CRYPTO_PACKET_MIN_RATE) {
-                        conn->packet_send_rate = CRYPTO_PACKET_MIN_RATE;
-                    }
+                conn->packets_sent = 0;
+                conn->packets_resent = 0;
+                conn->packets_acked = 0;
+                conn->last_rtt_sample = 0;
 
-                    if (conn->packet_send_rate_requested < conn->packet_send_rate) {
-                        conn->packet_send_rate_requested = conn->packet_send_rate;
-                    }
-                }
+                conn->congestion_control->update(conn, &sample);
             }
 
             if (conn->last_packets_left_set == 0 || conn->last_packets_left_requested_set == 0) {
@@ -2521,6 +4228,9 @@ static void send_crypto_packets(Net_Crypto *c)
             if (ret != -1) {
                 conn->packets_left_requested -= ret;
                 conn->packets_resent += ret;
+                pthread_mutex_lock(&conn->mutex);
+                conn->total_packets_resent += ret;
+                pthread_mutex_unlock(&conn->mutex);
 
                 if ((unsigned int)ret < conn->packets_left) {
                     conn->packets_left -= ret;
@@ -2530,31 +4240,23 @@ static void send_crypto_packets(Net_Crypto *c)
                 }
             }
 
-            if (conn->packet_send_rate > CRYPTO_PACKET_MIN_RATE * 1.5) {
-                total_send_rate += conn->packet_send_rate;
-            }
-        }
-    }
-
-    c->current_sleep_time = ~0;
-    uint32_t sleep_time = peak_request_packet_interval;
-
-    if (c->current_sleep_time > sleep_time) {
-        c->current_sleep_time = sleep_time;
-    }
-
-    if (total_send_rate > CRYPTO_PACKET_MIN_RATE) {
-        sleep_time = (1000.0 / total_send_rate);
+            /* Wake up when the next packet of a connection that is waiting for
+               its send rate to allow it is due. */
+            if (conn->packets_left == 0 || conn->maximum_speed_reached) {
+                const uint64_t next_send = paced_send_time(conn);
 
-        if (c->current_sleep_time > sleep_time) {
-            c->current_sleep_time = sleep_time + 1;
+                if (next_send < next_paced_send) {
+                    next_paced_send = next_send;
+                }
+            }
         }
     }
 
-    sleep_time = CRYPTO_SEND_PACKET_INTERVAL;
+    c->current_sleep_time = CRYPTO_SEND_PACKET_INTERVAL;
+    crypto_run_before(c, temp_time, temp_time + peak_request_packet_interval);
 
-    if (c->current_sleep_time > sleep_time) {
-        c->current_sleep_time = sleep_time;
+    if (next_paced_send != UINT64_MAX) {
+        crypto_run_before(c, temp_time, next_paced_send);
     }
 }
 
@@ -2632,6 +4334,11 @@ int64_t write_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t
         --conn->packets_left;
         --conn->packets_left_requested;
         conn->packets_sent++;
+
+        /* Make sure do_net_crypto() runs when the next packet is due. */
+        if (conn->packets_left == 0) {
+            crypto_run_before(c, c->last_run, paced_send_time(conn));
+        }
     }
 
     return ret;
@@ -2737,8 +4444,8 @@ int crypto_kill(Net_Crypto *c, int crypt_connection_id)
         bs_list_remove(&c->ip_port_list, (uint8_t *)&conn->ip_portv4, crypt_connection_id);
         bs_list_remove(&c->ip_port_list, (uint8_t *)&conn->ip_portv6, crypt_connection_id);
         clear_temp_packet(c, crypt_connection_id);
-        clear_buffer(&conn->send_array);
-        clear_buffer(&conn->recv_array);
+        clear_buffer(&c->packet_pool, &conn->send_array);
+        clear_buffer(&c->packet_pool, &conn->recv_array);
         ret = wipe_crypto_connection(c, crypt_connection_id);
     }
 
@@ -2764,7 +4471,7 @@ unsigned int crypto_connection_status(const Net_Crypto *c, int crypt_connection_
     if (direct_connected) {
         *direct_connected = 0;
 
-        uint64_t current_time = unix_time();
+        uint64_t current_time = mono_time_get(c->mono_time);
 
         if ((UDP_DIRECT_TIMEOUT + conn->direct_lastrecv_timev4) > current_time) {
             *direct_connected = 1;
@@ -2782,6 +4489,40 @@ unsigned int crypto_connection_status(const Net_Crypto *c, int crypt_connection_
     return conn->status;
 }
 
+int crypto_connection_stats(const Net_Crypto *c, int crypt_connection_id, Crypto_Connection_Stats *stats)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0) {
+        return -1;
+    }
+
+    memset(stats, 0, sizeof(Crypto_Connection_Stats));
+    stats->status = crypto_connection_status(c, crypt_connection_id, &stats->direct_connected,
+                    &stats->online_tcp_relays);
+
+    if (!stats->direct_connected) {
+        stats->tcp_relay_in_use = tcp_connection_to_relay(c->tcp_c, conn->connection_number_tcp,
+                                  stats->tcp_relay_public_key) == 0;
+    }
+
+    pthread_mutex_lock(&conn->mutex);
+    stats->rtt = conn->srtt;
+    stats->rtt_var = conn->rtt_var;
+    stats->min_rtt = conn->srtt ? conn->rtt_time : 0;
+    stats->packet_send_rate = conn->packet_send_rate;
+    stats->packet_recv_rate = conn->packet_recv_rate;
+    stats->send_buffer = num_packets_array(&conn->send_array);
+    stats->recv_buffer = num_packets_array(&conn->recv_array);
+    stats->packets_sent = conn->data_packets_sent;
+    stats->packets_resent = conn->total_packets_resent;
+    stats->packets_received = conn->data_packets_received;
+    stats->bytes_sent = conn->data_bytes_sent;
+    stats->bytes_received = conn->data_bytes_received;
+    pthread_mutex_unlock(&conn->mutex);
+    return 0;
+}
+
 void new_keys(Net_Crypto *c)
 {
     crypto_new_keypair(c->self_public_key, c->self_secret_key);
@@ -2810,9 +4551,9 @@ void load_secret_key(Net_Crypto *c, const uint8_t *sk)
 /* Run this to (re)initialize net_crypto.
  * Sets all the global connection variables to their default values.
  */
-Net_Crypto *new_net_crypto(Logger *log, DHT *dht, TCP_Proxy_Info *proxy_info)
+Net_Crypto *new_net_crypto(Logger *log, Mono_Time *mono_time, DHT *dht, TCP_Proxy_Info *proxy_info)
 {
-    unix_time_update();
+    mono_time_update(mono_time);
 
     if (dht == NULL) {
         return NULL;
@@ -2825,8 +4566,9 @@ Net_Crypto *new_net_crypto(Logger *log, DHT *dht, TCP_Proxy_Info *proxy_info)
     }
 
     temp->log = log;
+    temp->mono_time = mono_time;
 
-    temp->tcp_c = new_tcp_connections(dht->self_secret_key, proxy_info);
+    temp->tcp_c = new_tcp_connections(mono_time, dht->self_secret_key, proxy_info);
 
     if (temp->tcp_c == NULL) {
         free(temp);
@@ -2843,14 +4585,42 @@ Net_Crypto *new_net_crypto(Logger *log, DHT *dht, TCP_Proxy_Info *proxy_info)
         return NULL;
     }
 
+    if (pthread_mutex_init(&temp->packet_pool.mutex, NULL) != 0) {
+        pthread_mutex_destroy(&temp->tcp_mutex);
+        pthread_mutex_destroy(&temp->connections_mutex);
+        kill_tcp_connections(temp->tcp_c);
+        free(temp);
+        return NULL;
+    }
+
+    temp->packet_pool.max_free = CRYPTO_PACKET_DATA_DEFAULT_FREE;
+
+    temp->timers = new_timer_wheel(mono_time_monotonic(mono_time));
+    temp->handshakes = (Handshake_Admission *)calloc(1, sizeof(Handshake_Admission));
+
+    if (temp->timers == NULL || temp->handshakes == NULL) {
+        kill_timer_wheel(temp->timers);
+        free(temp->handshakes);
+        pthread_mutex_destroy(&temp->packet_pool.mutex);
+        pthread_mutex_destroy(&temp->tcp_mutex);
+        pthread_mutex_destroy(&temp->connections_mutex);
+        kill_tcp_connections(temp->tcp_c);
+        free(temp);
+        return NULL;
+    }
+
+    temp->handshakes->budget = CRYPTO_HANDSHAKES_PER_RUN;
+
     temp->dht = dht;
 
     new_keys(temp);
     new_symmetric_key(temp->secret_symmetric_key);
+    random_bytes((uint8_t *)temp->connections_hash_key, sizeof(temp->connections_hash_key));
+    temp->congestion_control = &congestion_control_queue;
 
     temp->current_sleep_time = CRYPTO_SEND_PACKET_INTERVAL;
 
-    networking_registerhandler(dht->net, NET_PACKET_COOKIE_REQUEST, &udp_handle_cookie_request, temp);
+    networking_registerhandler(dht->net, NET_PACKET_COOKIE_REQUEST, &udp_handle_handshake_request, temp);
     networking_registerhandler(dht->net, NET_PACKET_COOKIE_RESPONSE, &udp_handle_packet, temp);
     networking_registerhandler(dht->net, NET_PACKET_CRYPTO_HS, &udp_handle_packet, temp);
     networking_registerhandler(dht->net, NET_PACKET_CRYPTO_DATA, &udp_handle_packet, temp);
@@ -2860,61 +4630,138 @@ Net_Crypto *new_net_crypto(Logger *log, DHT *dht, TCP_Proxy_Info *proxy_info)
     return temp;
 }
 
-static void kill_timedout(Net_Crypto *c, void *userdata)
+/* Send the temp packet of a connection again, or kill the connection if it is
+ * still not established after the last try.
+ *
+ * Runs from the temp packet timer of the connection.
+ */
+static void kill_timedout(void *object, uint32_t crypt_connection_id, void *userdata)
 {
-    uint32_t i;
-    //uint64_t temp_time = current_time_monotonic();
+    Net_Crypto *c = (Net_Crypto *)object;
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
 
-    for (i = 0; i < c->crypto_connections_length; ++i) {
-        Crypto_Connection *conn = get_crypto_connection(c, i);
+    if (conn == 0) {
+        return;
+    }
 
-        if (conn == 0) {
+    if (conn->status == CRYPTO_CONN_COOKIE_REQUESTING || conn->status == CRYPTO_CONN_HANDSHAKE_SENT
+            || conn->status == CRYPTO_CONN_NOT_CONFIRMED) {
+        if (conn->temp_packet_num_sent >= MAX_NUM_SENDPACKET_TRIES) {
+            connection_kill(c, crypt_connection_id, userdata);
             return;
         }
+    }
 
-        if (conn->status == CRYPTO_CONN_NO_CONNECTION) {
-            continue;
-        }
-
-        if (conn->status == CRYPTO_CONN_COOKIE_REQUESTING || conn->status == CRYPTO_CONN_HANDSHAKE_SENT
-                || conn->status == CRYPTO_CONN_NOT_CONFIRMED) {
-            if (conn->temp_packet_num_sent < MAX_NUM_SENDPACKET_TRIES) {
-                continue;
-            }
+    const uint64_t next_send = conn->temp_packet_sent_time + CRYPTO_SEND_PACKET_INTERVAL + 1;
 
-            connection_kill(c, i, userdata);
-        }
+    if (mono_time_monotonic(c->mono_time) < next_send) {
+        timer_start(c->timers, conn->temp_packet_timer, next_send);
+        return;
+    }
 
-#if 0
+    send_temp_packet(c, crypt_connection_id);
+}
 
-        if (conn->status == CRYPTO_CONN_ESTABLISHED) {
-            // TODO(irungentoo): add a timeout here?
-        }
+/* return true if packets given to the crypto workers wait for
+ * crypto_finish_jobs().
+ */
+static bool crypto_jobs_pending(const Net_Crypto *c)
+{
+    Crypto_Pool *pool = c->crypto_pool;
 
-#endif
+    if (pool == NULL) {
+        return 0;
     }
+
+    pthread_mutex_lock(&pool->mutex);
+    const bool pending = pool->num_jobs > 0;
+    pthread_mutex_unlock(&pool->mutex);
+    return pending;
 }
 
 /* return the optimal interval in ms for running do_net_crypto.
  */
 uint32_t crypto_run_interval(const Net_Crypto *c)
 {
+    if (crypto_jobs_pending(c)) {
+        return CRYPTO_MIN_SLEEP_TIME;
+    }
+
     return c->current_sleep_time;
 }
 
+uint64_t crypto_next_run(const Net_Crypto *c)
+{
+    const uint64_t next_run = c->last_run + c->current_sleep_time;
+    const uint64_t next_timer = timer_wheel_next_deadline(c->timers);
+
+    /* Packets given to the crypto workers, possibly by other threads, are
+       only sent or handled by the next do_net_crypto(). */
+    if (c->handshake_stats.queued > 0 || crypto_jobs_pending(c)) {
+        return c->last_run;
+    }
+
+    return next_timer < next_run ? next_timer : next_run;
+}
+
+void crypto_reset_stats(Net_Crypto *c)
+{
+    packet_stats_reset(c->packet_stats, sizeof(c->packet_stats) / sizeof(c->packet_stats[0]));
+
+    const uint32_t queued = c->handshake_stats.queued;
+    memset(&c->handshake_stats, 0, sizeof(c->handshake_stats));
+    c->handshake_stats.queued = queued;
+}
+
+void crypto_set_packet_data_pool_size(Net_Crypto *c, uint32_t max_free)
+{
+    pthread_mutex_lock(&c->packet_pool.mutex);
+    c->packet_pool.max_free = max_free;
+    pthread_mutex_unlock(&c->packet_pool.mutex);
+
+    packet_data_pool_trim(&c->packet_pool, max_free);
+}
+
+void crypto_packet_data_pool_stats(Net_Crypto *c, Packet_Data_Pool_Stats *stats)
+{
+    pthread_mutex_lock(&c->packet_pool.mutex);
+    stats->num_used = c->packet_pool.num_used;
+    stats->num_free = c->packet_pool.num_free;
+    stats->num_allocated = c->packet_pool.num_allocated;
+    stats->num_reused = c->packet_pool.num_reused;
+    pthread_mutex_unlock(&c->packet_pool.mutex);
+}
+
+void crypto_handshake_stats(const Net_Crypto *c, Crypto_Handshake_Stats *stats)
+{
+    *stats = c->handshake_stats;
+}
+
+void crypto_set_congestion_control(Net_Crypto *c, const Congestion_Control *congestion_control)
+{
+    c->congestion_control = congestion_control;
+}
+
 /* Main loop. */
 void do_net_crypto(Net_Crypto *c, void *userdata)
 {
-    unix_time_update();
-    kill_timedout(c, userdata);
+    mono_time_update(c->mono_time);
+    crypto_finish_jobs(c, userdata);
+    do_handshake_queue(c, userdata);
+    c->last_run = mono_time_monotonic(c->mono_time);
+    timer_wheel_run(c->timers, c->last_run, userdata);
     do_tcp(c, userdata);
     send_crypto_packets(c);
+    crypto_finish_jobs(c, userdata);
+    networking_flush(c->dht->net);
 }
 
 void kill_net_crypto(Net_Crypto *c)
 {
     uint32_t i;
 
+    crypto_stop_workers(c);
+
     for (i = 0; i < c->crypto_connections_length; ++i) {
         crypto_kill(c, i);
     }
@@ -2922,8 +4769,14 @@ void kill_net_crypto(Net_Crypto *c)
     pthread_mutex_destroy(&c->tcp_mutex);
     pthread_mutex_destroy(&c->connections_mutex);
 
+    packet_data_pool_trim(&c->packet_pool, 0);
+    pthread_mutex_destroy(&c->packet_pool.mutex);
+
     kill_tcp_connections(c->tcp_c);
     bs_list_free(&c->ip_port_list);
+    free(c->connections_index);
+    kill_timer_wheel(c->timers);
+    free(c->handshakes);
     networking_registerhandler(c->dht->net, NET_PACKET_COOKIE_REQUEST, NULL, NULL);
     networking_registerhandler(c->dht->net, NET_PACKET_COOKIE_RESPONSE, NULL, NULL);
     networking_registerhandler(c->dht->net, NET_PACKET_CRYPTO_HS, NULL, NULL);
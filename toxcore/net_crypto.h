@@ -59,6 +59,17 @@
 /* Maximum size of receiving and sending packet buffers. */
 #define CRYPTO_PACKET_BUFFER_SIZE 32768 /* Must be a power of 2 */
 
+/* Number of packets a packet array has room for when it first holds one. It
+   doubles as needed, up to CRYPTO_PACKET_BUFFER_SIZE. Must be a power of 2. */
+#define CRYPTO_MIN_PACKET_BUFFER_SIZE 16
+
+/* Initial size of the index of crypto connections by public key. Must be a
+   power of 2. */
+#define CRYPTO_CONNECTIONS_INDEX_MIN_SIZE 16
+
+/* Number of unused Packet_Data kept for reuse by default. */
+#define CRYPTO_PACKET_DATA_DEFAULT_FREE 1024
+
 /* Minimum packet rate per second. */
 #define CRYPTO_PACKET_MIN_RATE 4.0
 
@@ -76,6 +87,14 @@
 /* Interval in ms between sending cookie request/handshake packets. */
 #define CRYPTO_SEND_PACKET_INTERVAL 1000
 
+/* Shortest interval in ms between two runs of do_net_crypto(), so that high
+   send rates don't make its callers spin. */
+#define CRYPTO_MIN_SLEEP_TIME 1
+
+/* Interval in ms between tries to send a cookie request/handshake packet that
+   could not be sent, e.g. because there is no path to the peer yet. */
+#define CRYPTO_SEND_PACKET_RETRY_INTERVAL 50
+
 /* The maximum number of times we try to send the cookie request and handshake
    before giving up. */
 #define MAX_NUM_SENDPACKET_TRIES 8
@@ -86,6 +105,7 @@
 #define PACKET_ID_PADDING 0 /* Denotes padding */
 #define PACKET_ID_REQUEST 1 /* Used to request unreceived packets */
 #define PACKET_ID_KILL    2 /* Used to kill connection */
+#define PACKET_ID_SACK    3 /* Used to request unreceived packets as ranges or a bitmap */
 
 /* Packet ids 0 to CRYPTO_RESERVED_PACKETS - 1 are reserved for use by net_crypto. */
 #define CRYPTO_RESERVED_PACKETS 16
@@ -108,6 +128,10 @@
 #define DEFAULT_PING_CONNECTION 1000
 #define DEFAULT_TCP_PING_CONNECTION 500
 
+/* Number of round trips the delay based congestion control keeps the maximum
+   delivery rate of. */
+#define CONGESTION_DELAY_BW_FILTER_SIZE 10
+
 typedef struct {
     uint64_t sent_time;
     uint16_t length;
@@ -115,12 +139,75 @@ typedef struct {
 } Packet_Data;
 
 typedef struct {
-    Packet_Data *buffer[CRYPTO_PACKET_BUFFER_SIZE];
+    /* Packet number n is in slot n % capacity. capacity is 0 or a power of 2,
+       and at least buffer_end - buffer_start. */
+    Packet_Data **buffer;
+    uint32_t  capacity;
     uint32_t  buffer_start;
     uint32_t  buffer_end; /* packet numbers in array: {buffer_start, buffer_end) */
 } Packets_Array;
 
+union Pooled_Packet_Data;
+
+/* The Packet_Data of the packet arrays of all connections. Freed ones are
+ * kept for reuse, up to max_free of them.
+ */
+typedef struct {
+    pthread_mutex_t mutex;
+
+    union Pooled_Packet_Data *free_list;
+    uint32_t num_free;
+    uint32_t max_free;
+
+    /* Packet_Data in the packet arrays. */
+    uint32_t num_used;
+    /* Packet_Data taken with malloc, and taken from free_list. */
+    uint64_t num_allocated;
+    uint64_t num_reused;
+} Packet_Data_Pool;
+
+typedef struct Crypto_Connection Crypto_Connection;
+
+/* What happened on an established connection since the last send rate update. */
 typedef struct {
+    uint64_t time; /* Current time in ms. */
+    uint64_t interval; /* Time since the last update in ms. */
+    uint32_t packets_sent; /* New lossless packets sent. */
+    uint32_t packets_resent; /* Lossless packets sent again because the peer requested them. */
+    uint32_t packets_acked; /* Lossless packets the peer confirmed receiving. */
+    uint32_t send_queue; /* Lossless packets sent or queued but not yet confirmed. */
+    uint64_t rtt; /* Round trip time measured since the last update in ms, 0 if none. */
+    /* The connection just switched from TCP to UDP: keep the send rate. */
+    bool keep_rate;
+    /* The budget of packets to send was not used up: the rates seen are what
+       the application wanted to send, not what the path can carry. */
+    bool app_limited;
+} Congestion_Sample;
+
+/* A congestion control algorithm for the lossless packets of crypto connections. */
+typedef struct {
+    /* Set up the algorithm state of a new connection. Can be NULL. */
+    void (*init)(Crypto_Connection *conn);
+
+    /* Set packet_send_rate, the rate of new packets, and
+       packet_send_rate_requested, the rate of new and requested packets, of
+       conn. Called every PACKET_COUNTER_AVERAGE_INTERVAL ms while the
+       connection is established. */
+    void (*update)(Crypto_Connection *conn, const Congestion_Sample *sample);
+} Congestion_Control;
+
+/* Size the send rate to keep the send queue short. This is the default. */
+extern const Congestion_Control congestion_control_queue;
+/* Send at the bottleneck bandwidth measured from acknowledgements, like BBR. */
+extern const Congestion_Control congestion_control_delay;
+
+typedef enum {
+    CONGESTION_DELAY_STARTUP,
+    CONGESTION_DELAY_DRAIN,
+    CONGESTION_DELAY_PROBE_BW,
+} Congestion_Delay_Mode;
+
+struct Crypto_Connection {
     uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE]; /* The real public key of the peer. */
     uint8_t recv_nonce[CRYPTO_NONCE_SIZE]; /* Nonce of received packets. */
     uint8_t sent_nonce[CRYPTO_NONCE_SIZE]; /* Nonce of sent packets. */
@@ -140,6 +227,7 @@ typedef struct {
     uint16_t temp_packet_length;
     uint64_t temp_packet_sent_time; /* The time at which the last temp_packet was sent in ms. */
     uint32_t temp_packet_num_sent;
+    uint32_t temp_packet_timer; /* Fires when the temp_packet is due to be sent again or has timed out. */
 
     IP_Port ip_portv4; /* The ip and port to contact this guy directly.*/
     IP_Port ip_portv6;
@@ -187,6 +275,40 @@ typedef struct {
     uint64_t last_congestion_event;
     uint64_t rtt_time;
 
+    /* The peer sent a PACKET_ID_SACK, so it understands them and doesn't need
+       PACKET_ID_REQUEST any more. */
+    bool peer_sack;
+    /* PACKET_ID_REQUEST received before any PACKET_ID_SACK. */
+    uint8_t requests_without_sack;
+
+    const Congestion_Control *congestion_control;
+    uint32_t packets_acked;
+    uint64_t last_rtt_sample; /* Latest round trip time measured, 0 once passed to the congestion control. */
+
+    /* Transport statistics, see crypto_connection_stats(). Guarded by mutex. */
+    uint64_t srtt; /* Smoothed round trip time in ms, 0 until measured. */
+    uint64_t rtt_var; /* Round trip time variation in ms. */
+    uint64_t total_packets_resent;
+    uint64_t data_packets_sent;
+    uint64_t data_bytes_sent;
+    uint64_t data_packets_received;
+    uint64_t data_bytes_received;
+
+    /* State of congestion_control_delay. */
+    struct {
+        Congestion_Delay_Mode mode;
+        double max_bw[CONGESTION_DELAY_BW_FILTER_SIZE]; /* Delivery rates in packets per second. */
+        uint32_t max_bw_pos;
+        uint64_t round_set;
+        uint32_t round_acked;
+        uint64_t min_rtt;
+        uint64_t min_rtt_set;
+        double full_bw;
+        uint8_t full_bw_count;
+        uint8_t cycle_pos;
+        uint64_t cycle_set;
+    } delay;
+
     /* TCP_connection connection_number */
     unsigned int connection_number_tcp;
 
@@ -197,7 +319,47 @@ typedef struct {
     void (*dht_pk_callback)(void *data, int32_t number, const uint8_t *dht_public_key, void *userdata);
     void *dht_pk_callback_object;
     uint32_t dht_pk_callback_number;
-} Crypto_Connection;
+};
+
+/* Maximum number of data packets that can wait for the crypto workers. When
+ * full, packets are encrypted and decrypted in place.
+ */
+#define CRYPTO_MAX_PENDING_JOBS 1024
+
+/* Maximum number of crypto worker threads. */
+#define CRYPTO_MAX_WORKERS 16
+
+typedef struct Crypto_Pool Crypto_Pool;
+
+/* Cookie requests and handshakes received over UDP cost public key crypto, so
+ * at most CRYPTO_HANDSHAKES_PER_RUN of them are handled between two
+ * do_net_crypto() and the others wait in a queue of
+ * CRYPTO_HANDSHAKE_QUEUE_SIZE packets per priority. Known ones, from the
+ * address of a connection that is still handshaking, go first.
+ */
+#define CRYPTO_HANDSHAKES_PER_RUN 32
+#define CRYPTO_HANDSHAKE_QUEUE_SIZE 128
+
+/* Handshakes are limited to CRYPTO_HANDSHAKE_SOURCE_RATE per second from each
+ * IPv4 address or IPv6 /64, with bursts of up to CRYPTO_HANDSHAKE_SOURCE_BURST,
+ * or CRYPTO_HANDSHAKE_KNOWN_BURST for known ones. The sources are tracked in a
+ * table of CRYPTO_HANDSHAKE_SOURCES slots (a power of 2).
+ */
+#define CRYPTO_HANDSHAKE_SOURCE_RATE 16
+#define CRYPTO_HANDSHAKE_SOURCE_BURST 32
+#define CRYPTO_HANDSHAKE_KNOWN_BURST 64
+#define CRYPTO_HANDSHAKE_SOURCES 1024
+
+typedef struct Handshake_Admission Handshake_Admission;
+
+/* Counters of the handshake admission control of a Net_Crypto. */
+typedef struct {
+    uint64_t handled; /* Handled when they arrived or from the queue. */
+    uint64_t deferred; /* Queued for a later do_net_crypto(). */
+    uint64_t dropped_rate_limited; /* Their source sent too many. */
+    uint64_t dropped_queue_full;
+    uint32_t queued; /* Waiting in the queue now. */
+} Crypto_Handshake_Stats;
 
 typedef struct {
     IP_Port source;
@@ -211,6 +373,7 @@ typedef struct {
 
 typedef struct {
     Logger *log;
+    Mono_Time *mono_time;
 
     DHT *dht;
     TCP_Connections *tcp_c;
@@ -223,6 +386,13 @@ typedef struct {
 
     uint32_t crypto_connections_length; /* Length of connections array. */
 
+    /* Open addressing hash table of connection ids + 1 (0 for an empty slot)
+     * keyed by real public key, holding the connections that are set up. */
+    uint32_t *connections_index;
+    uint32_t connections_index_size; /* a power of 2 */
+    uint32_t connections_index_count;
+    uint64_t connections_hash_key[4];
+
     /* Our public and secret keys. */
     uint8_t self_public_key[CRYPTO_PUBLIC_KEY_SIZE];
     uint8_t self_secret_key[CRYPTO_SECRET_KEY_SIZE];
@@ -235,8 +405,28 @@ typedef struct {
 
     /* The current optimal sleep time */
     uint32_t current_sleep_time;
+    /* When do_net_crypto() last ran, in ms of mono_time_monotonic(). */
+    uint64_t last_run;
 
     BS_LIST ip_port_list;
+
+    /* Timers of the connections, in ms of mono_time_monotonic(). */
+    Timer_Wheel *timers;
+
+    /* Data packets sent and received on the connections, by their packet id. */
+    Packet_Stats packet_stats[256];
+
+    Packet_Data_Pool packet_pool;
+
+    /* Congestion control of new connections. */
+    const Congestion_Control *congestion_control;
+
+    /* Worker threads encrypting and decrypting data packets, NULL if they
+       are encrypted and decrypted in place. */
+    Crypto_Pool *crypto_pool;
+
+    Handshake_Admission *handshakes;
+    Crypto_Handshake_Stats handshake_stats;
 } Net_Crypto;
 
 
@@ -431,12 +621,105 @@ void load_secret_key(Net_Crypto *c, const uint8_t *sk);
 /* Create new instance of Net_Crypto.
  *  Sets all the global connection variables to their default values.
  */
-Net_Crypto *new_net_crypto(Logger *log, DHT *dht, TCP_Proxy_Info *proxy_info);
+Net_Crypto *new_net_crypto(Logger *log, Mono_Time *mono_time, DHT *dht, TCP_Proxy_Info *proxy_info);
 
 /* return the optimal interval in ms for running do_net_crypto.
  */
 uint32_t crypto_run_interval(const Net_Crypto *c);
 
+/* return the mono_time_monotonic() time at which do_net_crypto() has
+ * timers due or packets to send, if no packets arrive before.
+ *
+ * return the time of the last do_net_crypto() while handshakes are queued
+ * or packets given to the crypto workers are not sent or handled yet.
+ */
+uint64_t crypto_next_run(const Net_Crypto *c);
+
+/* Set the packet_stats and handshake_stats counters of c to zero. */
+void crypto_reset_stats(Net_Crypto *c);
+
+/* Keep at most max_free unused Packet_Data for reuse, and free the ones
+ * above that.
+ */
+void crypto_set_packet_data_pool_size(Net_Crypto *c, uint32_t max_free);
+
+/* Counters of the Packet_Data pool of a Net_Crypto. */
+typedef struct {
+    uint32_t num_used;
+    uint32_t num_free;
+    uint64_t num_allocated;
+    uint64_t num_reused;
+} Packet_Data_Pool_Stats;
+
+/* Transport statistics of a crypto connection. */
+typedef struct {
+    uint8_t status; /* One of CRYPTO_CONN_*. */
+
+    /* Data packets go to the peer over UDP if direct_connected, else through
+     * the TCP relay with tcp_relay_public_key if tcp_relay_in_use. */
+    bool direct_connected;
+    unsigned int online_tcp_relays;
+    bool tcp_relay_in_use;
+    uint8_t tcp_relay_public_key[CRYPTO_PUBLIC_KEY_SIZE];
+
+    uint64_t rtt; /* Smoothed round trip time in ms, 0 until measured. */
+    uint64_t rtt_var; /* Round trip time variation in ms. */
+    uint64_t min_rtt; /* Lowest round trip time measured in ms. */
+
+    double packet_send_rate; /* Lossless packets per second. */
+    double packet_recv_rate;
+
+    uint32_t send_buffer; /* Lossless packets queued or waiting for an ack. */
+    uint32_t recv_buffer; /* Lossless packets received waiting for missing ones. */
+
+    /* Data packets on the wire, including the resent ones. */
+    uint64_t packets_sent;
+    uint64_t packets_resent;
+    uint64_t packets_received;
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+} Crypto_Connection_Stats;
+
+/* Copy the transport statistics of the connection into stats.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int crypto_connection_stats(const Net_Crypto *c, int crypt_connection_id, Crypto_Connection_Stats *stats);
+
+/* Copy the counters of the Packet_Data pool of c into stats. */
+void crypto_packet_data_pool_stats(Net_Crypto *c, Packet_Data_Pool_Stats *stats);
+
+/* Copy the counters of the handshake admission control of c into stats. */
+void crypto_handshake_stats(const Net_Crypto *c, Crypto_Handshake_Stats *stats);
+
+/* Use congestion_control for the connections created from now on. */
+void crypto_set_congestion_control(Net_Crypto *c, const Congestion_Control *congestion_control);
+
+/* Start num_threads worker threads that encrypt the lossless data packets
+ * sent and decrypt the data packets received over direct UDP connections,
+ * so that transfers to several friends use more than one core.
+ *
+ * The packets of a connection keep their nonces and are sent and handled in
+ * the order they were given to the workers, by crypto_finish_jobs().
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int crypto_start_workers(Net_Crypto *c, uint16_t num_threads);
+
+/* Stop the crypto workers and drop the packets they were given.
+ */
+void crypto_stop_workers(Net_Crypto *c);
+
+/* Wait for the crypto workers to be done with the packets given to them so
+ * far, then send the encrypted ones and handle the decrypted ones.
+ *
+ * do_net_crypto() calls this. Call it after sending lossless packets outside
+ * of do_net_crypto() so that they don't wait for the next one.
+ */
+void crypto_finish_jobs(Net_Crypto *c, void *userdata);
+
 /* Main loop. */
 void do_net_crypto(Net_Crypto *c, void *userdata);
 
@@ -47,6 +47,11 @@
 #define _DARWIN_C_SOURCE
 #define _XOPEN_SOURCE 600
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+/* For recvmmsg() and sendmmsg(). */
+#define _GNU_SOURCE
+#endif
+
 #if defined(_WIN32) && _WIN32_WINNT >= _WIN32_WINNT_WINXP
 #define _WIN32_WINNT  0x501
 #endif
@@ -54,6 +59,7 @@
 #include "network.h"
 
 #include "logger.h"
+#include "packet_buf.h"
 #include "util.h"
 
 #include <assert.h>
@@ -77,6 +83,18 @@
 #include <sys/time.h>
 #include <sys/types.h>
 
+#if defined(__linux__)
+#include <netinet/udp.h>
+
+/* Older C libraries don't have these, the kernel tells whether it does. */
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#endif
+
 #else
 
 #ifndef IPV6_V6ONLY
@@ -233,6 +251,21 @@ int set_socket_reuseaddr(Socket sock)
     return (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char *)&set, sizeof(set)) == 0);
 }
 
+/* Enable SO_REUSEPORT on socket.
+ *
+ * return 1 on success
+ * return 0 on failure or if the platform has no SO_REUSEPORT
+ */
+int set_socket_reuseport(Socket sock)
+{
+#ifdef SO_REUSEPORT
+    int set = 1;
+    return (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (const char *)&set, sizeof(set)) == 0);
+#else
+    return 0;
+#endif
+}
+
 /* Set socket to dual (IPv4 + IPv6 socket)
  *
  * return 1 on success
@@ -321,6 +354,17 @@ uint64_t current_time_monotonic(void)
     return time;
 }
 
+uint64_t current_time_monotonic_us(void)
+{
+#if defined(_WIN32) || defined(__WIN32__) || defined (WIN32) || defined(__APPLE__)
+    return current_time_actual();
+#else
+    struct timespec monotime;
+    clock_gettime(CLOCK_MONOTONIC, &monotime);
+    return 1000000ULL * monotime.tv_sec + (monotime.tv_nsec / 1000ULL);
+#endif
+}
+
 static uint32_t data_0(uint16_t buflen, const uint8_t *buffer)
 {
     return buflen > 4 ? net_ntohl(*(const uint32_t *)&buffer[1]) : 0;
@@ -365,159 +409,973 @@ void get_ip6(IP6 *result, const struct in6_addr *addr)
 }
 
 
-void fill_addr4(IP4 ip, struct in_addr *addr)
-{
-    addr->s_addr = ip.uint32;
+void fill_addr4(IP4 ip, struct in_addr *addr)
+{
+    addr->s_addr = ip.uint32;
+}
+
+void fill_addr6(IP6 ip, struct in6_addr *addr)
+{
+    assert(sizeof(ip.uint8) == sizeof(addr->s6_addr));
+    memcpy(addr->s6_addr, ip.uint8, sizeof(ip.uint8));
+}
+
+/* Fill addr with the address datagrams for ip_port are sent to from net.
+ *
+ * return 0 on success.
+ * return -1 if ip_port has an unknown address family.
+ */
+static int ip_port_to_sockaddr(const Networking_Core *net, IP_Port ip_port, struct sockaddr_storage *addr,
+                               size_t *addrsize)
+{
+    if (ip_port.ip.family == AF_INET) {
+        if (net->family == AF_INET6) {
+            /* must convert to IPV4-in-IPV6 address */
+            struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)addr;
+
+            *addrsize = sizeof(struct sockaddr_in6);
+            addr6->sin6_family = AF_INET6;
+            addr6->sin6_port = ip_port.port;
+
+            /* there should be a macro for this in a standards compliant
+             * environment, not found */
+            IP6 ip6;
+
+            ip6.uint32[0] = 0;
+            ip6.uint32[1] = 0;
+            ip6.uint32[2] = net_htonl(0xFFFF);
+            ip6.uint32[3] = ip_port.ip.ip4.uint32;
+            fill_addr6(ip6, &addr6->sin6_addr);
+
+            addr6->sin6_flowinfo = 0;
+            addr6->sin6_scope_id = 0;
+        } else {
+            struct sockaddr_in *addr4 = (struct sockaddr_in *)addr;
+
+            *addrsize = sizeof(struct sockaddr_in);
+            addr4->sin_family = AF_INET;
+            fill_addr4(ip_port.ip.ip4, &addr4->sin_addr);
+            addr4->sin_port = ip_port.port;
+        }
+    } else if (ip_port.ip.family == AF_INET6) {
+        struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)addr;
+
+        *addrsize = sizeof(struct sockaddr_in6);
+        addr6->sin6_family = AF_INET6;
+        addr6->sin6_port = ip_port.port;
+        fill_addr6(ip_port.ip.ip6, &addr6->sin6_addr);
+
+        addr6->sin6_flowinfo = 0;
+        addr6->sin6_scope_id = 0;
+    } else {
+        /* unknown address type*/
+        return -1;
+    }
+
+    return 0;
+
+}
+
+/* Fill ip_port with the address addr.
+ *
+ * return 0 on success.
+ * return -1 if addr has an unknown address family.
+ */
+static int sockaddr_to_ip_port(const struct sockaddr_storage *addr, IP_Port *ip_port)
+{
+    if (addr->ss_family == AF_INET) {
+        const struct sockaddr_in *addr_in = (const struct sockaddr_in *)addr;
+
+        ip_port->ip.family = addr_in->sin_family;
+        get_ip4(&ip_port->ip.ip4, &addr_in->sin_addr);
+        ip_port->port = addr_in->sin_port;
+    } else if (addr->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *addr_in6 = (const struct sockaddr_in6 *)addr;
+        ip_port->ip.family = addr_in6->sin6_family;
+        get_ip6(&ip_port->ip.ip6, &addr_in6->sin6_addr);
+        ip_port->port = addr_in6->sin6_port;
+
+        if (IPV6_IPV4_IN_V6(ip_port->ip.ip6)) {
+            ip_port->ip.family = AF_INET;
+            ip_port->ip.ip4.uint32 = ip_port->ip.ip6.uint32[3];
+        }
+    } else {
+        return -1;
+    }
+
+    return 0;
+
+}
+
+/* HAVE_RECVMMSG and HAVE_SENDMMSG come from the build system, which checks
+ * that the C library has them: not all Linux ones do. */
+#if defined(__linux__) && defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+#define NET_HAVE_MMSG 1
+
+/* UDP segmentation offload: Linux sends consecutive datagrams to the same
+ * address as one buffer split by the kernel (UDP_SEGMENT) and hands out
+ * datagrams it received from one sender as one buffer (UDP_GRO). */
+#define NET_HAVE_GSO 1
+#endif
+
+/* Longest datagram sent or received: a packet and the magic in front of it. */
+#define NET_DATAGRAM_SIZE (MAX_UDP_PACKET_SIZE + 16)
+
+/* Most datagrams the kernel puts in one segmented buffer. */
+#define NET_GSO_MAX_SEGMENTS 64
+
+/* Largest segmented buffer. */
+#define NET_GSO_MAX_SIZE 65507
+
+#ifdef NET_HAVE_GSO
+/* Room for the UDP_SEGMENT or UDP_GRO control message of a message. */
+typedef union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+} Net_Cmsg;
+#endif
+
+/* Datagrams of a Networking_Core object sent or received in batches. */
+struct Net_Batch {
+    uint16_t size;
+
+    /* Received datagrams not handed out yet are next to count. Datagrams are
+     * received into packet buffers, with the magic in front of their data;
+     * slots of buffers handed out are NULL. */
+    uint16_t recv_next;
+    uint16_t recv_count;
+    Packet_Buf **recv_bufs;
+    uint16_t *recv_lengths;
+    struct sockaddr_storage *recv_addrs;
+
+    /* Queued datagrams to send, in send_data or, if set, in send_bufs. */
+    uint16_t send_count;
+    uint8_t *send_data;
+    Packet_Buf **send_bufs;
+    uint16_t *send_lengths;
+    struct sockaddr_storage *send_addrs;
+    size_t *send_addrsizes;
+
+    /* Guards the send queue, msgs, iovecs, gso and stats. Only datagrams of
+     * send_thread, the thread that last polled or made the batch, are queued;
+     * other threads send theirs straight away. */
+    pthread_mutex_t send_mutex;
+    pthread_t send_thread;
+    Net_Batch_Stats stats;
+
+#ifdef NET_HAVE_MMSG
+    struct mmsghdr *msgs;
+    struct iovec *iovecs;
+#endif
+
+#ifdef NET_HAVE_GSO
+    /* Whether the socket sends with UDP_SEGMENT and receives with UDP_GRO. */
+    bool gso;
+    bool gro;
+    Net_Cmsg *cmsgs;
+
+    /* With gro, size / NET_GSO_MAX_SEGMENTS buffers of NET_GSO_MAX_SIZE bytes
+     * that datagrams are received into before being split into recv_bufs. */
+    uint8_t *gro_data;
+#endif
+};
+
+static void free_batch(Net_Batch *batch)
+{
+    if (batch == NULL) {
+        return;
+    }
+
+    for (uint16_t i = 0; i < batch->size; ++i) {
+        packet_buf_unref(batch->recv_bufs ? batch->recv_bufs[i] : NULL);
+        packet_buf_unref(batch->send_bufs ? batch->send_bufs[i] : NULL);
+    }
+
+    free(batch->recv_bufs);
+    free(batch->recv_lengths);
+    free(batch->recv_addrs);
+    free(batch->send_data);
+    free(batch->send_bufs);
+    free(batch->send_lengths);
+    free(batch->send_addrs);
+    free(batch->send_addrsizes);
+#ifdef NET_HAVE_MMSG
+    free(batch->msgs);
+    free(batch->iovecs);
+#endif
+#ifdef NET_HAVE_GSO
+    free(batch->cmsgs);
+    free(batch->gro_data);
+#endif
+    pthread_mutex_destroy(&batch->send_mutex);
+    free(batch);
+}
+
+static Net_Batch *new_batch(uint16_t size)
+{
+    Net_Batch *batch = (Net_Batch *)calloc(1, sizeof(Net_Batch));
+
+    if (batch == NULL) {
+        return NULL;
+    }
+
+    if (pthread_mutex_init(&batch->send_mutex, NULL) != 0) {
+        free(batch);
+        return NULL;
+    }
+
+    batch->send_thread = pthread_self();
+    batch->size = size;
+    batch->recv_bufs = (Packet_Buf **)calloc(size, sizeof(Packet_Buf *));
+    batch->recv_lengths = (uint16_t *)calloc(size, sizeof(uint16_t));
+    batch->recv_addrs = (struct sockaddr_storage *)calloc(size, sizeof(struct sockaddr_storage));
+    batch->send_data = (uint8_t *)malloc(size * NET_DATAGRAM_SIZE);
+    batch->send_bufs = (Packet_Buf **)calloc(size, sizeof(Packet_Buf *));
+    batch->send_lengths = (uint16_t *)calloc(size, sizeof(uint16_t));
+    batch->send_addrs = (struct sockaddr_storage *)calloc(size, sizeof(struct sockaddr_storage));
+    batch->send_addrsizes = (size_t *)calloc(size, sizeof(size_t));
+
+    if (batch->recv_bufs == NULL || batch->recv_lengths == NULL || batch->recv_addrs == NULL
+            || batch->send_data == NULL || batch->send_bufs == NULL || batch->send_lengths == NULL
+            || batch->send_addrs == NULL || batch->send_addrsizes == NULL) {
+        free_batch(batch);
+        return NULL;
+    }
+
+#ifdef NET_HAVE_MMSG
+    batch->msgs = (struct mmsghdr *)calloc(size, sizeof(struct mmsghdr));
+    batch->iovecs = (struct iovec *)calloc(size, sizeof(struct iovec));
+
+    if (batch->msgs == NULL || batch->iovecs == NULL) {
+        free_batch(batch);
+        return NULL;
+    }
+
+#endif
+#ifdef NET_HAVE_GSO
+    batch->cmsgs = (Net_Cmsg *)calloc(size, sizeof(Net_Cmsg));
+
+    if (batch->cmsgs == NULL) {
+        free_batch(batch);
+        return NULL;
+    }
+
+#endif
+    return batch;
+}
+
+#ifdef NET_HAVE_GSO
+/* Turn on segmentation offload for the datagrams of batch where the kernel
+ * supports it. Receiving with UDP_GRO needs room for NET_GSO_MAX_SEGMENTS
+ * datagrams in the batch.
+ */
+static void batch_enable_offload(Networking_Core *net, Net_Batch *batch)
+{
+    /* Kernels without UDP_SEGMENT would ignore the control message and send
+     * the whole buffer as one datagram, so ask first. */
+    int value = 0;
+    batch->gso = setsockopt(net->sock, IPPROTO_UDP, UDP_SEGMENT, &value, sizeof(value)) == 0;
+
+    if (batch->size < NET_GSO_MAX_SEGMENTS) {
+        return;
+    }
+
+    batch->gro_data = (uint8_t *)malloc((batch->size / NET_GSO_MAX_SEGMENTS) * NET_GSO_MAX_SIZE);
+
+    if (batch->gro_data == NULL) {
+        return;
+    }
+
+    value = 1;
+    batch->gro = setsockopt(net->sock, IPPROTO_UDP, UDP_GRO, &value, sizeof(value)) == 0;
+}
+
+/* Stop the kernel from coalescing the datagrams received for batch. */
+static void batch_disable_offload(Networking_Core *net, Net_Batch *batch)
+{
+    if (batch->gro) {
+        int value = 0;
+        setsockopt(net->sock, IPPROTO_UDP, UDP_GRO, &value, sizeof(value));
+        batch->gro = 0;
+    }
+}
+
+/* Receive up to batch->size datagrams coalesced by the kernel, splitting them
+ * into batch.
+ *
+ * return the number of datagrams received.
+ */
+static uint16_t recv_batch_gro(Networking_Core *net, Net_Batch *batch, uint16_t size)
+{
+    /* Every message can hold NET_GSO_MAX_SEGMENTS datagrams. */
+    const uint16_t num_msgs = size / NET_GSO_MAX_SEGMENTS;
+
+    if (num_msgs == 0) {
+        return 0;
+    }
+
+    for (uint16_t i = 0; i < num_msgs; ++i) {
+        batch->iovecs[i].iov_base = batch->gro_data + i * NET_GSO_MAX_SIZE;
+        batch->iovecs[i].iov_len = NET_GSO_MAX_SIZE;
+        memset(&batch->msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+        batch->msgs[i].msg_hdr.msg_name = &batch->recv_addrs[i];
+        batch->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+        batch->msgs[i].msg_hdr.msg_iov = &batch->iovecs[i];
+        batch->msgs[i].msg_hdr.msg_iovlen = 1;
+        batch->msgs[i].msg_hdr.msg_control = batch->cmsgs[i].buf;
+        batch->msgs[i].msg_hdr.msg_controllen = sizeof(batch->cmsgs[i].buf);
+    }
+
+    const int received = recvmmsg(net->sock, batch->msgs, num_msgs, 0, NULL);
+
+    if (received < 0) {
+        if (errno != EWOULDBLOCK) {
+            LOGGER_ERROR(net->log, "Unexpected error reading from socket: %u, %s\n", errno, strerror(errno));
+        }
+
+        return 0;
+    }
+
+    /* The datagrams overwrite the addresses the messages were received
+     * from. */
+    uint16_t count = 0;
+    struct sockaddr_storage addrs[NET_MAX_BATCH_SIZE / NET_GSO_MAX_SEGMENTS];
+    memcpy(addrs, batch->recv_addrs, received * sizeof(struct sockaddr_storage));
+
+    for (int i = 0; i < received; ++i) {
+        struct msghdr *hdr = &batch->msgs[i].msg_hdr;
+        const uint8_t *data = (const uint8_t *)hdr->msg_iov->iov_base;
+        const uint32_t length = batch->msgs[i].msg_len;
+        uint32_t segment = length;
+
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+            if (cmsg->cmsg_level == IPPROTO_UDP && cmsg->cmsg_type == UDP_GRO) {
+                int gso_size;
+                memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(gso_size));
+                segment = gso_size;
+            }
+        }
+
+        if (segment == 0) {
+            continue;
+        }
+
+        for (uint32_t offset = 0; offset < length && count < size; offset += segment) {
+            const uint32_t datagram = length - offset < segment ? length - offset : segment;
+
+            if (datagram > ela_rewind_size(MAX_UDP_PACKET_SIZE)) {
+                break;
+            }
+
+            memcpy((uint8_t *)ela_rewind(packet_buf_data(batch->recv_bufs[count])), data + offset, datagram);
+            batch->recv_lengths[count] = datagram;
+            batch->recv_addrs[count] = addrs[i];
+            ++count;
+        }
+    }
+
+    return count;
+}
+
+/* Number of datagrams, from the i-th one queued in batch, that can be sent
+ * as one UDP_SEGMENT buffer: to the same address, and as long as the first
+ * but for the last one, which can be shorter.
+ */
+static uint16_t gso_run(const Net_Batch *batch, uint16_t i)
+{
+    const uint16_t segment = batch->send_lengths[i];
+    uint32_t total = segment;
+    uint16_t n = 1;
+
+    while (i + n < batch->send_count && n < NET_GSO_MAX_SEGMENTS) {
+        const uint16_t j = i + n;
+
+        if (batch->send_lengths[j] > segment || total + batch->send_lengths[j] > NET_GSO_MAX_SIZE) {
+            break;
+        }
+
+        if (batch->send_addrsizes[j] != batch->send_addrsizes[i]
+                || memcmp(&batch->send_addrs[j], &batch->send_addrs[i], batch->send_addrsizes[i]) != 0) {
+            break;
+        }
+
+        total += batch->send_lengths[j];
+        ++n;
+
+        if (batch->send_lengths[j] < segment) {
+            break;
+        }
+    }
+
+    return n;
+}
+
+static void set_gso_segment(struct msghdr *hdr, Net_Cmsg *cmsg_buf, uint16_t segment)
+{
+    hdr->msg_control = cmsg_buf->buf;
+    hdr->msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr);
+    cmsg->cmsg_level = IPPROTO_UDP;
+    cmsg->cmsg_type = UDP_SEGMENT;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    memcpy(CMSG_DATA(cmsg), &segment, sizeof(uint16_t));
+}
+#endif
+
+/* Receive up to batch->size datagrams into batch.
+ *
+ * return the number of datagrams received.
+ */
+static uint16_t recv_batch(Networking_Core *net, Net_Batch *batch)
+{
+    uint16_t size;
+
+    for (size = 0; size < batch->size; ++size) {
+        if (batch->recv_bufs[size] == NULL) {
+            batch->recv_bufs[size] = packet_buf_new(net->packet_pool, PACKET_BUF_HEADROOM);
+
+            if (batch->recv_bufs[size] == NULL) {
+                break;
+            }
+        }
+    }
+
+#ifdef NET_HAVE_GSO
+
+    if (batch->gro) {
+        return recv_batch_gro(net, batch, size);
+    }
+
+#endif
+#ifdef NET_HAVE_MMSG
+
+    for (uint16_t i = 0; i < size; ++i) {
+        batch->iovecs[i].iov_base = (uint8_t *)ela_rewind(packet_buf_data(batch->recv_bufs[i]));
+        batch->iovecs[i].iov_len = ela_rewind_size(MAX_UDP_PACKET_SIZE);
+        memset(&batch->msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+        batch->msgs[i].msg_hdr.msg_name = &batch->recv_addrs[i];
+        batch->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+        batch->msgs[i].msg_hdr.msg_iov = &batch->iovecs[i];
+        batch->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    if (size == 0) {
+        return 0;
+    }
+
+    const int received = recvmmsg(net->sock, batch->msgs, size, 0, NULL);
+
+    if (received < 0) {
+        if (errno != EWOULDBLOCK) {
+            LOGGER_ERROR(net->log, "Unexpected error reading from socket: %u, %s\n", errno, strerror(errno));
+        }
+
+        return 0;
+    }
+
+    for (int i = 0; i < received; ++i) {
+        batch->recv_lengths[i] = batch->msgs[i].msg_len;
+    }
+
+    return received;
+#else
+    uint16_t received;
+
+    for (received = 0; received < size; ++received) {
+        socklen_t addrlen = sizeof(struct sockaddr_storage);
+        const int fail_or_len = recvfrom(net->sock, (char *)ela_rewind(packet_buf_data(batch->recv_bufs[received])),
+                                         ela_rewind_size(MAX_UDP_PACKET_SIZE), 0,
+                                         (struct sockaddr *)&batch->recv_addrs[received], &addrlen);
+
+        if (fail_or_len < 0) {
+            if (errno != EWOULDBLOCK) {
+                LOGGER_ERROR(net->log, "Unexpected error reading from socket: %u, %s\n", errno, strerror(errno));
+            }
+
+            break;
+        }
+
+        batch->recv_lengths[received] = fail_or_len;
+    }
+
+    return received;
+#endif
+}
+
+/* Send the datagrams queued in batch. Datagrams that fail to go out are
+ * dropped, like UDP would.
+ */
+static const uint8_t *batch_send_datagram(const Net_Batch *batch, uint16_t i)
+{
+    if (batch->send_bufs[i] != NULL) {
+        return ela_rewind(packet_buf_data(batch->send_bufs[i]));
+    }
+
+    return batch->send_data + i * NET_DATAGRAM_SIZE;
+}
+
+static void send_batch(Networking_Core *net, Net_Batch *batch)
+{
+    uint16_t sent = 0;
+
+#ifdef NET_HAVE_MMSG
+    uint16_t num_msgs = 0;
+
+    for (uint16_t i = 0; i < batch->send_count; ++i) {
+        batch->iovecs[i].iov_base = (uint8_t *)batch_send_datagram(batch, i);
+        batch->iovecs[i].iov_len = batch->send_lengths[i];
+    }
+
+    /* A message per datagram, or per run of datagrams the kernel segments. */
+    for (uint16_t i = 0; i < batch->send_count; ++num_msgs) {
+        uint16_t n = 1;
+#ifdef NET_HAVE_GSO
+
+        if (batch->gso) {
+            n = gso_run(batch, i);
+        }
+
+#endif
+        struct msghdr *hdr = &batch->msgs[num_msgs].msg_hdr;
+        memset(hdr, 0, sizeof(struct msghdr));
+        hdr->msg_name = &batch->send_addrs[i];
+        hdr->msg_namelen = batch->send_addrsizes[i];
+        hdr->msg_iov = &batch->iovecs[i];
+        hdr->msg_iovlen = n;
+#ifdef NET_HAVE_GSO
+
+        if (n > 1) {
+            set_gso_segment(hdr, &batch->cmsgs[num_msgs], batch->send_lengths[i]);
+            batch->stats.segmented += n;
+        }
+
+#endif
+        i += n;
+    }
+
+    /* A full socket buffer fails every remaining message, so failures are
+     * logged once per batch rather than once per message. */
+    uint16_t failed = 0;
+    int error = 0;
+
+    while (sent < num_msgs) {
+        const int res = sendmmsg(net->sock, batch->msgs + sent, num_msgs - sent, 0);
+
+        if (res <= 0) {
+            ++failed;
+            error = errno;
+#ifdef NET_HAVE_GSO
+            const struct msghdr *hdr = &batch->msgs[sent].msg_hdr;
+
+            if (hdr->msg_iovlen > 1) {
+                /* Send the datagrams of the message one by one. Stop
+                 * segmenting if the device can't do it; EINVAL only means the
+                 * segments don't fit the path MTU of this destination. */
+                if (error == EIO || error == EOPNOTSUPP) {
+                    batch->gso = 0;
+                }
+
+                for (size_t j = 0; j < hdr->msg_iovlen; ++j) {
+                    sendto(net->sock, (const char *)hdr->msg_iov[j].iov_base, hdr->msg_iov[j].iov_len, 0,
+                           (const struct sockaddr *)hdr->msg_name, hdr->msg_namelen);
+                }
+
+                batch->stats.resent += hdr->msg_iovlen;
+            }
+
+#endif
+            /* Skip the message that failed and send the rest. */
+            ++sent;
+            continue;
+        }
+
+        sent += res;
+    }
+
+    if (failed > 0) {
+        LOGGER_WARNING(net->log, "Failed to send %u of %u messages, last error: %u, %s", failed, num_msgs, error,
+                       strerror(error));
+    }
+
+#else
+
+    for (sent = 0; sent < batch->send_count; ++sent) {
+        sendto(net->sock, (const char *)batch_send_datagram(batch, sent), batch->send_lengths[sent], 0,
+               (struct sockaddr *)&batch->send_addrs[sent], batch->send_addrsizes[sent]);
+    }
+
+#endif
+
+    for (uint16_t i = 0; i < batch->send_count; ++i) {
+        packet_buf_unref(batch->send_bufs[i]);
+        batch->send_bufs[i] = NULL;
+    }
+
+    batch->stats.datagrams += batch->send_count;
+    batch->send_count = 0;
+}
+
+/* return true if datagrams sent by the calling thread are queued in batch.
+ * Call with batch->send_mutex locked.
+ */
+static bool batch_queues_thread(const Net_Batch *batch)
+{
+    return pthread_equal(batch->send_thread, pthread_self()) != 0;
+}
+
+/* Take the next send slot of batch for a datagram to ip_port, sending the
+ * queued datagrams first if they fill the batch.
+ *
+ * return the index of the slot.
+ * return -1 on failure.
+ */
+static int queue_datagram(Networking_Core *net, Net_Batch *batch, IP_Port ip_port)
+{
+    if (batch->send_count == batch->size) {
+        send_batch(net, batch);
+    }
+
+    const uint16_t i = batch->send_count;
+
+    /* Zeroed so that the addresses of datagrams can be compared. */
+    memset(&batch->send_addrs[i], 0, sizeof(struct sockaddr_storage));
+
+    if (ip_port_to_sockaddr(net, ip_port, &batch->send_addrs[i], &batch->send_addrsizes[i]) == -1) {
+        return -1;
+    }
+
+    ++batch->send_count;
+    return i;
+}
+
+/* Queue a copy of a datagram to ip_port in batch.
+ *
+ * return length on success.
+ * return -1 on failure.
+ */
+static int queue_datagram_copy(Networking_Core *net, Net_Batch *batch, IP_Port ip_port, const uint8_t *data,
+                               uint16_t length)
+{
+    if (length > NET_DATAGRAM_SIZE) {
+        return -1;
+    }
+
+    const int i = queue_datagram(net, batch, ip_port);
+
+    if (i == -1) {
+        return -1;
+    }
+
+    memcpy(batch->send_data + i * NET_DATAGRAM_SIZE, data, length);
+    batch->send_lengths[i] = length;
+    return length;
+}
+
+/* Send a datagram over the UDP socket of the Networking_Core object, or queue
+ * it if datagrams are sent in batches. */
+static int udp_backend_send(void *object, IP_Port ip_port, const uint8_t *data, uint16_t length)
+{
+    Networking_Core *net = (Networking_Core *)object;
+    Net_Batch *batch = net->batch;
+
+    if (batch != NULL) {
+        pthread_mutex_lock(&batch->send_mutex);
+
+        if (batch_queues_thread(batch)) {
+            const int res = queue_datagram_copy(net, batch, ip_port, data, length);
+            pthread_mutex_unlock(&batch->send_mutex);
+            return res;
+        }
+
+        ++batch->stats.direct;
+        pthread_mutex_unlock(&batch->send_mutex);
+    }
+
+    struct sockaddr_storage addr;
+    size_t addrsize = 0;
+
+    if (ip_port_to_sockaddr(net, ip_port, &addr, &addrsize) == -1) {
+        return -1;
+    }
+
+    return sendto(net->sock, (const char *)data, length, 0, (struct sockaddr *)&addr, addrsize);
+}
+
+/* Hand out the next datagram of the last batch received, receiving a new
+ * batch once they are all handed out. The datagram starts with the magic in
+ * front of the data of the buffer.
+ *
+ * return the buffer holding the datagram and its length in received.
+ * return NULL if there is none to receive.
+ */
+static Packet_Buf *next_batch_datagram(Networking_Core *net, Net_Batch *batch, IP_Port *ip_port, uint16_t *received)
+{
+    while (1) {
+        if (batch->recv_next == batch->recv_count) {
+            batch->recv_next = 0;
+            batch->recv_count = recv_batch(net, batch);
+
+            if (batch->recv_count == 0) {
+                return NULL;
+            }
+        }
+
+        const uint16_t i = batch->recv_next;
+        ++batch->recv_next;
+
+        if (sockaddr_to_ip_port(&batch->recv_addrs[i], ip_port) == -1) {
+            continue;
+        }
+
+        Packet_Buf *buf = batch->recv_bufs[i];
+        batch->recv_bufs[i] = NULL;
+        *received = batch->recv_lengths[i];
+        return buf;
+    }
+}
+
+/* Receive a datagram from the UDP socket of the Networking_Core object, or
+ * from the last batch received from it. */
+static int udp_backend_recv(void *object, IP_Port *ip_port, uint8_t *data, uint16_t length)
+{
+    Networking_Core *net = (Networking_Core *)object;
+    Net_Batch *batch = net->batch;
+
+    if (batch == NULL) {
+        struct sockaddr_storage addr;
+#if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
+        int addrlen = sizeof(addr);
+#else
+        socklen_t addrlen = sizeof(addr);
+#endif
+        int fail_or_len = recvfrom(net->sock, (char *)data, length, 0, (struct sockaddr *)&addr, &addrlen);
+
+        if (fail_or_len < 0) {
+            if (errno != EWOULDBLOCK) {
+                LOGGER_ERROR(net->log, "Unexpected error reading from socket: %u, %s\n", errno, strerror(errno));
+            }
+
+            return -1; /* Nothing received. */
+        }
+
+        if (sockaddr_to_ip_port(&addr, ip_port) == -1) {
+            return -1;
+        }
+
+        return fail_or_len;
+    }
+
+    uint16_t received;
+    Packet_Buf *buf;
+
+    while ((buf = next_batch_datagram(net, batch, ip_port, &received)) != NULL) {
+        if (received <= length) {
+            memcpy(data, ela_rewind(packet_buf_data(buf)), received);
+            packet_buf_unref(buf);
+            return received;
+        }
+
+        packet_buf_unref(buf);
+    }
+
+    return -1; /* Nothing received. */
+}
+
+static void udp_backend_flush(void *object)
+{
+    Networking_Core *net = (Networking_Core *)object;
+    Net_Batch *batch = net->batch;
+
+    if (batch == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&batch->send_mutex);
+
+    if (batch->send_count != 0) {
+        send_batch(net, batch);
+    }
+
+    pthread_mutex_unlock(&batch->send_mutex);
 }
 
-void fill_addr6(IP6 ip, struct in6_addr *addr)
-{
-    assert(sizeof(ip.uint8) == sizeof(addr->s6_addr));
-    memcpy(addr->s6_addr, ip.uint8, sizeof(ip.uint8));
-}
+static const Network_Backend udp_backend = {
+    udp_backend_send,
+    udp_backend_recv,
+    NULL,
+    udp_backend_flush,
+};
 
 /* Basic network functions:
  * Function to send packet(data) of length length to ip_port.
  */
-int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint16_t length)
+static bool can_send_to(const Networking_Core *net, IP_Port ip_port)
 {
     if (net->family == 0) { /* Socket not initialized */
-        return -1;
+        return false;
     }
 
     /* socket AF_INET, but target IP NOT: can't send */
     if ((net->family == AF_INET) && (ip_port.ip.family != AF_INET)) {
+        return false;
+    }
+
+    if (ip_port.ip.family != AF_INET && ip_port.ip.family != AF_INET6) {
+        /* unknown address type*/
+        return false;
+    }
+
+    return true;
+}
+
+int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint16_t length)
+{
+    if (!can_send_to(net, ip_port)) {
         return -1;
     }
 
-    struct sockaddr_storage addr;
+    ela_magic_set(data);
+    int res = net->backend->send(net->backend_object, ip_port, ela_rewind(data), ela_rewind_size(length));
 
-    size_t addrsize = 0;
+    loglogdata(net->log, "O=>", data, length, ip_port, res);
 
-    if (ip_port.ip.family == AF_INET) {
-        if (net->family == AF_INET6) {
-            /* must convert to IPV4-in-IPV6 address */
-            struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)&addr;
+    if (res > 0 && length > 0) {
+        packet_stats_sent(&net->packet_stats[data[0]], length);
 
-            addrsize = sizeof(struct sockaddr_in6);
-            addr6->sin6_family = AF_INET6;
-            addr6->sin6_port = ip_port.port;
+        if (net->sent_callback) {
+            net->sent_callback(net->sent_callback_object, ip_port, data, length);
+        }
+    }
 
-            /* there should be a macro for this in a standards compliant
-             * environment, not found */
-            IP6 ip6;
+    return res > 0 ? (res - ela_magic_size()) : res;
+}
 
-            ip6.uint32[0] = 0;
-            ip6.uint32[1] = 0;
-            ip6.uint32[2] = net_htonl(0xFFFF);
-            ip6.uint32[3] = ip_port.ip.ip4.uint32;
-            fill_addr6(ip6, &addr6->sin6_addr);
+int sendpacket_buf(Networking_Core *net, IP_Port ip_port, Packet_Buf *packet)
+{
+    const uint8_t *data = packet_buf_data(packet);
+    const uint16_t length = packet_buf_length(packet);
+    Net_Batch *batch = net->batch;
 
-            addr6->sin6_flowinfo = 0;
-            addr6->sin6_scope_id = 0;
-        } else {
-            struct sockaddr_in *addr4 = (struct sockaddr_in *)&addr;
+    if (net->backend != &udp_backend || batch == NULL || packet_buf_headroom(packet) < ela_magic_size()) {
+        return sendpacket(net, ip_port, data, length);
+    }
 
-            addrsize = sizeof(struct sockaddr_in);
-            addr4->sin_family = AF_INET;
-            fill_addr4(ip_port.ip.ip4, &addr4->sin_addr);
-            addr4->sin_port = ip_port.port;
-        }
-    } else if (ip_port.ip.family == AF_INET6) {
-        struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)&addr;
+    if (!can_send_to(net, ip_port)) {
+        return -1;
+    }
 
-        addrsize = sizeof(struct sockaddr_in6);
-        addr6->sin6_family = AF_INET6;
-        addr6->sin6_port = ip_port.port;
-        fill_addr6(ip_port.ip.ip6, &addr6->sin6_addr);
+    pthread_mutex_lock(&batch->send_mutex);
 
-        addr6->sin6_flowinfo = 0;
-        addr6->sin6_scope_id = 0;
-    } else {
-        /* unknown address type*/
+    if (!batch_queues_thread(batch)) {
+        pthread_mutex_unlock(&batch->send_mutex);
+        return sendpacket(net, ip_port, data, length);
+    }
+
+    const int i = queue_datagram(net, batch, ip_port);
+
+    if (i == -1) {
+        pthread_mutex_unlock(&batch->send_mutex);
         return -1;
     }
 
     ela_magic_set(data);
-    int res = sendto(net->sock, (const char *)ela_rewind(data), ela_rewind_size(length), 0, (struct sockaddr *)&addr, addrsize);
+    batch->send_bufs[i] = packet_buf_ref(packet);
+    batch->send_lengths[i] = ela_rewind_size(length);
+    pthread_mutex_unlock(&batch->send_mutex);
 
-    loglogdata(net->log, "O=>", data, length, ip_port, res);
+    loglogdata(net->log, "O=>", data, length, ip_port, length);
 
-    return res > 0 ? (res - ela_magic_size()) : res;
+    if (length > 0) {
+        packet_stats_sent(&net->packet_stats[data[0]], length);
+
+        if (net->sent_callback) {
+            net->sent_callback(net->sent_callback_object, ip_port, data, length);
+        }
+    }
+
+    return length;
 }
 
 /* Function to receive data
  *  ip and port of sender is put into ip_port.
- *  Packet data is put into data.
- *  Packet length is put into length.
+ *
+ * return a buffer of the packet pool holding the packet.
+ * return NULL if nothing was received.
  */
-static int receivepacket(Logger *log, Socket sock, IP_Port *ip_port, uint8_t *data, uint32_t *length)
+static Packet_Buf *receivepacket(Networking_Core *net, IP_Port *ip_port)
 {
     memset(ip_port, 0, sizeof(IP_Port));
-    struct sockaddr_storage addr;
-#if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
-    int addrlen = sizeof(addr);
-#else
-    socklen_t addrlen = sizeof(addr);
-#endif
-    *length = 0;
-    int fail_or_len = recvfrom(sock, (char *) ela_rewind(data), ela_rewind_size(MAX_UDP_PACKET_SIZE), 0, (struct sockaddr *)&addr, &addrlen);
-
-    if (fail_or_len < 0) {
+    Packet_Buf *buf;
+    int fail_or_len;
+
+    if (net->backend == &udp_backend && net->batch != NULL) {
+        /* Hand out the buffer the datagram was received into. */
+        uint16_t received;
+        buf = next_batch_datagram(net, net->batch, ip_port, &received);
+        fail_or_len = buf ? received : -1;
+    } else {
+        buf = packet_buf_new(net->packet_pool, PACKET_BUF_HEADROOM);
 
-        if (fail_or_len < 0 && errno != EWOULDBLOCK) {
-            LOGGER_ERROR(log, "Unexpected error reading from socket: %u, %s\n", errno, strerror(errno));
+        if (buf == NULL) {
+            return NULL;
         }
 
-        return -1; /* Nothing received. */
+        fail_or_len = net->backend->recv(net->backend_object, ip_port, (uint8_t *)ela_rewind(packet_buf_data(buf)),
+                                         ela_rewind_size(MAX_UDP_PACKET_SIZE));
     }
+
+    if (fail_or_len < 0) {
+        packet_buf_unref(buf);
+        return NULL; /* Nothing received. */
+    }
+
+    const uint8_t *data = packet_buf_data(buf);
+
 #if defined(ELASTOS_BUILD)
 	fail_or_len -= ela_magic_size();
 	if (fail_or_len < 0) {
-		LOGGER_ERROR(log, "Too short data receving from socket.");
-		return -1;
+		LOGGER_ERROR(net->log, "Too short data receving from socket.");
+		packet_buf_unref(buf);
+		return NULL;
 	}
 	if (!ela_magic_check(data)) {
-		//LOGGER_ERROR(log, "Received DHT message with invalid magic, dropped.");
-		return -1;
+		//LOGGER_ERROR(net->log, "Received DHT message with invalid magic, dropped.");
+		packet_buf_unref(buf);
+		return NULL;
 	} else {
-		//LOGGER_DEBUG(log, "Recevied valid DHT message, congradulations!!!!");
+		//LOGGER_DEBUG(net->log, "Recevied valid DHT message, congradulations!!!!");
 	}
 #endif
 
-    *length = (uint32_t)fail_or_len;
-
-    if (addr.ss_family == AF_INET) {
-        struct sockaddr_in *addr_in = (struct sockaddr_in *)&addr;
-
-        ip_port->ip.family = addr_in->sin_family;
-        get_ip4(&ip_port->ip.ip4, &addr_in->sin_addr);
-        ip_port->port = addr_in->sin_port;
-    } else if (addr.ss_family == AF_INET6) {
-        struct sockaddr_in6 *addr_in6 = (struct sockaddr_in6 *)&addr;
-        ip_port->ip.family = addr_in6->sin6_family;
-        get_ip6(&ip_port->ip.ip6, &addr_in6->sin6_addr);
-        ip_port->port = addr_in6->sin6_port;
-
-        if (IPV6_IPV4_IN_V6(ip_port->ip.ip6)) {
-            ip_port->ip.family = AF_INET;
-            ip_port->ip.ip4.uint32 = ip_port->ip.ip6.uint32[3];
-        }
-    } else {
-        return -1;
-    }
+    packet_buf_put(buf, fail_or_len);
 
-    loglogdata(log, "=>O", data, MAX_UDP_PACKET_SIZE, *ip_port, *length);
+    loglogdata(net->log, "=>O", data, MAX_UDP_PACKET_SIZE, *ip_port, fail_or_len);
 
-    return 0;
+    return buf;
 }
 
 void networking_registerhandler(Networking_Core *net, uint8_t byte, packet_handler_callback cb, void *object)
 {
     net->packethandlers[byte].function = cb;
+    net->packethandlers[byte].buf_function = NULL;
+    net->packethandlers[byte].object = object;
+}
+
+void networking_registerhandler_buf(Networking_Core *net, uint8_t byte, packet_buf_handler_callback cb,
+                                    void *object)
+{
+    net->packethandlers[byte].function = NULL;
+    net->packethandlers[byte].buf_function = cb;
     net->packethandlers[byte].object = object;
 }
 
+void networking_callback_sent(Networking_Core *net, packet_sent_callback cb, void *object)
+{
+    net->sent_callback = cb;
+    net->sent_callback_object = object;
+}
+
 #if defined(ELASTOS_BUILD)
 static const char* packet_name(uint8_t type)
 {
@@ -603,6 +1461,99 @@ static const char* packet_name(uint8_t type)
 }
 #endif
 
+/* Packets are sent from the net_crypto workers and the threads of API users,
+ * and the UDP workers of the bootstrap daemon count the packets of the stats
+ * its main thread reads, so the counters are only accessed atomically. */
+#if defined(__GNUC__)
+#define PACKET_STATS_LOAD(value) __atomic_load_n(value, __ATOMIC_RELAXED)
+#define PACKET_STATS_STORE(value, new_value) __atomic_store_n(value, new_value, __ATOMIC_RELAXED)
+#define PACKET_STATS_ADD(value, n) __atomic_fetch_add(value, n, __ATOMIC_RELAXED)
+#else
+static pthread_mutex_t packet_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t packet_stats_load(const uint64_t *value)
+{
+    pthread_mutex_lock(&packet_stats_mutex);
+    const uint64_t ret = *value;
+    pthread_mutex_unlock(&packet_stats_mutex);
+    return ret;
+}
+
+static void packet_stats_store(uint64_t *value, uint64_t new_value)
+{
+    pthread_mutex_lock(&packet_stats_mutex);
+    *value = new_value;
+    pthread_mutex_unlock(&packet_stats_mutex);
+}
+
+static void packet_stats_add(uint64_t *value, uint64_t n)
+{
+    pthread_mutex_lock(&packet_stats_mutex);
+    *value += n;
+    pthread_mutex_unlock(&packet_stats_mutex);
+}
+
+#define PACKET_STATS_LOAD(value) packet_stats_load(value)
+#define PACKET_STATS_STORE(value, new_value) packet_stats_store(value, new_value)
+#define PACKET_STATS_ADD(value, n) packet_stats_add(value, n)
+#endif
+
+void packet_stats_received(Packet_Stats *stats, uint16_t length)
+{
+    PACKET_STATS_ADD(&stats->packets_in, 1);
+    PACKET_STATS_ADD(&stats->bytes_in, length);
+}
+
+void packet_stats_sent(Packet_Stats *stats, uint16_t length)
+{
+    PACKET_STATS_ADD(&stats->packets_out, 1);
+    PACKET_STATS_ADD(&stats->bytes_out, length);
+}
+
+void packet_stats_dropped(Packet_Stats *stats)
+{
+    PACKET_STATS_ADD(&stats->dropped, 1);
+}
+
+void packet_stats_handled(Packet_Stats *stats, uint64_t handler_start, bool success)
+{
+    const uint64_t handler_end = current_time_monotonic_us();
+
+    if (handler_end > handler_start) {
+        PACKET_STATS_ADD(&stats->handler_time, handler_end - handler_start);
+    }
+
+    PACKET_STATS_ADD(&stats->handled, 1);
+
+    if (!success) {
+        PACKET_STATS_ADD(&stats->dropped, 1);
+    }
+}
+
+void packet_stats_copy(const Packet_Stats *stats, Packet_Stats *copy)
+{
+    copy->packets_in = PACKET_STATS_LOAD(&stats->packets_in);
+    copy->bytes_in = PACKET_STATS_LOAD(&stats->bytes_in);
+    copy->packets_out = PACKET_STATS_LOAD(&stats->packets_out);
+    copy->bytes_out = PACKET_STATS_LOAD(&stats->bytes_out);
+    copy->handled = PACKET_STATS_LOAD(&stats->handled);
+    copy->dropped = PACKET_STATS_LOAD(&stats->dropped);
+    copy->handler_time = PACKET_STATS_LOAD(&stats->handler_time);
+}
+
+void packet_stats_reset(Packet_Stats *stats, size_t count)
+{
+    for (size_t i = 0; i < count; ++i) {
+        PACKET_STATS_STORE(&stats[i].packets_in, 0);
+        PACKET_STATS_STORE(&stats[i].bytes_in, 0);
+        PACKET_STATS_STORE(&stats[i].packets_out, 0);
+        PACKET_STATS_STORE(&stats[i].bytes_out, 0);
+        PACKET_STATS_STORE(&stats[i].handled, 0);
+        PACKET_STATS_STORE(&stats[i].dropped, 0);
+        PACKET_STATS_STORE(&stats[i].handler_time, 0);
+    }
+}
+
 void networking_poll(Networking_Core *net, void *userdata)
 {
     if (net->family == 0) { /* Socket not initialized */
@@ -611,24 +1562,53 @@ void networking_poll(Networking_Core *net, void *userdata)
 
     unix_time_update();
 
+    if (net->batch != NULL) {
+        /* Datagrams sent while handling the received ones are queued. */
+        pthread_mutex_lock(&net->batch->send_mutex);
+        net->batch->send_thread = pthread_self();
+        pthread_mutex_unlock(&net->batch->send_mutex);
+    }
+
     IP_Port ip_port;
-    ELASTOS_VLA(uint8_t, data, MAX_UDP_PACKET_SIZE);
-    uint32_t length;
+    Packet_Buf *buf;
+
+    while ((buf = receivepacket(net, &ip_port)) != NULL) {
+        const uint8_t *data = packet_buf_data(buf);
+        const uint16_t length = packet_buf_length(buf);
 
-    while (receivepacket(net->log, net->sock, &ip_port, data, &length) != -1) {
         if (length < 1) {
+            packet_buf_unref(buf);
             continue;
         }
 
-        if (!(net->packethandlers[data[0]].function)) {
+        const Packet_Handles *handler = &net->packethandlers[data[0]];
+        Packet_Stats *stats = &net->packet_stats[data[0]];
+        packet_stats_received(stats, length);
+
+        if (!handler->function && !handler->buf_function) {
             LOGGER_WARNING(net->log, "[%02u] -- Packet has no handler", data[0]);
+            packet_stats_dropped(stats);
+            packet_buf_unref(buf);
             continue;
         }
 		
         LOGGER_TRACE(net->log, "received packet [0x%x](%s)", data[0], packet_name(data[0]));
 
-        net->packethandlers[data[0]].function(net->packethandlers[data[0]].object, ip_port, data, length, userdata);
+        const uint64_t handler_start = current_time_monotonic_us();
+        int ret;
+
+        if (handler->buf_function) {
+            ret = handler->buf_function(handler->object, ip_port, buf, userdata);
+        } else {
+            ret = handler->function(handler->object, ip_port, data, length, userdata);
+        }
+
+        packet_stats_handled(stats, handler_start, ret == 0);
+        packet_buf_unref(buf);
     }
+
+    /* Send the replies of the handlers. */
+    networking_flush(net);
 }
 
 #ifndef VANILLA_NACL
@@ -692,13 +1672,15 @@ Networking_Core *new_networking(Logger *log, IP ip, uint16_t port)
  * Bind to ip and port.
  * ip must be in network order EX: 127.0.0.1 = (7F000001).
  * port is in host byte order (this means don't worry about it).
+ * If reuseport is set, SO_REUSEPORT is enabled on the socket before binding it.
  *
  *  return Networking_Core object if no problems
  *  return NULL if there are problems.
  *
  * If error is non NULL it is set to 0 if no issues, 1 if socket related error, 2 if other.
  */
-Networking_Core *new_networking_ex(Logger *log, IP ip, uint16_t port_from, uint16_t port_to, unsigned int *error)
+static Networking_Core *new_networking_socket(Logger *log, IP ip, uint16_t port_from, uint16_t port_to,
+        bool reuseport, unsigned int *error)
 {
     /* If both from and to are 0, use default port range
      * If one is 0 and the other is non-0, use the non-0 value as only port
@@ -740,6 +1722,13 @@ Networking_Core *new_networking_ex(Logger *log, IP ip, uint16_t port_from, uint1
     temp->log = log;
     temp->family = ip.family;
     temp->port = 0;
+    networking_set_backend(temp, NULL, NULL);
+    temp->packet_pool = new_packet_pool(PACKET_POOL_DEFAULT_FREE);
+
+    if (temp->packet_pool == NULL) {
+        free(temp);
+        return NULL;
+    }
 
     /* Initialize our socket. */
     /* add log message what we're creating */
@@ -748,6 +1737,7 @@ Networking_Core *new_networking_ex(Logger *log, IP ip, uint16_t port_from, uint1
     /* Check for socket error. */
     if (!sock_valid(temp->sock)) {
         LOGGER_ERROR(log, "Failed to get a socket?! %u, %s\n", errno, strerror(errno));
+        kill_packet_pool(temp->packet_pool);
         free(temp);
 
         if (error) {
@@ -789,6 +1779,17 @@ Networking_Core *new_networking_ex(Logger *log, IP ip, uint16_t port_from, uint1
         return NULL;
     }
 
+    if (reuseport && !set_socket_reuseport(temp->sock)) {
+        LOGGER_ERROR(log, "Failed to set SO_REUSEPORT: %u, %s\n", errno, strerror(errno));
+        kill_networking(temp);
+
+        if (error) {
+            *error = 1;
+        }
+
+        return NULL;
+    }
+
     /* Bind our socket to port PORT and the given IP address (usually 0.0.0.0 or ::) */
     uint16_t *portptr = NULL;
     struct sockaddr_storage addr;
@@ -816,7 +1817,7 @@ Networking_Core *new_networking_ex(Logger *log, IP ip, uint16_t port_from, uint1
 
         portptr = &addr6->sin6_port;
     } else {
-        free(temp);
+        kill_networking(temp);
         return NULL;
     }
 
@@ -903,6 +1904,157 @@ Networking_Core *new_networking_ex(Logger *log, IP ip, uint16_t port_from, uint1
     return NULL;
 }
 
+Networking_Core *new_networking_ex(Logger *log, IP ip, uint16_t port_from, uint16_t port_to, unsigned int *error)
+{
+    return new_networking_socket(log, ip, port_from, port_to, false, error);
+}
+
+Networking_Core *new_networking_reuseport(Logger *log, IP ip, uint16_t port, unsigned int *error)
+{
+    if (port == 0) {
+        if (error) {
+            *error = 2;
+        }
+
+        return NULL;
+    }
+
+    return new_networking_socket(log, ip, port, port, true, error);
+}
+
+Networking_Core *new_networking_backend(Logger *log, Family family, uint16_t port, const Network_Backend *backend,
+                                        void *object)
+{
+    if (family != AF_INET && family != AF_INET6) {
+        LOGGER_ERROR(log, "Invalid address family: %u\n", family);
+        return NULL;
+    }
+
+    if (networking_at_startup() != 0) {
+        return NULL;
+    }
+
+    Networking_Core *net = (Networking_Core *)calloc(1, sizeof(Networking_Core));
+
+    if (net == NULL) {
+        return NULL;
+    }
+
+    net->log = log;
+    net->family = family;
+    net->port = net_htons(port);
+    net->sock = ~0;
+    networking_set_backend(net, backend, object);
+    net->packet_pool = new_packet_pool(PACKET_POOL_DEFAULT_FREE);
+
+    if (net->packet_pool == NULL) {
+        free(net);
+        return NULL;
+    }
+
+    return net;
+}
+
+void networking_flush(Networking_Core *net)
+{
+    if (net->family != 0 && net->backend->flush) {
+        net->backend->flush(net->backend_object);
+    }
+}
+
+Socket networking_socket(const Networking_Core *net)
+{
+    if (net->family == 0 || net->backend != &udp_backend) {
+        return ~0;
+    }
+
+    return net->sock;
+}
+
+bool networking_has_queued(const Networking_Core *net)
+{
+    Net_Batch *batch = net->batch;
+
+    if (net->backend != &udp_backend || batch == NULL) {
+        return false;
+    }
+
+    pthread_mutex_lock(&batch->send_mutex);
+    const bool queued = batch->send_count != 0;
+    pthread_mutex_unlock(&batch->send_mutex);
+    return queued;
+}
+
+bool networking_batch_stats(const Networking_Core *net, Net_Batch_Stats *stats)
+{
+    Net_Batch *batch = net->batch;
+
+    if (batch == NULL) {
+        return false;
+    }
+
+    pthread_mutex_lock(&batch->send_mutex);
+    *stats = batch->stats;
+#ifdef NET_HAVE_GSO
+    stats->segmentation = batch->gso;
+#endif
+    pthread_mutex_unlock(&batch->send_mutex);
+    return true;
+}
+
+void networking_reset_stats(Networking_Core *net)
+{
+    packet_stats_reset(net->packet_stats, sizeof(net->packet_stats) / sizeof(net->packet_stats[0]));
+}
+
+int networking_set_batch_size(Networking_Core *net, uint16_t batch_size)
+{
+    if (batch_size == 0 || batch_size > NET_MAX_BATCH_SIZE) {
+        return -1;
+    }
+
+    Net_Batch *batch = NULL;
+
+    if (batch_size > 1) {
+        batch = new_batch(batch_size);
+
+        if (batch == NULL) {
+            return -1;
+        }
+    }
+
+    /* networking_poll() handles every datagram received, so only the queued
+     * ones are left. */
+    if (net->batch != NULL) {
+        send_batch(net, net->batch);
+#ifdef NET_HAVE_GSO
+        batch_disable_offload(net, net->batch);
+#endif
+        free_batch(net->batch);
+    }
+
+#ifdef NET_HAVE_GSO
+
+    if (batch != NULL) {
+        batch_enable_offload(net, batch);
+    }
+
+#endif
+    net->batch = batch;
+    return 0;
+}
+
+void networking_set_backend(Networking_Core *net, const Network_Backend *backend, void *object)
+{
+    if (backend == NULL) {
+        backend = &udp_backend;
+        object = net;
+    }
+
+    net->backend = backend;
+    net->backend_object = object;
+}
+
 /* Function to cleanup networking stuff. */
 void kill_networking(Networking_Core *net)
 {
@@ -911,9 +2063,20 @@ void kill_networking(Networking_Core *net)
     }
 
     if (net->family != 0) { /* Socket not initialized */
-        kill_sock(net->sock);
+        networking_flush(net);
+
+        if (net->backend->kill) {
+            net->backend->kill(net->backend_object);
+        }
+
+        if (sock_valid(net->sock)) {
+            kill_sock(net->sock);
+        }
     }
 
+    free_batch(net->batch);
+    kill_packet_pool(net->packet_pool);
+
     free(net);
 }
 
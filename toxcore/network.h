@@ -52,6 +52,7 @@
 #include "ccompat.h"
 #include "logger.h"
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -398,11 +399,72 @@ int addr_resolve_or_parse_ip(const char *address, IP *to, IP *extra);
 typedef int (*packet_handler_callback)(void *object, IP_Port ip_port, const uint8_t *data, uint16_t len,
                                        void *userdata);
 
+typedef struct Packet_Pool Packet_Pool;
+typedef struct Packet_Buf Packet_Buf;
+
+/* Like packet_handler_callback, for handlers that take the buffer the packet
+ * was received into (see packet_buf.h). The handler may change the packet in
+ * place, and must take a reference to keep the buffer after it returns.
+ */
+typedef int (*packet_buf_handler_callback)(void *object, IP_Port ip_port, Packet_Buf *packet, void *userdata);
+
+/* Function called with a packet of length len that was sent to ip_port. */
+typedef void (*packet_sent_callback)(void *object, IP_Port ip_port, const uint8_t *data, uint16_t len);
+
+/* Only one of function and buf_function is set. */
 typedef struct {
     packet_handler_callback function;
+    packet_buf_handler_callback buf_function;
     void *object;
 } Packet_Handles;
 
+/* Functions moving the datagrams of a Networking_Core object. The default
+ * backend uses a UDP socket; others can move datagrams over whatever they
+ * like: memory in tests and simulations, or another I/O interface. Datagrams
+ * are passed exactly as they go on the wire.
+ */
+typedef struct {
+    /* Send the datagram data of length length to ip_port.
+     *
+     * return the number of bytes sent.
+     * return -1 on failure.
+     */
+    int (*send)(void *object, IP_Port ip_port, const uint8_t *data, uint16_t length);
+
+    /* Receive a datagram of at most length bytes into data, and the address it
+     * came from into ip_port.
+     *
+     * return the length of the datagram.
+     * return -1 if there is none to receive.
+     */
+    int (*recv)(void *object, IP_Port *ip_port, uint8_t *data, uint16_t length);
+
+    /* Release what the backend holds for the Networking_Core object. Can be NULL. */
+    void (*kill)(void *object);
+
+    /* Send the datagrams the backend queued. Can be NULL. */
+    void (*flush)(void *object);
+} Network_Backend;
+
+typedef struct Net_Batch Net_Batch;
+
+/* Traffic and handler CPU time of the packets with one packet id. Packets are
+ * sent and counted from several threads, so the counters are only updated and
+ * read with the packet_stats_ functions.
+ */
+typedef struct {
+    uint64_t packets_in;
+    uint64_t bytes_in;
+    uint64_t packets_out;
+    uint64_t bytes_out;
+    /* Received packets passed to a handler. */
+    uint64_t handled;
+    /* Received packets without a handler, or that their handler rejected. */
+    uint64_t dropped;
+    /* Time spent in the handlers, in microseconds. */
+    uint64_t handler_time;
+} Packet_Stats;
+
 typedef struct {
     Logger *log;
     Packet_Handles packethandlers[256];
@@ -411,6 +473,23 @@ typedef struct {
     uint16_t port;
     /* Our UDP socket. */
     Socket sock;
+
+    const Network_Backend *backend;
+    void *backend_object;
+
+    /* Datagrams of the socket sent and received in batches, NULL if they are
+     * sent and received one at a time. */
+    Net_Batch *batch;
+
+    /* Buffers received packets go into. */
+    Packet_Pool *packet_pool;
+
+    /* Datagrams sent and received, by their first byte. */
+    Packet_Stats packet_stats[256];
+
+    /* See networking_callback_sent(). */
+    packet_sent_callback sent_callback;
+    void *sent_callback_object;
 } Networking_Core;
 
 /* Run this before creating sockets.
@@ -452,6 +531,13 @@ int set_socket_nosigpipe(Socket sock);
  */
 int set_socket_reuseaddr(Socket sock);
 
+/* Enable SO_REUSEPORT on socket.
+ *
+ * return 1 on success
+ * return 0 on failure or if the platform has no SO_REUSEPORT
+ */
+int set_socket_reuseport(Socket sock);
+
 /* Set socket to dual (IPv4 + IPv6 socket)
  *
  * return 1 on success
@@ -462,17 +548,127 @@ int set_socket_dualstack(Socket sock);
 /* return current monotonic time in milliseconds (ms). */
 uint64_t current_time_monotonic(void);
 
+/* return current monotonic time in microseconds (us), to measure how long
+ * something takes. This always reads the system clock.
+ */
+uint64_t current_time_monotonic_us(void);
+
 /* Basic network functions: */
 
 /* Function to send packet(data) of length length to ip_port. */
 int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint16_t length);
 
+/* Function to send the packet in packet to ip_port.
+ *
+ * When datagrams are sent in batches a reference to packet is queued instead
+ * of a copy of it, so it must not be changed after this call.
+ */
+int sendpacket_buf(Networking_Core *net, IP_Port ip_port, Packet_Buf *packet);
+
 /* Function to call when packet beginning with byte is received. */
 void networking_registerhandler(Networking_Core *net, uint8_t byte, packet_handler_callback cb, void *object);
 
+/* Function to call with the buffer of the packet when packet beginning with
+ * byte is received. Replaces the function set with networking_registerhandler.
+ */
+void networking_registerhandler_buf(Networking_Core *net, uint8_t byte, packet_buf_handler_callback cb,
+                                    void *object);
+
+/* Function to call with every packet sendpacket() or sendpacket_buf() hands
+ * to the backend or queues. It is called from the thread that sends. A NULL
+ * function removes it.
+ */
+void networking_callback_sent(Networking_Core *net, packet_sent_callback cb, void *object);
+
+/* Count a received packet of length bytes in stats. */
+void packet_stats_received(Packet_Stats *stats, uint16_t length);
+
+/* Count a sent packet of length bytes in stats. */
+void packet_stats_sent(Packet_Stats *stats, uint16_t length);
+
+/* Count a received packet without a handler in stats. */
+void packet_stats_dropped(Packet_Stats *stats);
+
+/* Count a packet passed to a handler that was called at handler_start, a time
+ * of current_time_monotonic_us(), in stats. success is false if the handler
+ * rejected the packet.
+ */
+void packet_stats_handled(Packet_Stats *stats, uint64_t handler_start, bool success);
+
+/* Copy the counters of stats to copy. */
+void packet_stats_copy(const Packet_Stats *stats, Packet_Stats *copy);
+
+/* Set the counters of the count stats to zero. */
+void packet_stats_reset(Packet_Stats *stats, size_t count);
+
 /* Call this several times a second. */
 void networking_poll(Networking_Core *net, void *userdata);
 
+/* Send the datagrams queued by net. Call this once the packets of an
+ * iteration are sent.
+ */
+void networking_flush(Networking_Core *net);
+
+/* return the UDP socket to wait on for datagrams of net.
+ * return an invalid socket if net has none or moves its datagrams with
+ * another backend.
+ */
+Socket networking_socket(const Networking_Core *net);
+
+/* return true if net has datagrams queued that networking_flush() sends. */
+bool networking_has_queued(const Networking_Core *net);
+
+/* Set the packet_stats counters of net to zero. */
+void networking_reset_stats(Networking_Core *net);
+
+/* Most datagrams the UDP socket can send or receive in a batch. */
+#define NET_MAX_BATCH_SIZE 256
+
+/* Make the UDP socket of net receive up to batch_size datagrams per system
+ * call, using recvmmsg() where available. Outgoing datagrams of the thread
+ * calling networking_poll() are then queued and sent batch_size per system
+ * call, using sendmmsg() where available, by networking_flush() or once the
+ * queue is full; sendpacket() can no longer report failures to send them.
+ * Other threads can keep sending: their datagrams go out straight away.
+ * Must not be called while other threads send.
+ *
+ * On Linux, consecutive datagrams of the same length to the same address are
+ * handed to the kernel as one buffer that it segments (UDP_SEGMENT), and with
+ * a batch_size of at least 64 datagrams from the same sender are received as
+ * one buffer (UDP_GRO). Either is left off where the kernel lacks it.
+ *
+ * A batch_size of 1 sends and receives datagrams one at a time, which is the
+ * default.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int networking_set_batch_size(Networking_Core *net, uint16_t batch_size);
+
+typedef struct {
+    /* Whether queued datagrams are handed to the kernel to segment. */
+    bool segmentation;
+    /* Queued datagrams sent. */
+    uint64_t datagrams;
+    /* Queued datagrams sent in segmented buffers. */
+    uint64_t segmented;
+    /* Queued datagrams sent one by one after their segmented buffer failed. */
+    uint64_t resent;
+    /* Datagrams of other threads sent straight away. */
+    uint64_t direct;
+} Net_Batch_Stats;
+
+/* Copy the counters of the datagrams net sent in batches to stats.
+ *
+ * return false if net sends datagrams one at a time.
+ */
+bool networking_batch_stats(const Networking_Core *net, Net_Batch_Stats *stats);
+
+/* Move the datagrams of net with backend instead of its UDP socket. object is
+ * passed to the functions of backend. A NULL backend restores the socket.
+ */
+void networking_set_backend(Networking_Core *net, const Network_Backend *backend, void *object);
+
 /* Connect a socket to the address specified by the ip_port. */
 int net_connect(Socket sock, IP_Port ip_port);
 
@@ -513,6 +709,31 @@ size_t net_sendto_ip4(Socket sock, const char *buf, size_t n, IP_Port ip_port);
 Networking_Core *new_networking(Logger *log, IP ip, uint16_t port);
 Networking_Core *new_networking_ex(Logger *log, IP ip, uint16_t port_from, uint16_t port_to, unsigned int *error);
 
+/* Initialize networking on a socket with SO_REUSEPORT set, bound to ip and
+ * exactly port (in host byte order).
+ *
+ * Every Networking_Core created this way on the same ip and port gets its own
+ * socket, and the kernel spreads the datagrams of different peers over them.
+ * The datagrams of one peer keep going to the same socket as long as the set
+ * of sockets doesn't change.
+ *
+ * return Networking_Core object if no problems
+ * return NULL if there are problems.
+ *
+ * If error is non NULL it is set to 0 if no issues, 1 if socket related error, 2 if other.
+ */
+Networking_Core *new_networking_reuseport(Logger *log, IP ip, uint16_t port, unsigned int *error);
+
+/* Initialize networking without a socket, moving datagrams with backend.
+ * family is the address family and port the port in host byte order the
+ * backend sends from. object is passed to the functions of backend.
+ *
+ * return Networking_Core object if no problems
+ * return NULL if there are problems.
+ */
+Networking_Core *new_networking_backend(Logger *log, Family family, uint16_t port, const Network_Backend *backend,
+                                        void *object);
+
 /* Function to cleanup networking stuff (doesn't do much right now). */
 void kill_networking(Networking_Core *net);
 
@@ -46,6 +46,7 @@
 
 #include "onion.h"
 
+#include "packet_buf.h"
 #include "util.h"
 
 #define RETURN_1 ONION_RETURN_1
@@ -61,9 +62,9 @@
 #define KEY_REFRESH_INTERVAL (2 * 60 * 60)
 static void change_symmetric_key(Onion *onion)
 {
-    if (is_timeout(onion->timestamp, KEY_REFRESH_INTERVAL)) {
+    if (!onion->external_key && mono_time_is_timeout(onion->mono_time, onion->timestamp, KEY_REFRESH_INTERVAL)) {
         new_symmetric_key(onion->secret_symmetric_key);
-        onion->timestamp = unix_time();
+        onion->timestamp = mono_time_get(onion->mono_time);
     }
 }
 
@@ -344,34 +345,54 @@ int send_onion_response(Networking_Core *net, IP_Port dest, const uint8_t *data,
     return 0;
 }
 
-static int handle_send_initial(void *object, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata)
+/* Turn buf into the packet for the next hop and send it to send_to: a header
+ * of packet_id and nonce, unless nonce is NULL, in front of the data_len bytes
+ * of data, followed by ret_data encrypted with our symmetric key. data must
+ * point into buf, far enough from its start to leave room for the header.
+ *
+ * return 0 on success.
+ * return 1 on failure.
+ */
+static int forward_onion_layer(const Onion *onion, Packet_Buf *buf, IP_Port send_to, uint8_t packet_id,
+                               const uint8_t *nonce, const uint8_t *data, uint16_t data_len,
+                               const uint8_t *ret_data, uint16_t ret_data_len)
 {
-    Onion *onion = (Onion *)object;
+    const uint16_t header_len = nonce ? 1 + CRYPTO_NONCE_SIZE : 0;
+    uint8_t *packet = packet_buf_set_data(buf, data - header_len, header_len + data_len);
 
-    if (length > ONION_MAX_PACKET_SIZE) {
+    if (packet == NULL) {
         return 1;
     }
 
-    if (length <= 1 + SEND_1) {
+    if (nonce) {
+        packet[0] = packet_id;
+        memmove(packet + 1, nonce, CRYPTO_NONCE_SIZE);
+    }
+
+    uint8_t *ret_part = packet_buf_put(buf, CRYPTO_NONCE_SIZE + ret_data_len + CRYPTO_MAC_SIZE);
+
+    if (ret_part == NULL) {
         return 1;
     }
 
-    change_symmetric_key(onion);
+    random_nonce(ret_part);
+    const int len = encrypt_data_symmetric(onion->secret_symmetric_key, ret_part, ret_data, ret_data_len,
+                                           ret_part + CRYPTO_NONCE_SIZE);
 
-    uint8_t plain[ONION_MAX_PACKET_SIZE];
-    uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
-    get_shared_key(&onion->shared_keys_1, shared_key, onion->dht->self_secret_key, packet + 1 + CRYPTO_NONCE_SIZE);
-    int len = decrypt_data_symmetric(shared_key, packet + 1, packet + 1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE,
-                                     length - (1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE), plain);
+    if (len != ret_data_len + CRYPTO_MAC_SIZE) {
+        return 1;
+    }
 
-    if (len != length - (1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_MAC_SIZE)) {
+    if (sendpacket_buf(onion->net, send_to, buf) != packet_buf_length(buf)) {
         return 1;
     }
 
-    return onion_send_1(onion, plain, len, source, packet + 1);
+    return 0;
 }
 
-int onion_send_1(const Onion *onion, const uint8_t *plain, uint16_t len, IP_Port source, const uint8_t *nonce)
+/* Like onion_send_1, with plain pointing into buf. */
+static int onion_send_1_buf(const Onion *onion, Packet_Buf *buf, const uint8_t *plain, uint16_t len, IP_Port source,
+                            const uint8_t *nonce)
 {
     if (len > ONION_MAX_PACKET_SIZE + SIZE_IPPORT - (1 + CRYPTO_NONCE_SIZE + ONION_RETURN_1)) {
         return 1;
@@ -390,32 +411,71 @@ int onion_send_1(const Onion *onion, const uint8_t *plain, uint16_t len, IP_Port
     uint8_t ip_port[SIZE_IPPORT];
     ipport_pack(ip_port, &source);
 
-    ELASTOS_VLA(uint8_t, data, ONION_MAX_PACKET_SIZE);
-    data[0] = NET_PACKET_ONION_SEND_1;
-    memcpy(data + 1, nonce, CRYPTO_NONCE_SIZE);
-    memcpy(data + 1 + CRYPTO_NONCE_SIZE, plain + SIZE_IPPORT, len - SIZE_IPPORT);
-    uint16_t data_len = 1 + CRYPTO_NONCE_SIZE + (len - SIZE_IPPORT);
-    uint8_t *ret_part = data + data_len;
-    random_nonce(ret_part);
-    len = encrypt_data_symmetric(onion->secret_symmetric_key, ret_part, ip_port, SIZE_IPPORT,
-                                 ret_part + CRYPTO_NONCE_SIZE);
+    return forward_onion_layer(onion, buf, send_to, NET_PACKET_ONION_SEND_1, nonce, plain + SIZE_IPPORT,
+                               len - SIZE_IPPORT, ip_port, sizeof(ip_port));
+}
+
+static int handle_parked_send_initial(void *object, IP_Port source, const uint8_t *packet, uint16_t length,
+                                      void *userdata);
+static int handle_parked_send_1(void *object, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata);
+static int handle_parked_send_2(void *object, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata);
+
+/* The relay handlers below decrypt and forward the packet in its receive
+ * buffer: every layer is decrypted where it is, and the header and return data
+ * of the next hop are written around it.
+ */
+static int handle_send_initial(void *object, IP_Port source, Packet_Buf *buf, void *userdata)
+{
+    Onion *onion = (Onion *)object;
+    uint8_t *packet = packet_buf_data(buf);
+    const uint16_t length = packet_buf_length(buf);
 
-    if (len != SIZE_IPPORT + CRYPTO_MAC_SIZE) {
+    if (length > ONION_MAX_PACKET_SIZE) {
+        return 1;
+    }
+
+    if (length <= 1 + SEND_1) {
         return 1;
     }
 
-    data_len += CRYPTO_NONCE_SIZE + len;
+    change_symmetric_key(onion);
+
+    uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
 
-    if ((uint32_t)sendpacket(onion->net, send_to, data, data_len) != data_len) {
+    if (DHT_get_shared_key_async(onion->dht, &onion->shared_keys_1, shared_key, packet + 1 + CRYPTO_NONCE_SIZE,
+                                 source, packet, length, &handle_parked_send_initial, onion) != 0) {
+        return 0;
+    }
+
+    uint8_t *plain = packet + 1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE;
+    int len = decrypt_data_symmetric(shared_key, packet + 1, plain,
+                                     length - (1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE), plain);
+
+    if (len != length - (1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_MAC_SIZE)) {
         return 1;
     }
 
-    return 0;
+    return onion_send_1_buf(onion, buf, plain, len, source, packet + 1);
+}
+
+int onion_send_1(const Onion *onion, const uint8_t *plain, uint16_t len, IP_Port source, const uint8_t *nonce)
+{
+    Packet_Buf *buf = packet_buf_from_data(onion->net->packet_pool, plain, len);
+
+    if (buf == NULL) {
+        return 1;
+    }
+
+    const int ret = onion_send_1_buf(onion, buf, packet_buf_data(buf), len, source, nonce);
+    packet_buf_unref(buf);
+    return ret;
 }
 
-static int handle_send_1(void *object, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata)
+static int handle_send_1(void *object, IP_Port source, Packet_Buf *buf, void *userdata)
 {
     Onion *onion = (Onion *)object;
+    uint8_t *packet = packet_buf_data(buf);
+    const uint16_t length = packet_buf_length(buf);
 
     if (length > ONION_MAX_PACKET_SIZE) {
         return 1;
@@ -427,51 +487,40 @@ static int handle_send_1(void *object, IP_Port source, const uint8_t *packet, ui
 
     change_symmetric_key(onion);
 
-    uint8_t plain[ONION_MAX_PACKET_SIZE];
     uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
-    get_shared_key(&onion->shared_keys_2, shared_key, onion->dht->self_secret_key, packet + 1 + CRYPTO_NONCE_SIZE);
-    int len = decrypt_data_symmetric(shared_key, packet + 1, packet + 1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE,
-                                     length - (1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE + RETURN_1), plain);
-
-    if (len != length - (1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE + RETURN_1 + CRYPTO_MAC_SIZE)) {
-        return 1;
-    }
-
-    IP_Port send_to;
 
-    if (ipport_unpack(&send_to, plain, len, 0) == -1) {
-        return 1;
+    if (DHT_get_shared_key_async(onion->dht, &onion->shared_keys_2, shared_key, packet + 1 + CRYPTO_NONCE_SIZE,
+                                 source, packet, length, &handle_parked_send_1, onion) != 0) {
+        return 0;
     }
 
-    ELASTOS_VLA(uint8_t, data, ONION_MAX_PACKET_SIZE);
-    data[0] = NET_PACKET_ONION_SEND_2;
-    memcpy(data + 1, packet + 1, CRYPTO_NONCE_SIZE);
-    memcpy(data + 1 + CRYPTO_NONCE_SIZE, plain + SIZE_IPPORT, len - SIZE_IPPORT);
-    uint16_t data_len = 1 + CRYPTO_NONCE_SIZE + (len - SIZE_IPPORT);
-    uint8_t *ret_part = data + data_len;
-    random_nonce(ret_part);
     uint8_t ret_data[RETURN_1 + SIZE_IPPORT];
     ipport_pack(ret_data, &source);
     memcpy(ret_data + SIZE_IPPORT, packet + (length - RETURN_1), RETURN_1);
-    len = encrypt_data_symmetric(onion->secret_symmetric_key, ret_part, ret_data, sizeof(ret_data),
-                                 ret_part + CRYPTO_NONCE_SIZE);
 
-    if (len != RETURN_2 - CRYPTO_NONCE_SIZE) {
+    uint8_t *plain = packet + 1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE;
+    int len = decrypt_data_symmetric(shared_key, packet + 1, plain,
+                                     length - (1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE + RETURN_1), plain);
+
+    if (len != length - (1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE + RETURN_1 + CRYPTO_MAC_SIZE)) {
         return 1;
     }
 
-    data_len += CRYPTO_NONCE_SIZE + len;
+    IP_Port send_to;
 
-    if ((uint32_t)sendpacket(onion->net, send_to, data, data_len) != data_len) {
+    if (ipport_unpack(&send_to, plain, len, 0) == -1) {
         return 1;
     }
 
-    return 0;
+    return forward_onion_layer(onion, buf, send_to, NET_PACKET_ONION_SEND_2, packet + 1, plain + SIZE_IPPORT,
+                               len - SIZE_IPPORT, ret_data, sizeof(ret_data));
 }
 
-static int handle_send_2(void *object, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata)
+static int handle_send_2(void *object, IP_Port source, Packet_Buf *buf, void *userdata)
 {
     Onion *onion = (Onion *)object;
+    uint8_t *packet = packet_buf_data(buf);
+    const uint16_t length = packet_buf_length(buf);
 
     if (length > ONION_MAX_PACKET_SIZE) {
         return 1;
@@ -483,66 +532,82 @@ static int handle_send_2(void *object, IP_Port source, const uint8_t *packet, ui
 
     change_symmetric_key(onion);
 
-    uint8_t plain[ONION_MAX_PACKET_SIZE];
     uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
-    get_shared_key(&onion->shared_keys_3, shared_key, onion->dht->self_secret_key, packet + 1 + CRYPTO_NONCE_SIZE);
-    int len = decrypt_data_symmetric(shared_key, packet + 1, packet + 1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE,
-                                     length - (1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE + RETURN_2), plain);
-
-    if (len != length - (1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE + RETURN_2 + CRYPTO_MAC_SIZE)) {
-        return 1;
-    }
-
-    IP_Port send_to;
 
-    if (ipport_unpack(&send_to, plain, len, 0) == -1) {
-        return 1;
+    if (DHT_get_shared_key_async(onion->dht, &onion->shared_keys_3, shared_key, packet + 1 + CRYPTO_NONCE_SIZE,
+                                 source, packet, length, &handle_parked_send_2, onion) != 0) {
+        return 0;
     }
 
-    ELASTOS_VLA(uint8_t, data, ONION_MAX_PACKET_SIZE);
-    memcpy(data, plain + SIZE_IPPORT, len - SIZE_IPPORT);
-    uint16_t data_len = (len - SIZE_IPPORT);
-    uint8_t *ret_part = data + (len - SIZE_IPPORT);
-    random_nonce(ret_part);
     uint8_t ret_data[RETURN_2 + SIZE_IPPORT];
     ipport_pack(ret_data, &source);
     memcpy(ret_data + SIZE_IPPORT, packet + (length - RETURN_2), RETURN_2);
-    len = encrypt_data_symmetric(onion->secret_symmetric_key, ret_part, ret_data, sizeof(ret_data),
-                                 ret_part + CRYPTO_NONCE_SIZE);
 
-    if (len != RETURN_3 - CRYPTO_NONCE_SIZE) {
+    uint8_t *plain = packet + 1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE;
+    int len = decrypt_data_symmetric(shared_key, packet + 1, plain,
+                                     length - (1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE + RETURN_2), plain);
+
+    if (len != length - (1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE + RETURN_2 + CRYPTO_MAC_SIZE)) {
         return 1;
     }
 
-    data_len += RETURN_3;
+    IP_Port send_to;
 
-    if ((uint32_t)sendpacket(onion->net, send_to, data, data_len) != data_len) {
+    if (ipport_unpack(&send_to, plain, len, 0) == -1) {
         return 1;
     }
 
-    return 0;
+    return forward_onion_layer(onion, buf, send_to, 0, NULL, plain + SIZE_IPPORT, len - SIZE_IPPORT,
+                               ret_data, sizeof(ret_data));
 }
 
-
-static int handle_recv_3(void *object, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata)
+/* Packets parked by DHT_get_shared_key_async come back as plain data. */
+static int handle_parked(Onion *onion, IP_Port source, const uint8_t *packet, uint16_t length,
+                         packet_buf_handler_callback handler)
 {
-    Onion *onion = (Onion *)object;
+    Packet_Buf *buf = packet_buf_from_data(onion->net->packet_pool, packet, length);
 
-    if (length > ONION_MAX_PACKET_SIZE) {
+    if (buf == NULL) {
         return 1;
     }
 
-    if (length <= 1 + RETURN_3) {
-        return 1;
-    }
+    const int ret = handler(onion, source, buf, NULL);
+    packet_buf_unref(buf);
+    return ret;
+}
 
-    change_symmetric_key(onion);
+static int handle_parked_send_initial(void *object, IP_Port source, const uint8_t *packet, uint16_t length,
+                                      void *userdata)
+{
+    return handle_parked((Onion *)object, source, packet, length, &handle_send_initial);
+}
+
+static int handle_parked_send_1(void *object, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata)
+{
+    return handle_parked((Onion *)object, source, packet, length, &handle_send_1);
+}
+
+static int handle_parked_send_2(void *object, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata)
+{
+    return handle_parked((Onion *)object, source, packet, length, &handle_send_2);
+}
 
+/* Replace the first 1 + ret_len_in bytes of the response in buf, its packet id and
+ * encrypted return data, by packet_id and the return data of the next hop, and
+ * send it there.
+ *
+ * return 0 on success.
+ * return 1 on failure.
+ */
+static int forward_onion_response(const Onion *onion, Packet_Buf *buf, uint8_t packet_id, uint16_t ret_len_in,
+                                  uint16_t ret_len_out)
+{
+    const uint8_t *packet = packet_buf_data(buf);
     uint8_t plain[SIZE_IPPORT + RETURN_2];
-    int len = decrypt_data_symmetric(onion->secret_symmetric_key, packet + 1, packet + 1 + CRYPTO_NONCE_SIZE,
-                                     SIZE_IPPORT + RETURN_2 + CRYPTO_MAC_SIZE, plain);
+    const int len = decrypt_data_symmetric(onion->secret_symmetric_key, packet + 1, packet + 1 + CRYPTO_NONCE_SIZE,
+                                           SIZE_IPPORT + ret_len_out + CRYPTO_MAC_SIZE, plain);
 
-    if ((uint32_t)len != sizeof(plain)) {
+    if (len != SIZE_IPPORT + ret_len_out) {
         return 1;
     }
 
@@ -552,63 +617,63 @@ static int handle_recv_3(void *object, IP_Port source, const uint8_t *packet, ui
         return 1;
     }
 
-    ELASTOS_VLA(uint8_t, data, ONION_MAX_PACKET_SIZE);
-    data[0] = NET_PACKET_ONION_RECV_2;
-    memcpy(data + 1, plain + SIZE_IPPORT, RETURN_2);
-    memcpy(data + 1 + RETURN_2, packet + 1 + RETURN_3, length - (1 + RETURN_3));
-    uint16_t data_len = 1 + RETURN_2 + (length - (1 + RETURN_3));
+    uint8_t *data = packet_buf_pull(buf, (1 + ret_len_in) - (1 + ret_len_out));
+
+    if (data == NULL) {
+        return 1;
+    }
+
+    data[0] = packet_id;
+    memcpy(data + 1, plain + SIZE_IPPORT, ret_len_out);
 
-    if ((uint32_t)sendpacket(onion->net, send_to, data, data_len) != data_len) {
+    if (sendpacket_buf(onion->net, send_to, buf) != packet_buf_length(buf)) {
         return 1;
     }
 
     return 0;
 }
 
-static int handle_recv_2(void *object, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata)
+static int handle_recv_3(void *object, IP_Port source, Packet_Buf *buf, void *userdata)
 {
     Onion *onion = (Onion *)object;
+    const uint16_t length = packet_buf_length(buf);
 
     if (length > ONION_MAX_PACKET_SIZE) {
         return 1;
     }
 
-    if (length <= 1 + RETURN_2) {
+    if (length <= 1 + RETURN_3) {
         return 1;
     }
 
     change_symmetric_key(onion);
 
-    uint8_t plain[SIZE_IPPORT + RETURN_1];
-    int len = decrypt_data_symmetric(onion->secret_symmetric_key, packet + 1, packet + 1 + CRYPTO_NONCE_SIZE,
-                                     SIZE_IPPORT + RETURN_1 + CRYPTO_MAC_SIZE, plain);
-
-    if ((uint32_t)len != sizeof(plain)) {
-        return 1;
-    }
+    return forward_onion_response(onion, buf, NET_PACKET_ONION_RECV_2, RETURN_3, RETURN_2);
+}
 
-    IP_Port send_to;
+static int handle_recv_2(void *object, IP_Port source, Packet_Buf *buf, void *userdata)
+{
+    Onion *onion = (Onion *)object;
+    const uint16_t length = packet_buf_length(buf);
 
-    if (ipport_unpack(&send_to, plain, len, 0) == -1) {
+    if (length > ONION_MAX_PACKET_SIZE) {
         return 1;
     }
 
-    ELASTOS_VLA(uint8_t, data, ONION_MAX_PACKET_SIZE);
-    data[0] = NET_PACKET_ONION_RECV_1;
-    memcpy(data + 1, plain + SIZE_IPPORT, RETURN_1);
-    memcpy(data + 1 + RETURN_1, packet + 1 + RETURN_2, length - (1 + RETURN_2));
-    uint16_t data_len = 1 + RETURN_1 + (length - (1 + RETURN_2));
-
-    if ((uint32_t)sendpacket(onion->net, send_to, data, data_len) != data_len) {
+    if (length <= 1 + RETURN_2) {
         return 1;
     }
 
-    return 0;
+    change_symmetric_key(onion);
+
+    return forward_onion_response(onion, buf, NET_PACKET_ONION_RECV_1, RETURN_2, RETURN_1);
 }
 
-static int handle_recv_1(void *object, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata)
+static int handle_recv_1(void *object, IP_Port source, Packet_Buf *buf, void *userdata)
 {
     Onion *onion = (Onion *)object;
+    const uint8_t *packet = packet_buf_data(buf);
+    const uint16_t length = packet_buf_length(buf);
 
     if (length > ONION_MAX_PACKET_SIZE) {
         return 1;
@@ -640,7 +705,9 @@ static int handle_recv_1(void *object, IP_Port source, const uint8_t *packet, ui
         return onion->recv_1_function(onion->callback_object, send_to, packet + (1 + RETURN_1), data_len);
     }
 
-    if ((uint32_t)sendpacket(onion->net, send_to, packet + (1 + RETURN_1), data_len) != data_len) {
+    packet_buf_pull(buf, 1 + RETURN_1);
+
+    if ((uint32_t)sendpacket_buf(onion->net, send_to, buf) != data_len) {
         return 1;
     }
 
@@ -653,7 +720,7 @@ void set_callback_handle_recv_1(Onion *onion, int (*function)(void *, IP_Port, c
     onion->callback_object = object;
 }
 
-Onion *new_onion(DHT *dht)
+Onion *new_onion(const Mono_Time *mono_time, DHT *dht)
 {
     if (dht == NULL) {
         return NULL;
@@ -665,22 +732,45 @@ Onion *new_onion(DHT *dht)
         return NULL;
     }
 
+    onion->mono_time = mono_time;
     onion->dht = dht;
     onion->net = dht->net;
     new_symmetric_key(onion->secret_symmetric_key);
-    onion->timestamp = unix_time();
+    onion->timestamp = mono_time_get(onion->mono_time);
+
+    if (shared_keys_init(&onion->shared_keys_1, SHARED_KEYS_DEFAULT_SIZE) == -1
+            || shared_keys_init(&onion->shared_keys_2, SHARED_KEYS_DEFAULT_SIZE) == -1
+            || shared_keys_init(&onion->shared_keys_3, SHARED_KEYS_DEFAULT_SIZE) == -1) {
+        shared_keys_free(&onion->shared_keys_1);
+        shared_keys_free(&onion->shared_keys_2);
+        shared_keys_free(&onion->shared_keys_3);
+        free(onion);
+        return NULL;
+    }
 
-    networking_registerhandler(onion->net, NET_PACKET_ONION_SEND_INITIAL, &handle_send_initial, onion);
-    networking_registerhandler(onion->net, NET_PACKET_ONION_SEND_1, &handle_send_1, onion);
-    networking_registerhandler(onion->net, NET_PACKET_ONION_SEND_2, &handle_send_2, onion);
+    networking_registerhandler_buf(onion->net, NET_PACKET_ONION_SEND_INITIAL, &handle_send_initial, onion);
+    networking_registerhandler_buf(onion->net, NET_PACKET_ONION_SEND_1, &handle_send_1, onion);
+    networking_registerhandler_buf(onion->net, NET_PACKET_ONION_SEND_2, &handle_send_2, onion);
 
-    networking_registerhandler(onion->net, NET_PACKET_ONION_RECV_3, &handle_recv_3, onion);
-    networking_registerhandler(onion->net, NET_PACKET_ONION_RECV_2, &handle_recv_2, onion);
-    networking_registerhandler(onion->net, NET_PACKET_ONION_RECV_1, &handle_recv_1, onion);
+    networking_registerhandler_buf(onion->net, NET_PACKET_ONION_RECV_3, &handle_recv_3, onion);
+    networking_registerhandler_buf(onion->net, NET_PACKET_ONION_RECV_2, &handle_recv_2, onion);
+    networking_registerhandler_buf(onion->net, NET_PACKET_ONION_RECV_1, &handle_recv_1, onion);
 
     return onion;
 }
 
+int onion_set_shared_keys_size(Onion *onion, uint32_t size)
+{
+    Shared_Keys *const caches[] = { &onion->shared_keys_1, &onion->shared_keys_2, &onion->shared_keys_3 };
+    return shared_keys_resize_all(caches, sizeof(caches) / sizeof(caches[0]), size);
+}
+
+void onion_set_symmetric_key(Onion *onion, const uint8_t *key)
+{
+    memcpy(onion->secret_symmetric_key, key, CRYPTO_SYMMETRIC_KEY_SIZE);
+    onion->external_key = true;
+}
+
 void kill_onion(Onion *onion)
 {
     if (onion == NULL) {
@@ -695,5 +785,9 @@ void kill_onion(Onion *onion)
     networking_registerhandler(onion->net, NET_PACKET_ONION_RECV_2, NULL, NULL);
     networking_registerhandler(onion->net, NET_PACKET_ONION_RECV_1, NULL, NULL);
 
+    DHT_drop_parked_packets(onion->dht, onion);
+    shared_keys_free(&onion->shared_keys_1);
+    shared_keys_free(&onion->shared_keys_2);
+    shared_keys_free(&onion->shared_keys_3);
     free(onion);
 }
@@ -27,10 +27,13 @@
 #include "DHT.h"
 
 typedef struct {
+    const Mono_Time *mono_time;
     DHT     *dht;
     Networking_Core *net;
     uint8_t secret_symmetric_key[CRYPTO_SYMMETRIC_KEY_SIZE];
     uint64_t timestamp;
+    /* The key was set with onion_set_symmetric_key() and is never refreshed. */
+    bool external_key;
 
     Shared_Keys shared_keys_1;
     Shared_Keys shared_keys_2;
@@ -157,7 +160,21 @@ int onion_send_1(const Onion *onion, const uint8_t *plain, uint16_t len, IP_Port
 void set_callback_handle_recv_1(Onion *onion, int (*function)(void *, IP_Port, const uint8_t *, uint16_t),
                                 void *object);
 
-Onion *new_onion(DHT *dht);
+Onion *new_onion(const Mono_Time *mono_time, DHT *dht);
+
+/* Make the shared key caches of the three onion layers hold at least size
+ * keys each. The keys already cached are dropped.
+ *
+ * return 0 on success.
+ * return -1 on failure, the caches are left as they were.
+ */
+int onion_set_shared_keys_size(Onion *onion, uint32_t size);
+
+/* Encrypt the return paths with key instead of a key that is refreshed every
+ * two hours. Meant for onions that must decrypt the return paths of another
+ * one, whose owner passes its key on whenever it changes.
+ */
+void onion_set_symmetric_key(Onion *onion, const uint8_t *key);
 
 void kill_onion(Onion *onion);
 
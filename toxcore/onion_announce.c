@@ -47,6 +47,7 @@
 #include "onion_announce.h"
 
 #include "LAN_discovery.h"
+#include "distance.h"
 #include "util.h"
 
 #define PING_ID_TIMEOUT 20
@@ -243,7 +244,7 @@ static int in_entries(const Onion_Announce *onion_a, const uint8_t *public_key)
     unsigned int i;
 
     for (i = 0; i < ONION_ANNOUNCE_MAX_ENTRIES; ++i) {
-        if (!is_timeout(onion_a->entries[i].time, ONION_ANNOUNCE_TIMEOUT)
+        if (!mono_time_is_timeout(onion_a->mono_time, onion_a->entries[i].time, ONION_ANNOUNCE_TIMEOUT)
                 && public_key_cmp(onion_a->entries[i].public_key, public_key) == 0) {
             return i;
         }
@@ -253,6 +254,7 @@ static int in_entries(const Onion_Announce *onion_a, const uint8_t *public_key)
 }
 
 typedef struct {
+    const Mono_Time *mono_time;
     const uint8_t *base_public_key;
     Onion_Announce_Entry entry;
 } Cmp_data;
@@ -266,8 +268,8 @@ static int cmp_entry(const void *a, const void *b)
     Onion_Announce_Entry entry2 = cmp2.entry;
     const uint8_t *cmp_public_key = cmp1.base_public_key;
 
-    int t1 = is_timeout(entry1.time, ONION_ANNOUNCE_TIMEOUT);
-    int t2 = is_timeout(entry2.time, ONION_ANNOUNCE_TIMEOUT);
+    int t1 = mono_time_is_timeout(cmp1.mono_time, entry1.time, ONION_ANNOUNCE_TIMEOUT);
+    int t2 = mono_time_is_timeout(cmp1.mono_time, entry2.time, ONION_ANNOUNCE_TIMEOUT);
 
     if (t1 && t2) {
         return 0;
@@ -281,26 +283,19 @@ static int cmp_entry(const void *a, const void *b)
         return 1;
     }
 
-    int close = id_closest(cmp_public_key, entry1.public_key, entry2.public_key);
-
-    if (close == 1) {
-        return 1;
-    }
-
-    if (close == 2) {
-        return -1;
-    }
-
-    return 0;
+    /* Closest entries sort last. */
+    return -pk_distance_cmp(cmp_public_key, entry1.public_key, entry2.public_key);
 }
 
-static void sort_onion_announce_list(Onion_Announce_Entry *list, unsigned int length, const uint8_t *comp_public_key)
+static void sort_onion_announce_list(const Mono_Time *mono_time, Onion_Announce_Entry *list, unsigned int length,
+                                     const uint8_t *comp_public_key)
 {
     // Pass comp_public_key to qsort with each Client_data entry, so the
     // comparison function can use it as the base of comparison.
     VLA(Cmp_data, cmp_list, length);
 
     for (uint32_t i = 0; i < length; i++) {
+        cmp_list[i].mono_time = mono_time;
         cmp_list[i].base_public_key = comp_public_key;
         cmp_list[i].entry = list[i];
     }
@@ -327,7 +322,7 @@ static int add_to_entries(Onion_Announce *onion_a, IP_Port ret_ip_port, const ui
 
     if (pos == -1) {
         for (i = 0; i < ONION_ANNOUNCE_MAX_ENTRIES; ++i) {
-            if (is_timeout(onion_a->entries[i].time, ONION_ANNOUNCE_TIMEOUT)) {
+            if (mono_time_is_timeout(onion_a->mono_time, onion_a->entries[i].time, ONION_ANNOUNCE_TIMEOUT)) {
                 pos = i;
             }
         }
@@ -347,9 +342,10 @@ static int add_to_entries(Onion_Announce *onion_a, IP_Port ret_ip_port, const ui
     onion_a->entries[pos].ret_ip_port = ret_ip_port;
     memcpy(onion_a->entries[pos].ret, ret, ONION_RETURN_3);
     memcpy(onion_a->entries[pos].data_public_key, data_public_key, CRYPTO_PUBLIC_KEY_SIZE);
-    onion_a->entries[pos].time = unix_time();
+    onion_a->entries[pos].time = mono_time_get(onion_a->mono_time);
 
-    sort_onion_announce_list(onion_a->entries, ONION_ANNOUNCE_MAX_ENTRIES, onion_a->dht->self_public_key);
+    sort_onion_announce_list(onion_a->mono_time, onion_a->entries, ONION_ANNOUNCE_MAX_ENTRIES,
+                             onion_a->dht->self_public_key);
     return in_entries(onion_a, public_key);
 }
 
@@ -363,7 +359,11 @@ static int handle_announce_request(void *object, IP_Port source, const uint8_t *
 
     const uint8_t *packet_public_key = packet + 1 + CRYPTO_NONCE_SIZE;
     uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
-    get_shared_key(&onion_a->shared_keys_recv, shared_key, onion_a->dht->self_secret_key, packet_public_key);
+
+    if (DHT_get_shared_key_async(onion_a->dht, &onion_a->shared_keys_recv, shared_key, packet_public_key, source,
+                                 packet, length, &handle_announce_request, onion_a) != 0) {
+        return 0;
+    }
 
     uint8_t plain[ONION_PING_ID_SIZE + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_PUBLIC_KEY_SIZE +
                   ONION_ANNOUNCE_SENDBACK_DATA_LENGTH];
@@ -376,10 +376,10 @@ static int handle_announce_request(void *object, IP_Port source, const uint8_t *
     }
 
     uint8_t ping_id1[ONION_PING_ID_SIZE];
-    generate_ping_id(onion_a, unix_time(), packet_public_key, source, ping_id1);
+    generate_ping_id(onion_a, mono_time_get(onion_a->mono_time), packet_public_key, source, ping_id1);
 
     uint8_t ping_id2[ONION_PING_ID_SIZE];
-    generate_ping_id(onion_a, unix_time() + PING_ID_TIMEOUT, packet_public_key, source, ping_id2);
+    generate_ping_id(onion_a, mono_time_get(onion_a->mono_time) + PING_ID_TIMEOUT, packet_public_key, source, ping_id2);
 
     int index = -1;
 
@@ -482,7 +482,7 @@ static int handle_data_request(void *object, IP_Port source, const uint8_t *pack
     return 0;
 }
 
-Onion_Announce *new_onion_announce(DHT *dht)
+Onion_Announce *new_onion_announce(const Mono_Time *mono_time, DHT *dht)
 {
     if (dht == NULL) {
         return NULL;
@@ -494,16 +494,27 @@ Onion_Announce *new_onion_announce(DHT *dht)
         return NULL;
     }
 
+    onion_a->mono_time = mono_time;
     onion_a->dht = dht;
     onion_a->net = dht->net;
     new_symmetric_key(onion_a->secret_bytes);
 
+    if (shared_keys_init(&onion_a->shared_keys_recv, SHARED_KEYS_DEFAULT_SIZE) == -1) {
+        free(onion_a);
+        return NULL;
+    }
+
     networking_registerhandler(onion_a->net, NET_PACKET_ANNOUNCE_REQUEST, &handle_announce_request, onion_a);
     networking_registerhandler(onion_a->net, NET_PACKET_ONION_DATA_REQUEST, &handle_data_request, onion_a);
 
     return onion_a;
 }
 
+int onion_announce_set_shared_keys_size(Onion_Announce *onion_a, uint32_t size)
+{
+    return shared_keys_resize(&onion_a->shared_keys_recv, size);
+}
+
 void kill_onion_announce(Onion_Announce *onion_a)
 {
     if (onion_a == NULL) {
@@ -512,5 +523,7 @@ void kill_onion_announce(Onion_Announce *onion_a)
 
     networking_registerhandler(onion_a->net, NET_PACKET_ANNOUNCE_REQUEST, NULL, NULL);
     networking_registerhandler(onion_a->net, NET_PACKET_ONION_DATA_REQUEST, NULL, NULL);
+    DHT_drop_parked_packets(onion_a->dht, onion_a);
+    shared_keys_free(&onion_a->shared_keys_recv);
     free(onion_a);
 }
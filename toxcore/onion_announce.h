@@ -55,6 +55,7 @@ typedef struct {
 } Onion_Announce_Entry;
 
 typedef struct {
+    const Mono_Time *mono_time;
     DHT     *dht;
     Networking_Core *net;
     Onion_Announce_Entry entries[ONION_ANNOUNCE_MAX_ENTRIES];
@@ -132,7 +133,15 @@ int send_data_request(Networking_Core *net, const Onion_Path *path, IP_Port dest
                       const uint8_t *encrypt_public_key, const uint8_t *nonce, const uint8_t *data, uint16_t length);
 
 
-Onion_Announce *new_onion_announce(DHT *dht);
+Onion_Announce *new_onion_announce(const Mono_Time *mono_time, DHT *dht);
+
+/* Make the shared key cache of announce requests hold at least size keys.
+ * The keys already cached are dropped.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int onion_announce_set_shared_keys_size(Onion_Announce *onion_a, uint32_t size);
 
 void kill_onion_announce(Onion_Announce *onion_a);
 
@@ -136,6 +136,7 @@ typedef int (*oniondata_handler_callback)(void *object, const uint8_t *source_pu
         uint16_t len, void *userdata);
 
 typedef struct {
+    const Mono_Time *mono_time;
     DHT     *dht;
     Net_Crypto *c;
     Networking_Core *net;
@@ -288,7 +289,7 @@ void oniondata_registerhandler(Onion_Client *onion_c, uint8_t byte, oniondata_ha
 
 void do_onion_client(Onion_Client *onion_c);
 
-Onion_Client *new_onion_client(Net_Crypto *c);
+Onion_Client *new_onion_client(const Mono_Time *mono_time, Net_Crypto *c);
 
 void kill_onion_client(Onion_Client *onion_c);
 
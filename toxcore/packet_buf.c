@@ -0,0 +1,239 @@
+/*
+ * Pooled, reference counted packet buffers.
+ */
+
+/*
+ * Copyright © 2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "packet_buf.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct Packet_Pool {
+    Packet_Buf *free_list;
+    uint32_t num_free;
+    uint32_t max_free;
+
+    /* Buffers taken from the pool and not returned yet. A killed pool is
+     * freed once they are all back. */
+    uint32_t num_used;
+    bool killed;
+};
+
+Packet_Pool *new_packet_pool(uint32_t max_free)
+{
+    Packet_Pool *pool = (Packet_Pool *)calloc(1, sizeof(Packet_Pool));
+
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    pool->max_free = max_free;
+    return pool;
+}
+
+static void free_unused_buffers(Packet_Pool *pool)
+{
+    while (pool->free_list != NULL) {
+        Packet_Buf *buf = pool->free_list;
+        pool->free_list = buf->next_free;
+        free(buf);
+    }
+
+    pool->num_free = 0;
+}
+
+void kill_packet_pool(Packet_Pool *pool)
+{
+    if (pool == NULL) {
+        return;
+    }
+
+    free_unused_buffers(pool);
+
+    if (pool->num_used == 0) {
+        free(pool);
+        return;
+    }
+
+    pool->killed = true;
+}
+
+Packet_Buf *packet_buf_new(Packet_Pool *pool, uint16_t headroom)
+{
+    if (headroom > PACKET_BUF_SIZE) {
+        return NULL;
+    }
+
+    Packet_Buf *buf = pool->free_list;
+
+    if (buf != NULL) {
+        pool->free_list = buf->next_free;
+        --pool->num_free;
+    } else {
+        buf = (Packet_Buf *)malloc(sizeof(Packet_Buf));
+
+        if (buf == NULL) {
+            return NULL;
+        }
+
+        buf->pool = pool;
+    }
+
+    buf->next_free = NULL;
+    buf->refs = 1;
+    buf->head = headroom;
+    buf->length = 0;
+    ++pool->num_used;
+    return buf;
+}
+
+Packet_Buf *packet_buf_from_data(Packet_Pool *pool, const uint8_t *data, uint16_t length)
+{
+    Packet_Buf *buf = packet_buf_new(pool, PACKET_BUF_HEADROOM);
+
+    if (buf == NULL) {
+        return NULL;
+    }
+
+    uint8_t *dest = packet_buf_put(buf, length);
+
+    if (dest == NULL) {
+        packet_buf_unref(buf);
+        return NULL;
+    }
+
+    memcpy(dest, data, length);
+    return buf;
+}
+
+Packet_Buf *packet_buf_ref(Packet_Buf *buf)
+{
+    ++buf->refs;
+    return buf;
+}
+
+void packet_buf_unref(Packet_Buf *buf)
+{
+    if (buf == NULL || --buf->refs > 0) {
+        return;
+    }
+
+    Packet_Pool *pool = buf->pool;
+    --pool->num_used;
+
+    if (pool->killed) {
+        free(buf);
+
+        if (pool->num_used == 0) {
+            free(pool);
+        }
+
+        return;
+    }
+
+    if (pool->num_free >= pool->max_free) {
+        free(buf);
+        return;
+    }
+
+    buf->next_free = pool->free_list;
+    pool->free_list = buf;
+    ++pool->num_free;
+}
+
+uint8_t *packet_buf_data(const Packet_Buf *buf)
+{
+    return (uint8_t *)buf->buffer + buf->head;
+}
+
+uint16_t packet_buf_length(const Packet_Buf *buf)
+{
+    return buf->length;
+}
+
+uint16_t packet_buf_headroom(const Packet_Buf *buf)
+{
+    return buf->head;
+}
+
+uint16_t packet_buf_tailroom(const Packet_Buf *buf)
+{
+    return PACKET_BUF_SIZE - (buf->head + buf->length);
+}
+
+uint8_t *packet_buf_push(Packet_Buf *buf, uint16_t length)
+{
+    if (length > buf->head) {
+        return NULL;
+    }
+
+    buf->head -= length;
+    buf->length += length;
+    return packet_buf_data(buf);
+}
+
+uint8_t *packet_buf_pull(Packet_Buf *buf, uint16_t length)
+{
+    if (length > buf->length) {
+        return NULL;
+    }
+
+    buf->head += length;
+    buf->length -= length;
+    return packet_buf_data(buf);
+}
+
+uint8_t *packet_buf_put(Packet_Buf *buf, uint16_t length)
+{
+    if (length > packet_buf_tailroom(buf)) {
+        return NULL;
+    }
+
+    uint8_t *end = packet_buf_data(buf) + buf->length;
+    buf->length += length;
+    return end;
+}
+
+uint8_t *packet_buf_set_data(Packet_Buf *buf, const uint8_t *start, uint16_t length)
+{
+    if (start < buf->buffer || start > buf->buffer + PACKET_BUF_SIZE
+            || length > PACKET_BUF_SIZE - (start - buf->buffer)) {
+        return NULL;
+    }
+
+    buf->head = start - buf->buffer;
+    buf->length = length;
+    return packet_buf_data(buf);
+}
+
+int packet_buf_trim(Packet_Buf *buf, uint16_t length)
+{
+    if (length > buf->length) {
+        return -1;
+    }
+
+    buf->length = length;
+    return 0;
+}
@@ -0,0 +1,132 @@
+/*
+ * Pooled, reference counted packet buffers.
+ *
+ * A received datagram is read into a buffer with free room before and after
+ * it, so that handlers can strip headers, decrypt and add headers in place
+ * and pass the same buffer on instead of copying the packet at every step.
+ */
+
+/*
+ * Copyright © 2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef PACKET_BUF_H
+#define PACKET_BUF_H
+
+#include "network.h"
+
+/* Room in front of a received packet, for headers added when it is passed on. */
+#define PACKET_BUF_HEADROOM 64
+
+/* Room behind a received packet of MAX_UDP_PACKET_SIZE bytes. */
+#define PACKET_BUF_TAILROOM 64
+
+#define PACKET_BUF_SIZE (PACKET_BUF_HEADROOM + MAX_UDP_PACKET_SIZE + PACKET_BUF_TAILROOM)
+
+/* Number of unused buffers a pool keeps for reuse by default. */
+#define PACKET_POOL_DEFAULT_FREE 64
+
+/* The data of a buffer is the length bytes at offset head of buffer. The
+ * buffer goes back to its pool when the last reference is dropped.
+ */
+struct Packet_Buf {
+    Packet_Pool *pool;
+    struct Packet_Buf *next_free;
+    uint32_t refs;
+
+    uint16_t head;
+    uint16_t length;
+    uint8_t buffer[PACKET_BUF_SIZE];
+};
+
+/* A pool is not thread safe: all its buffers must be taken, referenced and
+ * released by the same thread.
+ */
+Packet_Pool *new_packet_pool(uint32_t max_free);
+
+/* Free the pool and its unused buffers. Buffers still referenced are freed
+ * when their last reference is dropped.
+ */
+void kill_packet_pool(Packet_Pool *pool);
+
+/* Take a buffer with one reference and no data, with headroom bytes of room
+ * in front of the data.
+ *
+ * return NULL on failure.
+ */
+Packet_Buf *packet_buf_new(Packet_Pool *pool, uint16_t headroom);
+
+/* Take a buffer holding a copy of the length bytes of data, with
+ * PACKET_BUF_HEADROOM bytes of room in front of it.
+ *
+ * return NULL on failure.
+ */
+Packet_Buf *packet_buf_from_data(Packet_Pool *pool, const uint8_t *data, uint16_t length);
+
+/* Add a reference to buf.
+ *
+ * return buf.
+ */
+Packet_Buf *packet_buf_ref(Packet_Buf *buf);
+
+/* Drop a reference to buf, returning it to its pool if it was the last one.
+ * buf may be NULL.
+ */
+void packet_buf_unref(Packet_Buf *buf);
+
+uint8_t *packet_buf_data(const Packet_Buf *buf);
+uint16_t packet_buf_length(const Packet_Buf *buf);
+uint16_t packet_buf_headroom(const Packet_Buf *buf);
+uint16_t packet_buf_tailroom(const Packet_Buf *buf);
+
+/* Grow the data by length bytes at the front.
+ *
+ * return the new start of the data.
+ * return NULL if there is not enough headroom.
+ */
+uint8_t *packet_buf_push(Packet_Buf *buf, uint16_t length);
+
+/* Remove length bytes from the front of the data.
+ *
+ * return the new start of the data.
+ * return NULL if the data is shorter than length.
+ */
+uint8_t *packet_buf_pull(Packet_Buf *buf, uint16_t length);
+
+/* Grow the data by length bytes at the end.
+ *
+ * return the start of the added bytes.
+ * return NULL if there is not enough tailroom.
+ */
+uint8_t *packet_buf_put(Packet_Buf *buf, uint16_t length);
+
+/* Make the length bytes at start the data of buf. start must point into the
+ * buffer of buf, e.g. into its data.
+ *
+ * return start.
+ * return NULL if the bytes are not all inside the buffer.
+ */
+uint8_t *packet_buf_set_data(Packet_Buf *buf, const uint8_t *start, uint16_t length);
+
+/* Cut the data down to length bytes.
+ *
+ * return 0 on success.
+ * return -1 if the data is shorter than length.
+ */
+int packet_buf_trim(Packet_Buf *buf, uint16_t length);
+
+#endif
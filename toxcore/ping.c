@@ -65,11 +65,13 @@
 
 
 struct PING {
+    const Mono_Time *mono_time;
     DHT *dht;
 
     Ping_Array  ping_array;
     Node_format to_ping[MAX_TO_PING];
     uint64_t    last_to_ping;
+    uint32_t    to_ping_timer;
 };
 
 
@@ -95,7 +97,7 @@ int send_ping_request(PING *ping, IP_Port ipp, const uint8_t *public_key)
     uint8_t data[PING_DATA_SIZE];
     id_copy(data, public_key);
     memcpy(data + CRYPTO_PUBLIC_KEY_SIZE, &ipp, sizeof(IP_Port));
-    ping_id = ping_array_add(&ping->ping_array, data, sizeof(data));
+    ping_id = ping_array_add(&ping->ping_array, ping->mono_time, data, sizeof(data));
 
     if (ping_id == 0) {
         return 1;
@@ -172,7 +174,11 @@ static int handle_ping_request(void *object, IP_Port source, const uint8_t *pack
 
     uint8_t ping_plain[PING_PLAIN_SIZE];
     // Decrypt ping_id
-    DHT_get_shared_key_recv(dht, shared_key, packet + 1);
+    if (DHT_get_shared_key_async(dht, &dht->shared_keys_recv, shared_key, packet + 1, source, packet, length,
+                                 &handle_ping_request, dht) != 0) {
+        return 0;
+    }
+
     rc = decrypt_data_symmetric(shared_key,
                                 packet + 1 + CRYPTO_PUBLIC_KEY_SIZE,
                                 packet + 1 + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_NONCE_SIZE,
@@ -236,7 +242,7 @@ static int handle_ping_response(void *object, IP_Port source, const uint8_t *pac
     memcpy(&ping_id, ping_plain + 1, sizeof(ping_id));
     uint8_t data[PING_DATA_SIZE];
 
-    if (ping_array_check(data, sizeof(data), &ping->ping_array, ping_id) != sizeof(data)) {
+    if (ping_array_check(data, sizeof(data), &ping->ping_array, ping->mono_time, ping_id) != sizeof(data)) {
         return 1;
     }
 
@@ -260,7 +266,8 @@ static int handle_ping_response(void *object, IP_Port source, const uint8_t *pac
  * return 1 if it is.
  * return 0 if it isn't.
  */
-static int in_list(const Client_data *list, uint16_t length, const uint8_t *public_key, IP_Port ip_port)
+static int in_list(const Mono_Time *mono_time, const Client_data *list, uint16_t length, const uint8_t *public_key,
+                   IP_Port ip_port)
 {
     unsigned int i;
 
@@ -274,7 +281,8 @@ static int in_list(const Client_data *list, uint16_t length, const uint8_t *publ
                 ipptp = &list[i].assoc6;
             }
 
-            if (!is_timeout(ipptp->timestamp, BAD_NODE_TIMEOUT) && ipport_equal(&ipptp->ip_port, &ip_port)) {
+            if (!mono_time_is_timeout(mono_time, ipptp->timestamp, BAD_NODE_TIMEOUT)
+                    && ipport_equal(&ipptp->ip_port, &ip_port)) {
                 return 1;
             }
         }
@@ -283,6 +291,47 @@ static int in_list(const Client_data *list, uint16_t length, const uint8_t *publ
     return 0;
 }
 
+static void start_to_ping_timer(PING *ping)
+{
+    if (ip_isset(&ping->to_ping[0].ip_port.ip) && !timer_is_running(ping->dht->timers, ping->to_ping_timer)) {
+        timer_start(ping->dht->timers, ping->to_ping_timer, ping->last_to_ping + TIME_TO_PING);
+    }
+}
+
+/* Ping all the valid nodes in the to_ping list. The to_ping timer runs this
+ * TIME_TO_PING seconds after the last ping, as long as the list has nodes.
+ */
+static void do_to_ping(void *object, uint32_t id, void *userdata)
+{
+    PING *ping = (PING *)object;
+
+    if (!ip_isset(&ping->to_ping[0].ip_port.ip)) {
+        return;
+    }
+
+    unsigned int i;
+
+    for (i = 0; i < MAX_TO_PING; ++i) {
+        if (!ip_isset(&ping->to_ping[i].ip_port.ip)) {
+            break;
+        }
+
+        if (!node_addable_to_close_list(ping->dht, ping->to_ping[i].public_key, ping->to_ping[i].ip_port)) {
+            continue;
+        }
+
+        send_ping_request(ping, ping->to_ping[i].ip_port, ping->to_ping[i].public_key);
+        ip_reset(&ping->to_ping[i].ip_port.ip);
+    }
+
+    if (i != 0) {
+        ping->last_to_ping = mono_time_get(ping->mono_time);
+    }
+
+    /* Nodes that couldn't be added to the close list yet are tried again. */
+    start_to_ping_timer(ping);
+}
+
 /* Add nodes to the to_ping list.
  * All nodes in this list are pinged every TIME_TO_PING seconds
  * and are then removed from the list.
@@ -303,7 +352,7 @@ int add_to_ping(PING *ping, const uint8_t *public_key, IP_Port ip_port)
         return -1;
     }
 
-    if (in_list(ping->dht->close_clientlist, LCLIENT_LIST, public_key, ip_port)) {
+    if (in_list(ping->mono_time, DHT_close_bucket(ping->dht, public_key), LCLIENT_NODES, public_key, ip_port)) {
         return -1;
     }
 
@@ -320,6 +369,7 @@ int add_to_ping(PING *ping, const uint8_t *public_key, IP_Port ip_port)
         if (!ip_isset(&ping->to_ping[i].ip_port.ip)) {
             memcpy(ping->to_ping[i].public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
             ipport_copy(&ping->to_ping[i].ip_port, &ip_port);
+            start_to_ping_timer(ping);
             return 0;
         }
 
@@ -329,48 +379,14 @@ int add_to_ping(PING *ping, const uint8_t *public_key, IP_Port ip_port)
     }
 
     if (add_to_list(ping->to_ping, MAX_TO_PING, public_key, ip_port, ping->dht->self_public_key)) {
+        start_to_ping_timer(ping);
         return 0;
     }
 
     return -1;
 }
 
-
-/* Ping all the valid nodes in the to_ping list every TIME_TO_PING seconds.
- * This function must be run at least once every TIME_TO_PING seconds.
- */
-void do_to_ping(PING *ping)
-{
-    if (!is_timeout(ping->last_to_ping, TIME_TO_PING)) {
-        return;
-    }
-
-    if (!ip_isset(&ping->to_ping[0].ip_port.ip)) {
-        return;
-    }
-
-    unsigned int i;
-
-    for (i = 0; i < MAX_TO_PING; ++i) {
-        if (!ip_isset(&ping->to_ping[i].ip_port.ip)) {
-            break;
-        }
-
-        if (!node_addable_to_close_list(ping->dht, ping->to_ping[i].public_key, ping->to_ping[i].ip_port)) {
-            continue;
-        }
-
-        send_ping_request(ping, ping->to_ping[i].ip_port, ping->to_ping[i].public_key);
-        ip_reset(&ping->to_ping[i].ip_port.ip);
-    }
-
-    if (i != 0) {
-        ping->last_to_ping = unix_time();
-    }
-}
-
-
-PING *new_ping(DHT *dht)
+PING *new_ping(const Mono_Time *mono_time, DHT *dht)
 {
     PING *ping = (PING *)calloc(1, sizeof(PING));
 
@@ -378,12 +394,22 @@ PING *new_ping(DHT *dht)
         return NULL;
     }
 
+    ping->mono_time = mono_time;
+
     if (ping_array_init(&ping->ping_array, PING_NUM_MAX, PING_TIMEOUT) != 0) {
         free(ping);
         return NULL;
     }
 
     ping->dht = dht;
+    ping->to_ping_timer = timer_new(dht->timers, &do_to_ping, ping, 0);
+
+    if (ping->to_ping_timer == 0) {
+        ping_array_free_all(&ping->ping_array);
+        free(ping);
+        return NULL;
+    }
+
     networking_registerhandler(ping->dht->net, NET_PACKET_PING_REQUEST, &handle_ping_request, dht);
     networking_registerhandler(ping->dht->net, NET_PACKET_PING_RESPONSE, &handle_ping_response, dht);
 
@@ -392,6 +418,11 @@ PING *new_ping(DHT *dht)
 
 void kill_ping(PING *ping)
 {
+    if (ping == NULL) {
+        return;
+    }
+
+    timer_free(ping->dht->timers, ping->to_ping_timer);
     networking_registerhandler(ping->dht->net, NET_PACKET_PING_REQUEST, NULL, NULL);
     networking_registerhandler(ping->dht->net, NET_PACKET_PING_RESPONSE, NULL, NULL);
     ping_array_free_all(&ping->ping_array);
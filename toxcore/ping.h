@@ -44,9 +44,8 @@ typedef struct PING PING;
  *  return -1 if node was not added.
  */
 int add_to_ping(PING *ping, const uint8_t *public_key, IP_Port ip_port);
-void do_to_ping(PING *ping);
 
-PING *new_ping(DHT *dht);
+PING *new_ping(const Mono_Time *mono_time, DHT *dht);
 void kill_ping(PING *ping);
 
 int send_ping_request(PING *ping, IP_Port ipp, const uint8_t *public_key);
@@ -25,6 +25,7 @@
 #define PING_ARRAY_H
 
 #include "network.h"
+#include "util.h"
 
 typedef struct {
     void *data;
@@ -49,7 +50,7 @@ typedef struct {
  * return ping_id on success.
  * return 0 on failure.
  */
-uint64_t ping_array_add(Ping_Array *array, const uint8_t *data, uint32_t length);
+uint64_t ping_array_add(Ping_Array *array, const Mono_Time *mono_time, const uint8_t *data, uint32_t length);
 
 /* Check if ping_id is valid and not timed out.
  *
@@ -58,7 +59,8 @@ uint64_t ping_array_add(Ping_Array *array, const uint8_t *data, uint32_t length)
  * return length of data copied on success.
  * return -1 on failure.
  */
-int ping_array_check(uint8_t *data, uint32_t length, Ping_Array *array, uint64_t ping_id);
+int ping_array_check(uint8_t *data, uint32_t length, Ping_Array *array, const Mono_Time *mono_time,
+                     uint64_t ping_id);
 
 /* Initialize a Ping_Array.
  * size represents the total size of the array and should be a power of 2.
@@ -384,6 +384,23 @@ enum class SAVEDATA_TYPE {
   SECRET_KEY,
 }
 
+/**
+ * Congestion control algorithm deciding how fast lossless data, such as
+ * messages and file transfers, is sent to friends.
+ */
+enum class CONGESTION_CONTROL {
+  /**
+   * Adjust the send rate to keep the queue of unacknowledged packets short.
+   */
+  QUEUE,
+  /**
+   * Send at the measured bottleneck bandwidth of the path, probing for more
+   * periodically, and back off when the round trip time grows. Reaches higher
+   * rates on long or lossy paths.
+   */
+  DELAY,
+}
+
 
 /**
  * Severity level of log messages.
@@ -430,6 +447,15 @@ enum class LOG_LEVEL {
  */
 typedef void log_cb(LOG_LEVEL level, string file, uint32_t line, string func, string message, any user_data);
 
+/**
+ * A clock replacing the system monotonic clock of a Tox instance, e.g. to
+ * simulate time in tests. It must return milliseconds that never go
+ * backwards. It can be called from any thread that calls into the instance.
+ *
+ * @param user_data The user data pointer passed to $new in options.
+ */
+typedef uint64_t clock_cb(any user_data);
+
 
 static class options {
   /**
@@ -569,6 +595,61 @@ static class options {
        */
       any user_data;
     }
+
+    /**
+     * The number of public keys whose shared keys are cached by each of the
+     * DHT and onion key caches, or 0 for the default of 1024. Nodes handling
+     * many peers, like bootstrap nodes, compute fewer keys with a bigger
+     * cache. (Default: 0).
+     */
+    uint32_t shared_keys_size;
+
+    /**
+     * The number of threads computing the shared keys of DHT and onion packets
+     * from peers whose key isn't cached yet, or 0 to compute them in
+     * ${tox.iterate}. The packets wait for their key meanwhile. (Default: 0).
+     */
+    uint16_t shared_key_threads;
+
+    namespace clock {
+      /**
+       * Clock used for all timeouts of the new tox instance, or NULL for the
+       * system monotonic clock. (Default: NULL).
+       */
+      clock_cb *callback;
+
+      /**
+       * User data pointer passed to the clock callback.
+       */
+      any user_data;
+    }
+
+    /**
+     * The number of unused lossless packet buffers kept for reuse instead of
+     * being freed, or 0 for the default of 1024. (Default: 0).
+     */
+    uint32_t packet_pool_size;
+
+    /**
+     * The congestion control algorithm used for connections to friends.
+     * (Default: QUEUE).
+     */
+    CONGESTION_CONTROL congestion_control;
+
+    /**
+     * The number of threads encrypting and decrypting data packets sent and
+     * received over UDP, or 0 to do it in ${tox.iterate}. (Default: 0).
+     */
+    uint16_t crypto_threads;
+
+    /**
+     * The number of UDP datagrams sent and received per system call, or 0 to
+     * send and receive them one at a time. Datagrams sent while ${tox.iterate}
+     * runs are queued until it returns; where the kernel supports it, runs of
+     * them to the same address go out as one segmented buffer. Falls back to
+     * one at a time if batches can't be set up. At most 256. (Default: 0).
+     */
+    uint16_t udp_batch_size;
   }
 
 
@@ -831,6 +912,48 @@ inline namespace self {
  */
 const uint32_t iteration_interval();
 
+/**
+ * Return the time in milliseconds until $iterate() has timers due, if none of
+ * the sockets returned by ${iteration.fds.get} become readable before.
+ *
+ * Unlike $iteration_interval(), this is not capped: an idle instance only
+ * needs to run about once per second.
+ */
+const uint32_t iteration_timeout();
+
+inline namespace iteration {
+
+  int32_t[size] fds {
+    /**
+     * Return the number of sockets $iterate() reads from.
+     *
+     * This function can be used to determine how much memory to allocate for
+     * $get.
+     */
+    size();
+
+
+    /**
+     * Copy the file descriptors of the sockets $iterate() reads from into an
+     * array: the UDP socket, the sockets of the TCP relay connections and the
+     * sockets of the TCP server, if it is enabled.
+     *
+     * Clients with their own event loop can wait for any of them to become
+     * readable or for $iteration_timeout() milliseconds to pass, whichever
+     * comes first, and then call $iterate(). The sockets change as
+     * connections come and go, so they should be fetched again after each
+     * call to $iterate().
+     *
+     * Call $size to determine the number of elements to allocate.
+     *
+     * @param fds A memory region with enough space to hold the file
+     *   descriptors. If this parameter is NULL, this function has no effect.
+     */
+    get();
+  }
+
+}
+
 
 /**
  * The main loop that needs to be run in intervals of $iteration_interval()
@@ -2572,6 +2695,275 @@ inline namespace self {
 
 }
 
+
+/*******************************************************************************
+ *
+ * :: Traffic statistics
+ *
+ ******************************************************************************/
+
+
+/**
+ * The layers that count the packets they send and receive by packet id.
+ */
+enum class TRAFFIC_LAYER {
+  /**
+   * UDP datagrams, counted by their first byte. This includes the DHT, onion
+   * and net_crypto handshake and data packets sent and received over UDP.
+   */
+  UDP,
+  /**
+   * Decrypted data packets of the connections to friends and other peers,
+   * over both UDP and TCP relays, counted by their packet id. Custom lossy
+   * and lossless packets are counted by their first byte as well.
+   */
+  NET_CRYPTO,
+}
+
+
+/**
+ * The counters kept for every packet id of a $TRAFFIC_LAYER.
+ */
+enum class TRAFFIC_STAT {
+  /**
+   * Packets received.
+   */
+  PACKETS_IN,
+  /**
+   * Bytes received.
+   */
+  BYTES_IN,
+  /**
+   * Packets sent.
+   */
+  PACKETS_OUT,
+  /**
+   * Bytes sent.
+   */
+  BYTES_OUT,
+  /**
+   * Received packets passed to a handler.
+   */
+  HANDLED,
+  /**
+   * Received packets without a handler, or that their handler rejected.
+   */
+  DROPPED,
+  /**
+   * Time spent in the handlers, in microseconds.
+   */
+  HANDLER_TIME,
+}
+
+
+/**
+ * The counters of the cookie requests and handshakes received over UDP from
+ * peers that want to start a connection. Only a limited number of them is
+ * handled per $iterate(), and each IP address can only send a limited number
+ * of them per second unless a connection to the peer already exists.
+ */
+enum class HANDSHAKE_STAT {
+  /**
+   * Handshakes handled, when they arrived or after waiting in the queue.
+   */
+  HANDLED,
+  /**
+   * Handshakes put in the queue because too many arrived at once.
+   */
+  DEFERRED,
+  /**
+   * Handshakes dropped because their IP address sent too many.
+   */
+  DROPPED_RATE_LIMITED,
+  /**
+   * Handshakes dropped because the queue was full.
+   */
+  DROPPED_QUEUE_FULL,
+  /**
+   * Handshakes waiting in the queue now. This one is not reset.
+   */
+  QUEUED,
+}
+
+
+/**
+ * The counters of the caches of shared keys computed for the DHT and onion
+ * packets of other peers, summed over all the caches of the instance.
+ */
+enum class SHARED_KEY_STAT {
+  /**
+   * Keys found in a cache.
+   */
+  HITS,
+  /**
+   * Keys that had to be computed.
+   */
+  MISSES,
+  /**
+   * Keys dropped from a cache to make room for another one.
+   */
+  EVICTIONS,
+}
+
+
+/**
+ * The counters of the pool of buffers holding the lossless packets queued
+ * for sending or waiting for missing packets.
+ */
+enum class PACKET_POOL_STAT {
+  /**
+   * Buffers holding a packet now.
+   */
+  USED,
+  /**
+   * Unused buffers kept for reuse now.
+   */
+  FREE,
+  /**
+   * Buffers allocated since the instance was created.
+   */
+  ALLOCATED,
+  /**
+   * Buffers taken from the pool instead of being allocated since the
+   * instance was created.
+   */
+  REUSED,
+}
+
+
+namespace traffic {
+
+  /**
+   * Return the counter stat of the packets with id packet_id on the layer
+   * layer since the instance was created or $reset was last called.
+   *
+   * The counters are always kept. Packets of a layer sent from other threads
+   * than the one calling $iterate() may be missed.
+   */
+  const uint64_t stat(TRAFFIC_LAYER layer, uint8_t packet_id, TRAFFIC_STAT stat);
+
+  /**
+   * Return the counter stat of the handshake admission control since the
+   * instance was created or $reset was last called.
+   */
+  const uint64_t handshake_stat(HANDSHAKE_STAT stat);
+
+  /**
+   * Return the counter stat of the shared key caches since the instance was
+   * created or $reset was last called.
+   */
+  const uint64_t shared_key_stat(SHARED_KEY_STAT stat);
+
+  /**
+   * Return the counter stat of the lossless packet buffer pool. These are not
+   * affected by $reset.
+   */
+  const uint64_t packet_pool_stat(PACKET_POOL_STAT stat);
+
+  /**
+   * Set all traffic counters of the instance to zero.
+   */
+  void reset();
+
+}
+
+
+/*******************************************************************************
+ *
+ * :: Transport statistics
+ *
+ ******************************************************************************/
+
+
+/**
+ * The statistics kept for the connection to a friend.
+ */
+enum class TRANSPORT_STAT {
+  /**
+   * Smoothed round trip time in milliseconds, 0 until measured.
+   */
+  RTT,
+  /**
+   * Variation of the round trip time in milliseconds.
+   */
+  RTT_VARIATION,
+  /**
+   * Lowest round trip time measured in milliseconds.
+   */
+  MIN_RTT,
+  /**
+   * Rate lossless packets are sent at, in packets per second.
+   */
+  SEND_RATE,
+  /**
+   * Rate lossless packets are received at, in packets per second.
+   */
+  RECV_RATE,
+  /**
+   * Lossless packets queued or sent and waiting to be acknowledged.
+   */
+  SEND_BUFFER,
+  /**
+   * Lossless packets received and waiting for the ones before them.
+   */
+  RECV_BUFFER,
+  /**
+   * Data packets sent, including the resent ones.
+   */
+  PACKETS_SENT,
+  /**
+   * Lossless packets sent again because they were lost.
+   */
+  PACKETS_RESENT,
+  /**
+   * Data packets received.
+   */
+  PACKETS_RECEIVED,
+  /**
+   * Bytes of the data packets sent, as they go on the wire.
+   */
+  BYTES_SENT,
+  /**
+   * Bytes of the data packets received.
+   */
+  BYTES_RECEIVED,
+  /**
+   * TCP relays the friend can be reached through.
+   */
+  ONLINE_TCP_RELAYS,
+}
+
+
+namespace friend {
+
+  namespace transport {
+
+    /**
+     * Return the statistic stat of the connection to the friend, or 0 while
+     * the friend is offline. Whether the connection is direct is given by
+     * ${connection_status.get}.
+     *
+     * The counters start at 0 every time the friend comes online.
+     */
+    const uint64_t stat(uint32_t friend_number, TRANSPORT_STAT stat)
+        with error for query;
+
+    /**
+     * Copy the public key of the TCP relay that packets to the friend go
+     * through to public_key.
+     *
+     * @return true on success.
+     * @return false if the friend is offline, directly connected over UDP or
+     *   the friend number was invalid. Inspect the error code to determine
+     *   which case it is.
+     */
+    bool relay(uint32_t friend_number, uint8_t[PUBLIC_KEY_SIZE] public_key)
+        with error for query;
+
+  }
+
+}
+
 } // class tox
 
 %{
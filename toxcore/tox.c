@@ -142,9 +142,22 @@ Tox *tox_new(const struct Tox_Options *options, TOX_ERR_NEW *error)
         m_options.hole_punching_enabled = tox_options_get_hole_punching_enabled(options);
         m_options.local_discovery_enabled = tox_options_get_local_discovery_enabled(options);
 
+        if (tox_options_get_congestion_control(options) == TOX_CONGESTION_CONTROL_DELAY) {
+            m_options.congestion_control = &congestion_control_delay;
+        }
+
+        m_options.crypto_threads = tox_options_get_crypto_threads(options);
+        m_options.udp_batch_size = tox_options_get_udp_batch_size(options);
+        m_options.shared_keys_size = tox_options_get_shared_keys_size(options);
+        m_options.shared_key_threads = tox_options_get_shared_key_threads(options);
+
         m_options.log_callback = (logger_cb *)tox_options_get_log_callback(options);
         m_options.log_user_data = tox_options_get_log_user_data(options);
 
+        m_options.clock_callback = tox_options_get_clock_callback(options);
+        m_options.clock_user_data = tox_options_get_clock_user_data(options);
+        m_options.packet_pool_size = tox_options_get_packet_pool_size(options);
+
         switch (tox_options_get_proxy_type(options)) {
             case TOX_PROXY_TYPE_HTTP:
                 m_options.proxy_info.proxy_type = TCP_PROXY_HTTP;
@@ -356,6 +369,39 @@ uint32_t tox_iteration_interval(const Tox *tox)
     return messenger_run_interval(m);
 }
 
+uint32_t tox_iteration_timeout(const Tox *tox)
+{
+    const Messenger *m = tox;
+    return messenger_run_timeout(m);
+}
+
+size_t tox_iteration_get_fds_size(const Tox *tox)
+{
+    const Messenger *m = tox;
+    return messenger_sockets(m, NULL, 0);
+}
+
+void tox_iteration_get_fds(const Tox *tox, int32_t *fds)
+{
+    if (fds) {
+        const Messenger *m = tox;
+        const uint32_t count = messenger_sockets(m, NULL, 0);
+
+        if (count == 0) {
+            return;
+        }
+
+        VLA(Socket, socks, count);
+        messenger_sockets(m, socks, count);
+
+        uint32_t i;
+
+        for (i = 0; i < count; ++i) {
+            fds[i] = socks[i];
+        }
+    }
+}
+
 void tox_iterate(Tox *tox, void *user_data)
 {
     Messenger *m = tox;
@@ -1629,6 +1675,210 @@ uint16_t tox_self_get_tcp_port(const Tox *tox, TOX_ERR_GET_PORT *error)
     return 0;
 }
 
+uint64_t tox_traffic_stat(const Tox *tox, TOX_TRAFFIC_LAYER layer, uint8_t packet_id, TOX_TRAFFIC_STAT stat)
+{
+    const Messenger *m = tox;
+    Packet_Stats stats;
+
+    switch (layer) {
+        case TOX_TRAFFIC_LAYER_UDP:
+            packet_stats_copy(&m->net->packet_stats[packet_id], &stats);
+            break;
+
+        case TOX_TRAFFIC_LAYER_NET_CRYPTO:
+            packet_stats_copy(&m->net_crypto->packet_stats[packet_id], &stats);
+            break;
+
+        default:
+            return 0;
+    }
+
+    switch (stat) {
+        case TOX_TRAFFIC_STAT_PACKETS_IN:
+            return stats.packets_in;
+
+        case TOX_TRAFFIC_STAT_BYTES_IN:
+            return stats.bytes_in;
+
+        case TOX_TRAFFIC_STAT_PACKETS_OUT:
+            return stats.packets_out;
+
+        case TOX_TRAFFIC_STAT_BYTES_OUT:
+            return stats.bytes_out;
+
+        case TOX_TRAFFIC_STAT_HANDLED:
+            return stats.handled;
+
+        case TOX_TRAFFIC_STAT_DROPPED:
+            return stats.dropped;
+
+        case TOX_TRAFFIC_STAT_HANDLER_TIME:
+            return stats.handler_time;
+    }
+
+    return 0;
+}
+
+uint64_t tox_traffic_handshake_stat(const Tox *tox, TOX_HANDSHAKE_STAT stat)
+{
+    const Messenger *m = tox;
+    Crypto_Handshake_Stats stats;
+    crypto_handshake_stats(m->net_crypto, &stats);
+
+    switch (stat) {
+        case TOX_HANDSHAKE_STAT_HANDLED:
+            return stats.handled;
+
+        case TOX_HANDSHAKE_STAT_DEFERRED:
+            return stats.deferred;
+
+        case TOX_HANDSHAKE_STAT_DROPPED_RATE_LIMITED:
+            return stats.dropped_rate_limited;
+
+        case TOX_HANDSHAKE_STAT_DROPPED_QUEUE_FULL:
+            return stats.dropped_queue_full;
+
+        case TOX_HANDSHAKE_STAT_QUEUED:
+            return stats.queued;
+    }
+
+    return 0;
+}
+
+uint64_t tox_traffic_shared_key_stat(const Tox *tox, TOX_SHARED_KEY_STAT stat)
+{
+    const Messenger *m = tox;
+    Shared_Keys_Stats stats;
+    m_get_shared_keys_stats(m, &stats);
+
+    switch (stat) {
+        case TOX_SHARED_KEY_STAT_HITS:
+            return stats.hits;
+
+        case TOX_SHARED_KEY_STAT_MISSES:
+            return stats.misses;
+
+        case TOX_SHARED_KEY_STAT_EVICTIONS:
+            return stats.evictions;
+    }
+
+    return 0;
+}
+
+uint64_t tox_traffic_packet_pool_stat(const Tox *tox, TOX_PACKET_POOL_STAT stat)
+{
+    const Messenger *m = tox;
+    Packet_Data_Pool_Stats stats;
+    crypto_packet_data_pool_stats(m->net_crypto, &stats);
+
+    switch (stat) {
+        case TOX_PACKET_POOL_STAT_USED:
+            return stats.num_used;
+
+        case TOX_PACKET_POOL_STAT_FREE:
+            return stats.num_free;
+
+        case TOX_PACKET_POOL_STAT_ALLOCATED:
+            return stats.num_allocated;
+
+        case TOX_PACKET_POOL_STAT_REUSED:
+            return stats.num_reused;
+    }
+
+    return 0;
+}
+
+void tox_traffic_reset(Tox *tox)
+{
+    Messenger *m = tox;
+    networking_reset_stats(m->net);
+    crypto_reset_stats(m->net_crypto);
+    m_reset_shared_keys_stats(m);
+}
+
+uint64_t tox_friend_transport_stat(const Tox *tox, uint32_t friend_number, TOX_TRANSPORT_STAT stat,
+                                   TOX_ERR_FRIEND_QUERY *error)
+{
+    const Messenger *m = tox;
+    Crypto_Connection_Stats stats;
+
+    if (m_get_friend_transport_stats(m, friend_number, &stats) == -1) {
+        SET_ERROR_PARAMETER(error, TOX_ERR_FRIEND_QUERY_FRIEND_NOT_FOUND);
+        return 0;
+    }
+
+    SET_ERROR_PARAMETER(error, TOX_ERR_FRIEND_QUERY_OK);
+
+    switch (stat) {
+        case TOX_TRANSPORT_STAT_RTT:
+            return stats.rtt;
+
+        case TOX_TRANSPORT_STAT_RTT_VARIATION:
+            return stats.rtt_var;
+
+        case TOX_TRANSPORT_STAT_MIN_RTT:
+            return stats.min_rtt;
+
+        case TOX_TRANSPORT_STAT_SEND_RATE:
+            return (uint64_t)(stats.packet_send_rate + 0.5);
+
+        case TOX_TRANSPORT_STAT_RECV_RATE:
+            return (uint64_t)(stats.packet_recv_rate + 0.5);
+
+        case TOX_TRANSPORT_STAT_SEND_BUFFER:
+            return stats.send_buffer;
+
+        case TOX_TRANSPORT_STAT_RECV_BUFFER:
+            return stats.recv_buffer;
+
+        case TOX_TRANSPORT_STAT_PACKETS_SENT:
+            return stats.packets_sent;
+
+        case TOX_TRANSPORT_STAT_PACKETS_RESENT:
+            return stats.packets_resent;
+
+        case TOX_TRANSPORT_STAT_PACKETS_RECEIVED:
+            return stats.packets_received;
+
+        case TOX_TRANSPORT_STAT_BYTES_SENT:
+            return stats.bytes_sent;
+
+        case TOX_TRANSPORT_STAT_BYTES_RECEIVED:
+            return stats.bytes_received;
+
+        case TOX_TRANSPORT_STAT_ONLINE_TCP_RELAYS:
+            return stats.online_tcp_relays;
+    }
+
+    return 0;
+}
+
+bool tox_friend_transport_relay(const Tox *tox, uint32_t friend_number, uint8_t *public_key,
+                                TOX_ERR_FRIEND_QUERY *error)
+{
+    if (!public_key) {
+        SET_ERROR_PARAMETER(error, TOX_ERR_FRIEND_QUERY_NULL);
+        return 0;
+    }
+
+    const Messenger *m = tox;
+    Crypto_Connection_Stats stats;
+
+    if (m_get_friend_transport_stats(m, friend_number, &stats) == -1) {
+        SET_ERROR_PARAMETER(error, TOX_ERR_FRIEND_QUERY_FRIEND_NOT_FOUND);
+        return 0;
+    }
+
+    SET_ERROR_PARAMETER(error, TOX_ERR_FRIEND_QUERY_OK);
+
+    if (!stats.tcp_relay_in_use) {
+        return 0;
+    }
+
+    memcpy(public_key, stats.tcp_relay_public_key, TOX_PUBLIC_KEY_SIZE);
+    return 1;
+}
+
 #if defined(ELASTOS_BUILD)
 int tox_self_get_random_tcp_relay(const Tox *tox, uint8_t *ip, uint8_t *public_key)
 {
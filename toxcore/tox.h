@@ -448,6 +448,27 @@ typedef enum TOX_SAVEDATA_TYPE {
 } TOX_SAVEDATA_TYPE;
 
 
+/**
+ * Congestion control algorithm deciding how fast lossless data, such as
+ * messages and file transfers, is sent to friends.
+ */
+typedef enum TOX_CONGESTION_CONTROL {
+
+    /**
+     * Adjust the send rate to keep the queue of unacknowledged packets short.
+     */
+    TOX_CONGESTION_CONTROL_QUEUE,
+
+    /**
+     * Send at the measured bottleneck bandwidth of the path, probing for more
+     * periodically, and back off when the round trip time grows. Reaches higher
+     * rates on long or lossy paths.
+     */
+    TOX_CONGESTION_CONTROL_DELAY,
+
+} TOX_CONGESTION_CONTROL;
+
+
 /**
  * Severity level of log messages.
  */
@@ -501,6 +522,15 @@ typedef enum TOX_LOG_LEVEL {
 typedef void tox_log_cb(Tox *tox, TOX_LOG_LEVEL level, const char *file, uint32_t line, const char *func,
                         const char *message, void *user_data);
 
+/**
+ * A clock replacing the system monotonic clock of a Tox instance, e.g. to
+ * simulate time in tests. It must return milliseconds that never go
+ * backwards. It can be called from any thread that calls into the instance.
+ *
+ * @param user_data The user data pointer passed to tox_new in options.
+ */
+typedef uint64_t tox_clock_cb(void *user_data);
+
 
 /**
  * This struct contains all the startup options for Tox. You must tox_options_new to
@@ -649,6 +679,67 @@ struct Tox_Options {
      */
     void *log_user_data;
 
+
+    /**
+     * The number of public keys whose shared keys are cached by each of the
+     * DHT and onion key caches, or 0 for the default of 1024. Nodes handling
+     * many peers, like bootstrap nodes, compute fewer keys with a bigger
+     * cache. (Default: 0).
+     */
+    uint32_t shared_keys_size;
+
+
+    /**
+     * The number of threads computing the shared keys of DHT and onion packets
+     * from peers whose key isn't cached yet, or 0 to compute them in
+     * tox_iterate. The packets wait for their key meanwhile. (Default: 0).
+     */
+    uint16_t shared_key_threads;
+
+
+    /**
+     * Clock used for all timeouts of the new tox instance, or NULL for the
+     * system monotonic clock. (Default: NULL).
+     */
+    tox_clock_cb *clock_callback;
+
+
+    /**
+     * User data pointer passed to the clock callback.
+     */
+    void *clock_user_data;
+
+
+    /**
+     * The number of unused lossless packet buffers kept for reuse instead of
+     * being freed, or 0 for the default of 1024. (Default: 0).
+     */
+    uint32_t packet_pool_size;
+
+
+    /**
+     * The congestion control algorithm used for connections to friends.
+     * (Default: QUEUE).
+     */
+    TOX_CONGESTION_CONTROL congestion_control;
+
+
+    /**
+     * The number of threads encrypting and decrypting data packets sent and
+     * received over UDP, or 0 to do it in tox_iterate. (Default: 0).
+     */
+    uint16_t crypto_threads;
+
+
+    /**
+     * The number of UDP datagrams sent and received per system call, or 0 to
+     * send and receive them one at a time. Datagrams sent while tox_iterate
+     * runs are queued until it returns; where the kernel supports it, runs of
+     * them to the same address go out as one segmented buffer. Falls back to
+     * one at a time if batches can't be set up. At most 256. (Default: 0).
+     */
+    uint16_t udp_batch_size;
+
 };
 
 
@@ -712,6 +803,38 @@ void *tox_options_get_log_user_data(const struct Tox_Options *options);
 
 void tox_options_set_log_user_data(struct Tox_Options *options, void *user_data);
 
+uint32_t tox_options_get_shared_keys_size(const struct Tox_Options *options);
+
+void tox_options_set_shared_keys_size(struct Tox_Options *options, uint32_t shared_keys_size);
+
+uint16_t tox_options_get_shared_key_threads(const struct Tox_Options *options);
+
+void tox_options_set_shared_key_threads(struct Tox_Options *options, uint16_t shared_key_threads);
+
+tox_clock_cb *tox_options_get_clock_callback(const struct Tox_Options *options);
+
+void tox_options_set_clock_callback(struct Tox_Options *options, tox_clock_cb *callback);
+
+void *tox_options_get_clock_user_data(const struct Tox_Options *options);
+
+void tox_options_set_clock_user_data(struct Tox_Options *options, void *user_data);
+
+uint32_t tox_options_get_packet_pool_size(const struct Tox_Options *options);
+
+void tox_options_set_packet_pool_size(struct Tox_Options *options, uint32_t packet_pool_size);
+
+TOX_CONGESTION_CONTROL tox_options_get_congestion_control(const struct Tox_Options *options);
+
+void tox_options_set_congestion_control(struct Tox_Options *options, TOX_CONGESTION_CONTROL congestion_control);
+
+uint16_t tox_options_get_crypto_threads(const struct Tox_Options *options);
+
+void tox_options_set_crypto_threads(struct Tox_Options *options, uint16_t crypto_threads);
+
+uint16_t tox_options_get_udp_batch_size(const struct Tox_Options *options);
+
+void tox_options_set_udp_batch_size(struct Tox_Options *options, uint16_t udp_batch_size);
+
 /**
  * Initialises a Tox_Options object with the default options.
  *
@@ -1003,6 +1126,41 @@ void tox_callback_self_connection_status(Tox *tox, tox_self_connection_status_cb
  */
 uint32_t tox_iteration_interval(const Tox *tox);
 
+/**
+ * Return the time in milliseconds until tox_iterate() has timers due, if none of
+ * the sockets returned by tox_iteration_get_fds become readable before.
+ *
+ * Unlike tox_iteration_interval(), this is not capped: an idle instance only
+ * needs to run about once per second.
+ */
+uint32_t tox_iteration_timeout(const Tox *tox);
+
+/**
+ * Return the number of sockets tox_iterate() reads from.
+ *
+ * This function can be used to determine how much memory to allocate for
+ * tox_iteration_get_fds.
+ */
+size_t tox_iteration_get_fds_size(const Tox *tox);
+
+/**
+ * Copy the file descriptors of the sockets tox_iterate() reads from into an
+ * array: the UDP socket, the sockets of the TCP relay connections and the
+ * sockets of the TCP server, if it is enabled.
+ *
+ * Clients with their own event loop can wait for any of them to become
+ * readable or for tox_iteration_timeout() milliseconds to pass, whichever
+ * comes first, and then call tox_iterate(). The sockets change as
+ * connections come and go, so they should be fetched again after each
+ * call to tox_iterate().
+ *
+ * Call tox_iteration_get_fds_size to determine the number of elements to allocate.
+ *
+ * @param fds A memory region with enough space to hold the file
+ *   descriptors. If this parameter is NULL, this function has no effect.
+ */
+void tox_iteration_get_fds(const Tox *tox, int32_t *fds);
+
 /**
  * The main loop that needs to be run in intervals of tox_iteration_interval()
  * milliseconds.
@@ -3054,6 +3212,305 @@ uint16_t tox_self_get_udp_port(const Tox *tox, TOX_ERR_GET_PORT *error);
  */
 uint16_t tox_self_get_tcp_port(const Tox *tox, TOX_ERR_GET_PORT *error);
 
+
+/*******************************************************************************
+ *
+ * :: Traffic statistics
+ *
+ ******************************************************************************/
+
+
+
+/**
+ * The layers that count the packets they send and receive by packet id.
+ */
+typedef enum TOX_TRAFFIC_LAYER {
+
+    /**
+     * UDP datagrams, counted by their first byte. This includes the DHT, onion
+     * and net_crypto handshake and data packets sent and received over UDP.
+     */
+    TOX_TRAFFIC_LAYER_UDP,
+
+    /**
+     * Decrypted data packets of the connections to friends and other peers,
+     * over both UDP and TCP relays, counted by their packet id. Custom lossy
+     * and lossless packets are counted by their first byte as well.
+     */
+    TOX_TRAFFIC_LAYER_NET_CRYPTO,
+
+} TOX_TRAFFIC_LAYER;
+
+
+/**
+ * The counters kept for every packet id of a TOX_TRAFFIC_LAYER.
+ */
+typedef enum TOX_TRAFFIC_STAT {
+
+    /**
+     * Packets received.
+     */
+    TOX_TRAFFIC_STAT_PACKETS_IN,
+
+    /**
+     * Bytes received.
+     */
+    TOX_TRAFFIC_STAT_BYTES_IN,
+
+    /**
+     * Packets sent.
+     */
+    TOX_TRAFFIC_STAT_PACKETS_OUT,
+
+    /**
+     * Bytes sent.
+     */
+    TOX_TRAFFIC_STAT_BYTES_OUT,
+
+    /**
+     * Received packets passed to a handler.
+     */
+    TOX_TRAFFIC_STAT_HANDLED,
+
+    /**
+     * Received packets without a handler, or that their handler rejected.
+     */
+    TOX_TRAFFIC_STAT_DROPPED,
+
+    /**
+     * Time spent in the handlers, in microseconds.
+     */
+    TOX_TRAFFIC_STAT_HANDLER_TIME,
+
+} TOX_TRAFFIC_STAT;
+
+
+/**
+ * The counters of the cookie requests and handshakes received over UDP from
+ * peers that want to start a connection. Only a limited number of them is
+ * handled per tox_iterate(), and each IP address can only send a limited number
+ * of them per second unless a connection to the peer already exists.
+ */
+typedef enum TOX_HANDSHAKE_STAT {
+
+    /**
+     * Handshakes handled, when they arrived or after waiting in the queue.
+     */
+    TOX_HANDSHAKE_STAT_HANDLED,
+
+    /**
+     * Handshakes put in the queue because too many arrived at once.
+     */
+    TOX_HANDSHAKE_STAT_DEFERRED,
+
+    /**
+     * Handshakes dropped because their IP address sent too many.
+     */
+    TOX_HANDSHAKE_STAT_DROPPED_RATE_LIMITED,
+
+    /**
+     * Handshakes dropped because the queue was full.
+     */
+    TOX_HANDSHAKE_STAT_DROPPED_QUEUE_FULL,
+
+    /**
+     * Handshakes waiting in the queue now. This one is not reset.
+     */
+    TOX_HANDSHAKE_STAT_QUEUED,
+
+} TOX_HANDSHAKE_STAT;
+
+
+/**
+ * The counters of the caches of shared keys computed for the DHT and onion
+ * packets of other peers, summed over all the caches of the instance.
+ */
+typedef enum TOX_SHARED_KEY_STAT {
+
+    /**
+     * Keys found in a cache.
+     */
+    TOX_SHARED_KEY_STAT_HITS,
+
+    /**
+     * Keys that had to be computed.
+     */
+    TOX_SHARED_KEY_STAT_MISSES,
+
+    /**
+     * Keys dropped from a cache to make room for another one.
+     */
+    TOX_SHARED_KEY_STAT_EVICTIONS,
+
+} TOX_SHARED_KEY_STAT;
+
+
+/**
+ * The counters of the pool of buffers holding the lossless packets queued
+ * for sending or waiting for missing packets.
+ */
+typedef enum TOX_PACKET_POOL_STAT {
+
+    /**
+     * Buffers holding a packet now.
+     */
+    TOX_PACKET_POOL_STAT_USED,
+
+    /**
+     * Unused buffers kept for reuse now.
+     */
+    TOX_PACKET_POOL_STAT_FREE,
+
+    /**
+     * Buffers allocated since the instance was created.
+     */
+    TOX_PACKET_POOL_STAT_ALLOCATED,
+
+    /**
+     * Buffers taken from the pool instead of being allocated since the
+     * instance was created.
+     */
+    TOX_PACKET_POOL_STAT_REUSED,
+
+} TOX_PACKET_POOL_STAT;
+
+
+/**
+ * Return the counter stat of the packets with id packet_id on the layer
+ * layer since the instance was created or tox_traffic_reset was last called.
+ *
+ * The counters are always kept. Packets of a layer sent from other threads
+ * than the one calling tox_iterate() may be missed.
+ */
+uint64_t tox_traffic_stat(const Tox *tox, TOX_TRAFFIC_LAYER layer, uint8_t packet_id, TOX_TRAFFIC_STAT stat);
+
+/**
+ * Return the counter stat of the handshake admission control since the
+ * instance was created or tox_traffic_reset was last called.
+ */
+uint64_t tox_traffic_handshake_stat(const Tox *tox, TOX_HANDSHAKE_STAT stat);
+
+/**
+ * Return the counter stat of the shared key caches since the instance was
+ * created or tox_traffic_reset was last called.
+ */
+uint64_t tox_traffic_shared_key_stat(const Tox *tox, TOX_SHARED_KEY_STAT stat);
+
+/**
+ * Return the counter stat of the lossless packet buffer pool. These are not
+ * affected by tox_traffic_reset.
+ */
+uint64_t tox_traffic_packet_pool_stat(const Tox *tox, TOX_PACKET_POOL_STAT stat);
+
+/**
+ * Set all traffic counters of the instance to zero.
+ */
+void tox_traffic_reset(Tox *tox);
+
+
+/*******************************************************************************
+ *
+ * :: Transport statistics
+ *
+ ******************************************************************************/
+
+
+
+/**
+ * The statistics kept for the connection to a friend.
+ */
+typedef enum TOX_TRANSPORT_STAT {
+
+    /**
+     * Smoothed round trip time in milliseconds, 0 until measured.
+     */
+    TOX_TRANSPORT_STAT_RTT,
+
+    /**
+     * Variation of the round trip time in milliseconds.
+     */
+    TOX_TRANSPORT_STAT_RTT_VARIATION,
+
+    /**
+     * Lowest round trip time measured in milliseconds.
+     */
+    TOX_TRANSPORT_STAT_MIN_RTT,
+
+    /**
+     * Rate lossless packets are sent at, in packets per second.
+     */
+    TOX_TRANSPORT_STAT_SEND_RATE,
+
+    /**
+     * Rate lossless packets are received at, in packets per second.
+     */
+    TOX_TRANSPORT_STAT_RECV_RATE,
+
+    /**
+     * Lossless packets queued or sent and waiting to be acknowledged.
+     */
+    TOX_TRANSPORT_STAT_SEND_BUFFER,
+
+    /**
+     * Lossless packets received and waiting for the ones before them.
+     */
+    TOX_TRANSPORT_STAT_RECV_BUFFER,
+
+    /**
+     * Data packets sent, including the resent ones.
+     */
+    TOX_TRANSPORT_STAT_PACKETS_SENT,
+
+    /**
+     * Lossless packets sent again because they were lost.
+     */
+    TOX_TRANSPORT_STAT_PACKETS_RESENT,
+
+    /**
+     * Data packets received.
+     */
+    TOX_TRANSPORT_STAT_PACKETS_RECEIVED,
+
+    /**
+     * Bytes of the data packets sent, as they go on the wire.
+     */
+    TOX_TRANSPORT_STAT_BYTES_SENT,
+
+    /**
+     * Bytes of the data packets received.
+     */
+    TOX_TRANSPORT_STAT_BYTES_RECEIVED,
+
+    /**
+     * TCP relays the friend can be reached through.
+     */
+    TOX_TRANSPORT_STAT_ONLINE_TCP_RELAYS,
+
+} TOX_TRANSPORT_STAT;
+
+
+/**
+ * Return the statistic stat of the connection to the friend, or 0 while
+ * the friend is offline. Whether the connection is direct is given by
+ * tox_friend_get_connection_status.
+ *
+ * The counters start at 0 every time the friend comes online.
+ */
+uint64_t tox_friend_transport_stat(const Tox *tox, uint32_t friend_number, TOX_TRANSPORT_STAT stat,
+                                   TOX_ERR_FRIEND_QUERY *error);
+
+/**
+ * Copy the public key of the TCP relay that packets to the friend go
+ * through to public_key.
+ *
+ * @return true on success.
+ * @return false if the friend is offline, directly connected over UDP or
+ *   the friend number was invalid. Inspect the error code to determine
+ *   which case it is.
+ */
+bool tox_friend_transport_relay(const Tox *tox, uint32_t friend_number, uint8_t *public_key,
+                                TOX_ERR_FRIEND_QUERY *error);
+
 #if defined(ELASTOS_BUILD)
 /* Return a random TCP relay address for use as address of turn server.
  *
@@ -52,6 +52,14 @@ ACCESSORS(size_t, savedata_, length)
 ACCESSORS(tox_log_cb *, log_, callback)
 ACCESSORS(void *, log_, user_data)
 ACCESSORS(bool, , local_discovery_enabled)
+ACCESSORS(uint32_t, , shared_keys_size)
+ACCESSORS(uint16_t, , shared_key_threads)
+ACCESSORS(tox_clock_cb *, clock_, callback)
+ACCESSORS(void *, clock_, user_data)
+ACCESSORS(uint32_t, , packet_pool_size)
+ACCESSORS(TOX_CONGESTION_CONTROL, , congestion_control)
+ACCESSORS(uint16_t, , crypto_threads)
+ACCESSORS(uint16_t, , udp_batch_size)
 
 const uint8_t *tox_options_get_savedata_data(const struct Tox_Options *options)
 {
@@ -73,6 +81,7 @@ void tox_options_default(struct Tox_Options *options)
         tox_options_set_udp_enabled(options, true);
         tox_options_set_proxy_type(options, TOX_PROXY_TYPE_NONE);
         tox_options_set_hole_punching_enabled(options, true);
+        tox_options_set_congestion_control(options, TOX_CONGESTION_CONTROL_QUEUE);
         tox_options_set_local_discovery_enabled(options, true);
     }
 }
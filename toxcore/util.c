@@ -34,32 +34,154 @@
 #include "crypto_core.h" /* for CRYPTO_PUBLIC_KEY_SIZE */
 #include "network.h" /* for current_time_monotonic */
 
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 
-/* don't call into system billions of times for no reason */
-static uint64_t unix_time_value;
-static uint64_t unix_base_time_value;
+/* Instances running in different threads, such as the UDP workers of the
+ * bootstrap daemon, share the system time, and the time of an instance is
+ * read from the threads of its API users, so these values are only accessed
+ * atomically. */
+#if defined(__GNUC__)
+#define MONO_TIME_LOAD(value) __atomic_load_n(value, __ATOMIC_RELAXED)
+#define MONO_TIME_STORE(value, new_value) __atomic_store_n(value, new_value, __ATOMIC_RELAXED)
+#define MONO_TIME_CAS(value, expected, new_value) \
+    __atomic_compare_exchange_n(value, expected, new_value, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+#else
+static pthread_mutex_t mono_time_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-/* XXX: note that this is not thread-safe; if multiple threads call unix_time_update() concurrently, the return value of
- * unix_time() may fail to increase monotonically with increasing time */
-void unix_time_update(void)
+static uint64_t mono_time_load(const uint64_t *value)
+{
+    pthread_mutex_lock(&mono_time_mutex);
+    const uint64_t ret = *value;
+    pthread_mutex_unlock(&mono_time_mutex);
+    return ret;
+}
+
+static void mono_time_store(uint64_t *value, uint64_t new_value)
+{
+    pthread_mutex_lock(&mono_time_mutex);
+    *value = new_value;
+    pthread_mutex_unlock(&mono_time_mutex);
+}
+
+static bool mono_time_cas(uint64_t *value, uint64_t *expected, uint64_t new_value)
+{
+    pthread_mutex_lock(&mono_time_mutex);
+    const bool swapped = *value == *expected;
+
+    if (swapped) {
+        *value = new_value;
+    } else {
+        *expected = *value;
+    }
+
+    pthread_mutex_unlock(&mono_time_mutex);
+    return swapped;
+}
+
+#define MONO_TIME_LOAD(value) mono_time_load(value)
+#define MONO_TIME_STORE(value, new_value) mono_time_store(value, new_value)
+#define MONO_TIME_CAS(value, expected, new_value) mono_time_cas(value, expected, new_value)
+#endif
+
+struct Mono_Time {
+    /* don't call into system billions of times for no reason */
+    uint64_t time;
+    /* Seconds from the start of the clock to the epoch, 0 until known. */
+    uint64_t base_time;
+
+    monotonic_clock_cb *clock;
+    void *clock_object;
+};
+
+static Mono_Time system_mono_time;
+
+Mono_Time *mono_time_new(void)
+{
+    Mono_Time *mono_time = (Mono_Time *)calloc(1, sizeof(Mono_Time));
+
+    if (mono_time == NULL) {
+        return NULL;
+    }
+
+    mono_time_update(mono_time);
+    return mono_time;
+}
+
+void mono_time_free(Mono_Time *mono_time)
+{
+    free(mono_time);
+}
+
+uint64_t mono_time_monotonic(const Mono_Time *mono_time)
+{
+    if (mono_time->clock != NULL) {
+        return mono_time->clock(mono_time->clock_object);
+    }
+
+    return current_time_monotonic();
+}
+
+static uint64_t mono_time_base(Mono_Time *mono_time)
+{
+    uint64_t base = MONO_TIME_LOAD(&mono_time->base_time);
+
+    if (base == 0) {
+        /* Concurrent first calls all agree on the base the first one stored. */
+        const uint64_t new_base = (uint64_t)time(NULL) - (mono_time_monotonic(mono_time) / 1000ULL);
+
+        if (MONO_TIME_CAS(&mono_time->base_time, &base, new_base)) {
+            base = new_base;
+        }
+    }
+
+    return base;
+}
+
+void mono_time_update(Mono_Time *mono_time)
 {
-    if (unix_base_time_value == 0) {
-        unix_base_time_value = ((uint64_t)time(NULL) - (current_time_monotonic() / 1000ULL));
+    const uint64_t now = (mono_time_monotonic(mono_time) / 1000ULL) + mono_time_base(mono_time);
+    uint64_t value = MONO_TIME_LOAD(&mono_time->time);
+
+    while (value < now && !MONO_TIME_CAS(&mono_time->time, &value, now)) {
+        /* value was reloaded, try again. */
     }
+}
 
-    unix_time_value = (current_time_monotonic() / 1000ULL) + unix_base_time_value;
+uint64_t mono_time_get(const Mono_Time *mono_time)
+{
+    return MONO_TIME_LOAD(&mono_time->time);
+}
+
+bool mono_time_is_timeout(const Mono_Time *mono_time, uint64_t timestamp, uint64_t timeout)
+{
+    return timestamp + timeout <= mono_time_get(mono_time);
+}
+
+void mono_time_set_clock(Mono_Time *mono_time, monotonic_clock_cb *clock, void *object)
+{
+    mono_time->clock = clock;
+    mono_time->clock_object = object;
+    MONO_TIME_STORE(&mono_time->base_time, 0);
+    MONO_TIME_STORE(&mono_time->time, (mono_time_monotonic(mono_time) / 1000ULL) + mono_time_base(mono_time));
+}
+
+void unix_time_update(void)
+{
+    mono_time_update(&system_mono_time);
 }
 
 uint64_t unix_time(void)
 {
-    return unix_time_value;
+    return mono_time_get(&system_mono_time);
 }
 
 int is_timeout(uint64_t timestamp, uint64_t timeout)
 {
-    return timestamp + timeout <= unix_time();
+    return mono_time_is_timeout(&system_mono_time, timestamp, timeout);
 }
 
 
@@ -75,6 +197,61 @@ uint32_t id_copy(uint8_t *dest, const uint8_t *src)
     return CRYPTO_PUBLIC_KEY_SIZE;
 }
 
+static uint64_t load64_le(const uint8_t *bytes)
+{
+    uint64_t word = 0;
+
+    for (uint32_t i = 0; i < sizeof(uint64_t); ++i) {
+        word |= (uint64_t)bytes[i] << (i * 8);
+    }
+
+    return word;
+}
+
+#define ROTL64(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND(v0, v1, v2, v3)                                                  \
+    do {                                                                          \
+        v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0; v0 = ROTL64(v0, 32);             \
+        v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2;                                  \
+        v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0;                                  \
+        v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2; v2 = ROTL64(v2, 32);             \
+    } while (0)
+
+/* SipHash-2-4 of the public key, keyed with the first two words of hash_key.
+ */
+uint32_t hash_public_key(const uint64_t *hash_key, const uint8_t *public_key)
+{
+    uint64_t v0 = hash_key[0] ^ 0x736f6d6570736575ULL;
+    uint64_t v1 = hash_key[1] ^ 0x646f72616e646f6dULL;
+    uint64_t v2 = hash_key[0] ^ 0x6c7967656e657261ULL;
+    uint64_t v3 = hash_key[1] ^ 0x7465646279746573ULL;
+
+    for (uint32_t i = 0; i < CRYPTO_PUBLIC_KEY_SIZE; i += sizeof(uint64_t)) {
+        const uint64_t m = load64_le(public_key + i);
+        v3 ^= m;
+        SIPROUND(v0, v1, v2, v3);
+        SIPROUND(v0, v1, v2, v3);
+        v0 ^= m;
+    }
+
+    /* The last block only holds the length, the key being a multiple of 8. */
+    const uint64_t b = (uint64_t)CRYPTO_PUBLIC_KEY_SIZE << 56;
+    v3 ^= b;
+    SIPROUND(v0, v1, v2, v3);
+    SIPROUND(v0, v1, v2, v3);
+    v0 ^= b;
+
+    v2 ^= 0xff;
+    SIPROUND(v0, v1, v2, v3);
+    SIPROUND(v0, v1, v2, v3);
+    SIPROUND(v0, v1, v2, v3);
+    SIPROUND(v0, v1, v2, v3);
+
+    const uint64_t hash = v0 ^ v1 ^ v2 ^ v3;
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
 void host_to_net(uint8_t *num, uint16_t numbytes)
 {
 #ifndef WORDS_BIGENDIAN
@@ -193,3 +370,354 @@ int create_recursive_mutex(pthread_mutex_t *mutex)
 
     return 0;
 }
+
+
+/* Timer wheel: TIMER_WHEEL_LEVELS rings of TIMER_WHEEL_SLOTS lists. Level n
+ * holds the timers due in fewer than TIMER_WHEEL_SLOTS^(n + 1) ticks, in the
+ * slot of their deadline divided by TIMER_WHEEL_SLOTS^n. When the current tick
+ * reaches the start of a slot of a higher level, its timers move down.
+ */
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_SLOT_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOT_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+
+/* The last list holds the timers firing in the current run. */
+#define TIMER_LIST_FIRING (TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS)
+
+typedef struct {
+    uint64_t deadline;
+    timer_cb *function;
+    void *object;
+    uint32_t id;
+
+    /* Timer numbers of the neighbours in its list, 0 for none. next links the
+     * free timers when unused. */
+    uint32_t next;
+    uint32_t prev;
+
+    /* Index + 1 of the list the timer is in, 0 when stopped. */
+    uint16_t list;
+    bool used;
+} Wheel_Timer;
+
+struct Timer_Wheel {
+    /* Next tick to process. */
+    uint64_t now;
+
+    Wheel_Timer *timers;
+    uint32_t timers_size;
+    uint32_t free_timers;
+
+    uint32_t heads[TIMER_LIST_FIRING + 1];
+    uint32_t level_count[TIMER_WHEEL_LEVELS];
+};
+
+Timer_Wheel *new_timer_wheel(uint64_t now)
+{
+    Timer_Wheel *wheel = (Timer_Wheel *)calloc(1, sizeof(Timer_Wheel));
+
+    if (wheel == NULL) {
+        return NULL;
+    }
+
+    wheel->now = now;
+    return wheel;
+}
+
+void kill_timer_wheel(Timer_Wheel *wheel)
+{
+    if (wheel == NULL) {
+        return;
+    }
+
+    free(wheel->timers);
+    free(wheel);
+}
+
+static Wheel_Timer *get_timer(const Timer_Wheel *wheel, uint32_t timer)
+{
+    if (timer == 0 || timer > wheel->timers_size || !wheel->timers[timer - 1].used) {
+        return NULL;
+    }
+
+    return &wheel->timers[timer - 1];
+}
+
+static void timer_link(Timer_Wheel *wheel, uint32_t timer, uint32_t list)
+{
+    Wheel_Timer *t = &wheel->timers[timer - 1];
+    t->list = list + 1;
+    t->prev = 0;
+    t->next = wheel->heads[list];
+
+    if (t->next != 0) {
+        wheel->timers[t->next - 1].prev = timer;
+    }
+
+    wheel->heads[list] = timer;
+
+    if (list < TIMER_LIST_FIRING) {
+        ++wheel->level_count[list / TIMER_WHEEL_SLOTS];
+    }
+}
+
+static void timer_unlink(Timer_Wheel *wheel, uint32_t timer)
+{
+    Wheel_Timer *t = &wheel->timers[timer - 1];
+
+    if (t->list == 0) {
+        return;
+    }
+
+    const uint32_t list = t->list - 1;
+
+    if (t->prev != 0) {
+        wheel->timers[t->prev - 1].next = t->next;
+    } else {
+        wheel->heads[list] = t->next;
+    }
+
+    if (t->next != 0) {
+        wheel->timers[t->next - 1].prev = t->prev;
+    }
+
+    if (list < TIMER_LIST_FIRING) {
+        --wheel->level_count[list / TIMER_WHEEL_SLOTS];
+    }
+
+    t->list = 0;
+    t->next = 0;
+    t->prev = 0;
+}
+
+/* Put a timer in the slot for its deadline, relative to the current tick. */
+static void timer_insert(Timer_Wheel *wheel, uint32_t timer)
+{
+    const Wheel_Timer *t = &wheel->timers[timer - 1];
+    uint64_t expires = t->deadline < wheel->now ? wheel->now : t->deadline;
+    const uint64_t delta = expires - wheel->now;
+    unsigned int level = 0;
+
+    while (level < TIMER_WHEEL_LEVELS - 1 && (delta >> (TIMER_WHEEL_SLOT_BITS * (level + 1))) != 0) {
+        ++level;
+    }
+
+    /* Timers further away than the wheel reaches wait in the last slot of the
+     * top level and are put back when it comes up. */
+    if ((delta >> (TIMER_WHEEL_SLOT_BITS * TIMER_WHEEL_LEVELS)) != 0) {
+        expires = wheel->now + (UINT64_C(1) << (TIMER_WHEEL_SLOT_BITS * TIMER_WHEEL_LEVELS)) - 1;
+    }
+
+    const uint32_t slot = (expires >> (TIMER_WHEEL_SLOT_BITS * level)) & TIMER_WHEEL_MASK;
+    timer_link(wheel, timer, level * TIMER_WHEEL_SLOTS + slot);
+}
+
+uint32_t timer_new(Timer_Wheel *wheel, timer_cb *function, void *object, uint32_t id)
+{
+    if (wheel->free_timers == 0) {
+        if (wheel->timers_size == UINT32_MAX / 2) {
+            return 0;
+        }
+
+        const uint32_t size = wheel->timers_size ? wheel->timers_size * 2 : 16;
+        Wheel_Timer *timers = (Wheel_Timer *)realloc(wheel->timers, size * sizeof(Wheel_Timer));
+
+        if (timers == NULL) {
+            return 0;
+        }
+
+        memset(timers + wheel->timers_size, 0, (size - wheel->timers_size) * sizeof(Wheel_Timer));
+
+        for (uint32_t i = wheel->timers_size; i < size; ++i) {
+            timers[i].next = (i + 1 < size) ? i + 2 : 0;
+        }
+
+        wheel->free_timers = wheel->timers_size + 1;
+        wheel->timers = timers;
+        wheel->timers_size = size;
+    }
+
+    const uint32_t timer = wheel->free_timers;
+    Wheel_Timer *t = &wheel->timers[timer - 1];
+    wheel->free_timers = t->next;
+
+    memset(t, 0, sizeof(Wheel_Timer));
+    t->function = function;
+    t->object = object;
+    t->id = id;
+    t->used = 1;
+    return timer;
+}
+
+void timer_free(Timer_Wheel *wheel, uint32_t timer)
+{
+    Wheel_Timer *t = get_timer(wheel, timer);
+
+    if (t == NULL) {
+        return;
+    }
+
+    timer_unlink(wheel, timer);
+    memset(t, 0, sizeof(Wheel_Timer));
+    t->next = wheel->free_timers;
+    wheel->free_timers = timer;
+}
+
+void timer_set_id(Timer_Wheel *wheel, uint32_t timer, uint32_t id)
+{
+    Wheel_Timer *t = get_timer(wheel, timer);
+
+    if (t != NULL) {
+        t->id = id;
+    }
+}
+
+void timer_start(Timer_Wheel *wheel, uint32_t timer, uint64_t deadline)
+{
+    Wheel_Timer *t = get_timer(wheel, timer);
+
+    if (t == NULL) {
+        return;
+    }
+
+    timer_unlink(wheel, timer);
+    t->deadline = deadline;
+    timer_insert(wheel, timer);
+}
+
+void timer_stop(Timer_Wheel *wheel, uint32_t timer)
+{
+    if (get_timer(wheel, timer) != NULL) {
+        timer_unlink(wheel, timer);
+    }
+}
+
+bool timer_is_running(const Timer_Wheel *wheel, uint32_t timer)
+{
+    const Wheel_Timer *t = get_timer(wheel, timer);
+    return t != NULL && t->list != 0;
+}
+
+/* Move the timers of the higher level slots starting at tick down. */
+static void timer_wheel_cascade(Timer_Wheel *wheel, uint64_t tick)
+{
+    for (unsigned int level = 1; level < TIMER_WHEEL_LEVELS; ++level) {
+        const unsigned int shift = TIMER_WHEEL_SLOT_BITS * level;
+
+        if ((tick & ((UINT64_C(1) << shift) - 1)) != 0) {
+            break;
+        }
+
+        const uint32_t list = level * TIMER_WHEEL_SLOTS + ((tick >> shift) & TIMER_WHEEL_MASK);
+        uint32_t timer = wheel->heads[list];
+
+        while (timer != 0) {
+            const uint32_t next = wheel->timers[timer - 1].next;
+            timer_unlink(wheel, timer);
+            timer_insert(wheel, timer);
+            timer = next;
+        }
+    }
+}
+
+/* Return the first tick from the current one at which a timer can fire or has
+ * to move down, or UINT64_MAX if there are no timers.
+ */
+static uint64_t timer_wheel_next_tick(const Timer_Wheel *wheel)
+{
+    for (unsigned int level = 0; level < TIMER_WHEEL_LEVELS; ++level) {
+        if (wheel->level_count[level] != 0) {
+            const uint64_t mask = (UINT64_C(1) << (TIMER_WHEEL_SLOT_BITS * level)) - 1;
+            return (wheel->now + mask) & ~mask;
+        }
+    }
+
+    return UINT64_MAX;
+}
+
+uint32_t timer_wheel_run(Timer_Wheel *wheel, uint64_t now, void *userdata)
+{
+    uint32_t fired = 0;
+
+    while (wheel->now <= now) {
+        const uint64_t tick = wheel->now;
+        timer_wheel_cascade(wheel, tick);
+
+        uint32_t timer;
+
+        while ((timer = wheel->heads[tick & TIMER_WHEEL_MASK]) != 0) {
+            timer_unlink(wheel, timer);
+            timer_link(wheel, timer, TIMER_LIST_FIRING);
+        }
+
+        /* Timers started by the callbacks count from the next tick. */
+        wheel->now = tick + 1;
+
+        while ((timer = wheel->heads[TIMER_LIST_FIRING]) != 0) {
+            const Wheel_Timer *t = &wheel->timers[timer - 1];
+            timer_cb *function = t->function;
+            void *object = t->object;
+            const uint32_t id = t->id;
+            timer_unlink(wheel, timer);
+            function(object, id, userdata);
+            ++fired;
+        }
+
+        const uint64_t next_tick = timer_wheel_next_tick(wheel);
+        wheel->now = next_tick <= now ? next_tick : now + 1;
+    }
+
+    return fired;
+}
+
+static uint64_t timer_list_min_deadline(const Timer_Wheel *wheel, uint32_t list)
+{
+    uint64_t deadline = UINT64_MAX;
+
+    for (uint32_t timer = wheel->heads[list]; timer != 0; timer = wheel->timers[timer - 1].next) {
+        if (wheel->timers[timer - 1].deadline < deadline) {
+            deadline = wheel->timers[timer - 1].deadline;
+        }
+    }
+
+    return deadline;
+}
+
+uint64_t timer_wheel_next_deadline(const Timer_Wheel *wheel)
+{
+    uint64_t deadline = UINT64_MAX;
+
+    for (unsigned int level = 0; level < TIMER_WHEEL_LEVELS; ++level) {
+        if (wheel->level_count[level] == 0) {
+            continue;
+        }
+
+        /* The current slot of a level can also hold timers due a whole turn of
+         * the level later, so it is checked along with the first one after it
+         * that isn't empty. */
+        const uint32_t base = level * TIMER_WHEEL_SLOTS;
+        const uint32_t current = (wheel->now >> (TIMER_WHEEL_SLOT_BITS * level)) & TIMER_WHEEL_MASK;
+        uint64_t level_deadline = timer_list_min_deadline(wheel, base + current);
+
+        for (uint32_t i = 1; i < TIMER_WHEEL_SLOTS; ++i) {
+            const uint32_t list = base + ((current + i) & TIMER_WHEEL_MASK);
+
+            if (wheel->heads[list] != 0) {
+                const uint64_t slot_deadline = timer_list_min_deadline(wheel, list);
+
+                if (slot_deadline < level_deadline) {
+                    level_deadline = slot_deadline;
+                }
+
+                break;
+            }
+        }
+
+        if (level_deadline < deadline) {
+            deadline = level_deadline;
+        }
+    }
+
+    return deadline < wheel->now ? wheel->now : deadline;
+}
@@ -35,15 +35,63 @@
 #define MIN(a,b) (((a)<(b))?(a):(b))
 #define PAIR(TYPE1__, TYPE2__) struct { TYPE1__ first; TYPE2__ second; }
 
+/* The time of the system clock, shared by everything in the process that
+ * doesn't have a Mono_Time of its own. */
 void unix_time_update(void);
 uint64_t unix_time(void);
 int is_timeout(uint64_t timestamp, uint64_t timeout);
 
+/* The clock of a Tox instance, passed to each of its modules. It reads the
+ * system clock unless it was given another one with mono_time_set_clock(),
+ * which lets tests and simulations run protocol time faster than real time,
+ * each instance at its own pace. It can be read from any thread.
+ */
+typedef struct Mono_Time Mono_Time;
+
+/* Source of the time of a Mono_Time, monotonic and in milliseconds. */
+typedef uint64_t monotonic_clock_cb(void *object);
+
+Mono_Time *mono_time_new(void);
+void mono_time_free(Mono_Time *mono_time);
+
+/* Read the time in seconds that mono_time_get() returns from the clock.
+ * Concurrent calls never make it go back.
+ */
+void mono_time_update(Mono_Time *mono_time);
+
+/* return the time in seconds since the epoch as of the last
+ * mono_time_update().
+ */
+uint64_t mono_time_get(const Mono_Time *mono_time);
+
+/* return true if timeout seconds passed since timestamp, a time of
+ * mono_time_get().
+ */
+bool mono_time_is_timeout(const Mono_Time *mono_time, uint64_t timestamp, uint64_t timeout);
+
+/* return the time of the clock of mono_time in milliseconds. Unlike
+ * mono_time_get() it reads the clock.
+ */
+uint64_t mono_time_monotonic(const Mono_Time *mono_time);
+
+/* Make mono_time read clock instead of the system clock. object is passed to
+ * clock. Pass NULL to use the system clock again. mono_time_get() starts over
+ * from the current date, so set the clock before anything takes timestamps of
+ * mono_time. The clock must not go backwards.
+ */
+void mono_time_set_clock(Mono_Time *mono_time, monotonic_clock_cb *clock, void *object);
+
 
 /* id functions */
 bool id_equal(const uint8_t *dest, const uint8_t *src);
 uint32_t id_copy(uint8_t *dest, const uint8_t *src); /* return value is CLIENT_ID_SIZE */
 
+/* Hash the whole public key with SipHash-2-4 keyed by a random hash_key of 4
+ * words (only the first 2 are used), so that peers that don't know hash_key
+ * can't pick keys that all land in the same slot of a table.
+ */
+uint32_t hash_public_key(const uint64_t *hash_key, const uint8_t *public_key);
+
 void host_to_net(uint8_t *num, uint16_t numbytes);
 #define net_to_host(x, y) host_to_net(x, y)
 
@@ -61,4 +109,65 @@ int load_state(load_state_callback_func load_state_callback, Logger *log, void *
 /* Returns -1 if failed or 0 if success */
 int create_recursive_mutex(pthread_mutex_t *mutex);
 
+/* Hierarchical timer wheel.
+ *
+ * Timers fire once when the wheel is run at or after their deadline. Times are
+ * in whatever unit the owner of a wheel runs it with, e.g. seconds of
+ * unix_time(). A run costs a step per level for every tick that has something
+ * to do plus a step per timer that fires or moves down a level, however many
+ * timers are waiting.
+ */
+typedef struct Timer_Wheel Timer_Wheel;
+
+/* Called with the object and id the timer was created with and the userdata
+ * passed to timer_wheel_run(). The timer is stopped when its callback is called,
+ * and the callback may start, stop or free it and any other timer.
+ */
+typedef void timer_cb(void *object, uint32_t id, void *userdata);
+
+/* Create a timer wheel with no timers, at time now.
+ *
+ * return NULL on failure.
+ */
+Timer_Wheel *new_timer_wheel(uint64_t now);
+
+/* Free the wheel and all its timers. */
+void kill_timer_wheel(Timer_Wheel *wheel);
+
+/* Create a stopped timer calling function with object and id.
+ *
+ * return the timer number, which is never 0.
+ * return 0 on failure.
+ */
+uint32_t timer_new(Timer_Wheel *wheel, timer_cb *function, void *object, uint32_t id);
+
+/* Stop and free a timer. Timer 0 is ignored. */
+void timer_free(Timer_Wheel *wheel, uint32_t timer);
+
+/* Change the id passed to the callback of timer, e.g. when the object it is
+ * for moved to another index.
+ */
+void timer_set_id(Timer_Wheel *wheel, uint32_t timer, uint32_t id);
+
+/* Start timer to fire at deadline, restarting it if it is running. A deadline
+ * at or before the time of the last run fires on the next run at a later time.
+ */
+void timer_start(Timer_Wheel *wheel, uint32_t timer, uint64_t deadline);
+
+void timer_stop(Timer_Wheel *wheel, uint32_t timer);
+bool timer_is_running(const Timer_Wheel *wheel, uint32_t timer);
+
+/* Fire the timers with a deadline at or before now.
+ *
+ * return the number of timers fired.
+ */
+uint32_t timer_wheel_run(Timer_Wheel *wheel, uint64_t now, void *userdata);
+
+/* return the earliest time at which timer_wheel_run() fires a timer: the
+ * earliest deadline of the running timers, or the next tick after the last
+ * run if that deadline has passed.
+ * return UINT64_MAX if no timer is running.
+ */
+uint64_t timer_wheel_next_deadline(const Timer_Wheel *wheel);
+
 #endif /* UTIL_H */